@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "bench.h"
+/* Communication protocol addressing */
+#include "faceclient.h"
+
+// Messages, printed after benchName
+ImmutableString invalidFileMsg = "cannot open the input file \"";
+ImmutableString invalidPortNumMsg = "cannot connect to the server on port \"";
+ImmutableString errorCommunicationMsg = "a communication error occurred\n";
+
+/// Exiting Functions ///////////////////
+
+/* exit_invalid_command_line()
+ * ---------------------------
+ * Prints to stderr invalidCmdLineMsg and exits with an exit status of
+ * EXIT_INVALID_COMMAND_LINE.
+ */
+void exit_invalid_command_line(void)
+{
+    fprintf(stderr, "%s", invalidCmdLineMsg);
+    exit(EXIT_INVALID_COMMAND_LINE);
+}
+
+/* exit_invalid_file()
+ * -------------------
+ * Prints to stderr that filename could not be read and exits with an exit
+ * status of EXIT_INVALID_FILE_READ.
+ *
+ * filename: The file that could not be read.
+ */
+void exit_invalid_file(char* filename)
+{
+    fprintf(stderr, "%s: %s%s\" for reading\n", benchName, invalidFileMsg,
+            filename);
+    exit(EXIT_INVALID_FILE_READ);
+}
+
+/* exit_invalid_port()
+ * -------------------
+ * Prints to stderr that portNum could not be connected to and exits with an
+ * exit status of EXIT_INVALID_PORT_NUM.
+ *
+ * portNum: The portNum supplied at terminal that could not be connected to.
+ */
+void exit_invalid_port(char* portNum)
+{
+    fprintf(stderr, "%s: %s%s\"\n", benchName, invalidPortNumMsg, portNum);
+    exit(EXIT_INVALID_PORT_NUM);
+}
+
+/* exit_communication_error()
+ * --------------------------
+ * Prints to stderr errorCommunicationMsg and exits with an exit status of
+ * EXIT_ERROR_COMMUNICATION.
+ */
+void exit_communication_error(void)
+{
+    fprintf(stderr, "%s: %s", benchName, errorCommunicationMsg);
+    exit(EXIT_ERROR_COMMUNICATION);
+}
+
+/// File Functions //////////////////////
+
+/* read_image()
+ * ------------
+ * Reads the entire contents of filename into memory.
+ *
+ * filename: The image file to be read.
+ *
+ * Returns: An ImageFile holding the contents of filename.
+ * Errors: Function calls exit_invalid_file() if filename cannot be read.
+ */
+ImageFile read_image(char* filename)
+{
+    ImageFile image = {0};
+    FILE* stream = fopen(filename, "rb");
+    if (!stream || fseek(stream, 0, SEEK_END)) {
+        exit_invalid_file(filename);
+    }
+    image.size = (uint32_t)ftell(stream);
+    rewind(stream);
+    image.data = (uint8_t*)malloc(image.size);
+    if (fread(image.data, 1, image.size, stream) != image.size) {
+        exit_invalid_file(filename);
+    }
+    fclose(stream);
+    return image;
+}
+
+/// Socket Functions ////////////////////
+
+/* connect_server()
+ * ----------------
+ * Opens a new connection to the server listening on localhost at portNum,
+ * or on the Unix domain socket it names (see face_resolve()). Nagle's
+ * algorithm is disabled so that the last segment of a request is not held
+ * back waiting on the acknowledgement of the one before.
+ *
+ * portNum: The port or socket the server is listening on.
+ *
+ * Returns: The connected socket's file descriptor.
+ * Errors: Function calls exit_invalid_port() if the server cannot be reached.
+ */
+int connect_server(char* portNum)
+{
+    int fd;
+    FaceAddress address;
+    if (face_resolve("localhost", portNum, &address)
+            || (fd = face_connect(&address, 0)) < 0) {
+        exit_invalid_port(portNum);
+    }
+    return fd;
+}
+
+/* write_fully()
+ * -------------
+ * Writes all size bytes of data to fd.
+ *
+ * Errors: Function calls exit_communication_error() if the write fails.
+ */
+void write_fully(int fd, const void* data, size_t size)
+{
+    const uint8_t* next = (const uint8_t*)data;
+    while (size) {
+        ssize_t nwritten = write(fd, next, size);
+        if (nwritten <= 0) {
+            exit_communication_error();
+        }
+        next += nwritten;
+        size -= nwritten;
+    }
+}
+
+/* read_fully()
+ * ------------
+ * Reads exactly size bytes from fd into data.
+ *
+ * Returns: 1 once size bytes are read, or 0 if the server closed the
+ *          connection before sending any of them.
+ * Errors: Function calls exit_communication_error() if the server closes the
+ *         connection part way through or the read fails.
+ */
+int read_fully(int fd, void* data, size_t size)
+{
+    uint8_t* next = (uint8_t*)data;
+    size_t remaining = size;
+    while (remaining) {
+        ssize_t nread = read(fd, next, remaining);
+        if (!nread && remaining == size) {
+            return 0;
+        } else if (nread <= 0) {
+            exit_communication_error();
+        }
+        next += nread;
+        remaining -= nread;
+    }
+    return 1;
+}
+
+/// Time Functions //////////////////////
+
+/* now_nanos()
+ * -----------
+ * Returns: The monotonic clock in nanoseconds.
+ */
+uint64_t now_nanos(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NANOSECONDS + now.tv_nsec;
+}
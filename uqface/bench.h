@@ -0,0 +1,46 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NANOSECONDS 1000000000ULL
+
+/* typedef definitions */
+typedef const char* const ImmutableString;
+
+// Exit codes shared by uqfacebench and uqfaceload
+typedef enum {
+    EXIT_INVALID_COMMAND_LINE = 13,
+    EXIT_INVALID_FILE_READ = 16,
+    EXIT_INVALID_PORT_NUM = 5,
+    EXIT_ERROR_COMMUNICATION = 7,
+    SUCCESS_EXIT = 0
+} ExitCodes;
+
+// An image file held in memory so that it can be resent without disk reads
+typedef struct {
+    uint8_t* data;
+    uint32_t size;
+} ImageFile;
+
+// Defined by each program: the name its error messages start with and its
+// usage message
+extern ImmutableString benchName;
+extern ImmutableString invalidCmdLineMsg;
+
+/* exiting functions */
+void exit_invalid_command_line(void);
+void exit_invalid_file(char* filename);
+void exit_invalid_port(char* portNum);
+void exit_communication_error(void);
+/* file functions */
+ImageFile read_image(char* filename);
+/* socket functions */
+int connect_server(char* portNum);
+void write_fully(int fd, const void* data, size_t size);
+int read_fully(int fd, void* data, size_t size);
+/* time functions */
+uint64_t now_nanos(void);
+
+#endif
@@ -0,0 +1,439 @@
+#include <string.h>
+#include <math.h>
+#include "blend.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BLEND_X86 // SSE4.2 and AVX2 kernels are built
+#include <immintrin.h>
+#endif
+
+#define OVERLAY_CHANNELS 4 // overlays are premultiplied BGRA
+#define FRAME_CHANNELS 3 // frames are BGR
+#define ALPHA 3 // index of the alpha channel of an overlay pixel
+#define OPAQUE 255
+#define WEIGHT_BITS 8 // fixed point precision of the sampling weights
+#define WEIGHT_ONE (1 << WEIGHT_BITS)
+#define WEIGHT_ROUND (1 << (WEIGHT_BITS - 1))
+#define WEIGHT_LANES                                                           \
+    8 // near and far weights of each channel, laid out for pmaddwd
+#define SCRATCH_ALIGN 64 // scratch buffers start on their own cache line
+
+/// Static Function Prototypes ///////////
+static size_t align_up(size_t size);
+static int sample_at(int index, int outSize, int inSize, int* weight);
+static void lerp_row(const uint8_t* top, const uint8_t* bottom, uint8_t* out,
+        int length, int weight);
+static void blend_row(const uint8_t* row, const int* offsets,
+        const uint16_t* weights, uint8_t* frame, int width);
+#ifdef BLEND_X86
+static void lerp_row_sse42(const uint8_t* top, const uint8_t* bottom,
+        uint8_t* out, int length, int weight);
+static void lerp_row_avx2(const uint8_t* top, const uint8_t* bottom,
+        uint8_t* out, int length, int weight);
+static void blend_row_sse42(const uint8_t* row, const int* offsets,
+        const uint16_t* weights, uint8_t* frame, int width);
+#endif
+
+//////////////////////////////////////////
+
+// Kernels chosen by blend_use_kernels(), scalar until it is called. Only set
+// before worker threads start, so never read and written concurrently.
+static void (*lerpKernel)(const uint8_t*, const uint8_t*, uint8_t*, int, int)
+        = lerp_row;
+static void (*blendKernel)(const uint8_t*, const int*, const uint16_t*,
+        uint8_t*, int)
+        = blend_row;
+
+/// Kernel Functions /////////////////////
+
+/* blend_use_kernels()
+ * -------------------
+ * Chooses the compositing kernels for the rest of the program: the widest
+ * instruction set both supported by the CPU and no wider than limit. Must be
+ * called before any thread starts compositing.
+ *
+ * limit: The widest instruction set that may be used.
+ *
+ * Returns: The instruction set chosen.
+ */
+BlendKernels blend_use_kernels(BlendKernels limit)
+{
+    BlendKernels kernels = BLEND_SCALAR;
+    lerpKernel = lerp_row;
+    blendKernel = blend_row;
+#ifdef BLEND_X86
+    __builtin_cpu_init();
+    if (limit >= BLEND_AVX2 && __builtin_cpu_supports("avx2")) {
+        kernels = BLEND_AVX2;
+        lerpKernel = lerp_row_avx2;
+        // gathering pixel pairs costs as much as the loads it replaces
+        blendKernel = blend_row_sse42;
+    } else if (limit >= BLEND_SSE42 && __builtin_cpu_supports("sse4.2")) {
+        kernels = BLEND_SSE42;
+        lerpKernel = lerp_row_sse42;
+        blendKernel = blend_row_sse42;
+    }
+#else
+    (void)limit;
+#endif
+    return kernels;
+}
+
+/// Compositing Functions ////////////////
+
+/* blend_premultiply()
+ * -------------------
+ * Multiplies the colour channels of an 8 bit BGRA image by its alpha channel,
+ * in place and rounded to nearest. Run once per overlay, so it is left
+ * scalar.
+ *
+ * bgra: The first pixel of the image.
+ * step: The number of bytes between successive rows.
+ * width: The image width.
+ * height: The image height.
+ */
+void blend_premultiply(uint8_t* bgra, size_t step, int width, int height)
+{
+    for (int y = 0; y < height; y++) {
+        uint8_t* pixel = bgra + y * step;
+        for (int x = 0; x < width; x++, pixel += OVERLAY_CHANNELS) {
+            int alpha = pixel[ALPHA];
+            for (int c = 0; c < ALPHA; c++) {
+                pixel[c] = (pixel[c] * alpha + OPAQUE / 2) / OPAQUE;
+            }
+        }
+    }
+}
+
+/* blend_scratch_size()
+ * --------------------
+ * Returns: The number of bytes of scratch space blend_face() needs to draw an
+ *          overlay overlayWidth pixels wide over a face width pixels wide.
+ */
+size_t blend_scratch_size(int overlayWidth, int width)
+{
+    return SCRATCH_ALIGN + align_up(WEIGHT_LANES * sizeof(uint16_t) * width)
+            + align_up(sizeof(int) * width)
+            + align_up(OVERLAY_CHANNELS * (overlayWidth + 1));
+}
+
+/* blend_face()
+ * ------------
+ * Resizes a premultiplied BGRA overlay to a face and draws it over the face
+ * with the "over" operator, in a single pass over the face. Each overlay row
+ * needed is interpolated from the two nearest overlay rows into a scratch row,
+ * and each face pixel is then interpolated from the two nearest pixels of
+ * that row and blended straight into the frame; no resized overlay is ever
+ * stored.
+ *
+ * Sampling is bilinear, with pixel centres aligned as for CV_INTER_LINEAR.
+ * The overlay should be no more than twice the face size in either
+ * dimension (e.g. the nearest mip), as bilinear sampling skips pixels when
+ * shrinking further.
+ *
+ * overlay: The first pixel of the premultiplied BGRA overlay.
+ * overlayStep: The number of bytes between successive overlay rows.
+ * overlayWidth: The overlay width.
+ * overlayHeight: The overlay height.
+ * frame: The top left pixel of the face in the BGR frame.
+ * frameStep: The number of bytes between successive frame rows.
+ * width: The face width.
+ * height: The face height.
+ * scratch: At least blend_scratch_size(overlayWidth, width) bytes.
+ */
+void blend_face(const uint8_t* overlay, size_t overlayStep, int overlayWidth,
+        int overlayHeight, uint8_t* frame, size_t frameStep, int width,
+        int height, void* scratch)
+{
+    uint8_t* base = (uint8_t*)(((uintptr_t)scratch + SCRATCH_ALIGN - 1)
+            & ~(uintptr_t)(SCRATCH_ALIGN - 1));
+    uint16_t* weights = (uint16_t*)base;
+    int* offsets = (int*)(base
+            + align_up(WEIGHT_LANES * sizeof(uint16_t) * width));
+    uint8_t* row = (uint8_t*)offsets + align_up(sizeof(int) * width);
+    size_t rowLength = (size_t)OVERLAY_CHANNELS * overlayWidth;
+    for (int x = 0; x < width; x++) {
+        int weight;
+        offsets[x] = OVERLAY_CHANNELS * sample_at(x, width, overlayWidth,
+                                                 &weight);
+        for (int lane = 0; lane < WEIGHT_LANES; lane += 2) {
+            weights[WEIGHT_LANES * x + lane] = WEIGHT_ONE - weight;
+            weights[WEIGHT_LANES * x + lane + 1] = weight;
+        }
+    }
+    for (int y = 0; y < height; y++) {
+        int weight;
+        const uint8_t* top = overlay
+                + sample_at(y, height, overlayHeight, &weight) * overlayStep;
+        if (weight) {
+            lerpKernel(top, top + overlayStep, row, rowLength, weight);
+        } else {
+            memcpy(row, top, rowLength);
+        }
+        // the last pixel is its own far neighbour
+        memcpy(row + rowLength, row + rowLength - OVERLAY_CHANNELS,
+                OVERLAY_CHANNELS);
+        blendKernel(row, offsets, weights, frame + y * frameStep, width);
+    }
+}
+
+/* align_up()
+ * ----------
+ * Returns: size rounded up to a multiple of SCRATCH_ALIGN.
+ */
+static size_t align_up(size_t size)
+{
+    return (size + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+}
+
+/* sample_at()
+ * -----------
+ * Maps an output pixel to the pair of input pixels it is interpolated from,
+ * pixel centres aligned as for CV_INTER_LINEAR. Pixels past either edge are
+ * clamped to it.
+ *
+ * index: The output pixel.
+ * outSize: The number of output pixels.
+ * inSize: The number of input pixels.
+ * weight: Set to the weight of the far pixel, out of WEIGHT_ONE.
+ *
+ * Returns: The near input pixel, the far one follows it.
+ */
+static int sample_at(int index, int outSize, int inSize, int* weight)
+{
+    double position = (index + 0.5) * inSize / outSize - 0.5;
+    int near = (int)floor(position);
+    *weight = (int)lround((position - near) * WEIGHT_ONE);
+    if (*weight == WEIGHT_ONE) {
+        near++;
+        *weight = 0;
+    }
+    if (near < 0) {
+        near = 0;
+        *weight = 0;
+    } else if (near >= inSize - 1) {
+        near = inSize - 1;
+        *weight = 0;
+    }
+    return near;
+}
+
+/* lerp_row()
+ * ----------
+ * Interpolates between two rows of bytes.
+ *
+ * top: The near row.
+ * bottom: The far row.
+ * out: Set to the interpolated row.
+ * length: The number of bytes in each row.
+ * weight: The weight of the far row, out of WEIGHT_ONE.
+ */
+static void lerp_row(const uint8_t* top, const uint8_t* bottom, uint8_t* out,
+        int length, int weight)
+{
+    for (int i = 0; i < length; i++) {
+        out[i] = (top[i] * (WEIGHT_ONE - weight) + bottom[i] * weight
+                         + WEIGHT_ROUND)
+                >> WEIGHT_BITS;
+    }
+}
+
+/* blend_row()
+ * -----------
+ * Interpolates each pixel of a face row from a premultiplied BGRA row and
+ * draws it over the frame: frame = overlay + frame * (255 - alpha) / 255,
+ * rounded to nearest. Fully transparent pixels leave the frame unchanged and
+ * opaque ones replace it.
+ *
+ * row: The overlay row, with its last pixel repeated once past its end.
+ * offsets: The byte offset in row of the near pixel of each face pixel.
+ * weights: WEIGHT_LANES weights per face pixel, alternately of the near and
+ *          far pixel.
+ * frame: The first pixel of the face row in the BGR frame.
+ * width: The face width.
+ */
+static void blend_row(const uint8_t* row, const int* offsets,
+        const uint16_t* weights, uint8_t* frame, int width)
+{
+    for (int x = 0; x < width; x++, frame += FRAME_CHANNELS) {
+        const uint8_t* near = row + offsets[x];
+        const uint8_t* far = near + OVERLAY_CHANNELS;
+        int nearWeight = weights[WEIGHT_LANES * x];
+        int farWeight = weights[WEIGHT_LANES * x + 1];
+        uint8_t pixel[OVERLAY_CHANNELS];
+        for (int c = 0; c < OVERLAY_CHANNELS; c++) {
+            pixel[c] = (near[c] * nearWeight + far[c] * farWeight
+                               + WEIGHT_ROUND)
+                    >> WEIGHT_BITS;
+        }
+        int inverse = OPAQUE - pixel[ALPHA];
+        for (int c = 0; c < FRAME_CHANNELS; c++) {
+            // rounded division by 255, exact for every 16 bit product
+            int kept = frame[c] * inverse + OPAQUE / 2 + 1;
+            int value = pixel[c] + ((kept + (kept >> 8)) >> 8);
+            frame[c] = value < OPAQUE ? value : OPAQUE;
+        }
+    }
+}
+
+#ifdef BLEND_X86
+/* lerp_row_sse42()
+ * ----------------
+ * lerp_row() 16 bytes at a time with SSE4.2.
+ */
+__attribute__((target("sse4.2"))) static void lerp_row_sse42(
+        const uint8_t* top, const uint8_t* bottom, uint8_t* out, int length,
+        int weight)
+{
+    const __m128i near = _mm_set1_epi16(WEIGHT_ONE - weight);
+    const __m128i far = _mm_set1_epi16(weight);
+    const __m128i round = _mm_set1_epi16(WEIGHT_ROUND);
+    int i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(top + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(bottom + i));
+        __m128i low = _mm_add_epi16(
+                _mm_add_epi16(_mm_mullo_epi16(_mm_cvtepu8_epi16(a), near),
+                        _mm_mullo_epi16(_mm_cvtepu8_epi16(b), far)),
+                round);
+        __m128i high = _mm_add_epi16(
+                _mm_add_epi16(_mm_mullo_epi16(
+                                      _mm_cvtepu8_epi16(_mm_srli_si128(a, 8)),
+                                      near),
+                        _mm_mullo_epi16(
+                                _mm_cvtepu8_epi16(_mm_srli_si128(b, 8)), far)),
+                round);
+        _mm_storeu_si128((__m128i*)(out + i),
+                _mm_packus_epi16(_mm_srli_epi16(low, WEIGHT_BITS),
+                        _mm_srli_epi16(high, WEIGHT_BITS)));
+    }
+    lerp_row(top + i, bottom + i, out + i, length - i, weight);
+}
+
+/* lerp_row_avx2()
+ * ---------------
+ * lerp_row() 32 bytes at a time with AVX2.
+ */
+__attribute__((target("avx2"))) static void lerp_row_avx2(const uint8_t* top,
+        const uint8_t* bottom, uint8_t* out, int length, int weight)
+{
+    const __m256i near = _mm256_set1_epi16(WEIGHT_ONE - weight);
+    const __m256i far = _mm256_set1_epi16(weight);
+    const __m256i round = _mm256_set1_epi16(WEIGHT_ROUND);
+    int i = 0;
+    for (; i + 32 <= length; i += 32) {
+        const __m128i* a = (const __m128i*)(top + i);
+        const __m128i* b = (const __m128i*)(bottom + i);
+        __m256i low = _mm256_add_epi16(
+                _mm256_add_epi16(_mm256_mullo_epi16(_mm256_cvtepu8_epi16(
+                                                            _mm_loadu_si128(a)),
+                                         near),
+                        _mm256_mullo_epi16(
+                                _mm256_cvtepu8_epi16(_mm_loadu_si128(b)), far)),
+                round);
+        __m256i high = _mm256_add_epi16(
+                _mm256_add_epi16(
+                        _mm256_mullo_epi16(
+                                _mm256_cvtepu8_epi16(_mm_loadu_si128(a + 1)),
+                                near),
+                        _mm256_mullo_epi16(
+                                _mm256_cvtepu8_epi16(_mm_loadu_si128(b + 1)),
+                                far)),
+                round);
+        __m256i packed
+                = _mm256_packus_epi16(_mm256_srli_epi16(low, WEIGHT_BITS),
+                        _mm256_srli_epi16(high, WEIGHT_BITS));
+        // packing interleaves the 64 bit quarters of both halves
+        _mm256_storeu_si256((__m256i*)(out + i),
+                _mm256_permute4x64_epi64(packed, 0xD8));
+    }
+    lerp_row_sse42(top + i, bottom + i, out + i, length - i, weight);
+}
+
+/* sample_sse42()
+ * --------------
+ * Interpolates one overlay pixel from its near and far pixels. The channels
+ * of both are interleaved so that pmaddwd weighs and adds each pair in one
+ * step.
+ *
+ * near: The near pixel, directly followed by the far pixel.
+ * weights: The WEIGHT_LANES weights of the face pixel.
+ *
+ * Returns: The 4 channels of the pixel as 32 bit integers.
+ */
+__attribute__((target("sse4.2"))) static inline __m128i sample_sse42(
+        const uint8_t* near, const uint16_t* weights)
+{
+    const __m128i interleave = _mm_setr_epi8(
+            0, 4, 1, 5, 2, 6, 3, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+    __m128i pair = _mm_cvtepu8_epi16(_mm_shuffle_epi8(
+            _mm_loadl_epi64((const __m128i*)near), interleave));
+    __m128i sum = _mm_madd_epi16(
+            pair, _mm_loadu_si128((const __m128i*)weights));
+    return _mm_srli_epi32(
+            _mm_add_epi32(sum, _mm_set1_epi32(WEIGHT_ROUND)), WEIGHT_BITS);
+}
+
+/* over4_sse42()
+ * -------------
+ * Draws 4 premultiplied BGRA pixels over 4 BGR frame pixels, as blend_row().
+ * 16 frame bytes are loaded and stored, the 4 past the pixels being written
+ * back unchanged.
+ *
+ * pixels: The 4 overlay pixels.
+ * frame: The first of the 4 frame pixels, followed by at least 4 more bytes.
+ */
+__attribute__((target("sse4.2"))) static inline void over4_sse42(
+        __m128i pixels, uint8_t* frame)
+{
+    const __m128i toBgrx = _mm_setr_epi8(
+            0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i toBgr = _mm_setr_epi8(
+            0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const __m128i alphas = _mm_setr_epi8(
+            3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15);
+    const __m128i untouched = _mm_setr_epi8(
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, -1);
+    const __m128i round = _mm_set1_epi16(OPAQUE / 2 + 1);
+    __m128i loaded = _mm_loadu_si128((const __m128i*)frame);
+    __m128i bgrx = _mm_shuffle_epi8(loaded, toBgrx);
+    __m128i inverse = _mm_sub_epi8(
+            _mm_set1_epi8((char)OPAQUE), _mm_shuffle_epi8(pixels, alphas));
+    __m128i low = _mm_add_epi16(_mm_mullo_epi16(_mm_cvtepu8_epi16(bgrx),
+                                        _mm_cvtepu8_epi16(inverse)),
+            round);
+    __m128i high = _mm_add_epi16(
+            _mm_mullo_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(bgrx, 8)),
+                    _mm_cvtepu8_epi16(_mm_srli_si128(inverse, 8))),
+            round);
+    low = _mm_srli_epi16(_mm_add_epi16(low, _mm_srli_epi16(low, 8)), 8);
+    high = _mm_srli_epi16(_mm_add_epi16(high, _mm_srli_epi16(high, 8)), 8);
+    __m128i drawn = _mm_shuffle_epi8(
+            _mm_adds_epu8(_mm_packus_epi16(low, high), pixels), toBgr);
+    _mm_storeu_si128(
+            (__m128i*)frame, _mm_blendv_epi8(drawn, loaded, untouched));
+}
+
+/* blend_row_sse42()
+ * -----------------
+ * blend_row() 4 pixels at a time with SSE4.2. The last few pixels are left
+ * to blend_row() so that over4_sse42() never reads past the face row.
+ */
+__attribute__((target("sse4.2"))) static void blend_row_sse42(
+        const uint8_t* row, const int* offsets, const uint16_t* weights,
+        uint8_t* frame, int width)
+{
+    int x = 0;
+    for (; x + 6 <= width; x += 4) {
+        const uint16_t* w = weights + WEIGHT_LANES * x;
+        __m128i first = _mm_packs_epi32(sample_sse42(row + offsets[x], w),
+                sample_sse42(row + offsets[x + 1], w + WEIGHT_LANES));
+        __m128i second = _mm_packs_epi32(
+                sample_sse42(row + offsets[x + 2], w + 2 * WEIGHT_LANES),
+                sample_sse42(row + offsets[x + 3], w + 3 * WEIGHT_LANES));
+        over4_sse42(_mm_packus_epi16(first, second),
+                frame + FRAME_CHANNELS * x);
+    }
+    blend_row(row, offsets + x, weights + WEIGHT_LANES * x,
+            frame + FRAME_CHANNELS * x, width - x);
+}
+#endif
@@ -0,0 +1,23 @@
+#ifndef BLEND_H
+#define BLEND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Instruction sets the compositing kernels are built for. Every set gives
+// bit-identical results.
+typedef enum {
+    BLEND_SCALAR = 0,
+    BLEND_SSE42 = 1,
+    BLEND_AVX2 = 2
+} BlendKernels;
+
+/* functions */
+BlendKernels blend_use_kernels(BlendKernels limit);
+void blend_premultiply(uint8_t* bgra, size_t step, int width, int height);
+size_t blend_scratch_size(int overlayWidth, int width);
+void blend_face(const uint8_t* overlay, size_t overlayStep, int overlayWidth,
+        int overlayHeight, uint8_t* frame, size_t frameStep, int width,
+        int height, void* scratch);
+
+#endif
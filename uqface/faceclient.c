@@ -0,0 +1,873 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "faceclient.h"
+
+#define RECEIVE_SIZE 65536 // bytes read from a connection at a time
+#define MAX_EVENTS 64 // epoll events handled per wait
+#define MAX_PARTS                                                              \
+    64 // buffers handed to one writev(), so that many small requests queued
+       // on a connection go out in one call
+#define REQUEST_PARTS 4 // header and image, then the replace image's
+#define NANOSECONDS 1000000000ULL
+#define MILLISECOND 1000000 // nanoseconds
+
+// A submitted request. Its images are borrowed from the caller until its
+// callback is called.
+typedef struct Request {
+    uint8_t head[FACE_REQUEST_HEADER_SIZE + sizeof(uint32_t)]; // header and
+                                                              // image size
+    uint8_t replaceHead[sizeof(uint32_t)]; // replace image size
+    struct iovec parts[REQUEST_PARTS];
+    int partCount;
+    size_t length; // bytes over every part
+    uint8_t operation;
+    FaceCallback callback;
+    void* data;
+    uint64_t deadline; // now_nanos() by which it must be answered, 0 for none
+    int abandoned; // its callback was called before it was answered (timed
+                   // out), so its response is ignored
+    struct Request* next; // next waiting or queued to be written
+} Request;
+
+// One connection of a FaceClient pool and the requests pipelined on it
+typedef struct {
+    int fd; // non-blocking socket, -1 while closed
+    int connecting; // connect() has yet to complete
+    uint32_t events; // epoll events registered
+    Request* slots[FACE_MAX_PIPELINE]; // by request ID % FACE_MAX_PIPELINE
+    int inFlight; // occupied slots
+    int abandoned; // slots held by timed out requests written in full, whose
+                   // responses are ignored
+    uint32_t nextId;
+    Request* sendHead; // requests still to be (fully) written
+    Request* sendTail;
+    size_t sent; // bytes of sendHead already written
+    uint8_t* in; // RECEIVE_SIZE bytes read but not yet parsed
+    size_t inStart;
+    size_t inEnd;
+    uint8_t header[FACE_TAGGED_HEADER_SIZE]; // response header being read
+    int headerFill;
+    FaceHeader current; // decoded once the header is complete
+    int haveHeader;
+    uint8_t* body; // body of the current response
+    uint32_t bodyFill;
+} Connection;
+
+struct FaceClient {
+    int epollFd;
+    FaceAddress address;
+    int timeout; // milliseconds a request may take, 0 for no limit
+    Connection* connections;
+    int count;
+    Request* waitHead; // submitted, but not yet given a connection
+    Request* waitTail;
+    int pending; // requests whose callback is yet to be called
+};
+
+/// Static Function Prototypes ///////////
+static uint64_t now_nanos(void);
+static void finish(FaceClient* client, Request* request, FaceStatus status,
+        const FaceHeader* header, const uint8_t* body);
+static int open_connection(FaceClient* client, Connection* connection);
+static void fail_connection(FaceClient* client, Connection* connection);
+static void watch(FaceClient* client, Connection* connection, uint32_t events);
+static void assign_waiting(FaceClient* client);
+static void send_queued(FaceClient* client, Connection* connection);
+static void recieve(FaceClient* client, Connection* connection);
+static int parse(FaceClient* client, Connection* connection);
+static void expire(FaceClient* client, uint64_t now);
+static int unqueue(Connection* connection, Request* request);
+static uint64_t next_deadline(const FaceClient* client);
+
+/// Framing Functions ///////////////////
+
+/* face_encode_request()
+ * ---------------------
+ * Encodes the start of a request: the prefix and operation, with the
+ * pipelined operation and request ID between them when tagged. The image
+ * fields (each a u32 size, then the bytes) follow.
+ *
+ * header: Where the header is written, FACE_REQUEST_HEADER_SIZE bytes.
+ * operation: The FaceOperation requested (with FACE_FAST, if wanted).
+ * tagged: Pipeline the request under id.
+ * id: The request ID its response is tagged with.
+ *
+ * Returns: The length of the header.
+ */
+size_t face_encode_request(
+        uint8_t* header, uint8_t operation, int tagged, uint32_t id)
+{
+    uint32_t prefix = FACE_PREFIX;
+    size_t length = sizeof(uint32_t);
+    memcpy(header, &prefix, sizeof(uint32_t));
+    if (tagged) {
+        header[length++] = FACE_PIPELINED;
+        memcpy(header + length, &id, sizeof(uint32_t));
+        length += sizeof(uint32_t);
+    }
+    header[length++] = operation;
+    return length;
+}
+
+/* face_header_length()
+ * --------------------
+ * header: The first FACE_HEADER_PEEK bytes of a response.
+ *
+ * Returns: The length of the whole response header
+ *          (FACE_RESPONSE_HEADER_SIZE or FACE_TAGGED_HEADER_SIZE), or -1 if
+ *          header does not start with the prefix.
+ */
+int face_header_length(const uint8_t* header)
+{
+    uint32_t prefix;
+    memcpy(&prefix, header, sizeof(uint32_t));
+    if (prefix != FACE_PREFIX) {
+        return -1;
+    }
+    return header[sizeof(uint32_t)] == FACE_PIPELINED
+            ? FACE_TAGGED_HEADER_SIZE
+            : FACE_RESPONSE_HEADER_SIZE;
+}
+
+/* face_decode_response()
+ * ----------------------
+ * header: A whole response header, of face_header_length() bytes.
+ * decoded: Populated with the fields of header.
+ *
+ * Returns: 0, or -1 if header does not start with the prefix.
+ */
+int face_decode_response(const uint8_t* header, FaceHeader* decoded)
+{
+    int length = face_header_length(header);
+    if (length < 0) {
+        return -1;
+    }
+    const uint8_t* fields = header + sizeof(uint32_t);
+    decoded->tagged = length == FACE_TAGGED_HEADER_SIZE;
+    decoded->id = 0;
+    if (decoded->tagged) {
+        memcpy(&decoded->id, fields + sizeof(uint8_t), sizeof(uint32_t));
+        fields += sizeof(uint8_t) + sizeof(uint32_t);
+    }
+    decoded->operation = fields[0];
+    memcpy(&decoded->size, fields + sizeof(uint8_t), sizeof(uint32_t));
+    return 0;
+}
+
+/// Address Functions /////////////////
+
+/* face_resolve()
+ * --------------
+ * Resolves where uqfacedetect listens. A port containing a '/' is the path
+ * of a Unix domain socket, and one starting with '@' names a socket in the
+ * abstract namespace (the rest of the name, see unix(7)); host is then
+ * ignored. Any other port is a TCP port on host.
+ *
+ * host: The server's host name or address.
+ * port: The server's port or socket.
+ * address: Populated with the resolved address.
+ *
+ * Returns: 0, or -1 if port cannot be resolved.
+ */
+int face_resolve(const char* host, const char* port, FaceAddress* address)
+{
+    memset(address, 0, sizeof(FaceAddress));
+    if (strchr(port, '/') || port[0] == '@') {
+        struct sockaddr_un* un = (struct sockaddr_un*)&address->address;
+        size_t length = strlen(port);
+        if (!length || length >= sizeof(un->sun_path)) {
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, port, length);
+        address->length = offsetof(struct sockaddr_un, sun_path) + length;
+        if (port[0] == '@') {
+            // abstract names are not nul terminated, and may not be empty
+            un->sun_path[0] = '\0';
+            return length > 1 ? 0 : -1;
+        }
+        address->length++; // the path's terminating nul
+        return 0;
+    }
+    struct addrinfo* ai = 0;
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_INET; // as uqfacedetect listens on
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &ai)) {
+        return -1;
+    }
+    memcpy(&address->address, ai->ai_addr, ai->ai_addrlen);
+    address->length = ai->ai_addrlen;
+    freeaddrinfo(ai);
+    return 0;
+}
+
+/* face_connect()
+ * --------------
+ * Connects a new stream socket to address. TCP sockets have Nagle's
+ * algorithm disabled, so small requests are not held back.
+ *
+ * address: Resolved by face_resolve().
+ * flags: Socket type flags (e.g. SOCK_NONBLOCK, when a connect() still in
+ *        progress counts as success).
+ *
+ * Returns: The socket, or -1 if it could not be connected.
+ */
+int face_connect(const FaceAddress* address, int flags)
+{
+    int optVal = 1;
+    int family = address->address.ss_family;
+    int fd = socket(family, SOCK_STREAM | flags, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (family == AF_INET) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optVal, sizeof(int));
+    }
+    if (connect(fd, (const struct sockaddr*)&address->address,
+                address->length)
+            && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/// Client Functions ////////////////////
+
+/* face_client_open()
+ * ------------------
+ * Creates a pool of connections to the uqfacedetect at host and port. Each
+ * connection is opened when it is first needed, and reopened when needed
+ * again after failing.
+ *
+ * host: The server's host name or address.
+ * port: The server's port or socket (see face_resolve()).
+ * connections: The number of connections requests are spread over.
+ * timeout: Milliseconds a request may take from being submitted to being
+ *          answered, 0 for no limit.
+ *
+ * Returns: The new FaceClient, or NULL if host and port cannot be resolved.
+ */
+FaceClient* face_client_open(
+        const char* host, const char* port, int connections, int timeout)
+{
+    FaceClient* client = (FaceClient*)calloc(1, sizeof(FaceClient));
+    if (connections < 1 || face_resolve(host, port, &client->address)) {
+        free(client);
+        return NULL;
+    }
+    client->epollFd = epoll_create1(0);
+    client->timeout = timeout;
+    client->count = connections;
+    client->connections
+            = (Connection*)calloc(connections, sizeof(Connection));
+    for (int i = 0; i < connections; i++) {
+        client->connections[i].fd = -1;
+        client->connections[i].in = (uint8_t*)malloc(RECEIVE_SIZE);
+    }
+    return client;
+}
+
+/* face_client_submit()
+ * --------------------
+ * Queues a request. It is sent by face_client_run(), which later calls
+ * callback with its outcome (never this function, so callbacks may submit
+ * further requests).
+ *
+ * client: The FaceClient the request is sent by.
+ * operation: The FaceOperation requested (with FACE_FAST, if wanted).
+ * image: The image to detect faces in, borrowed until callback is called.
+ * size: The size of image.
+ * replace: For FACE_REPLACE, the image faces are replaced with (borrowed as
+ *          image is); ignored otherwise.
+ * replaceSize: The size of replace.
+ * callback: Called with the outcome of the request.
+ * data: Passed to callback.
+ *
+ * Returns: 0, or -1 if the request could not be queued.
+ */
+int face_client_submit(FaceClient* client, uint8_t operation,
+        const uint8_t* image, uint32_t size, const uint8_t* replace,
+        uint32_t replaceSize, FaceCallback callback, void* data)
+{
+    Request* request = (Request*)calloc(1, sizeof(Request));
+    if (!request) {
+        return -1;
+    }
+    // the request ID is filled in once a connection is chosen
+    size_t length = face_encode_request(request->head, operation, 1, 0);
+    memcpy(request->head + length, &size, sizeof(uint32_t));
+    request->parts[0].iov_base = request->head;
+    request->parts[0].iov_len = length + sizeof(uint32_t);
+    request->parts[1].iov_base = (void*)image;
+    request->parts[1].iov_len = size;
+    request->partCount = 2;
+    if ((operation & ~FACE_FAST) == FACE_REPLACE) {
+        memcpy(request->replaceHead, &replaceSize, sizeof(uint32_t));
+        request->parts[2].iov_base = request->replaceHead;
+        request->parts[2].iov_len = sizeof(uint32_t);
+        request->parts[3].iov_base = (void*)replace;
+        request->parts[3].iov_len = replaceSize;
+        request->partCount = REQUEST_PARTS;
+    }
+    for (int i = 0; i < request->partCount; i++) {
+        request->length += request->parts[i].iov_len;
+    }
+    request->operation = operation;
+    request->callback = callback;
+    request->data = data;
+    if (client->timeout) {
+        request->deadline
+                = now_nanos() + (uint64_t)client->timeout * MILLISECOND;
+    }
+    if (client->waitTail) {
+        client->waitTail->next = request;
+    } else {
+        client->waitHead = request;
+    }
+    client->waitTail = request;
+    client->pending++;
+    return 0;
+}
+
+/* face_client_fd()
+ * ----------------
+ * Returns: A file descriptor that becomes readable whenever
+ *          face_client_run() has work to do, for callers waiting on it in
+ *          their own event loop (then calling face_client_run() with a wait
+ *          of 0).
+ */
+int face_client_fd(const FaceClient* client)
+{
+    return client->epollFd;
+}
+
+/* face_client_run()
+ * -----------------
+ * Sends queued requests, reads responses and calls the callbacks of the
+ * requests that are answered, time out or lose their connection. Waits up to
+ * wait milliseconds (-1 for as long as a request is pending) for anything to
+ * happen.
+ *
+ * client: The FaceClient to be run.
+ * wait: Milliseconds to wait, 0 to only handle what is ready.
+ *
+ * Returns: The number of requests still pending.
+ */
+int face_client_run(FaceClient* client, int wait)
+{
+    struct epoll_event events[MAX_EVENTS];
+    assign_waiting(client);
+    if (!client->pending) {
+        return 0;
+    }
+    uint64_t deadline = next_deadline(client);
+    if (deadline) {
+        uint64_t now = now_nanos();
+        int untilDeadline = deadline > now
+                ? (int)((deadline - now + MILLISECOND - 1) / MILLISECOND)
+                : 0;
+        if (wait < 0 || untilDeadline < wait) {
+            wait = untilDeadline;
+        }
+    }
+    int count = epoll_wait(client->epollFd, events, MAX_EVENTS, wait);
+    for (int i = 0; i < count; i++) {
+        Connection* connection = (Connection*)events[i].data.ptr;
+        if (connection->fd >= 0 && (events[i].events & EPOLLOUT)) {
+            send_queued(client, connection);
+        }
+        if (connection->fd >= 0
+                && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+            recieve(client, connection);
+        }
+    }
+    expire(client, now_nanos());
+    assign_waiting(client);
+    return client->pending;
+}
+
+/* face_client_pending()
+ * ---------------------
+ * Returns: The number of requests whose callback is yet to be called.
+ */
+int face_client_pending(const FaceClient* client)
+{
+    return client->pending;
+}
+
+/* face_client_close()
+ * -------------------
+ * Closes every connection and frees client. Requests still pending are
+ * dropped without their callbacks being called.
+ */
+void face_client_close(FaceClient* client)
+{
+    for (int i = 0; i < client->count; i++) {
+        Connection* connection = &client->connections[i];
+        if (connection->fd >= 0) {
+            close(connection->fd);
+        }
+        for (int slot = 0; slot < FACE_MAX_PIPELINE; slot++) {
+            free(connection->slots[slot]);
+        }
+        free(connection->body);
+        free(connection->in);
+    }
+    while (client->waitHead) {
+        Request* next = client->waitHead->next;
+        free(client->waitHead);
+        client->waitHead = next;
+    }
+    close(client->epollFd);
+    free(client->connections);
+    free(client);
+}
+
+/// Static Functions ////////////////////
+
+/* now_nanos()
+ * -----------
+ * Returns: The monotonic clock in nanoseconds.
+ */
+static uint64_t now_nanos(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NANOSECONDS + now.tv_nsec;
+}
+
+/* finish()
+ * --------
+ * Calls the callback of request with its outcome, unless it has already been
+ * called.
+ *
+ * client: The FaceClient request was submitted to.
+ * request: The Request that has ended.
+ * status: How it ended.
+ * header: The header of its response, or NULL if it was not answered.
+ * body: The body of its response.
+ */
+static void finish(FaceClient* client, Request* request, FaceStatus status,
+        const FaceHeader* header, const uint8_t* body)
+{
+    if (request->abandoned) {
+        return;
+    }
+    FaceResult result = {status, header ? header->operation : 0, body,
+            header ? header->size : 0};
+    request->abandoned = 1;
+    client->pending--;
+    request->callback(request->data, &result);
+}
+
+/* open_connection()
+ * -----------------
+ * Starts a non-blocking connect() of connection to the server and registers
+ * it with the client's epoll instance.
+ *
+ * Returns: 0, or -1 if the connection failed straight away.
+ */
+static int open_connection(FaceClient* client, Connection* connection)
+{
+    int fd = face_connect(&client->address, SOCK_NONBLOCK);
+    if (fd < 0) {
+        return -1;
+    }
+    connection->fd = fd;
+    connection->connecting = 1;
+    struct epoll_event event = {EPOLLIN | EPOLLOUT, {.ptr = connection}};
+    connection->events = event.events;
+    epoll_ctl(client->epollFd, EPOLL_CTL_ADD, fd, &event);
+    return 0;
+}
+
+/* fail_connection()
+ * -----------------
+ * Closes connection, ending every request on it as FACE_DISCONNECTED, and
+ * leaves it to be reopened when next needed.
+ */
+static void fail_connection(FaceClient* client, Connection* connection)
+{
+    close(connection->fd); // also removes it from the epoll instance
+    connection->fd = -1;
+    connection->sendHead = connection->sendTail = NULL;
+    connection->sent = 0;
+    connection->inStart = connection->inEnd = 0;
+    connection->headerFill = 0;
+    connection->haveHeader = 0;
+    free(connection->body);
+    connection->body = NULL;
+    for (int slot = 0; slot < FACE_MAX_PIPELINE; slot++) {
+        Request* request = connection->slots[slot];
+        if (request) {
+            connection->slots[slot] = NULL;
+            finish(client, request, FACE_DISCONNECTED, NULL, NULL);
+            free(request);
+        }
+    }
+    connection->inFlight = 0;
+    connection->abandoned = 0;
+}
+
+/* watch()
+ * -------
+ * Changes the epoll events connection is registered for.
+ */
+static void watch(FaceClient* client, Connection* connection, uint32_t events)
+{
+    if (connection->events != events) {
+        struct epoll_event event = {events, {.ptr = connection}};
+        connection->events = events;
+        epoll_ctl(client->epollFd, EPOLL_CTL_MOD, connection->fd, &event);
+    }
+}
+
+/* assign_waiting()
+ * ----------------
+ * Gives each waiting request, in order, a request ID on the connection with
+ * the fewest in flight, for as long as one has a free slot. Connections are
+ * (re)opened as needed; a request whose connection cannot be opened ends as
+ * FACE_DISCONNECTED.
+ */
+static void assign_waiting(FaceClient* client)
+{
+    while (client->waitHead) {
+        Connection* connection = NULL;
+        for (int i = 0; i < client->count; i++) {
+            Connection* candidate = &client->connections[i];
+            if (candidate->inFlight < FACE_MAX_PIPELINE
+                    && (!connection
+                            || candidate->inFlight < connection->inFlight)) {
+                connection = candidate;
+            }
+        }
+        if (!connection) {
+            // every connection is full
+            return;
+        }
+        Request* request = client->waitHead;
+        client->waitHead = request->next;
+        if (!client->waitHead) {
+            client->waitTail = NULL;
+        }
+        request->next = NULL;
+        if (connection->fd < 0 && open_connection(client, connection)) {
+            finish(client, request, FACE_DISCONNECTED, NULL, NULL);
+            free(request);
+            continue;
+        }
+        while (connection->slots[connection->nextId % FACE_MAX_PIPELINE]) {
+            connection->nextId++;
+        }
+        uint32_t id = connection->nextId++;
+        face_encode_request(request->head, request->operation, 1, id);
+        connection->slots[id % FACE_MAX_PIPELINE] = request;
+        connection->inFlight++;
+        if (connection->sendTail) {
+            connection->sendTail->next = request;
+        } else {
+            connection->sendHead = request;
+        }
+        connection->sendTail = request;
+        watch(client, connection, EPOLLIN | EPOLLOUT);
+    }
+}
+
+/* send_queued()
+ * -------------
+ * Completes a pending connect() and writes as much of the queued requests of
+ * connection as the socket takes, several requests per writev().
+ */
+static void send_queued(FaceClient* client, Connection* connection)
+{
+    struct iovec parts[MAX_PARTS];
+    if (connection->connecting) {
+        int error = 0;
+        socklen_t length = sizeof(int);
+        getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error) {
+            fail_connection(client, connection);
+            return;
+        }
+        connection->connecting = 0;
+    }
+    while (connection->sendHead) {
+        int count = 0;
+        size_t skip = connection->sent;
+        for (Request* request = connection->sendHead;
+                request && count < MAX_PARTS; request = request->next) {
+            for (int i = 0; i < request->partCount && count < MAX_PARTS; i++) {
+                struct iovec part = request->parts[i];
+                if (skip >= part.iov_len) {
+                    skip -= part.iov_len;
+                    continue;
+                }
+                parts[count].iov_base = (uint8_t*)part.iov_base + skip;
+                parts[count++].iov_len = part.iov_len - skip;
+                skip = 0;
+            }
+        }
+        ssize_t nwritten = writev(connection->fd, parts, count);
+        if (nwritten < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        } else if (nwritten < 0) {
+            fail_connection(client, connection);
+            return;
+        }
+        connection->sent += nwritten;
+        while (connection->sendHead
+                && connection->sent >= connection->sendHead->length) {
+            // written in full, the request stays in its slot until answered
+            connection->sent -= connection->sendHead->length;
+            Request* next = connection->sendHead->next;
+            connection->sendHead->next = NULL;
+            connection->sendHead = next;
+        }
+    }
+    connection->sendTail = NULL;
+    watch(client, connection, EPOLLIN);
+}
+
+/* recieve()
+ * ---------
+ * Reads whatever the server has sent on connection and completes the
+ * requests it answers. A closed or broken connection is failed.
+ */
+static void recieve(FaceClient* client, Connection* connection)
+{
+    while (connection->fd >= 0) {
+        ssize_t nread;
+        if (connection->haveHeader
+                && connection->inStart == connection->inEnd) {
+            // a body is read straight into place
+            nread = read(connection->fd,
+                    connection->body + connection->bodyFill,
+                    connection->current.size - connection->bodyFill);
+            if (nread > 0) {
+                connection->bodyFill += nread;
+            }
+        } else {
+            nread = read(connection->fd, connection->in + connection->inEnd,
+                    RECEIVE_SIZE - connection->inEnd);
+            if (nread > 0) {
+                connection->inEnd += nread;
+            }
+        }
+        if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        } else if (nread <= 0 || parse(client, connection)) {
+            fail_connection(client, connection);
+            return;
+        }
+    }
+}
+
+/* parse()
+ * -------
+ * Consumes the bytes read on connection, completing each request whose
+ * response has arrived in full.
+ *
+ * Returns: 0, or -1 if the server sent something other than a pipelined
+ *          response to a request in flight.
+ */
+static int parse(FaceClient* client, Connection* connection)
+{
+    while (1) {
+        size_t available = connection->inEnd - connection->inStart;
+        uint8_t* next = connection->in + connection->inStart;
+        if (!connection->haveHeader) {
+            // the first FACE_HEADER_PEEK bytes tell how long the header is
+            int needed = connection->headerFill < FACE_HEADER_PEEK
+                    ? FACE_HEADER_PEEK
+                    : face_header_length(connection->header);
+            if (needed < 0) {
+                return -1;
+            } else if (connection->headerFill < needed) {
+                if (!available) {
+                    break;
+                }
+                size_t copy = (size_t)(needed - connection->headerFill);
+                copy = copy < available ? copy : available;
+                memcpy(connection->header + connection->headerFill, next,
+                        copy);
+                connection->headerFill += copy;
+                connection->inStart += copy;
+                continue;
+            }
+            FaceHeader* header = &connection->current;
+            if (face_decode_response(connection->header, header)
+                    || !header->tagged
+                    || !connection->slots[header->id % FACE_MAX_PIPELINE]) {
+                return -1;
+            }
+            connection->body
+                    = (uint8_t*)malloc(header->size ? header->size : 1);
+            connection->bodyFill = 0;
+            connection->haveHeader = 1;
+            continue;
+        }
+        size_t copy = connection->current.size - connection->bodyFill;
+        copy = copy < available ? copy : available;
+        memcpy(connection->body + connection->bodyFill, next, copy);
+        connection->bodyFill += copy;
+        connection->inStart += copy;
+        if (connection->bodyFill < connection->current.size) {
+            break;
+        }
+        // response complete
+        FaceHeader* header = &connection->current;
+        Request* request = connection->slots[header->id % FACE_MAX_PIPELINE];
+        connection->slots[header->id % FACE_MAX_PIPELINE] = NULL;
+        connection->inFlight--;
+        connection->abandoned -= request->abandoned;
+        connection->haveHeader = 0;
+        connection->headerFill = 0;
+        finish(client, request,
+                header->operation == FACE_ERROR ? FACE_SERVER_ERROR : FACE_OK,
+                header, connection->body);
+        free(request);
+        free(connection->body);
+        connection->body = NULL;
+    }
+    if (connection->inStart == connection->inEnd) {
+        connection->inStart = connection->inEnd = 0;
+    }
+    return 0;
+}
+
+/* expire()
+ * --------
+ * Ends every pending request whose deadline has passed as FACE_TIMEOUT. Its
+ * images are never touched again once its callback is called:
+ *
+ * - one not yet started being written is taken off its connection, freeing
+ *   its request ID;
+ * - one partly written can only be abandoned with its connection, which is
+ *   failed first (ending the other requests on it as FACE_DISCONNECTED);
+ * - one written in full keeps its slot until its response arrives, which is
+ *   then ignored. Once every request in flight on a connection has been
+ *   abandoned so, the connection is reset rather than left waiting on a
+ *   server that may never answer.
+ */
+static void expire(FaceClient* client, uint64_t now)
+{
+    if (!client->timeout) {
+        return;
+    }
+    for (int i = 0; i < client->count; i++) {
+        Connection* connection = &client->connections[i];
+        for (int slot = 0; slot < FACE_MAX_PIPELINE; slot++) {
+            Request* request = connection->slots[slot];
+            if (!request || request->abandoned || now < request->deadline) {
+                continue;
+            }
+            if (unqueue(connection, request)) {
+                connection->slots[slot] = NULL;
+                connection->inFlight--;
+                finish(client, request, FACE_TIMEOUT, NULL, NULL);
+                free(request);
+            } else if (request == connection->sendHead) {
+                // partly written, so the rest of it cannot be left out
+                connection->slots[slot] = NULL;
+                connection->inFlight--;
+                fail_connection(client, connection);
+                finish(client, request, FACE_TIMEOUT, NULL, NULL);
+                free(request);
+            } else {
+                finish(client, request, FACE_TIMEOUT, NULL, NULL);
+                connection->abandoned++;
+            }
+        }
+        if (connection->fd >= 0 && connection->inFlight
+                && connection->abandoned == connection->inFlight) {
+            fail_connection(client, connection);
+        }
+    }
+    Request** link = &client->waitHead;
+    client->waitTail = NULL;
+    while (*link) {
+        Request* request = *link;
+        if (now >= request->deadline) {
+            *link = request->next;
+            finish(client, request, FACE_TIMEOUT, NULL, NULL);
+            free(request);
+        } else {
+            client->waitTail = request;
+            link = &request->next;
+        }
+    }
+}
+
+/* unqueue()
+ * ---------
+ * Takes request off the send queue of connection, unless it has been
+ * started being written.
+ *
+ * Returns: 1 if request was taken off, 0 if it was not queued or has been
+ *          (partly) written.
+ */
+static int unqueue(Connection* connection, Request* request)
+{
+    Request* previous = NULL;
+    if (request == connection->sendHead && connection->sent) {
+        return 0;
+    }
+    for (Request* queued = connection->sendHead; queued;
+            queued = queued->next) {
+        if (queued == request) {
+            if (previous) {
+                previous->next = request->next;
+            } else {
+                connection->sendHead = request->next;
+            }
+            if (connection->sendTail == request) {
+                connection->sendTail = previous;
+            }
+            request->next = NULL;
+            return 1;
+        }
+        previous = queued;
+    }
+    return 0;
+}
+
+/* next_deadline()
+ * ---------------
+ * Returns: The earliest deadline of a pending request, or 0 if none has one.
+ */
+static uint64_t next_deadline(const FaceClient* client)
+{
+    uint64_t earliest = 0;
+    if (!client->timeout) {
+        return 0;
+    }
+    for (int i = 0; i < client->count; i++) {
+        const Connection* connection = &client->connections[i];
+        for (int slot = 0; slot < FACE_MAX_PIPELINE; slot++) {
+            const Request* request = connection->slots[slot];
+            if (request && !request->abandoned
+                    && (!earliest || request->deadline < earliest)) {
+                earliest = request->deadline;
+            }
+        }
+    }
+    for (const Request* request = client->waitHead; request;
+            request = request->next) {
+        if (!earliest || request->deadline < earliest) {
+            earliest = request->deadline;
+        }
+    }
+    return earliest;
+}
@@ -0,0 +1,91 @@
+#ifndef FACECLIENT_H
+#define FACECLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// First field of every request and response
+#define FACE_PREFIX 0x23107231
+// Set in a detect operation to detect on a reduced image (fast mode)
+#define FACE_FAST 0x80
+// Requests uqfacedetect keeps in flight on one pipelined connection
+#define FACE_MAX_PIPELINE 64
+// Longest request header: prefix, pipelined operation, request ID, operation
+#define FACE_REQUEST_HEADER_SIZE 10
+// Response headers: prefix, operation and size, with the pipelined operation
+// and request ID before the operation when tagged
+#define FACE_RESPONSE_HEADER_SIZE 9
+#define FACE_TAGGED_HEADER_SIZE 14
+// Bytes of a response header needed to tell how long it is
+#define FACE_HEADER_PEEK 5
+
+// Operations of the communication protocol
+typedef enum {
+    FACE_DETECT = 0,
+    FACE_REPLACE = 1,
+    FACE_OUTPUT_IMAGE = 2,
+    FACE_ERROR = 3, // body is an error message (not nul terminated)
+    FACE_PIPELINED = 4, // followed by a request ID and operation
+    FACE_DETECT_RECTS = 5,
+    FACE_OUTPUT_RECTS = 6
+} FaceOperation;
+
+// A decoded response header
+typedef struct {
+    uint8_t operation;
+    int tagged; // the response is to a pipelined request
+    uint32_t id; // request ID, when tagged
+    uint32_t size; // bytes of the body that follows
+} FaceHeader;
+
+// An address uqfacedetect listens on, a TCP port or a Unix domain socket
+// (see face_resolve())
+typedef struct {
+    struct sockaddr_storage address;
+    socklen_t length;
+} FaceAddress;
+
+// How a request submitted to a FaceClient ended
+typedef enum {
+    FACE_OK = 0, // answered with an output image or rectangles
+    FACE_SERVER_ERROR = 1, // answered with an error message
+    FACE_TIMEOUT = 2, // not answered in time
+    FACE_DISCONNECTED = 3 // the connection failed before it was answered
+} FaceStatus;
+
+// The outcome of a request, handed to its FaceCallback. body is only valid
+// during the callback.
+typedef struct {
+    FaceStatus status;
+    uint8_t operation; // FACE_OUTPUT_IMAGE, FACE_OUTPUT_RECTS or FACE_ERROR
+    const uint8_t* body;
+    uint32_t size;
+} FaceResult;
+
+typedef void (*FaceCallback)(void* data, const FaceResult* result);
+
+// A pool of non-blocking connections to uqfacedetect, driven by
+// face_client_run() on a single thread
+typedef struct FaceClient FaceClient;
+
+/* framing functions */
+size_t face_encode_request(
+        uint8_t* header, uint8_t operation, int tagged, uint32_t id);
+int face_header_length(const uint8_t* header);
+int face_decode_response(const uint8_t* header, FaceHeader* decoded);
+/* address functions */
+int face_resolve(const char* host, const char* port, FaceAddress* address);
+int face_connect(const FaceAddress* address, int flags);
+/* client functions */
+FaceClient* face_client_open(
+        const char* host, const char* port, int connections, int timeout);
+int face_client_submit(FaceClient* client, uint8_t operation,
+        const uint8_t* image, uint32_t size, const uint8_t* replace,
+        uint32_t replaceSize, FaceCallback callback, void* data);
+int face_client_fd(const FaceClient* client);
+int face_client_run(FaceClient* client, int wait);
+int face_client_pending(const FaceClient* client);
+void face_client_close(FaceClient* client);
+
+#endif
@@ -0,0 +1,2149 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+#include "haar.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAAR_X86 // SSE4.2 and AVX2 kernels are built
+#include <immintrin.h>
+#endif
+
+#define STAGE_BIAS 0.0001 // subtracted from every stage threshold (as OpenCV)
+#define GROUP_EPS 0.2 // relative distance below which windows are grouped
+#define MIN_INNER_NEIGHBOURS                                                   \
+    3 // groups with fewer windows never hide a smaller group inside them
+#define PYRAMID_MARGIN                                                         \
+    10 // the pyramid stops once a window is within this many pixels of the
+       // image size
+#define MIN_STEP 2.0 // windows are never placed closer than this many pixels
+#define TILTED_CORRECTION 0.5 // weight correction for 45 degree rectangles
+#define GRAY_SHIFT 14 // fixed point BGR to gray weights (as cvCvtColor())
+#define GRAY_B 1868
+#define GRAY_G 9617
+#define GRAY_R 4899
+#define GRAY_ROUND (1 << (GRAY_SHIFT - 1))
+#define LEVELS 256 // gray levels of an 8 bit image
+#define HIST_BANKS 4 // histograms counted in parallel by haar_equalize()
+#define MAX_TREE_NODES                                                         \
+    32 // classifiers with more nodes are only evaluated by the scalar kernel
+#define SPLIT_PIXELS                                                           \
+    (1 << 18) // smaller images are not worth splitting between threads
+#define STRIP_ROWS                                                             \
+    (2 * HAAR_LANES) // rows of windows scanned by one task of a split
+                     // detection
+
+// The searches of a haar_detect_regions() call, shared with the threads
+// running its tasks
+typedef struct {
+    HaarEvaluator* owner; // evaluator holding the image
+    const HaarCascade* cascade;
+    int minNeighbours;
+    CvSize minSize;
+    CvSize maxSize;
+    const CvRect* regions;
+    HaarRectLists* objects;
+} RegionSearch;
+
+// A helper thread of a HaarScheduler
+typedef struct {
+    HaarScheduler* scheduler;
+    int slot; // task range of every job handed to this helper
+    HaarEvaluator* evaluator; // borrows the integral images of each job
+} Helper;
+
+/// Static Function Prototypes ///////////
+static HaarCascade* convert_cascade(CvHaarClassifierCascade* source);
+static void scale_cascade(
+        HaarCascade* cascade, double scaleFactor, int maxWindow);
+static void scale_node(
+        const HaarCascade* cascade, HaarScale* scale, int node);
+static void* grow(void* array, int* capacity, int needed, size_t size);
+static void push_rect(HaarRects* list, CvRect rect);
+static void gray_row(const uint8_t* bgr, uint8_t* gray, int width);
+static void integral_row(const uint8_t* row, const uint32_t* sumAbove,
+        uint32_t* sumRow, const double* sqsumAbove, double* sqsumRow,
+        int width);
+static void build_tilted(HaarEvaluator* evaluator);
+static void* helper_thread(void* data);
+static void work_on(HaarJob* job, int slot, HaarEvaluator* evaluator);
+static int claim_task(HaarRange* range, int front);
+static void lend_image(HaarEvaluator* evaluator, const HaarEvaluator* owner,
+        CvRect region);
+static int split_pyramid(HaarEvaluator* evaluator, const HaarCascade* cascade,
+        int firstScale, int endScale);
+static void pyramid_task(void* data, int task, HaarEvaluator* evaluator);
+static void region_task(void* data, int task, HaarEvaluator* evaluator);
+static void scale_grid(const HaarEvaluator* evaluator, const HaarScale* scale,
+        double* step, int* endX, int* endY);
+static void bind_scale(HaarEvaluator* evaluator, const HaarCascade* cascade,
+        const HaarScale* scale);
+static int eval_window(const HaarEvaluator* evaluator,
+        const HaarCascade* cascade, const HaarScale* scale, size_t base);
+static void scan_scale(HaarEvaluator* evaluator, const HaarCascade* cascade,
+        const HaarScale* scale, int beginY, int endY);
+static void scan_windows(HaarEvaluator* evaluator,
+        const HaarCascade* cascade, const HaarScale* scale, double step,
+        int endX, int beginY, int endY);
+#ifdef HAAR_X86
+static void gray_row_sse42(const uint8_t* bgr, uint8_t* gray, int width);
+static void gray_row_avx2(const uint8_t* bgr, uint8_t* gray, int width);
+static void integral_row_sse42(const uint8_t* row, const uint32_t* sumAbove,
+        uint32_t* sumRow, const double* sqsumAbove, double* sqsumRow,
+        int width);
+static void integral_row_avx2(const uint8_t* row, const uint32_t* sumAbove,
+        uint32_t* sumRow, const double* sqsumAbove, double* sqsumRow,
+        int width);
+static void scan_windows_avx2(HaarEvaluator* evaluator,
+        const HaarCascade* cascade, const HaarScale* scale, double step,
+        int endX, int beginY, int endY);
+static void queue_window_avx2(HaarEvaluator* evaluator,
+        const HaarCascade* cascade, const HaarScale* scale, int stage,
+        int base, int x, int row, double norm, const int* ys);
+static void run_batch_avx2(HaarEvaluator* evaluator,
+        const HaarCascade* cascade, const HaarScale* scale, int stage,
+        const int* ys);
+static void sort_row(HaarRects* row);
+#endif
+static int similar_rects(CvRect a, CvRect b);
+static int find_root(int* parents, int i);
+static void group_rects(
+        HaarEvaluator* evaluator, int minNeighbours, HaarRects* objects);
+
+//////////////////////////////////////////
+
+// Kernels chosen by haar_use_kernels(), scalar until it is called. Only set
+// before detection threads start, so never read and written concurrently.
+static void (*grayKernel)(const uint8_t*, uint8_t*, int) = gray_row;
+static void (*integralKernel)(const uint8_t*, const uint32_t*, uint32_t*,
+        const double*, double*, int)
+        = integral_row;
+static void (*scanKernel)(HaarEvaluator*, const HaarCascade*,
+        const HaarScale*, double, int, int, int)
+        = scan_windows;
+
+/// Loading Functions ////////////////////
+
+/* haar_load()
+ * -----------
+ * Loads a cascade classifier file with cvLoad() and converts it into a
+ * HaarCascade, precomputing the scaled features of every window size of the
+ * detection pyramid. The CvHaarClassifierCascade is released once converted.
+ *
+ * path: The cascade classifier file.
+ * scaleFactor: The ratio between successive window sizes, must exceed 1.
+ * maxWindow: The largest window width and height that will be searched for.
+ *
+ * Returns: The loaded HaarCascade, or NULL if the file could not be loaded or
+ *          holds a tree of stages (only a chain of stages is supported).
+ */
+HaarCascade* haar_load(const char* path, double scaleFactor, int maxWindow)
+{
+    HaarCascade* cascade;
+    CvHaarClassifierCascade* source;
+    if (scaleFactor <= 1
+            || !(source = (CvHaarClassifierCascade*)cvLoad(
+                         path, NULL, NULL, NULL))) {
+        return NULL;
+    }
+    if ((cascade = convert_cascade(source))) {
+        scale_cascade(cascade, scaleFactor, maxWindow);
+    }
+    cvReleaseHaarClassifierCascade(&source);
+    return cascade;
+}
+
+/* convert_cascade()
+ * -----------------
+ * Flattens the nested stages, classifiers and features of source into the
+ * arrays of a new HaarCascade.
+ *
+ * source: The cascade loaded by cvLoad().
+ *
+ * Returns: The new HaarCascade, or NULL if source holds a tree of stages.
+ */
+static HaarCascade* convert_cascade(CvHaarClassifierCascade* source)
+{
+    int classifiers = 0, nodes = 0;
+    for (int i = 0; i < source->count; i++) {
+        CvHaarStageClassifier* stage = &source->stage_classifier[i];
+        if (stage->next != -1) {
+            // stage trees are not supported
+            return NULL;
+        }
+        classifiers += stage->count;
+        for (int j = 0; j < stage->count; j++) {
+            nodes += stage->classifier[j].count;
+        }
+    }
+    HaarCascade* cascade = (HaarCascade*)calloc(1, sizeof(HaarCascade));
+    cascade->forwardTrees = 1;
+    cascade->window = source->orig_window_size;
+    cascade->stageCount = source->count;
+    cascade->stageFirst = (int*)malloc((source->count + 1) * sizeof(int));
+    cascade->stageThresholds = (float*)malloc(source->count * sizeof(float));
+    cascade->classifierCount = classifiers;
+    cascade->nodeFirst = (int*)malloc((classifiers + 1) * sizeof(int));
+    cascade->alphaFirst = (int*)malloc(classifiers * sizeof(int));
+    cascade->nodeCount = nodes;
+    cascade->nodeThresholds = (float*)malloc(nodes * sizeof(float));
+    cascade->left = (int*)malloc(nodes * sizeof(int));
+    cascade->right = (int*)malloc(nodes * sizeof(int));
+    cascade->tilted = (uint8_t*)malloc(nodes);
+    cascade->rectCounts = (uint8_t*)malloc(nodes);
+    cascade->alphas = (float*)malloc((nodes + classifiers) * sizeof(float));
+    cascade->baseRects = (CvRect*)calloc(nodes * HAAR_RECTS, sizeof(CvRect));
+    cascade->baseWeights = (float*)calloc(nodes * HAAR_RECTS, sizeof(float));
+    int classifier = 0, node = 0, alpha = 0;
+    for (int i = 0; i < source->count; i++) {
+        CvHaarStageClassifier* stage = &source->stage_classifier[i];
+        cascade->stageFirst[i] = classifier;
+        cascade->stageThresholds[i] = (float)(stage->threshold - STAGE_BIAS);
+        for (int j = 0; j < stage->count; j++, classifier++) {
+            CvHaarClassifier* weak = &stage->classifier[j];
+            cascade->nodeFirst[classifier] = node;
+            cascade->alphaFirst[classifier] = alpha;
+            if (weak->count > cascade->maxNodes) {
+                cascade->maxNodes = weak->count;
+            }
+            for (int k = 0; k < weak->count; k++, node++) {
+                CvHaarFeature* feature = &weak->haar_feature[k];
+                cascade->nodeThresholds[node] = weak->threshold[k];
+                cascade->left[node] = weak->left[k];
+                cascade->right[node] = weak->right[k];
+                if ((weak->left[k] > 0 && weak->left[k] <= k)
+                        || (weak->right[k] > 0 && weak->right[k] <= k)) {
+                    cascade->forwardTrees = 0;
+                }
+                cascade->tilted[node] = feature->tilted != 0;
+                cascade->hasTilted |= feature->tilted != 0;
+                // the third rectangle is optional
+                cascade->rectCounts[node]
+                        = (fabs(feature->rect[2].weight) < DBL_EPSILON
+                                  || !feature->rect[2].r.width
+                                  || !feature->rect[2].r.height)
+                        ? 2
+                        : 3;
+                for (int r = 0; r < cascade->rectCounts[node]; r++) {
+                    cascade->baseRects[node * HAAR_RECTS + r]
+                            = feature->rect[r].r;
+                    cascade->baseWeights[node * HAAR_RECTS + r]
+                            = feature->rect[r].weight;
+                }
+            }
+            for (int k = 0; k <= weak->count; k++) {
+                // a classifier with n nodes has n + 1 leaves
+                cascade->alphas[alpha++] = weak->alpha[k];
+            }
+        }
+    }
+    cascade->stageFirst[source->count] = classifier;
+    cascade->nodeFirst[classifiers] = node;
+    return cascade;
+}
+
+/* scale_cascade()
+ * ---------------
+ * Precomputes the scaled features of every window size of the detection
+ * pyramid, starting at the cascade's own window size and growing by
+ * scaleFactor until the window exceeds maxWindow.
+ *
+ * cascade: The converted HaarCascade.
+ * scaleFactor: The ratio between successive window sizes.
+ * maxWindow: The largest window width and height that will be searched for.
+ */
+static void scale_cascade(
+        HaarCascade* cascade, double scaleFactor, int maxWindow)
+{
+    int capacity = 0;
+    for (double factor = 1;; factor *= scaleFactor) {
+        // factor is accumulated exactly as cvHaarDetectObjects() does
+        CvSize window = cvSize(cvRound(cascade->window.width * factor),
+                cvRound(cascade->window.height * factor));
+        if (window.width > maxWindow || window.height > maxWindow) {
+            break;
+        }
+        cascade->scales = (HaarScale*)grow(cascade->scales, &capacity,
+                cascade->scaleCount + 1, sizeof(HaarScale));
+        HaarScale* scale = &cascade->scales[cascade->scaleCount++];
+        scale->factor = factor;
+        scale->window = window;
+        scale->equRect = cvRect(cvRound(factor), cvRound(factor),
+                cvRound((cascade->window.width - 2) * factor),
+                cvRound((cascade->window.height - 2) * factor));
+        scale->invArea = 1. / (scale->equRect.width * scale->equRect.height);
+        scale->rects = (CvRect*)calloc(
+                cascade->nodeCount * HAAR_RECTS, sizeof(CvRect));
+        scale->weights = (float*)calloc(
+                cascade->nodeCount * HAAR_RECTS, sizeof(float));
+        for (int node = 0; node < cascade->nodeCount; node++) {
+            scale_node(cascade, scale, node);
+        }
+    }
+}
+
+/* scale_node()
+ * ------------
+ * Scales the rectangles of a node's feature to scale.window and normalises
+ * their weights by the window area. The first rectangle's weight is then
+ * chosen so that the feature of a flat window sums to zero.
+ *
+ * cascade: The HaarCascade holding the unscaled feature.
+ * scale: The HaarScale to store the scaled feature in.
+ * node: The index of the node.
+ */
+static void scale_node(
+        const HaarCascade* cascade, HaarScale* scale, int node)
+{
+    double area0 = 0, sum0 = 0;
+    double correction = scale->invArea
+            * (cascade->tilted[node] ? TILTED_CORRECTION : 1);
+    for (int r = 0; r < cascade->rectCounts[node]; r++) {
+        CvRect base = cascade->baseRects[node * HAAR_RECTS + r];
+        CvRect scaled = cvRect(cvRound(base.x * scale->factor),
+                cvRound(base.y * scale->factor),
+                cvRound(base.width * scale->factor),
+                cvRound(base.height * scale->factor));
+        float weight = (float)(cascade->baseWeights[node * HAAR_RECTS + r]
+                * correction);
+        scale->rects[node * HAAR_RECTS + r] = scaled;
+        scale->weights[node * HAAR_RECTS + r] = weight;
+        if (!r) {
+            area0 = scaled.width * scaled.height;
+        } else {
+            sum0 += weight * scaled.width * scaled.height;
+        }
+    }
+    scale->weights[node * HAAR_RECTS] = (float)(-sum0 / area0);
+}
+
+/* haar_free()
+ * -----------
+ * Releases a HaarCascade returned by haar_load().
+ *
+ * cascade: The HaarCascade to be released.
+ */
+void haar_free(HaarCascade* cascade)
+{
+    for (int i = 0; i < cascade->scaleCount; i++) {
+        free(cascade->scales[i].rects);
+        free(cascade->scales[i].weights);
+    }
+    free(cascade->scales);
+    free(cascade->stageFirst);
+    free(cascade->stageThresholds);
+    free(cascade->nodeFirst);
+    free(cascade->alphaFirst);
+    free(cascade->nodeThresholds);
+    free(cascade->left);
+    free(cascade->right);
+    free(cascade->tilted);
+    free(cascade->rectCounts);
+    free(cascade->alphas);
+    free(cascade->baseRects);
+    free(cascade->baseWeights);
+    free(cascade);
+}
+
+/// Kernel Functions /////////////////////
+
+/* haar_use_kernels()
+ * ------------------
+ * Chooses the image and detection kernels for the rest of the program: the
+ * widest instruction set both supported by the CPU and no wider than limit.
+ * Must be called before any thread starts detecting.
+ *
+ * limit: The widest instruction set that may be used.
+ *
+ * Returns: The instruction set chosen.
+ */
+HaarKernels haar_use_kernels(HaarKernels limit)
+{
+    HaarKernels kernels = HAAR_SCALAR;
+    grayKernel = gray_row;
+    integralKernel = integral_row;
+    scanKernel = scan_windows;
+#ifdef HAAR_X86
+    __builtin_cpu_init();
+    if (limit >= HAAR_AVX2 && __builtin_cpu_supports("avx2")) {
+        kernels = HAAR_AVX2;
+        grayKernel = gray_row_avx2;
+        integralKernel = integral_row_avx2;
+        scanKernel = scan_windows_avx2;
+    } else if (limit >= HAAR_SSE42 && __builtin_cpu_supports("sse4.2")) {
+        kernels = HAAR_SSE42;
+        grayKernel = gray_row_sse42;
+        integralKernel = integral_row_sse42;
+        // without gathers, batching windows costs more than it saves
+    }
+#else
+    (void)limit;
+#endif
+    return kernels;
+}
+
+/// Image Functions //////////////////////
+
+/* haar_gray()
+ * -----------
+ * Converts an 8 bit BGR image to grayscale, giving the same pixels as
+ * cvCvtColor() with CV_BGR2GRAY.
+ *
+ * bgr: The first pixel of the BGR image.
+ * bgrStep: The number of bytes between successive BGR rows.
+ * width: The image width.
+ * height: The image height.
+ * gray: The first pixel of the grayscale image to be written.
+ * grayStep: The number of bytes between successive grayscale rows.
+ */
+void haar_gray(const uint8_t* bgr, size_t bgrStep, int width, int height,
+        uint8_t* gray, size_t grayStep)
+{
+    for (int y = 0; y < height; y++) {
+        grayKernel(bgr + y * bgrStep, gray + y * grayStep, width);
+    }
+}
+
+/* gray_row()
+ * ----------
+ * Converts one row of BGR pixels to grayscale with fixed point weights.
+ *
+ * bgr: The first BGR pixel.
+ * gray: The first gray pixel to be written.
+ * width: The number of pixels.
+ */
+static void gray_row(const uint8_t* bgr, uint8_t* gray, int width)
+{
+    for (int x = 0; x < width; x++, bgr += 3) {
+        gray[x] = (uint8_t)((bgr[0] * GRAY_B + bgr[1] * GRAY_G
+                                    + bgr[2] * GRAY_R + GRAY_ROUND)
+                >> GRAY_SHIFT);
+    }
+}
+
+/* haar_equalize()
+ * ---------------
+ * Equalises the histogram of an 8 bit grayscale image in place, giving the
+ * same pixels as cvEqualizeHist(). The histogram is counted into several
+ * banks so that runs of equal pixels do not serialise on one counter.
+ *
+ * gray: The first pixel of the image.
+ * step: The number of bytes between successive rows.
+ * width: The image width.
+ * height: The image height.
+ */
+void haar_equalize(uint8_t* gray, size_t step, int width, int height)
+{
+    int banks[HIST_BANKS][LEVELS] = {{0}};
+    int total = width * height;
+    if (!total) {
+        return;
+    }
+    for (int y = 0; y < height; y++) {
+        const uint8_t* row = gray + y * step;
+        int x = 0;
+        for (; x + HIST_BANKS <= width; x += HIST_BANKS) {
+            banks[0][row[x]]++;
+            banks[1][row[x + 1]]++;
+            banks[2][row[x + 2]]++;
+            banks[3][row[x + 3]]++;
+        }
+        for (; x < width; x++) {
+            banks[0][row[x]]++;
+        }
+    }
+    int hist[LEVELS];
+    for (int i = 0; i < LEVELS; i++) {
+        hist[i] = banks[0][i] + banks[1][i] + banks[2][i] + banks[3][i];
+    }
+    int first = 0;
+    while (!hist[first]) {
+        first++;
+    }
+    if (hist[first] == total) {
+        // a flat image maps onto itself
+        return;
+    }
+    uint8_t lut[LEVELS];
+    float scale = (LEVELS - 1.f) / (total - hist[first]);
+    int running = 0;
+    lut[first] = 0;
+    for (int i = first + 1; i < LEVELS; i++) {
+        running += hist[i];
+        int level = cvRound(running * scale);
+        lut[i] = (uint8_t)(level < LEVELS ? level : LEVELS - 1);
+    }
+    for (int y = 0; y < height; y++) {
+        uint8_t* row = gray + y * step;
+        for (int x = 0; x < width; x++) {
+            row[x] = lut[row[x]];
+        }
+    }
+}
+
+#ifdef HAAR_X86
+/* split_bgr_sse42()
+ * -----------------
+ * Deinterleaves 16 BGR pixels into one vector per channel.
+ *
+ * bgr: The first of the 16 pixels.
+ * blue: Set to the blue channel.
+ * green: Set to the green channel.
+ * red: Set to the red channel.
+ */
+__attribute__((target("sse4.2"))) static inline void split_bgr_sse42(
+        const uint8_t* bgr, __m128i* blue, __m128i* green, __m128i* red)
+{
+    __m128i p0 = _mm_loadu_si128((const __m128i*)bgr);
+    __m128i p1 = _mm_loadu_si128((const __m128i*)(bgr + 16));
+    __m128i p2 = _mm_loadu_si128((const __m128i*)(bgr + 32));
+    *blue = _mm_or_si128(
+            _mm_or_si128(_mm_shuffle_epi8(p0,
+                                 _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1,
+                                         -1, -1, -1, -1, -1, -1, -1)),
+                    _mm_shuffle_epi8(p1,
+                            _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11,
+                                    14, -1, -1, -1, -1, -1))),
+            _mm_shuffle_epi8(p2,
+                    _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                            1, 4, 7, 10, 13)));
+    *green = _mm_or_si128(
+            _mm_or_si128(_mm_shuffle_epi8(p0,
+                                 _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1,
+                                         -1, -1, -1, -1, -1, -1, -1)),
+                    _mm_shuffle_epi8(p1,
+                            _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12,
+                                    15, -1, -1, -1, -1, -1))),
+            _mm_shuffle_epi8(p2,
+                    _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                            2, 5, 8, 11, 14)));
+    *red = _mm_or_si128(
+            _mm_or_si128(_mm_shuffle_epi8(p0,
+                                 _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1,
+                                         -1, -1, -1, -1, -1, -1, -1)),
+                    _mm_shuffle_epi8(p1,
+                            _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13,
+                                    -1, -1, -1, -1, -1, -1))),
+            _mm_shuffle_epi8(p2,
+                    _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0,
+                            3, 6, 9, 12, 15)));
+}
+
+/* gray8_sse42()
+ * -------------
+ * Weighs 8 pixels of 16 bit blue, green and red channels into gray levels.
+ * Pairs of channels are multiplied and added in one step by pmaddwd, the
+ * rounding constant riding along with the red channel.
+ *
+ * Returns: The 8 gray levels as 16 bit integers.
+ */
+__attribute__((target("sse4.2"))) static inline __m128i gray8_sse42(
+        __m128i blue, __m128i green, __m128i red)
+{
+    const __m128i blueGreen = _mm_set1_epi32(GRAY_G << 16 | GRAY_B);
+    const __m128i redRound = _mm_set1_epi32(GRAY_ROUND << 16 | GRAY_R);
+    const __m128i one = _mm_set1_epi16(1);
+    __m128i low = _mm_add_epi32(
+            _mm_madd_epi16(_mm_unpacklo_epi16(blue, green), blueGreen),
+            _mm_madd_epi16(_mm_unpacklo_epi16(red, one), redRound));
+    __m128i high = _mm_add_epi32(
+            _mm_madd_epi16(_mm_unpackhi_epi16(blue, green), blueGreen),
+            _mm_madd_epi16(_mm_unpackhi_epi16(red, one), redRound));
+    return _mm_packs_epi32(_mm_srli_epi32(low, GRAY_SHIFT),
+            _mm_srli_epi32(high, GRAY_SHIFT));
+}
+
+/* gray_row_sse42()
+ * ----------------
+ * gray_row() 16 pixels at a time with SSE4.2.
+ */
+__attribute__((target("sse4.2"))) static void gray_row_sse42(
+        const uint8_t* bgr, uint8_t* gray, int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i blue, green, red;
+        split_bgr_sse42(bgr + 3 * x, &blue, &green, &red);
+        __m128i low = gray8_sse42(_mm_cvtepu8_epi16(blue),
+                _mm_cvtepu8_epi16(green), _mm_cvtepu8_epi16(red));
+        __m128i high = gray8_sse42(_mm_cvtepu8_epi16(_mm_srli_si128(blue, 8)),
+                _mm_cvtepu8_epi16(_mm_srli_si128(green, 8)),
+                _mm_cvtepu8_epi16(_mm_srli_si128(red, 8)));
+        _mm_storeu_si128((__m128i*)(gray + x), _mm_packus_epi16(low, high));
+    }
+    gray_row(bgr + 3 * x, gray + x, width - x);
+}
+
+/* gray16_avx2()
+ * -------------
+ * gray8_sse42() for 16 pixels, the pixels of each 128 bit lane staying in
+ * that lane.
+ */
+__attribute__((target("avx2"))) static inline __m256i gray16_avx2(
+        __m128i blue, __m128i green, __m128i red)
+{
+    const __m256i blueGreen = _mm256_set1_epi32(GRAY_G << 16 | GRAY_B);
+    const __m256i redRound = _mm256_set1_epi32(GRAY_ROUND << 16 | GRAY_R);
+    const __m256i one = _mm256_set1_epi16(1);
+    __m256i b = _mm256_cvtepu8_epi16(blue);
+    __m256i g = _mm256_cvtepu8_epi16(green);
+    __m256i r = _mm256_cvtepu8_epi16(red);
+    __m256i low = _mm256_add_epi32(
+            _mm256_madd_epi16(_mm256_unpacklo_epi16(b, g), blueGreen),
+            _mm256_madd_epi16(_mm256_unpacklo_epi16(r, one), redRound));
+    __m256i high = _mm256_add_epi32(
+            _mm256_madd_epi16(_mm256_unpackhi_epi16(b, g), blueGreen),
+            _mm256_madd_epi16(_mm256_unpackhi_epi16(r, one), redRound));
+    return _mm256_packs_epi32(_mm256_srli_epi32(low, GRAY_SHIFT),
+            _mm256_srli_epi32(high, GRAY_SHIFT));
+}
+
+/* gray_row_avx2()
+ * ---------------
+ * gray_row() 32 pixels at a time with AVX2.
+ */
+__attribute__((target("avx2"))) static void gray_row_avx2(
+        const uint8_t* bgr, uint8_t* gray, int width)
+{
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m128i blue0, green0, red0, blue1, green1, red1;
+        split_bgr_sse42(bgr + 3 * x, &blue0, &green0, &red0);
+        split_bgr_sse42(bgr + 3 * x + 48, &blue1, &green1, &red1);
+        __m256i packed = _mm256_packus_epi16(gray16_avx2(blue0, green0, red0),
+                gray16_avx2(blue1, green1, red1));
+        // packing interleaves the 64 bit quarters of both halves
+        _mm256_storeu_si256((__m256i*)(gray + x),
+                _mm256_permute4x64_epi64(packed, 0xD8));
+    }
+    gray_row_sse42(bgr + 3 * x, gray + x, width - x);
+}
+#endif
+
+/// Evaluator Functions //////////////////
+
+/* haar_evaluator()
+ * ----------------
+ * Creates an empty HaarEvaluator. Its buffers grow on first use and are
+ * reused by every later detection.
+ *
+ * Returns: The new HaarEvaluator.
+ */
+HaarEvaluator* haar_evaluator(void)
+{
+    return (HaarEvaluator*)calloc(1, sizeof(HaarEvaluator));
+}
+
+/* haar_free_evaluator()
+ * ---------------------
+ * Releases a HaarEvaluator and all of its buffers.
+ *
+ * evaluator: The HaarEvaluator to be released.
+ */
+void haar_free_evaluator(HaarEvaluator* evaluator)
+{
+    if (!evaluator->borrowed) {
+        free(evaluator->sum);
+        free(evaluator->sqsum);
+        free(evaluator->tiltedSum);
+    }
+    free(evaluator->diagonals);
+    free(evaluator->offsets);
+    free(evaluator->candidates.rects);
+    for (int i = 0; i < HAAR_LANES; i++) {
+        free(evaluator->rowCandidates[i].rects);
+    }
+    free(evaluator->batches);
+    free(evaluator->parents);
+    free(evaluator->labels);
+    free(evaluator->weights);
+    free(evaluator->groups);
+    free(evaluator->job.ranges);
+    free(evaluator->tasks);
+    for (int i = 0; i < evaluator->taskCandidateCapacity; i++) {
+        free(evaluator->taskCandidates[i].rects);
+    }
+    free(evaluator->taskCandidates);
+    if (evaluator->view) {
+        haar_free_evaluator(evaluator->view);
+    }
+    free(evaluator);
+}
+
+/* grow()
+ * ------
+ * Ensures array holds at least needed elements, doubling its capacity when
+ * it does not.
+ *
+ * array: The array to be grown, may be NULL.
+ * capacity: The number of elements array holds, updated when grown.
+ * needed: The number of elements required.
+ * size: The size of one element.
+ *
+ * Returns: The (possibly moved) array.
+ */
+static void* grow(void* array, int* capacity, int needed, size_t size)
+{
+    if (needed <= *capacity) {
+        return array;
+    }
+    while (*capacity < needed) {
+        *capacity = *capacity ? *capacity * 2 : needed;
+    }
+    return realloc(array, (size_t)*capacity * size);
+}
+
+/* push_rect()
+ * -----------
+ * Appends a rectangle to the back of list.
+ *
+ * list: The HaarRects to be appended to.
+ * rect: The rectangle to be appended.
+ */
+static void push_rect(HaarRects* list, CvRect rect)
+{
+    list->rects = (CvRect*)grow(
+            list->rects, &list->capacity, list->count + 1, sizeof(CvRect));
+    list->rects[list->count++] = rect;
+}
+
+/* haar_set_image()
+ * ----------------
+ * Builds the integral and squared integral images of an 8 bit grayscale
+ * image for the following detections. The 45 degree integral image is only
+ * built once a cascade with tilted features needs it, so image must remain
+ * valid until the last detection on it.
+ *
+ * evaluator: The HaarEvaluator to hold the integral images.
+ * image: The first pixel of the image.
+ * width: The image width.
+ * height: The image height.
+ * step: The number of bytes between successive image rows.
+ */
+void haar_set_image(HaarEvaluator* evaluator, const uint8_t* image, int width,
+        int height, size_t step)
+{
+    size_t stride = (size_t)width + 1;
+    size_t entries = stride * (height + 1);
+    if (evaluator->borrowed) {
+        // stop sharing another evaluator's integral images
+        evaluator->sum = NULL;
+        evaluator->sqsum = NULL;
+        evaluator->tiltedSum = NULL;
+        evaluator->capacity = 0;
+        evaluator->borrowed = 0;
+    }
+    if (entries > evaluator->capacity) {
+        free(evaluator->sum);
+        free(evaluator->sqsum);
+        free(evaluator->tiltedSum);
+        evaluator->sum = (uint32_t*)malloc(entries * sizeof(uint32_t));
+        evaluator->sqsum = (double*)malloc(entries * sizeof(double));
+        evaluator->tiltedSum = NULL; // allocated by build_tilted()
+        evaluator->capacity = entries;
+    }
+    evaluator->width = width;
+    evaluator->height = height;
+    evaluator->stride = stride;
+    evaluator->image = image;
+    evaluator->imageStep = step;
+    evaluator->tiltedReady = 0;
+    uint32_t* sum = evaluator->sum;
+    double* sqsum = evaluator->sqsum;
+    memset(sum, 0, stride * sizeof(uint32_t));
+    memset(sqsum, 0, stride * sizeof(double));
+    for (int y = 0; y < height; y++) {
+        uint32_t* sumRow = sum + (y + 1) * stride;
+        double* sqsumRow = sqsum + (y + 1) * stride;
+        sumRow[0] = 0;
+        sqsumRow[0] = 0;
+        integralKernel(image + y * step, sumRow - stride, sumRow,
+                sqsumRow - stride, sqsumRow, width);
+    }
+}
+
+/* integral_row()
+ * --------------
+ * Adds the running sums of one image row to the integral image rows above
+ * it. Entry 0 of each integral row is left alone.
+ *
+ * row: The image row.
+ * sumAbove: The previous integral image row.
+ * sumRow: The integral image row to be written.
+ * sqsumAbove: The previous squared integral image row.
+ * sqsumRow: The squared integral image row to be written.
+ * width: The number of pixels in row.
+ */
+static void integral_row(const uint8_t* row, const uint32_t* sumAbove,
+        uint32_t* sumRow, const double* sqsumAbove, double* sqsumRow,
+        int width)
+{
+    uint32_t rowSum = 0;
+    double rowSqsum = 0;
+    for (int x = 0; x < width; x++) {
+        rowSum += row[x];
+        rowSqsum += (double)row[x] * row[x];
+        sumRow[x + 1] = sumAbove[x + 1] + rowSum;
+        sqsumRow[x + 1] = sqsumAbove[x + 1] + rowSqsum;
+    }
+}
+
+#ifdef HAAR_X86
+/* integral_tail()
+ * ---------------
+ * Finishes a row started by a vector kernel, continuing its running sums
+ * from pixel x. Squared sums are whole numbers well below 2^53, so they are
+ * exact in any order of addition and match integral_row() bit for bit.
+ */
+static void integral_tail(const uint8_t* row, const uint32_t* sumAbove,
+        uint32_t* sumRow, const double* sqsumAbove, double* sqsumRow,
+        int width, int x, uint32_t rowSum, double rowSqsum)
+{
+    for (; x < width; x++) {
+        rowSum += row[x];
+        rowSqsum += (double)row[x] * row[x];
+        sumRow[x + 1] = sumAbove[x + 1] + rowSum;
+        sqsumRow[x + 1] = sqsumAbove[x + 1] + rowSqsum;
+    }
+}
+
+/* prefix_sse42()
+ * --------------
+ * Returns the inclusive prefix sums of 4 32 bit integers.
+ */
+__attribute__((target("sse4.2"))) static inline __m128i prefix_sse42(
+        __m128i values)
+{
+    values = _mm_add_epi32(values, _mm_slli_si128(values, 4));
+    return _mm_add_epi32(values, _mm_slli_si128(values, 8));
+}
+
+/* integral_row_sse42()
+ * --------------------
+ * integral_row() 4 pixels at a time with SSE4.2.
+ */
+__attribute__((target("sse4.2"))) static void integral_row_sse42(
+        const uint8_t* row, const uint32_t* sumAbove, uint32_t* sumRow,
+        const double* sqsumAbove, double* sqsumRow, int width)
+{
+    __m128i carry = _mm_setzero_si128(); // row sum so far in every element
+    double rowSqsum = 0;
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+        int32_t packed;
+        memcpy(&packed, row + x, sizeof(packed));
+        __m128i pixels = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed));
+        __m128i sums = _mm_add_epi32(prefix_sse42(pixels), carry);
+        __m128i squares = prefix_sse42(_mm_mullo_epi32(pixels, pixels));
+        carry = _mm_shuffle_epi32(sums, 0xFF);
+        _mm_storeu_si128((__m128i*)(sumRow + x + 1),
+                _mm_add_epi32(sums,
+                        _mm_loadu_si128((const __m128i*)(sumAbove + x + 1))));
+        __m128d base = _mm_set1_pd(rowSqsum);
+        __m128d low = _mm_add_pd(base, _mm_cvtepi32_pd(squares));
+        __m128d high = _mm_add_pd(
+                base, _mm_cvtepi32_pd(_mm_unpackhi_epi64(squares, squares)));
+        _mm_storeu_pd(sqsumRow + x + 1,
+                _mm_add_pd(low, _mm_loadu_pd(sqsumAbove + x + 1)));
+        _mm_storeu_pd(sqsumRow + x + 3,
+                _mm_add_pd(high, _mm_loadu_pd(sqsumAbove + x + 3)));
+        rowSqsum = _mm_cvtsd_f64(_mm_unpackhi_pd(high, high));
+    }
+    integral_tail(row, sumAbove, sumRow, sqsumAbove, sqsumRow, width, x,
+            (uint32_t)_mm_cvtsi128_si32(carry), rowSqsum);
+}
+
+/* prefix_avx2()
+ * -------------
+ * Returns the inclusive prefix sums of 8 32 bit integers.
+ */
+__attribute__((target("avx2"))) static inline __m256i prefix_avx2(
+        __m256i values)
+{
+    values = _mm256_add_epi32(values, _mm256_slli_si256(values, 4));
+    values = _mm256_add_epi32(values, _mm256_slli_si256(values, 8));
+    // carrying the low lane's total into the high lane
+    __m256i low = _mm256_permutevar8x32_epi32(values, _mm256_set1_epi32(3));
+    return _mm256_add_epi32(
+            values, _mm256_blend_epi32(_mm256_setzero_si256(), low, 0xF0));
+}
+
+/* integral_row_avx2()
+ * -------------------
+ * integral_row() 8 pixels at a time with AVX2.
+ */
+__attribute__((target("avx2"))) static void integral_row_avx2(
+        const uint8_t* row, const uint32_t* sumAbove, uint32_t* sumRow,
+        const double* sqsumAbove, double* sqsumRow, int width)
+{
+    const __m256i last = _mm256_set1_epi32(HAAR_LANES - 1);
+    __m256i carry = _mm256_setzero_si256(); // row sum so far in every element
+    double rowSqsum = 0;
+    int x = 0;
+    for (; x + HAAR_LANES <= width; x += HAAR_LANES) {
+        __m256i pixels = _mm256_cvtepu8_epi32(
+                _mm_loadl_epi64((const __m128i*)(row + x)));
+        __m256i sums = _mm256_add_epi32(prefix_avx2(pixels), carry);
+        __m256i squares = prefix_avx2(_mm256_mullo_epi32(pixels, pixels));
+        carry = _mm256_permutevar8x32_epi32(sums, last);
+        _mm256_storeu_si256((__m256i*)(sumRow + x + 1),
+                _mm256_add_epi32(sums,
+                        _mm256_loadu_si256(
+                                (const __m256i*)(sumAbove + x + 1))));
+        __m256d base = _mm256_set1_pd(rowSqsum);
+        __m256d low = _mm256_add_pd(
+                base, _mm256_cvtepi32_pd(_mm256_castsi256_si128(squares)));
+        __m256d high = _mm256_add_pd(base,
+                _mm256_cvtepi32_pd(_mm256_extracti128_si256(squares, 1)));
+        _mm256_storeu_pd(sqsumRow + x + 1,
+                _mm256_add_pd(low, _mm256_loadu_pd(sqsumAbove + x + 1)));
+        _mm256_storeu_pd(sqsumRow + x + 5,
+                _mm256_add_pd(high, _mm256_loadu_pd(sqsumAbove + x + 5)));
+        rowSqsum = _mm256_cvtsd_f64(_mm256_permute4x64_pd(high, 0xFF));
+    }
+    integral_tail(row, sumAbove, sumRow, sqsumAbove, sqsumRow, width, x,
+            (uint32_t)_mm256_cvtsi256_si32(carry), rowSqsum);
+}
+#endif
+
+/* build_tilted()
+ * --------------
+ * Builds the 45 degree integral image of the current image. Entry (Y, X)
+ * holds the sum of the triangle of pixels above it, which is accumulated row
+ * by row from running sums along both diagonals:
+ *      T(Y, X) = T(Y - 1, X) + L(Y - 1, X - 1) + R(Y - 2, X)
+ * where L and R sum pixels down-right and down-left diagonals respectively
+ * and pixels outside the image count as 0.
+ *
+ * evaluator: The HaarEvaluator holding the current image.
+ */
+static void build_tilted(HaarEvaluator* evaluator)
+{
+    int width = evaluator->width;
+    size_t stride = evaluator->stride;
+    if (!evaluator->tiltedSum) {
+        evaluator->tiltedSum = (uint32_t*)malloc(
+                evaluator->capacity * sizeof(uint32_t));
+    }
+    evaluator->diagonals = (uint32_t*)grow(evaluator->diagonals,
+            &evaluator->diagonalCapacity, 4 * stride, sizeof(uint32_t));
+    uint32_t* tilted = evaluator->tiltedSum;
+    uint32_t* leftPrev = evaluator->diagonals;
+    uint32_t* leftRow = leftPrev + stride;
+    uint32_t* rightPrev = leftRow + stride;
+    uint32_t* rightRow = rightPrev + stride;
+    memset(leftPrev, 0, stride * sizeof(uint32_t));
+    memset(rightPrev, 0, stride * sizeof(uint32_t));
+    memset(tilted, 0, stride * sizeof(uint32_t));
+    for (int y = 0; y < evaluator->height; y++) {
+        const uint8_t* row = evaluator->image + y * evaluator->imageStep;
+        uint32_t* above = tilted + y * stride;
+        uint32_t* current = above + stride;
+        for (int x = 0; x < width; x++) {
+            leftRow[x] = row[x] + (x > 0 ? leftPrev[x - 1] : 0);
+            rightRow[x] = row[x] + (x + 1 < width ? rightPrev[x + 1] : 0);
+        }
+        for (int x = 0; x <= width; x++) {
+            current[x] = above[x] + (x > 0 ? leftRow[x - 1] : 0)
+                    + (x < width ? rightPrev[x] : 0);
+        }
+        uint32_t* swap = leftPrev;
+        leftPrev = leftRow;
+        leftRow = swap;
+        swap = rightPrev;
+        rightPrev = rightRow;
+        rightRow = swap;
+    }
+    evaluator->tiltedReady = 1;
+}
+
+/// Scheduler Functions //////////////////
+
+/* haar_scheduler()
+ * ----------------
+ * Creates a HaarScheduler and starts its helper threads, each with an
+ * evaluator of its own. Helper threads run for the lifetime of the program.
+ *
+ * threads: The number of helper threads, 0 runs every job on the thread
+ *          submitting it.
+ *
+ * Returns: The new HaarScheduler.
+ */
+HaarScheduler* haar_scheduler(int threads)
+{
+    pthread_t thread;
+    HaarScheduler* scheduler
+            = (HaarScheduler*)calloc(1, sizeof(HaarScheduler));
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->work, NULL);
+    pthread_cond_init(&scheduler->left, NULL);
+    scheduler->threads = threads;
+    for (int i = 0; i < threads; i++) {
+        Helper* helper = (Helper*)malloc(sizeof(Helper));
+        helper->scheduler = scheduler;
+        helper->slot = i + 1;
+        helper->evaluator = haar_evaluator();
+        pthread_create(&thread, NULL, helper_thread, helper);
+        pthread_detach(thread);
+    }
+    return scheduler;
+}
+
+/* haar_use_scheduler()
+ * --------------------
+ * Lets haar_detect() split detections on large images between the calling
+ * thread and the helper threads of scheduler. Results are unchanged.
+ *
+ * evaluator: The HaarEvaluator detections are made with.
+ * scheduler: The HaarScheduler to share, or NULL to detect on the calling
+ *            thread only.
+ */
+void haar_use_scheduler(HaarEvaluator* evaluator, HaarScheduler* scheduler)
+{
+    evaluator->scheduler = scheduler;
+}
+
+/* helper_thread()
+ * ---------------
+ * Works on submitted jobs for the lifetime of the program, sleeping while
+ * every job's tasks have been claimed.
+ *
+ * data: A pointer to the Helper struct owned by this thread.
+ */
+static void* helper_thread(void* data)
+{
+    Helper* helper = (Helper*)data;
+    HaarScheduler* scheduler = helper->scheduler;
+    pthread_mutex_lock(&scheduler->lock);
+    while (1) {
+        HaarJob* job = scheduler->jobs;
+        while (job && __atomic_load_n(&job->exhausted, __ATOMIC_RELAXED)) {
+            job = job->next;
+        }
+        if (!job) {
+            pthread_cond_wait(&scheduler->work, &scheduler->lock);
+            continue;
+        }
+        job->users++;
+        pthread_mutex_unlock(&scheduler->lock);
+        // bound offsets may belong to a cascade that has since been freed
+        helper->evaluator->boundScale = NULL;
+        work_on(job, helper->slot, helper->evaluator);
+        pthread_mutex_lock(&scheduler->lock);
+        if (!--job->users) {
+            pthread_cond_broadcast(&scheduler->left);
+        }
+    }
+    return NULL;
+}
+
+/* haar_run()
+ * ----------
+ * Runs every task of job, splitting them evenly between the calling thread
+ * and the helper threads of scheduler. Idle threads steal tasks from the back
+ * of busy threads' ranges, so the job finishes even when every helper is
+ * busy with other jobs. Returns once every task has completed.
+ *
+ * scheduler: The HaarScheduler whose helpers may work on job, or NULL.
+ * job: The job with its run, data and taskCount set.
+ * evaluator: The HaarEvaluator of the calling thread, passed to the tasks it
+ *            runs.
+ */
+void haar_run(
+        HaarScheduler* scheduler, HaarJob* job, HaarEvaluator* evaluator)
+{
+    int slots = scheduler ? scheduler->threads + 1 : 1;
+    job->ranges = (HaarRange*)grow(
+            job->ranges, &job->rangeCapacity, slots, sizeof(HaarRange));
+    job->slots = slots;
+    job->users = 0;
+    job->exhausted = 0;
+    job->next = NULL;
+    for (int i = 0; i < slots; i++) {
+        uint64_t begin = (uint64_t)job->taskCount * i / slots;
+        uint64_t end = (uint64_t)job->taskCount * (i + 1) / slots;
+        job->ranges[i].span = begin << 32 | end;
+    }
+    if (slots > 1) {
+        pthread_mutex_lock(&scheduler->lock);
+        HaarJob** tail = &scheduler->jobs;
+        while (*tail) {
+            tail = &(*tail)->next;
+        }
+        *tail = job;
+        pthread_cond_broadcast(&scheduler->work);
+        pthread_mutex_unlock(&scheduler->lock);
+    }
+    work_on(job, 0, evaluator);
+    if (slots > 1) {
+        // every task is claimed, wait for helpers to finish theirs
+        pthread_mutex_lock(&scheduler->lock);
+        HaarJob** link = &scheduler->jobs;
+        while (*link != job) {
+            link = &(*link)->next;
+        }
+        *link = job->next;
+        while (job->users) {
+            pthread_cond_wait(&scheduler->left, &scheduler->lock);
+        }
+        pthread_mutex_unlock(&scheduler->lock);
+    }
+}
+
+/* work_on()
+ * ---------
+ * Runs tasks from the front of the thread's own range, then steals tasks
+ * from the back of the other ranges until none are left.
+ *
+ * job: The job being worked on.
+ * slot: The range handed to the calling thread.
+ * evaluator: The HaarEvaluator of the calling thread.
+ */
+static void work_on(HaarJob* job, int slot, HaarEvaluator* evaluator)
+{
+    int task;
+    while (1) {
+        task = claim_task(&job->ranges[slot], 1);
+        for (int i = 1; task < 0 && i < job->slots; i++) {
+            // steal from the next thread along
+            task = claim_task(&job->ranges[(slot + i) % job->slots], 0);
+        }
+        if (task < 0) {
+            break;
+        }
+        job->run(job->data, task, evaluator);
+    }
+    __atomic_store_n(&job->exhausted, 1, __ATOMIC_RELAXED);
+}
+
+/* claim_task()
+ * ------------
+ * Takes one task off either end of a range.
+ *
+ * range: The range to take from.
+ * front: 1 to take the first task (owner), 0 to take the last (thief).
+ *
+ * Returns: The task taken, or -1 if the range is empty.
+ */
+static int claim_task(HaarRange* range, int front)
+{
+    uint64_t span = __atomic_load_n(&range->span, __ATOMIC_RELAXED);
+    uint64_t next;
+    uint32_t begin, end;
+    do {
+        begin = (uint32_t)(span >> 32);
+        end = (uint32_t)span;
+        if (begin >= end) {
+            return -1;
+        }
+        next = front ? (uint64_t)(begin + 1) << 32 | end
+                     : (uint64_t)begin << 32 | (end - 1);
+    } while (!__atomic_compare_exchange_n(&range->span, &span, next, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return front ? (int)begin : (int)(end - 1);
+}
+
+/* lend_image()
+ * ------------
+ * Shares a region of the integral images of owner with evaluator, which
+ * only reads them. The region's integral images are never built: the
+ * evaluator reads owner's integral images from the region's top left corner
+ * on. Every rectangle sum is a difference of integral image entries, so sums
+ * within the region are unchanged by what lies outside it (squared sums are
+ * whole numbers well below 2^53 and sums wrap modulo 2^32 on both sides).
+ *
+ * evaluator: The HaarEvaluator of a thread helping with owner's detection.
+ * owner: The HaarEvaluator holding the current image.
+ * region: The part of owner's image to be shared.
+ */
+static void lend_image(HaarEvaluator* evaluator, const HaarEvaluator* owner,
+        CvRect region)
+{
+    size_t origin = (size_t)region.y * owner->stride + region.x;
+    if (!evaluator->borrowed) {
+        free(evaluator->sum);
+        free(evaluator->sqsum);
+        free(evaluator->tiltedSum);
+        evaluator->borrowed = 1;
+    }
+    evaluator->width = region.width;
+    evaluator->height = region.height;
+    evaluator->stride = owner->stride;
+    evaluator->capacity = owner->capacity;
+    evaluator->sum = owner->sum + origin;
+    evaluator->sqsum = owner->sqsum + origin;
+    evaluator->tiltedSum
+            = owner->tiltedReady ? owner->tiltedSum + origin : NULL;
+    evaluator->tiltedReady = owner->tiltedReady;
+    evaluator->image = owner->image + (size_t)region.y * owner->imageStep
+            + region.x;
+    evaluator->imageStep = owner->imageStep;
+}
+
+/// Detection Functions //////////////////
+
+/* haar_detect()
+ * -------------
+ * Searches the current image (see haar_set_image()) for objects with the
+ * detection pyramid of cascade, giving the same rectangles as
+ * cvHaarDetectObjects() does with the cascade's scale factor and no flags.
+ *
+ * Large images are split between threads when the evaluator has a scheduler
+ * (see split_pyramid()), with the same result.
+ *
+ * evaluator: The HaarEvaluator holding the current image.
+ * cascade: The HaarCascade to search with.
+ * minNeighbours: The number of overlapping windows an object needs, 0 returns
+ *                every window without grouping.
+ * minSize: The smallest window searched.
+ * maxSize: The largest window searched, (0, 0) for the image size. Windows
+ *          beyond the maxWindow given to haar_load() are never searched.
+ * objects: Replaced with the detected objects.
+ *
+ * Returns: The number of detected objects.
+ */
+int haar_detect(HaarEvaluator* evaluator, const HaarCascade* cascade,
+        int minNeighbours, CvSize minSize, CvSize maxSize, HaarRects* objects)
+{
+    int firstScale = 0, endScale = 0;
+    evaluator->candidates.count = 0;
+    evaluator->boundScale = NULL;
+    objects->count = 0;
+    if (cascade->hasTilted && !evaluator->tiltedReady) {
+        build_tilted(evaluator);
+    }
+    if (!maxSize.width || !maxSize.height) {
+        maxSize = cvSize(evaluator->width, evaluator->height);
+    }
+    for (; endScale < cascade->scaleCount; endScale++) {
+        const HaarScale* scale = &cascade->scales[endScale];
+        if (!(scale->factor * cascade->window.width
+                            < evaluator->width - PYRAMID_MARGIN
+                    && scale->factor * cascade->window.height
+                            < evaluator->height - PYRAMID_MARGIN)) {
+            // window no longer fits the image
+            break;
+        }
+        if (scale->window.width < minSize.width
+                || scale->window.height < minSize.height) {
+            firstScale = endScale + 1;
+            continue;
+        }
+        if (scale->window.width > maxSize.width
+                || scale->window.height > maxSize.height) {
+            break;
+        }
+    }
+    if (!split_pyramid(evaluator, cascade, firstScale, endScale)) {
+        for (int i = firstScale; i < endScale; i++) {
+            scan_scale(evaluator, cascade, &cascade->scales[i], 0, INT_MAX);
+        }
+    }
+    if (minNeighbours) {
+        group_rects(evaluator, minNeighbours, objects);
+    } else {
+        for (int i = 0; i < evaluator->candidates.count; i++) {
+            push_rect(objects, evaluator->candidates.rects[i]);
+        }
+    }
+    return objects->count;
+}
+
+/* haar_detect_regions()
+ * ---------------------
+ * Searches several regions of the current image (see haar_set_image()) for
+ * objects, as haar_detect() would search each region set as an image of its
+ * own. No region is copied and no integral image is rebuilt: every search
+ * reads the integral images of the whole image (see lend_image()). When the
+ * evaluator has a scheduler, the regions are searched as one job spread over
+ * its helper threads.
+ *
+ * evaluator: The HaarEvaluator holding the current image.
+ * cascade: The HaarCascade to search with.
+ * minNeighbours: As for haar_detect().
+ * minSize: As for haar_detect().
+ * maxSize: As for haar_detect().
+ * regions: The regions to be searched, each within the image.
+ * count: The number of regions.
+ * objects: Replaced with count lists, list i holding the objects found in
+ *          region i relative to its top left corner.
+ *
+ * Returns: The number of objects found over every region.
+ */
+int haar_detect_regions(HaarEvaluator* evaluator, const HaarCascade* cascade,
+        int minNeighbours, CvSize minSize, CvSize maxSize,
+        const CvRect* regions, int count, HaarRectLists* objects)
+{
+    RegionSearch search = {evaluator, cascade, minNeighbours, minSize,
+            maxSize, regions, objects};
+    int capacity = objects->capacity, found = 0;
+    objects->lists = (HaarRects*)grow(
+            objects->lists, &objects->capacity, count, sizeof(HaarRects));
+    memset(objects->lists + capacity, 0,
+            (objects->capacity - capacity) * sizeof(HaarRects));
+    objects->count = count;
+    if (!evaluator->view) {
+        evaluator->view = haar_evaluator();
+    }
+    if (cascade->hasTilted && !evaluator->tiltedReady) {
+        // built once here rather than by every region's search
+        build_tilted(evaluator);
+    }
+    evaluator->job.run = region_task;
+    evaluator->job.data = &search;
+    evaluator->job.taskCount = count;
+    haar_run(count > 1 ? evaluator->scheduler : NULL, &evaluator->job,
+            evaluator);
+    for (int i = 0; i < count; i++) {
+        found += objects->lists[i].count;
+    }
+    return found;
+}
+
+/* haar_reduction()
+ * ----------------
+ * Chooses how far an image is reduced before a fast detection: the smallest
+ * power of two (up to HAAR_MAX_REDUCTION) that brings it down to at most
+ * maxPixels pixels. Powers of two match the scaled decoding offered by JPEG.
+ *
+ * width: The full image width.
+ * height: The full image height.
+ * maxPixels: The most pixels the reduced image should have.
+ *
+ * Returns: The factor each side is to be divided by, 1 for no reduction.
+ */
+int haar_reduction(int width, int height, long maxPixels)
+{
+    int reduction = 1;
+    while (reduction < HAAR_MAX_REDUCTION
+            && (long)(width / reduction) * (height / reduction) > maxPixels) {
+        reduction *= 2;
+    }
+    return reduction;
+}
+
+/* haar_scale_rects()
+ * ------------------
+ * Maps rectangles found in a reduced image back to the full image, clipping
+ * them to its bounds (reduced sizes are rounded, so a scaled rectangle may
+ * reach a few pixels past the edge).
+ *
+ * rects: The rectangles, scaled in place.
+ * count: The number of rectangles.
+ * factor: The factor the image was reduced by.
+ * bounds: The size of the full image (or region) the rectangles lie in.
+ */
+void haar_scale_rects(CvRect* rects, int count, int factor, CvSize bounds)
+{
+    for (int i = 0; i < count; i++) {
+        CvRect* rect = &rects[i];
+        int x = rect->x * factor, y = rect->y * factor;
+        rect->x = x < bounds.width ? x : bounds.width;
+        rect->y = y < bounds.height ? y : bounds.height;
+        rect->width = x + rect->width * factor < bounds.width
+                ? rect->width * factor
+                : bounds.width - rect->x;
+        rect->height = y + rect->height * factor < bounds.height
+                ? rect->height * factor
+                : bounds.height - rect->y;
+    }
+}
+
+/* region_task()
+ * -------------
+ * Searches one region of a haar_detect_regions() call.
+ *
+ * data: The RegionSearch being run.
+ * task: The index of the region to be searched.
+ * evaluator: The HaarEvaluator of the thread running the task.
+ */
+static void region_task(void* data, int task, HaarEvaluator* evaluator)
+{
+    RegionSearch* search = (RegionSearch*)data;
+    if (evaluator == search->owner) {
+        // the owner's integral images must stay intact for the other tasks
+        evaluator = evaluator->view;
+    }
+    lend_image(evaluator, search->owner, search->regions[task]);
+    haar_detect(evaluator, search->cascade, search->minNeighbours,
+            search->minSize, search->maxSize, &search->objects->lists[task]);
+}
+
+/* split_pyramid()
+ * ---------------
+ * Splits the scan of every scale into strips of STRIP_ROWS rows of windows
+ * and runs them as one job on the evaluator's scheduler. Each task keeps the
+ * windows it accepts apart, and they are appended to evaluator.candidates in
+ * task order once the job completes, which is the order scan_scale() visits
+ * them in, so grouping sees exactly the same candidates.
+ *
+ * evaluator: The HaarEvaluator holding the current image.
+ * cascade: The HaarCascade being searched with.
+ * firstScale: The first scale to be scanned.
+ * endScale: One past the last scale to be scanned.
+ *
+ * Returns: 1 if the scales were scanned, 0 if the image is too small to be
+ *          worth splitting or there are no helper threads.
+ */
+static int split_pyramid(HaarEvaluator* evaluator, const HaarCascade* cascade,
+        int firstScale, int endScale)
+{
+    int count = 0;
+    if (!evaluator->scheduler || !evaluator->scheduler->threads
+            || (size_t)evaluator->width * evaluator->height < SPLIT_PIXELS) {
+        return 0;
+    }
+    for (int i = firstScale; i < endScale; i++) {
+        double step;
+        int endX, endY;
+        scale_grid(evaluator, &cascade->scales[i], &step, &endX, &endY);
+        for (int row = 0; row < endY; row += STRIP_ROWS) {
+            evaluator->tasks = (HaarTask*)grow(evaluator->tasks,
+                    &evaluator->taskCapacity, count + 1, sizeof(HaarTask));
+            HaarTask* task = &evaluator->tasks[count++];
+            task->scale = i;
+            task->firstRow = row;
+            task->endRow = row + STRIP_ROWS < endY ? row + STRIP_ROWS : endY;
+        }
+    }
+    int capacity = evaluator->taskCandidateCapacity;
+    evaluator->taskCandidates = (HaarRects*)grow(evaluator->taskCandidates,
+            &evaluator->taskCandidateCapacity, count, sizeof(HaarRects));
+    memset(evaluator->taskCandidates + capacity, 0,
+            (evaluator->taskCandidateCapacity - capacity) * sizeof(HaarRects));
+    for (int i = 0; i < count; i++) {
+        evaluator->taskCandidates[i].count = 0;
+    }
+    evaluator->jobCascade = cascade;
+    evaluator->job.run = pyramid_task;
+    evaluator->job.data = evaluator;
+    evaluator->job.taskCount = count;
+    haar_run(evaluator->scheduler, &evaluator->job, evaluator);
+    // the calling thread used candidates while running its tasks
+    evaluator->candidates.count = 0;
+    for (int i = 0; i < count; i++) {
+        HaarRects* accepted = &evaluator->taskCandidates[i];
+        for (int j = 0; j < accepted->count; j++) {
+            push_rect(&evaluator->candidates, accepted->rects[j]);
+        }
+    }
+    return 1;
+}
+
+/* pyramid_task()
+ * --------------
+ * Scans the rows of windows of one task of a split detection (see
+ * split_pyramid()).
+ *
+ * data: The HaarEvaluator whose detection was split.
+ * task: The index of the HaarTask to be run.
+ * evaluator: The HaarEvaluator of the thread running the task.
+ */
+static void pyramid_task(void* data, int task, HaarEvaluator* evaluator)
+{
+    HaarEvaluator* owner = (HaarEvaluator*)data;
+    const HaarTask* strip = &owner->tasks[task];
+    const HaarCascade* cascade = owner->jobCascade;
+    if (evaluator != owner) {
+        lend_image(evaluator, owner, cvRect(0, 0, owner->width, owner->height));
+    }
+    evaluator->candidates.count = 0;
+    scan_scale(evaluator, cascade, &cascade->scales[strip->scale],
+            strip->firstRow, strip->endRow);
+    HaarRects* accepted = &owner->taskCandidates[task];
+    for (int i = 0; i < evaluator->candidates.count; i++) {
+        push_rect(accepted, evaluator->candidates.rects[i]);
+    }
+}
+
+/* scale_grid()
+ * ------------
+ * Computes the grid of windows scanned at one scale.
+ *
+ * evaluator: The HaarEvaluator holding the current image.
+ * scale: The HaarScale to be scanned.
+ * step: Set to the distance between windows.
+ * endX: Set to the number of window positions in each row.
+ * endY: Set to the number of rows of windows.
+ */
+static void scale_grid(const HaarEvaluator* evaluator, const HaarScale* scale,
+        double* step, int* endX, int* endY)
+{
+    *step = scale->factor > MIN_STEP ? scale->factor : MIN_STEP;
+    *endX = cvRound((evaluator->width - scale->window.width) / *step);
+    *endY = cvRound((evaluator->height - scale->window.height) / *step);
+}
+
+/* bind_scale()
+ * ------------
+ * Converts the scaled rectangles of scale into offsets into the current
+ * integral images, relative to the top left corner of a window. The
+ * offsets of scale.equRect follow those of the last node. Offsets stay bound
+ * until the next detection starts.
+ *
+ * evaluator: The HaarEvaluator holding the current image.
+ * cascade: The HaarCascade being searched with.
+ * scale: The HaarScale about to be scanned.
+ */
+static void bind_scale(HaarEvaluator* evaluator, const HaarCascade* cascade,
+        const HaarScale* scale)
+{
+    int stride = (int)evaluator->stride;
+    int entries = (cascade->nodeCount + 1) * HAAR_RECTS * HAAR_CORNERS;
+    if (evaluator->boundScale == scale
+            && evaluator->boundStride == evaluator->stride) {
+        // already bound by an earlier task of the same detection
+        return;
+    }
+    evaluator->boundScale = scale;
+    evaluator->boundStride = evaluator->stride;
+    evaluator->offsets = (int*)grow(evaluator->offsets,
+            &evaluator->offsetCapacity, entries, sizeof(int));
+    for (int node = 0; node < cascade->nodeCount; node++) {
+        for (int r = 0; r < HAAR_RECTS; r++) {
+            CvRect rect = scale->rects[node * HAAR_RECTS + r];
+            int* corners = evaluator->offsets
+                    + (node * HAAR_RECTS + r) * HAAR_CORNERS;
+            corners[0] = rect.y * stride + rect.x;
+            if (!cascade->tilted[node]) {
+                corners[1] = corners[0] + rect.width;
+                corners[2] = corners[0] + rect.height * stride;
+                corners[3] = corners[2] + rect.width;
+            } else {
+                // corners of a rectangle rotated clockwise by 45 degrees
+                corners[1] = corners[0] + rect.height * (stride - 1);
+                corners[2] = corners[0] + rect.width * (stride + 1);
+                corners[3] = corners[2] + rect.height * (stride - 1);
+            }
+        }
+    }
+    int* equ = evaluator->offsets
+            + cascade->nodeCount * HAAR_RECTS * HAAR_CORNERS;
+    equ[0] = scale->equRect.y * stride + scale->equRect.x;
+    equ[1] = equ[0] + scale->equRect.width;
+    equ[2] = equ[0] + scale->equRect.height * stride;
+    equ[3] = equ[2] + scale->equRect.width;
+}
+
+/* eval_window()
+ * -------------
+ * Runs the cascade on the window whose top left corner is at base.
+ *
+ * evaluator: The HaarEvaluator with offsets bound to scale.
+ * cascade: The HaarCascade being searched with.
+ * scale: The HaarScale being scanned.
+ * base: The integral image offset of the window's top left corner.
+ *
+ * Returns: 1 if every stage accepted the window, otherwise minus the index of
+ *          the stage that rejected it.
+ */
+static int eval_window(const HaarEvaluator* evaluator,
+        const HaarCascade* cascade, const HaarScale* scale, size_t base)
+{
+    const int* offsets = evaluator->offsets;
+    const int* equ = offsets + cascade->nodeCount * HAAR_RECTS * HAAR_CORNERS;
+    const uint32_t* sum = evaluator->sum + base;
+    const double* sqsum = evaluator->sqsum + base;
+    const uint32_t* tiltedSum = evaluator->tiltedSum + base;
+    /* normalising features by the window's standard deviation */
+    double mean = (int32_t)(sum[equ[0]] - sum[equ[1]] - sum[equ[2]]
+                          + sum[equ[3]])
+            * scale->invArea;
+    double variance = (sqsum[equ[0]] - sqsum[equ[1]] - sqsum[equ[2]]
+                              + sqsum[equ[3]])
+                    * scale->invArea
+            - mean * mean;
+    double norm = variance >= 0 ? sqrt(variance) : 1.;
+    for (int stage = 0; stage < cascade->stageCount; stage++) {
+        double stageSum = 0;
+        for (int weak = cascade->stageFirst[stage];
+                weak < cascade->stageFirst[stage + 1]; weak++) {
+            int first = cascade->nodeFirst[weak];
+            int next = 0;
+            do {
+                int node = first + next;
+                const int* corners = offsets + node * HAAR_RECTS * HAAR_CORNERS;
+                const float* weights = scale->weights + node * HAAR_RECTS;
+                const uint32_t* integral
+                        = cascade->tilted[node] ? tiltedSum : sum;
+                double value = 0;
+                for (int r = 0; r < cascade->rectCounts[node];
+                        r++, corners += HAAR_CORNERS) {
+                    value += (int32_t)(integral[corners[0]]
+                                     - integral[corners[1]]
+                                     - integral[corners[2]]
+                                     + integral[corners[3]])
+                            * weights[r];
+                }
+                next = value < cascade->nodeThresholds[node] * norm
+                        ? cascade->left[node]
+                        : cascade->right[node];
+            } while (next > 0);
+            stageSum += cascade->alphas[cascade->alphaFirst[weak] - next];
+        }
+        if (stageSum < cascade->stageThresholds[stage]) {
+            return -stage;
+        }
+    }
+    return 1;
+}
+
+/* scan_scale()
+ * ------------
+ * Runs the cascade over a grid of windows of one size, recording every
+ * window accepted in evaluator.candidates.
+ *
+ * evaluator: The HaarEvaluator holding the current image.
+ * cascade: The HaarCascade being searched with.
+ * scale: The HaarScale to be scanned.
+ * beginY: The first row of windows to be scanned.
+ * endY: One past the last row of windows to be scanned, clamped to the grid.
+ */
+static void scan_scale(HaarEvaluator* evaluator, const HaarCascade* cascade,
+        const HaarScale* scale, int beginY, int endY)
+{
+    double step;
+    int endX, rows;
+    scale_grid(evaluator, scale, &step, &endX, &rows);
+    void (*scan)(HaarEvaluator*, const HaarCascade*, const HaarScale*, double,
+            int, int, int)
+            = scanKernel;
+    if (evaluator->capacity > INT_MAX || cascade->maxNodes > MAX_TREE_NODES
+            || !cascade->forwardTrees) {
+        // vector kernels index with 32 bits and walk small trees only
+        scan = scan_windows;
+    }
+    bind_scale(evaluator, cascade, scale);
+    scan(evaluator, cascade, scale, step, endX, beginY,
+            endY < rows ? endY : rows);
+}
+
+/* scan_windows()
+ * --------------
+ * Runs the cascade over the grid of windows one window at a time. Windows
+ * are step pixels apart, and the next column is skipped whenever a window
+ * fails the first stage.
+ *
+ * evaluator: The HaarEvaluator with offsets bound to scale.
+ * cascade: The HaarCascade being searched with.
+ * scale: The HaarScale being scanned.
+ * step: The distance between windows.
+ * endX: The number of window positions in each row.
+ * beginY: The first row of windows.
+ * endY: One past the last row of windows.
+ */
+static void scan_windows(HaarEvaluator* evaluator, const HaarCascade* cascade,
+        const HaarScale* scale, double step, int endX, int beginY, int endY)
+{
+    for (int iy = beginY; iy < endY; iy++) {
+        int y = cvRound(iy * step);
+        int skip = 1;
+        for (int ix = 0; ix < endX; ix += skip) {
+            int x = cvRound(ix * step);
+            int result = eval_window(
+                    evaluator, cascade, scale, y * evaluator->stride + x);
+            if (result > 0) {
+                push_rect(&evaluator->candidates,
+                        cvRect(x, y, scale->window.width,
+                                scale->window.height));
+            }
+            skip = result ? 1 : 2;
+        }
+    }
+}
+
+#ifdef HAAR_X86
+/* The AVX2 kernels below evaluate HAAR_LANES windows at once, one per lane.
+ * Every lane performs the same float and double operations in the same order
+ * as eval_window(), so results are bit-identical.
+ *
+ * The grid is scanned HAAR_LANES rows at a time with each lane walking its
+ * own row, so the column skipping of scan_windows() never leaves a lane
+ * idle. Only the first stage is run on these lanes. Windows passing a stage
+ * are queued for the next one, and a stage is run once HAAR_LANES windows
+ * wait for it, so lanes are not wasted on windows already rejected.
+ * Accepted windows are kept per row and sorted by column before being
+ * appended row by row, giving the same candidate order as scan_windows().
+ *
+ * Within a classifier a node is evaluated only if some lane reaches it,
+ * which relies on every branch leading to a later node (see
+ * HaarCascade.forwardTrees).
+ */
+
+/* gather_avx2()
+ * -------------
+ * Returns the integral image entry at offset from each of 8 windows.
+ */
+__attribute__((target("avx2"))) static inline __m256i gather_avx2(
+        const uint32_t* integral, __m256i bases, int offset)
+{
+    return _mm256_i32gather_epi32((const int*)integral,
+            _mm256_add_epi32(bases, _mm256_set1_epi32(offset)), 4);
+}
+
+/* rect_sum_avx2()
+ * ---------------
+ * Returns the sum of a rectangle in each of 8 windows.
+ */
+__attribute__((target("avx2"))) static inline __m256i rect_sum_avx2(
+        const uint32_t* integral, __m256i bases, const int* corners)
+{
+    __m256i sums = _mm256_sub_epi32(gather_avx2(integral, bases, corners[0]),
+            gather_avx2(integral, bases, corners[1]));
+    sums = _mm256_sub_epi32(sums, gather_avx2(integral, bases, corners[2]));
+    return _mm256_add_epi32(sums, gather_avx2(integral, bases, corners[3]));
+}
+
+/* norm_avx2()
+ * -----------
+ * Computes the normalisation factor of 4 windows, as eval_window() does.
+ */
+__attribute__((target("avx2"))) static inline __m256d norm_avx2(
+        const HaarEvaluator* evaluator, const HaarScale* scale,
+        const int* equ, __m128i bases, __m128i sums)
+{
+    __m256d sq[HAAR_CORNERS];
+    for (int i = 0; i < HAAR_CORNERS; i++) {
+        sq[i] = _mm256_i32gather_pd(evaluator->sqsum,
+                _mm_add_epi32(bases, _mm_set1_epi32(equ[i])), 8);
+    }
+    __m256d invArea = _mm256_set1_pd(scale->invArea);
+    __m256d mean = _mm256_mul_pd(_mm256_cvtepi32_pd(sums), invArea);
+    __m256d variance = _mm256_sub_pd(
+            _mm256_mul_pd(
+                    _mm256_add_pd(_mm256_sub_pd(_mm256_sub_pd(sq[0], sq[1]),
+                                          sq[2]),
+                            sq[3]),
+                    invArea),
+            _mm256_mul_pd(mean, mean));
+    return _mm256_blendv_pd(_mm256_set1_pd(1.), _mm256_sqrt_pd(variance),
+            _mm256_cmp_pd(variance, _mm256_setzero_pd(), _CMP_GE_OQ));
+}
+
+/* node_less_avx2()
+ * ----------------
+ * Evaluates a node's feature in 8 windows.
+ *
+ * Returns: Bit i is set if window i takes the node's left branch.
+ */
+__attribute__((target("avx2"))) static inline int node_less_avx2(
+        const HaarEvaluator* evaluator, const HaarCascade* cascade,
+        const HaarScale* scale, int node, __m256i bases, __m256d normLow,
+        __m256d normHigh)
+{
+    const int* corners
+            = evaluator->offsets + node * HAAR_RECTS * HAAR_CORNERS;
+    const float* weights = scale->weights + node * HAAR_RECTS;
+    const uint32_t* integral
+            = cascade->tilted[node] ? evaluator->tiltedSum : evaluator->sum;
+    __m256d low = _mm256_setzero_pd(), high = _mm256_setzero_pd();
+    for (int r = 0; r < cascade->rectCounts[node];
+            r++, corners += HAAR_CORNERS) {
+        __m256 value = _mm256_mul_ps(
+                _mm256_cvtepi32_ps(rect_sum_avx2(integral, bases, corners)),
+                _mm256_set1_ps(weights[r]));
+        low = _mm256_add_pd(
+                low, _mm256_cvtps_pd(_mm256_castps256_ps128(value)));
+        high = _mm256_add_pd(
+                high, _mm256_cvtps_pd(_mm256_extractf128_ps(value, 1)));
+    }
+    __m256d threshold = _mm256_set1_pd(cascade->nodeThresholds[node]);
+    return _mm256_movemask_pd(_mm256_cmp_pd(low,
+                   _mm256_mul_pd(threshold, normLow), _CMP_LT_OQ))
+            | _mm256_movemask_pd(_mm256_cmp_pd(high,
+                      _mm256_mul_pd(threshold, normHigh), _CMP_LT_OQ))
+            << 4;
+}
+
+/* lane_mask_avx2()
+ * ----------------
+ * Expands 4 bits of a lane mask into a mask of 4 doubles.
+ */
+__attribute__((target("avx2"))) static inline __m256d lane_mask_avx2(
+        int bits)
+{
+    const __m256i lanes = _mm256_setr_epi64x(1, 2, 4, 8);
+    return _mm256_castsi256_pd(_mm256_cmpeq_epi64(
+            _mm256_and_si256(_mm256_set1_epi64x(bits), lanes), lanes));
+}
+
+/* stage_avx2()
+ * ------------
+ * Evaluates one stage in 8 windows.
+ *
+ * Returns: Bit i is set if window i is rejected by the stage.
+ */
+__attribute__((target("avx2"))) static int stage_avx2(
+        const HaarEvaluator* evaluator, const HaarCascade* cascade,
+        const HaarScale* scale, int stage, __m256i bases, __m256d normLow,
+        __m256d normHigh)
+{
+    __m256d low = _mm256_setzero_pd(), high = _mm256_setzero_pd();
+    for (int weak = cascade->stageFirst[stage];
+            weak < cascade->stageFirst[stage + 1]; weak++) {
+        int first = cascade->nodeFirst[weak];
+        int nodes = cascade->nodeFirst[weak + 1] - first;
+        const float* alphas = cascade->alphas + cascade->alphaFirst[weak];
+        if (nodes == 1) {
+            // a stump picks one of two leaves
+            int less = node_less_avx2(evaluator, cascade, scale, first, bases,
+                    normLow, normHigh);
+            __m256d left = _mm256_set1_pd(alphas[-cascade->left[first]]);
+            __m256d right = _mm256_set1_pd(alphas[-cascade->right[first]]);
+            low = _mm256_add_pd(low,
+                    _mm256_blendv_pd(right, left, lane_mask_avx2(less)));
+            high = _mm256_add_pd(high,
+                    _mm256_blendv_pd(right, left, lane_mask_avx2(less >> 4)));
+            continue;
+        }
+        // lanes reaching each node, and the leaf value of every lane
+        int reached[MAX_TREE_NODES];
+        __m256d leafLow = _mm256_setzero_pd(), leafHigh = _mm256_setzero_pd();
+        reached[0] = (1 << HAAR_LANES) - 1;
+        for (int k = 1; k < nodes; k++) {
+            reached[k] = 0;
+        }
+        for (int k = 0; k < nodes; k++) {
+            if (!reached[k]) {
+                continue;
+            }
+            int node = first + k;
+            int less = node_less_avx2(evaluator, cascade, scale, node, bases,
+                    normLow, normHigh);
+            int branches[2] = {reached[k] & less, reached[k] & ~less};
+            int next[2] = {cascade->left[node], cascade->right[node]};
+            for (int b = 0; b < 2; b++) {
+                if (next[b] > 0) {
+                    reached[next[b]] |= branches[b];
+                } else if (branches[b]) {
+                    __m256d leaf = _mm256_set1_pd(alphas[-next[b]]);
+                    leafLow = _mm256_blendv_pd(
+                            leafLow, leaf, lane_mask_avx2(branches[b]));
+                    leafHigh = _mm256_blendv_pd(leafHigh, leaf,
+                            lane_mask_avx2(branches[b] >> 4));
+                }
+            }
+        }
+        low = _mm256_add_pd(low, leafLow);
+        high = _mm256_add_pd(high, leafHigh);
+    }
+    __m256d threshold = _mm256_set1_pd(cascade->stageThresholds[stage]);
+    return _mm256_movemask_pd(_mm256_cmp_pd(low, threshold, _CMP_LT_OQ))
+            | _mm256_movemask_pd(_mm256_cmp_pd(high, threshold, _CMP_LT_OQ))
+            << 4;
+}
+
+/* queue_window_avx2()
+ * -------------------
+ * Queues a window for a stage, running the stage once HAAR_LANES windows
+ * wait for it. Windows past the last stage are accepted.
+ *
+ * evaluator: The HaarEvaluator with offsets bound to scale.
+ * cascade: The HaarCascade being searched with.
+ * scale: The HaarScale being scanned.
+ * stage: The stage the window has reached.
+ * base: The integral image offset of the window.
+ * x: The left of the window.
+ * row: The lane whose row the window belongs to.
+ * norm: The normalisation factor of the window.
+ * ys: The top of each lane's row of windows.
+ */
+__attribute__((target("avx2"))) static void queue_window_avx2(
+        HaarEvaluator* evaluator, const HaarCascade* cascade,
+        const HaarScale* scale, int stage, int base, int x, int row,
+        double norm, const int* ys)
+{
+    if (stage == cascade->stageCount) {
+        push_rect(&evaluator->rowCandidates[row],
+                cvRect(x, ys[row], scale->window.width, scale->window.height));
+        return;
+    }
+    HaarBatch* batch = &evaluator->batches[stage];
+    batch->bases[batch->count] = base;
+    batch->xs[batch->count] = x;
+    batch->rows[batch->count] = row;
+    batch->norms[batch->count] = norm;
+    if (++batch->count == HAAR_LANES) {
+        run_batch_avx2(evaluator, cascade, scale, stage, ys);
+    }
+}
+
+/* run_batch_avx2()
+ * ----------------
+ * Runs the windows waiting for a stage through it, queueing those that pass
+ * for the next stage. Spare lanes repeat the first window.
+ *
+ * evaluator: The HaarEvaluator with offsets bound to scale.
+ * cascade: The HaarCascade being searched with.
+ * scale: The HaarScale being scanned.
+ * stage: The stage to be run.
+ * ys: The top of each lane's row of windows.
+ */
+__attribute__((target("avx2"))) static void run_batch_avx2(
+        HaarEvaluator* evaluator, const HaarCascade* cascade,
+        const HaarScale* scale, int stage, const int* ys)
+{
+    HaarBatch* batch = &evaluator->batches[stage];
+    for (int i = batch->count; i < HAAR_LANES; i++) {
+        batch->bases[i] = batch->bases[0];
+        batch->norms[i] = batch->norms[0];
+    }
+    int passed = ~stage_avx2(evaluator, cascade, scale, stage,
+                         _mm256_loadu_si256((const __m256i*)batch->bases),
+                         _mm256_loadu_pd(batch->norms),
+                         _mm256_loadu_pd(batch->norms + 4))
+            & ((1 << batch->count) - 1);
+    // later stages never queue into this batch, so its windows stay intact
+    batch->count = 0;
+    for (; passed; passed &= passed - 1) {
+        int i = __builtin_ctz(passed);
+        queue_window_avx2(evaluator, cascade, scale, stage + 1,
+                batch->bases[i], batch->xs[i], batch->rows[i],
+                batch->norms[i], ys);
+    }
+}
+
+/* sort_row()
+ * ----------
+ * Sorts the accepted windows of one row by column.
+ *
+ * row: The windows to be sorted, all with distinct columns.
+ */
+static void sort_row(HaarRects* row)
+{
+    for (int i = 1; i < row->count; i++) {
+        CvRect rect = row->rects[i];
+        int j = i;
+        for (; j > 0 && row->rects[j - 1].x > rect.x; j--) {
+            row->rects[j] = row->rects[j - 1];
+        }
+        row->rects[j] = rect;
+    }
+}
+
+/* scan_windows_avx2()
+ * -------------------
+ * scan_windows() HAAR_LANES rows at a time with AVX2.
+ */
+__attribute__((target("avx2"))) static void scan_windows_avx2(
+        HaarEvaluator* evaluator, const HaarCascade* cascade,
+        const HaarScale* scale, double step, int endX, int beginY, int endY)
+{
+    const int* equ = evaluator->offsets
+            + cascade->nodeCount * HAAR_RECTS * HAAR_CORNERS;
+    int stride = (int)evaluator->stride;
+    HaarRects* rows = evaluator->rowCandidates;
+    evaluator->batches = (HaarBatch*)grow(evaluator->batches,
+            &evaluator->batchCapacity, cascade->stageCount, sizeof(HaarBatch));
+    for (int stage = 0; stage < cascade->stageCount; stage++) {
+        evaluator->batches[stage].count = 0;
+    }
+    for (int firstRow = beginY; firstRow < endY; firstRow += HAAR_LANES) {
+        int ys[HAAR_LANES], ixs[HAAR_LANES], xs[HAAR_LANES];
+        int bases[HAAR_LANES], active = 0;
+        double norms[HAAR_LANES];
+        for (int lane = 0; lane < HAAR_LANES; lane++) {
+            ys[lane] = cvRound((firstRow + lane) * step);
+            ixs[lane] = 0;
+            rows[lane].count = 0;
+            if (firstRow + lane < endY && endX > 0) {
+                active |= 1 << lane;
+            }
+        }
+        while (active) {
+            int spare = __builtin_ctz(active);
+            for (int lane = 0; lane < HAAR_LANES; lane++) {
+                // finished lanes repeat a window of an active one
+                int from = (active >> lane & 1) ? lane : spare;
+                xs[lane] = cvRound(ixs[from] * step);
+                bases[lane] = ys[from] * stride + xs[lane];
+            }
+            __m256i baseVector = _mm256_loadu_si256((const __m256i*)bases);
+            __m256i sums = rect_sum_avx2(evaluator->sum, baseVector, equ);
+            __m256d normLow = norm_avx2(evaluator, scale, equ,
+                    _mm256_castsi256_si128(baseVector),
+                    _mm256_castsi256_si128(sums));
+            __m256d normHigh = norm_avx2(evaluator, scale, equ,
+                    _mm256_extracti128_si256(baseVector, 1),
+                    _mm256_extracti128_si256(sums, 1));
+            int passed = ~stage_avx2(evaluator, cascade, scale, 0, baseVector,
+                    normLow, normHigh);
+            _mm256_storeu_pd(norms, normLow);
+            _mm256_storeu_pd(norms + 4, normHigh);
+            for (int lanes = active; lanes; lanes &= lanes - 1) {
+                int lane = __builtin_ctz(lanes);
+                if (passed >> lane & 1) {
+                    queue_window_avx2(evaluator, cascade, scale, 1,
+                            bases[lane], xs[lane], lane, norms[lane], ys);
+                    ixs[lane]++;
+                } else {
+                    ixs[lane] += 2;
+                }
+                if (ixs[lane] >= endX) {
+                    active &= ~(1 << lane);
+                }
+            }
+        }
+        for (int stage = 1; stage < cascade->stageCount; stage++) {
+            // later stages are drained after the stages feeding them
+            if (evaluator->batches[stage].count) {
+                run_batch_avx2(evaluator, cascade, scale, stage, ys);
+            }
+        }
+        for (int lane = 0; lane < HAAR_LANES; lane++) {
+            sort_row(&rows[lane]);
+            for (int i = 0; i < rows[lane].count; i++) {
+                push_rect(&evaluator->candidates, rows[lane].rects[i]);
+            }
+        }
+    }
+}
+#endif
+
+/// Grouping Functions ///////////////////
+
+/* similar_rects()
+ * ---------------
+ * Decides whether two windows cover the same object, i.e. every edge is
+ * within GROUP_EPS of the mean smaller side.
+ *
+ * a: The first window.
+ * b: The second window.
+ *
+ * Returns: 1 if the windows are similar, 0 otherwise.
+ */
+static int similar_rects(CvRect a, CvRect b)
+{
+    double delta = GROUP_EPS
+            * ((a.width < b.width ? a.width : b.width)
+                    + (a.height < b.height ? a.height : b.height))
+            * 0.5;
+    return abs(a.x - b.x) <= delta && abs(a.y - b.y) <= delta
+            && abs(a.x + a.width - b.x - b.width) <= delta
+            && abs(a.y + a.height - b.y - b.height) <= delta;
+}
+
+/* find_root()
+ * -----------
+ * Finds the root of the set holding i, compressing the path as it goes.
+ *
+ * parents: The parent of every element, -1 for roots.
+ * i: The element to be looked up.
+ *
+ * Returns: The root of i's set.
+ */
+static int find_root(int* parents, int i)
+{
+    int root = i;
+    while (parents[root] >= 0) {
+        root = parents[root];
+    }
+    while (parents[i] >= 0) {
+        int next = parents[i];
+        parents[i] = root;
+        i = next;
+    }
+    return root;
+}
+
+/* group_rects()
+ * -------------
+ * Merges overlapping candidate windows into objects the way OpenCV's
+ * groupRectangles() does: similar windows are partitioned into groups
+ * (numbered by first appearance), each group with more than minNeighbours
+ * windows is averaged into one object, and objects lying inside a better
+ * supported object are dropped.
+ *
+ * evaluator: The HaarEvaluator holding the candidate windows.
+ * minNeighbours: The number of windows a group must exceed.
+ * objects: Appended with the detected objects.
+ */
+static void group_rects(
+        HaarEvaluator* evaluator, int minNeighbours, HaarRects* objects)
+{
+    int count = evaluator->candidates.count;
+    const CvRect* candidates = evaluator->candidates.rects;
+    int capacity = evaluator->groupCapacity;
+    evaluator->parents = (int*)grow(
+            evaluator->parents, &capacity, count, sizeof(int));
+    capacity = evaluator->groupCapacity;
+    evaluator->labels = (int*)grow(
+            evaluator->labels, &capacity, count, sizeof(int));
+    capacity = evaluator->groupCapacity;
+    evaluator->weights = (int*)grow(
+            evaluator->weights, &capacity, count, sizeof(int));
+    capacity = evaluator->groupCapacity;
+    evaluator->groups = (CvRect*)grow(
+            evaluator->groups, &capacity, count, sizeof(CvRect));
+    evaluator->groupCapacity = capacity;
+    int* parents = evaluator->parents;
+    int* labels = evaluator->labels;
+    int* weights = evaluator->weights;
+    CvRect* groups = evaluator->groups;
+    int threshold = minNeighbours > 1 ? minNeighbours : 1;
+    /* partitioning similar windows */
+    for (int i = 0; i < count; i++) {
+        parents[i] = -1;
+        labels[i] = -1;
+    }
+    for (int i = 0; i < count; i++) {
+        for (int j = i + 1; j < count; j++) {
+            if (similar_rects(candidates[i], candidates[j])) {
+                int a = find_root(parents, i), b = find_root(parents, j);
+                if (a != b) {
+                    parents[a] = b;
+                }
+            }
+        }
+    }
+    int groupCount = 0;
+    for (int i = 0; i < count; i++) {
+        // labels of roots are reused as group numbers
+        int root = find_root(parents, i);
+        if (labels[root] < 0) {
+            groups[groupCount] = cvRect(0, 0, 0, 0);
+            weights[groupCount] = 0;
+            labels[root] = groupCount++;
+        }
+        CvRect* group = &groups[labels[root]];
+        group->x += candidates[i].x;
+        group->y += candidates[i].y;
+        group->width += candidates[i].width;
+        group->height += candidates[i].height;
+        weights[labels[root]]++;
+    }
+    for (int i = 0; i < groupCount; i++) {
+        float scale = 1.f / weights[i];
+        groups[i] = cvRect(cvRound(groups[i].x * scale),
+                cvRound(groups[i].y * scale), cvRound(groups[i].width * scale),
+                cvRound(groups[i].height * scale));
+    }
+    /* dropping weak objects and objects inside stronger ones */
+    for (int i = 0; i < groupCount; i++) {
+        CvRect inner = groups[i];
+        int n1 = weights[i], j;
+        if (n1 <= threshold) {
+            continue;
+        }
+        for (j = 0; j < groupCount; j++) {
+            CvRect outer = groups[j];
+            int n2 = weights[j];
+            if (j == i || n2 <= threshold) {
+                continue;
+            }
+            int dx = cvRound(outer.width * GROUP_EPS);
+            int dy = cvRound(outer.height * GROUP_EPS);
+            if (inner.x >= outer.x - dx && inner.y >= outer.y - dy
+                    && inner.x + inner.width <= outer.x + outer.width + dx
+                    && inner.y + inner.height <= outer.y + outer.height + dy
+                    && (n2 > (n1 > MIN_INNER_NEIGHBOURS ? n1
+                                                        : MIN_INNER_NEIGHBOURS)
+                            || n1 < MIN_INNER_NEIGHBOURS)) {
+                break;
+            }
+        }
+        if (j == groupCount) {
+            push_rect(objects, inner);
+        }
+    }
+}
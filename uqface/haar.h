@@ -0,0 +1,204 @@
+#ifndef HAAR_H
+#define HAAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <opencv2/core/core_c.h>
+#include <opencv2/objdetect/objdetect_c.h>
+
+// A Haar feature has at most this many weighted rectangles
+#define HAAR_RECTS CV_HAAR_FEATURE_MAX
+// Integral image lookups needed per rectangle (one per corner)
+#define HAAR_CORNERS 4
+// Windows evaluated together by the vector kernels
+#define HAAR_LANES 8
+// Used to keep the task ranges of a job on separate cache lines
+#define HAAR_CACHE_LINE 64
+// Largest factor an image is reduced by before a fast detection
+#define HAAR_MAX_REDUCTION 8
+
+// Instruction sets the image and detection kernels are built for. Every set
+// gives bit-identical results.
+typedef enum {
+    HAAR_SCALAR = 0,
+    HAAR_SSE42 = 1,
+    HAAR_AVX2 = 2
+} HaarKernels;
+
+// A cascade's features scaled to a single window size of the detection
+// pyramid. Computed once when the cascade is loaded.
+typedef struct {
+    double factor; // scale relative to the cascade's window
+    CvSize window; // scaled window size
+    CvRect equRect; // window area used for variance normalisation
+    double invArea; // 1 / area of equRect
+    CvRect* rects; // scaled rectangles, HAAR_RECTS per node
+    float* weights; // normalised rectangle weights, HAAR_RECTS per node
+} HaarScale;
+
+// A Haar cascade held as flat arrays (struct-of-arrays) rather than the
+// nested stage/classifier/feature structs of CvHaarClassifierCascade.
+// Classifiers of a stage, and nodes of a classifier, are stored
+// contiguously. Read only once loaded, so one HaarCascade is shared by every
+// thread.
+typedef struct {
+    CvSize window; // window size the cascade was trained on
+    int stageCount;
+    int* stageFirst; // first classifier of each stage, stageCount + 1 entries
+    float* stageThresholds;
+    int classifierCount;
+    int* nodeFirst; // first node of each classifier, classifierCount + 1
+    int* alphaFirst; // first leaf value of each classifier
+    int maxNodes; // most nodes in any one classifier
+    int forwardTrees; // every branch leads to a later node of its classifier
+    int nodeCount;
+    float* nodeThresholds;
+    int* left; // > 0 is the next node, <= 0 is the negated leaf index
+    int* right;
+    uint8_t* tilted; // node's feature uses the 45 degree integral image
+    uint8_t* rectCounts; // rectangles used by node's feature (2 or 3)
+    float* alphas; // leaf values
+    CvRect* baseRects; // unscaled rectangles, HAAR_RECTS per node
+    float* baseWeights; // unscaled rectangle weights, HAAR_RECTS per node
+    int hasTilted; // any node is tilted
+    int scaleCount;
+    HaarScale* scales; // detection pyramid, smallest window first
+} HaarCascade;
+
+// A growable array of rectangles, reused between detections
+typedef struct {
+    CvRect* rects;
+    int count;
+    int capacity;
+} HaarRects;
+
+// Objects found in each of several regions of one image, reused between
+// detections (see haar_detect_regions())
+typedef struct {
+    HaarRects* lists; // objects of each region, relative to the region
+    int count;
+    int capacity;
+} HaarRectLists;
+
+// Windows waiting to be run through one stage together by the vector kernels
+typedef struct {
+    int count;
+    int bases[HAAR_LANES]; // integral image offsets of the windows
+    int xs[HAAR_LANES];
+    int rows[HAAR_LANES]; // lane whose row each window belongs to
+    double norms[HAAR_LANES]; // normalisation factors of the windows
+} HaarBatch;
+
+// Rows of windows of one scale of the detection pyramid, scanned as a
+// single task when a detection is split between threads
+typedef struct {
+    int scale; // index into HaarCascade.scales
+    int firstRow;
+    int endRow; // one past the last row
+} HaarTask;
+
+// A contiguous run of a job's tasks, initially handed to one thread. begin
+// and end are packed into one word so that the thread owning the run (taking
+// from the front) and threads stealing from it (taking from the back) claim
+// tasks with a single compare and swap.
+typedef struct {
+    uint64_t span; // begin in the high 32 bits, end in the low 32 bits
+    char pad[HAAR_CACHE_LINE - sizeof(uint64_t)];
+} HaarRange;
+
+struct HaarEvaluator;
+
+// Tasks of one detection, spread over the submitting thread and the helper
+// threads of a HaarScheduler. run is called once for every task, with the
+// evaluator of whichever thread claimed it.
+typedef struct HaarJob {
+    struct HaarJob* next; // next job waiting for helpers
+    void (*run)(void* data, int task, struct HaarEvaluator* evaluator);
+    void* data;
+    int taskCount;
+    int slots; // task ranges, the submitting thread owns range 0
+    HaarRange* ranges;
+    int rangeCapacity;
+    int users; // helper threads working on the job, guarded by lock
+    int exhausted; // every task has been claimed
+} HaarJob;
+
+// Helper threads shared by every evaluator that uses the scheduler. A
+// detection split into a HaarJob is worked on by the submitting thread and
+// by whichever helpers are idle, each taking tasks from its own range before
+// stealing from the others.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work; // signalled when a job is submitted
+    pthread_cond_t left; // signalled when the last helper leaves a job
+    HaarJob* jobs; // jobs that may still have unclaimed tasks
+    int threads; // number of helper threads
+} HaarScheduler;
+
+// Per-thread detection state: the integral images of the current image and
+// the scratch space used while scanning and grouping. Never shared, so
+// detection is reentrant as long as each thread has its own evaluator.
+typedef struct HaarEvaluator {
+    int width; // size of the current image
+    int height;
+    size_t stride; // integral image row length (width + 1)
+    size_t capacity; // integral image entries allocated
+    uint32_t* sum; // integral image, wraps modulo 2^32
+    double* sqsum; // integral image of squared pixels
+    uint32_t* tiltedSum; // 45 degree integral image, built on demand
+    int tiltedReady;
+    int borrowed; // sum, sqsum and tiltedSum belong to another evaluator
+    uint32_t* diagonals; // scratch rows used to build tiltedSum
+    int diagonalCapacity;
+    const uint8_t* image; // current image, kept for the tilted integral
+    size_t imageStep;
+    int* offsets; // integral offsets of every node's corners at one scale
+    int offsetCapacity;
+    const HaarScale* boundScale; // scale offsets are bound to, or NULL
+    size_t boundStride;
+    HaarRects candidates; // windows accepted by the whole cascade
+    HaarRects rowCandidates[HAAR_LANES]; // accepted windows of each row
+                                         // scanned together
+    HaarBatch* batches; // windows waiting for each stage
+    int batchCapacity;
+    int* parents; // grouping scratch space, one entry per candidate
+    int* labels;
+    int* weights;
+    CvRect* groups;
+    int groupCapacity;
+    HaarScheduler* scheduler; // splits large detections, or NULL
+    HaarJob job; // the detection currently split between threads
+    const HaarCascade* jobCascade;
+    HaarTask* tasks;
+    int taskCapacity;
+    HaarRects* taskCandidates; // windows accepted by each task
+    int taskCandidateCapacity;
+    struct HaarEvaluator* view; // borrows regions of the current image for
+                                // this evaluator's thread, created on demand
+} HaarEvaluator;
+
+/* functions */
+HaarKernels haar_use_kernels(HaarKernels limit);
+void haar_gray(const uint8_t* bgr, size_t bgrStep, int width, int height,
+        uint8_t* gray, size_t grayStep);
+void haar_equalize(uint8_t* gray, size_t step, int width, int height);
+HaarCascade* haar_load(const char* path, double scaleFactor, int maxWindow);
+void haar_free(HaarCascade* cascade);
+HaarEvaluator* haar_evaluator(void);
+void haar_free_evaluator(HaarEvaluator* evaluator);
+HaarScheduler* haar_scheduler(int threads);
+void haar_use_scheduler(HaarEvaluator* evaluator, HaarScheduler* scheduler);
+void haar_run(
+        HaarScheduler* scheduler, HaarJob* job, HaarEvaluator* evaluator);
+void haar_set_image(HaarEvaluator* evaluator, const uint8_t* image, int width,
+        int height, size_t step);
+int haar_detect(HaarEvaluator* evaluator, const HaarCascade* cascade,
+        int minNeighbours, CvSize minSize, CvSize maxSize, HaarRects* objects);
+int haar_detect_regions(HaarEvaluator* evaluator, const HaarCascade* cascade,
+        int minNeighbours, CvSize minSize, CvSize maxSize,
+        const CvRect* regions, int count, HaarRectLists* objects);
+int haar_reduction(int width, int height, long maxPixels);
+void haar_scale_rects(CvRect* rects, int count, int factor, CvSize bounds);
+
+#endif
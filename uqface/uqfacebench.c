@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+/* Communication protocol framing */
+#include "faceclient.h"
+/* Helpers shared with uqfaceload */
+#include "bench.h"
+
+#define DECIMAL_FORMAT 10
+#define DEFAULT_DURATION 5 // seconds spent at each concurrency level
+
+// Messages
+ImmutableString benchName = "uqfacebench";
+ImmutableString invalidCmdLineMsg
+        = "Usage: ./uqfacebench portnum imagefile [--replacefilename filename] "
+          "[--maxclients n] [--duration seconds]\n";
+ImmutableString tableHeader
+        = "clients  requests      req/s  speedup  efficiency\n";
+// Command line arguments
+ImmutableString replace = "--replacefilename";
+ImmutableString maxClientsArg = "--maxclients";
+ImmutableString durationArg = "--duration";
+
+// Stores all benchmark settings enabled by user at the command line
+typedef struct {
+    char* portNum;
+    ImageFile detect;
+    ImageFile replace; // size is 0 when --replacefilename was not supplied
+    int maxClients; // highest number of concurrent clients to measure
+    int duration; // seconds spent measuring each number of clients
+} Settings;
+
+// Stores the state of one benchmark client thread
+typedef struct {
+    Settings* settings;
+    pthread_barrier_t* start; // released once every client has connected
+    uint64_t* deadline; // now_nanos() after which the client stops sending
+    int fd; // connected socket to the server
+    uint64_t completed; // number of responses recieved
+} BenchClient;
+
+/// Functions ///////////////////////////
+/* command line processing functions */
+Settings get_settings(int argc, char* argv[]);
+/* benchmark functions */
+void send_request(BenchClient* client);
+void read_response(BenchClient* client, uint8_t** buffer, uint32_t* capacity);
+void* client_thread(void* data);
+double run_level(Settings* settings, int clients);
+/* main */
+int main(int argc, char* argv[]);
+
+/////////////////////////////////////////
+
+/// Command Line Processing Functions ////
+
+/* get_settings()
+ * --------------
+ * Generates a Settings struct populated with all benchmark settings enabled by
+ * user through terminal input. Image files are read into memory.
+ *
+ * argc: The number of program arguments supplied by user at the terminal.
+ * argv: The program arguments supplied by user at the terminal.
+ *
+ * Return: A Settings struct populated with all of the benchmark settings.
+ * Errors: Function calls exit_invalid_command_line() whenever an invalid
+ *         argument is detected.
+ */
+Settings get_settings(int argc, char* argv[])
+{
+    char* endptr;
+    char* replaceFilename = NULL;
+    Settings settings = {0};
+    settings.maxClients = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    settings.duration = DEFAULT_DURATION;
+    if (argc < 3 || !strlen(argv[1]) || !strlen(argv[2])) {
+        // portnum and imagefile are both required
+        exit_invalid_command_line();
+    }
+    settings.portNum = argv[1];
+    for (int i = 3; i < argc; i++) {
+        if (i + 1 >= argc || !strlen(argv[i + 1])) {
+            // every option expects a non-empty value
+            exit_invalid_command_line();
+        }
+        if (!strcmp(argv[i], replace) && !replaceFilename) {
+            replaceFilename = argv[++i];
+        } else if (!strcmp(argv[i], maxClientsArg)) {
+            settings.maxClients
+                    = (int)strtol(argv[++i], &endptr, DECIMAL_FORMAT);
+            if (*endptr != '\0' || settings.maxClients < 1) {
+                exit_invalid_command_line();
+            }
+        } else if (!strcmp(argv[i], durationArg)) {
+            settings.duration = (int)strtol(argv[++i], &endptr, DECIMAL_FORMAT);
+            if (*endptr != '\0' || settings.duration < 1) {
+                exit_invalid_command_line();
+            }
+        } else {
+            // argument cannot be identified, assume to be invalid
+            exit_invalid_command_line();
+        }
+    }
+    settings.detect = read_image(argv[2]);
+    if (replaceFilename) {
+        settings.replace = read_image(replaceFilename);
+    }
+    return settings;
+}
+
+/// Benchmark Functions /////////////////
+
+/* send_request()
+ * --------------
+ * Sends one detect (or replace, when a replace image was supplied) request
+ * over the client's connection.
+ *
+ * client: The BenchClient whose connection the request is sent on.
+ */
+void send_request(BenchClient* client)
+{
+    Settings* settings = client->settings;
+    int isReplace = settings->replace.size > 0;
+    // the image size goes out with the header, in one segment
+    uint8_t header[FACE_REQUEST_HEADER_SIZE + sizeof(uint32_t)];
+    size_t length = face_encode_request(
+            header, isReplace ? FACE_REPLACE : FACE_DETECT, 0, 0);
+    memcpy(header + length, &settings->detect.size, sizeof(uint32_t));
+    write_fully(client->fd, header, length + sizeof(uint32_t));
+    write_fully(client->fd, settings->detect.data, settings->detect.size);
+    if (isReplace) {
+        write_fully(client->fd, &settings->replace.size, sizeof(uint32_t));
+        write_fully(client->fd, settings->replace.data, settings->replace.size);
+    }
+}
+
+/* read_response()
+ * ---------------
+ * Reads one output image response from the client's connection. The image
+ * bytes are read into a buffer reused across requests.
+ *
+ * client: The BenchClient whose connection the response is read from.
+ * buffer: The reusable response buffer, grown as required.
+ * capacity: The current size of buffer.
+ *
+ * Errors: Function calls exit_communication_error() if anything other than an
+ *         output image is recieved (including server error messages).
+ */
+void read_response(BenchClient* client, uint8_t** buffer, uint32_t* capacity)
+{
+    uint8_t fields[FACE_RESPONSE_HEADER_SIZE];
+    FaceHeader header;
+    if (!read_fully(client->fd, fields, FACE_RESPONSE_HEADER_SIZE)
+            || face_header_length(fields) != FACE_RESPONSE_HEADER_SIZE
+            || face_decode_response(fields, &header)
+            || header.operation != FACE_OUTPUT_IMAGE) {
+        // server rejected the request or sent garbage
+        exit_communication_error();
+    }
+    uint32_t size = header.size;
+    if (size > *capacity) {
+        *buffer = (uint8_t*)realloc(*buffer, size);
+        *capacity = size;
+    }
+    if (!read_fully(client->fd, *buffer, size)) {
+        exit_communication_error();
+    }
+}
+
+/* client_thread()
+ * ---------------
+ * Repeatedly sends a request and waits for its response (closed loop) until
+ * the shared deadline passes, counting completed requests.
+ *
+ * data: A pointer to the BenchClient run by this thread.
+ */
+void* client_thread(void* data)
+{
+    BenchClient* client = (BenchClient*)data;
+    uint8_t* buffer = NULL;
+    uint32_t capacity = 0;
+    pthread_barrier_wait(client->start);
+    while (now_nanos() < *client->deadline) {
+        send_request(client);
+        read_response(client, &buffer, &capacity);
+        client->completed++;
+    }
+    free(buffer);
+    return NULL;
+}
+
+/* run_level()
+ * -----------
+ * Measures server throughput with the given number of concurrent clients,
+ * each holding its own persistent connection.
+ *
+ * settings: The benchmark settings.
+ * clients: The number of concurrent clients.
+ *
+ * Returns: The number of requests completed per second.
+ */
+double run_level(Settings* settings, int clients)
+{
+    pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * clients);
+    BenchClient* benchClients
+            = (BenchClient*)calloc(clients, sizeof(BenchClient));
+    pthread_barrier_t start;
+    uint64_t begin, deadline;
+    uint64_t completed = 0;
+    pthread_barrier_init(&start, NULL, clients + 1);
+    for (int i = 0; i < clients; i++) {
+        benchClients[i].settings = settings;
+        benchClients[i].start = &start;
+        benchClients[i].deadline = &deadline;
+        benchClients[i].fd = connect_server(settings->portNum);
+        pthread_create(&threads[i], NULL, client_thread, &benchClients[i]);
+    }
+    begin = now_nanos();
+    deadline = begin + settings->duration * NANOSECONDS;
+    pthread_barrier_wait(&start); // every client starts sending together
+    for (int i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+        completed += benchClients[i].completed;
+        close(benchClients[i].fd);
+    }
+    double elapsed = (now_nanos() - begin) / (double)NANOSECONDS;
+    pthread_barrier_destroy(&start);
+    free(threads);
+    free(benchClients);
+    printf("%7d  %8lu  %9.2f", clients, (unsigned long)completed,
+            completed / elapsed);
+    return completed / elapsed;
+}
+
+/// Main /////////////////////////////////
+int main(int argc, char* argv[])
+{
+    Settings settings = get_settings(argc, argv);
+    double baseline = 0;
+    signal(SIGPIPE, SIG_IGN); // broken connections are reported by write()
+    printf("%s", tableHeader);
+    // double the number of clients each level, always finishing on maxClients
+    for (int clients = 1; clients <= settings.maxClients;
+            clients = (clients * 2 > settings.maxClients
+                              && clients != settings.maxClients)
+                    ? settings.maxClients
+                    : clients * 2) {
+        double rate = run_level(&settings, clients);
+        if (clients == 1) {
+            baseline = rate;
+        }
+        printf("  %6.2fx  %9.0f%%\n", rate / baseline,
+                100 * rate / (baseline * clients));
+        fflush(stdout);
+    }
+    free(settings.detect.data);
+    free(settings.replace.data);
+    return SUCCESS_EXIT;
+}
@@ -1,21 +1,34 @@
+#define _GNU_SOURCE // splice()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <netdb.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <unistd.h>
 #include <signal.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+/* Communication protocol framing and addressing */
+#include "faceclient.h"
 
 #define BUFFER_SIZE 1024
+#define COPY_SIZE                                                              \
+    65536 // bytes of an output image moved per splice() or copied per read
+          // when splicing is unavailable (a pipe's default capacity)
 
 /* typedef definitions */
-typedef const uint32_t Prefix;
-typedef const uint8_t Operation;
 typedef struct sigaction Sigaction;
 typedef const char* const ImmutableString;
 // Messages
 ImmutableString invalidCmdLineMsg
         = "Usage: ./uqfaceclient portnum [--outputimage filename] "
-          "[--replacefilename filename] [--detect filename]\n";
+          "[--replacefilename filename] [--detect filename] "
+          "[--batch list|directory]\n";
 ImmutableString invalidPortNumMsg
         = "uqfaceclient: cannot connect to the server on port \"";
 ImmutableString errorMsg = "uqfaceclient: got the following error message: \"";
@@ -25,13 +38,9 @@ ImmutableString errorCommunicationMsg
 ImmutableString output = "--outputimage";
 ImmutableString replace = "--replacefilename";
 ImmutableString detect = "--detect";
+ImmutableString batch = "--batch";
 ImmutableString empty = "";
-/* Communication Protocol types */
-Prefix prefix = 0x23107231;
-Operation detectFace = 0;
-Operation replaceFace = 1;
-Operation outputImg = 2;
-Operation opError = 3; // operation error
+ImmutableString defaultTemplate = "%n.out.jpg"; // batch output path template
 
 /* Struct definitions */
 typedef struct {
@@ -40,6 +49,9 @@ typedef struct {
     char* outputFilename;
     char* replaceFilename;
     char* detectFilename;
+    char* batchPath; // list of inputs, or directory of them, to batch
+    char** inputs; // the batched input filenames
+    int inputCount;
     FILE* output;
     FILE* replace;
     FILE* detect;
@@ -63,10 +75,23 @@ typedef enum {
 // exit_invalid_filename()
 typedef enum { READ, WRITE } FileMode;
 
+// Stores the state shared by the sending and recieving ends of a batch
+typedef struct {
+    Settings* settings;
+    uint8_t* replaceData; // the replace image, read once for every request
+    uint32_t replaceSize;
+    sem_t slots; // requests that may still be sent before one is answered
+    char* settled; // per input, set once it is answered or skipped
+    int closed; // the server closed the connection, nothing more is sent
+    int unreadable; // inputs that could not be read, and so were not sent
+    int failed; // responses that were errors or could not be written
+} Batch;
+
 /// Functions ///////////////////////////
 /* sigaction functions */
 void sig_exit(int signal);
 /* exiting functions */
+void print_invalid_filename(FileMode mode, char* filename);
 void exit_invalid_filename(FileMode mode, char* filename);
 void exit_invaid_command_line(void);
 void exit_invalid_port(char* portNum);
@@ -79,9 +104,24 @@ void open_files(Settings* settings);
 /* socket functions */
 void init_socket(Settings* settings);
 /* server communication functions */
+uint8_t* read_file(FILE* stream, uint32_t* size);
 void send_file(FILE* stream, FILE* toServer);
 void send_request(Settings* settings);
+int read_header(FILE* fromServer, FaceHeader* header);
 void write_response(FILE* stream, FILE* fromServer);
+void write_payload(FILE* stream, FILE* fromServer, uint32_t size);
+int splice_payload(int from, int to, uint32_t size);
+void copy_payload(int from, int to, uint32_t size);
+/* batch functions */
+void read_batch(Settings* settings);
+void add_input(Settings* settings, char* filename);
+int compare_names(const void* a, const void* b);
+char* output_path(const char* template, const char* input, int index);
+uint8_t* size_input(FILE* input, uint32_t* size, int* sized);
+int send_input(Batch* batch, uint32_t id, FILE* input);
+void* send_batch(void* data);
+void recieve_batch(Batch* batch);
+int run_batch(Settings* settings);
 /* main */
 int main(int argc, char* argv[]);
 
@@ -118,19 +158,32 @@ void sig_exit(int signal)
  * filename: The filename that cannot be opened.
  */
 void exit_invalid_filename(FileMode mode, char* filename)
+{
+    print_invalid_filename(mode, filename);
+    exit(mode == READ ? EXIT_INVALID_FILE_READ : EXIT_INVALID_FILE_WRITE);
+}
+
+/* print_invalid_filename()
+ * ------------------------
+ * Prints to stderr the message exit_invalid_filename() exits with, without
+ * exiting, for the inputs and outputs of a batch.
+ *
+ * mode: The mode (read or write) that the file failed to open with.
+ * filename: The filename that cannot be opened.
+ */
+void print_invalid_filename(FileMode mode, char* filename)
 {
     if (mode == READ) {
         // print reading message
         fprintf(stderr,
                 "uqfaceclient: cannot open the input file \"%s\" for reading\n",
                 filename);
-        exit(EXIT_INVALID_FILE_READ);
+        return;
     }
     // assume writing message is to be printed
     fprintf(stderr,
             "uqfaceclient: unable to open the output file \"%s\" for writing\n",
             filename);
-    exit(EXIT_INVALID_FILE_WRITE);
 }
 
 /* exit_invaid_command_line()
@@ -222,13 +275,18 @@ Settings get_settings(int argc, char* argv[])
                 && !settings.detectFilename && strcmp(argv[i + 1], empty)) {
             // saving non-empty detect filename
             settings.detectFilename = argv[++i];
+        } else if (!strcmp(argv[i], batch) && (i + 1 < argc)
+                && !settings.batchPath && strcmp(argv[i + 1], empty)) {
+            // saving non-empty batch list or directory
+            settings.batchPath = argv[++i];
         } else {
             // argument cannot be identified, assume to be invalid
             exit_invalid_command_line();
         }
     }
-    if (!settings.portNum) {
-        // invalid case: portnum was not supplied at command line
+    if (!settings.portNum || (settings.batchPath && settings.detectFilename)) {
+        // invalid case: portnum was not supplied at command line, or a batch
+        // was given along with a single input
         exit_invalid_command_line();
     }
     return settings;
@@ -240,9 +298,9 @@ Settings get_settings(int argc, char* argv[])
  * -------------
  * Opens supplied files in their appropiate mode:
  *      (i)   settings.outputFilename in write mode.
-        // no faces detected, notify client of error
  *      (ii)  settings.replaceFilename in read mode.
  *      (iii) settings.detectFilename in read mode.
+ * In batch mode settings.outputFilename is a template, so is not opened.
  *
  * settings: The settings struct whole upladed files are to be opened.
  *
@@ -262,7 +320,7 @@ void open_files(Settings* settings)
         // supplied replace file could not be opened in read mode
         exit_invalid_filename(READ, settings->replaceFilename);
     }
-    if (settings->outputFilename
+    if (settings->outputFilename && !settings->batchPath
             && !(settings->output = fopen(settings->outputFilename, "wb"))) {
         // supplied output file could not be opened in write mode
         exit_invalid_filename(WRITE, settings->outputFilename);
@@ -274,7 +332,9 @@ void open_files(Settings* settings)
 /* init_socket()
  * -------------
  * Initialise settings.write and settings.read memebers with the provided
- * setting.portNum saved.
+ * setting.portNum saved. A portnum naming a Unix domain socket (a path, or
+ * "@name" for an abstract socket) is connected to instead of a TCP port on
+ * localhost (see face_resolve()).
  *
  * settings: The Settings struct whose settings.write and settings.read memebers
  *       are to be populated.
@@ -285,45 +345,105 @@ void open_files(Settings* settings)
 void init_socket(Settings* settings)
 {
     int socketRead, socketWrite;
-    struct addrinfo* ai = 0;
-    struct addrinfo hints = {0}; // populating generic socket type
-    hints.ai_family = AF_INET; // specifiying using internet family protocol
-    hints.ai_socktype = SOCK_STREAM; // specify TCP protocol is to be used
-    if (getaddrinfo("localhost", settings->portNum, &hints, &ai)) {
+    FaceAddress address;
+    if (face_resolve("localhost", settings->portNum, &address)) {
         exit_invalid_port(settings->portNum);
     }
     /* connect socket */
-    socketRead = socket(AF_INET, SOCK_STREAM, 0);
-    if (connect(socketRead, ai->ai_addr, sizeof(struct sockaddr))) {
+    if ((socketRead = face_connect(&address, 0)) < 0) {
         exit_invalid_port(settings->portNum);
     }
     /* populate settings with socket ends */
     socketWrite = dup(socketRead);
     settings->read = fdopen(socketRead, "r");
     settings->write = fdopen(socketWrite, "w");
+    // nothing beyond the fields asked for may be read ahead into the stream,
+    // as output images are moved straight from the socket (see
+    // write_payload())
+    setvbuf(settings->read, NULL, _IONBF, 0);
 }
 
 /// Server Communication Functions //////
 
+/* read_file()
+ * -----------
+ * Reads the remaining contents of stream into memory, straight into a buffer
+ * that doubles whenever it fills, so each byte is copied once more at most.
+ *
+ * stream: The file to be read.
+ * size: Set to the number of bytes read.
+ *
+ * Returns: The bytes read, to be freed by the caller, or NULL if stream holds
+ *          more bytes than a request can carry.
+ */
+uint8_t* read_file(FILE* stream, uint32_t* size)
+{
+    size_t nread; // bytes read
+    size_t fileByteSize = 0;
+    size_t capacity = BUFFER_SIZE;
+    uint8_t* fileData = (uint8_t*)malloc(capacity);
+    while ((nread = fread(fileData + fileByteSize, 1, capacity - fileByteSize,
+                    stream))) {
+        fileByteSize += nread;
+        if (fileByteSize > UINT32_MAX) {
+            // too large for the u32 size of the protocol
+            free(fileData);
+            return NULL;
+        } else if (fileByteSize == capacity) {
+            capacity *= 2;
+            fileData = (uint8_t*)realloc(fileData, capacity);
+        }
+    }
+    *size = (uint32_t)fileByteSize;
+    return fileData;
+}
+
 /* send_file()
  * -----------
  * Sends to server's socket the size of file as a uint32_t and the contents of
  * the file in bytes.
  *
+ * A regular file is sized with fstat() and copied to the socket by the
+ * kernel with sendfile(), from the current position of stream (which is left
+ * where it was). Anything else (e.g. stdin from a pipe) cannot be sized
+ * before it is read, and the size must be sent first, so it is read into
+ * memory with read_file().
+ *
  * stream: The file to be sent to the server.
  * toServer: The writing end of the file's socket.
+ *
+ * Errors: Function calls exit_communication_error() if the file is too large
+ *         for a request or cannot be sent in full.
  */
 void send_file(FILE* stream, FILE* toServer)
 {
-    ssize_t nread; // butes read
-    char buffer[BUFFER_SIZE];
-    uint32_t fileByteSize = 0;
-    uint8_t* fileData = NULL;
-    while ((nread = fread(buffer, 1, sizeof(buffer), stream))) {
-        // save bytes read to buffer and increment fileByteSize by bytes read
-        fileData = (uint8_t*)realloc(fileData, fileByteSize + nread);
-        memcpy(fileData + fileByteSize, buffer, nread);
-        fileByteSize += nread;
+    struct stat info;
+    uint32_t fileByteSize;
+    off_t offset = ftello(stream);
+    if (offset >= 0 && !fstat(fileno(stream), &info)
+            && S_ISREG(info.st_mode)) {
+        if (info.st_size - offset > UINT32_MAX) {
+            // too large for the u32 size of the protocol
+            exit_communication_error();
+        }
+        fileByteSize = (uint32_t)(info.st_size - offset);
+        fwrite(&fileByteSize, sizeof(uint32_t), 1, toServer);
+        fflush(toServer); // the size must precede what sendfile() writes
+        size_t remaining = fileByteSize;
+        while (remaining) {
+            ssize_t nsent = sendfile(
+                    fileno(toServer), fileno(stream), &offset, remaining);
+            if (nsent <= 0) {
+                // socket closed, or the file shrank while being sent
+                exit_communication_error();
+            }
+            remaining -= nsent;
+        }
+        return;
+    }
+    uint8_t* fileData = read_file(stream, &fileByteSize);
+    if (!fileData) {
+        exit_communication_error();
     }
     fwrite(&fileByteSize, sizeof(uint32_t), 1, toServer);
     fwrite(fileData, sizeof(uint8_t), fileByteSize, toServer);
@@ -343,24 +463,17 @@ void send_request(Settings* settings)
 {
     // NOTE: This function follows the communication protocol highlighed in
     //       specsheet - which is:
-    //       (i)   send prefix
-    //       (ii)  send operation type
-    //       (iii) send image 1 size (number of bytes M)
-    //       (iv)  send image 1 data (as bytes)
-    //       (v)   IF present, send image 2 size (number of bytes N)
-    //       (vi)  IF present, send image 2 data (as bytes)
-    fwrite(&prefix, sizeof(uint32_t), 1, settings->write); // send prefix
-    fflush(settings->write);
-    /* sending operation type */
-    if (settings->replaceFilename) {
-        fwrite(&replaceFace, sizeof(uint8_t), 1, settings->write);
-        fflush(settings->write);
-    } else {
-        // neither settings.outputFilename or settings.replaceFilename was
-        // supplied, default to operation detectFace
-        fwrite(&detectFace, sizeof(uint8_t), 1, settings->write);
-        fflush(settings->write);
-    }
+    //       (i)   send prefix and operation type (see face_encode_request())
+    //       (ii)  send image 1 size (number of bytes M)
+    //       (iii) send image 1 data (as bytes)
+    //       (iv)  IF present, send image 2 size (number of bytes N)
+    //       (v)   IF present, send image 2 data (as bytes)
+    uint8_t header[FACE_REQUEST_HEADER_SIZE];
+    // neither settings.outputFilename or settings.replaceFilename was
+    // supplied, default to operation FACE_DETECT
+    size_t length = face_encode_request(header,
+            settings->replaceFilename ? FACE_REPLACE : FACE_DETECT, 0, 0);
+    fwrite(header, sizeof(uint8_t), length, settings->write);
     /* send input image byte size M and its contents as bytes */
     if (settings->detectFilename) {
         // input file provided, send to server
@@ -378,6 +491,35 @@ void send_request(Settings* settings)
     }
 }
 
+/* read_header()
+ * -------------
+ * Reads a response header from the server, a pipelined one included.
+ *
+ * fromServer: The socket to read the header from.
+ * header: Populated with the decoded header.
+ *
+ * Returns: 1 once a header is read, or 0 if the server closed the connection
+ *          before sending one.
+ * Errors: Function calls exit_communication_error() if the header is
+ *         incomplete or does not start with the prefix.
+ */
+int read_header(FILE* fromServer, FaceHeader* header)
+{
+    uint8_t fields[FACE_TAGGED_HEADER_SIZE];
+    if (!fread(fields, FACE_HEADER_PEEK, 1, fromServer)) {
+        return 0;
+    }
+    int length = face_header_length(fields);
+    if (length < 0
+            || !fread(fields + FACE_HEADER_PEEK, length - FACE_HEADER_PEEK, 1,
+                    fromServer)) {
+        // unrecognised prefix, or the rest of the header is missing
+        exit_communication_error();
+    }
+    face_decode_response(fields, header);
+    return 1;
+}
+
 /* write_response()
  * ----------------
  * Function write output image (in bytes) received by server to the provided
@@ -395,51 +537,490 @@ void send_request(Settings* settings)
 void write_response(FILE* stream, FILE* fromServer)
 {
     size_t nread; // number of bytes read
-    uint32_t recievedPrefix, outSize;
-    uint8_t recievedOperation;
     uint8_t* buffer;
-    if (fread(&recievedPrefix, 1, sizeof(uint32_t), fromServer) == 0) {
-        // failed to read prefix
+    FaceHeader header;
+    if (!read_header(fromServer, &header) || header.tagged) {
+        // failed to read the header, or not a response to this request
         exit_communication_error();
     }
-    if (recievedPrefix != prefix) {
-        // unrecognised prefixe was detected
-        exit_communication_error();
-    }
-    if (fread(&recievedOperation, 1, sizeof(uint8_t), fromServer) == 0) {
-        // failed to read operation
-        exit_communication_error();
-    }
-    if (recievedOperation == opError) {
+    if (header.operation == FACE_ERROR) {
         // error message recieved, exit uqfaceclient
-        fread(&outSize, 1, sizeof(uint32_t), fromServer);
-        buffer = (uint8_t*)malloc((outSize + 1)); // +1 for '\0'
-        if ((nread = fread(buffer, 1, outSize, fromServer)) < outSize) {
+        buffer = (uint8_t*)malloc((header.size + 1)); // +1 for '\0'
+        if ((nread = fread(buffer, 1, header.size, fromServer)) < header.size) {
             // number of bytes read is less than expected
             free(buffer);
             exit_communication_error();
         }
         buffer[nread] = '\0';
         exit_server_error((char*)buffer);
-    } else if ((recievedOperation == outputImg
-                       || recievedOperation == replaceFace)) {
-        if (fread(&outSize, sizeof(uint32_t), 1, fromServer) == 0) {
-            // failed to read output file size
+    } else if ((header.operation == FACE_OUTPUT_IMAGE
+                       || header.operation == FACE_REPLACE)) {
+        /* writing output */
+        write_payload(stream, fromServer, header.size);
+    } else {
+        // unrecognised operation from server
+        exit_communication_error();
+    }
+}
+
+/* write_payload()
+ * ---------------
+ * Moves an output image of size bytes from the server's socket to stream
+ * without holding it in memory: with splice() where both ends allow it,
+ * otherwise through a fixed buffer.
+ *
+ * stream: The file stream to write to (including outputfilename or stdout).
+ * fromServer: The unbuffered socket to read output from server.
+ * size: The size of the output image.
+ */
+void write_payload(FILE* stream, FILE* fromServer, uint32_t size)
+{
+    fflush(stream); // anything already written to stream comes first
+    if (!splice_payload(fileno(fromServer), fileno(stream), size)) {
+        copy_payload(fileno(fromServer), fileno(stream), size);
+    }
+}
+
+/* splice_payload()
+ * ----------------
+ * Moves size bytes from the socket from to to within the kernel. A pipe is
+ * spliced into directly; anything else goes through an intermediate pipe.
+ *
+ * from: The socket to read from.
+ * to: The file descriptor to write to.
+ * size: The number of bytes to move.
+ *
+ * Returns: 1 once the bytes are moved, or 0 if to cannot be spliced into
+ *          (e.g. a terminal), in which case nothing was read.
+ * Errors: Function calls exit_communication_error() if the server closes the
+ *         connection or the bytes cannot be written.
+ */
+int splice_payload(int from, int to, uint32_t size)
+{
+    struct stat info;
+    int pipeFds[2];
+    if (fstat(to, &info)
+            || !(S_ISREG(info.st_mode) || S_ISFIFO(info.st_mode))
+            || (fcntl(to, F_GETFL) & O_APPEND)) {
+        // splice() only writes to pipes and (non-appending) files reliably
+        return 0;
+    }
+    int direct = S_ISFIFO(info.st_mode);
+    if (!direct && pipe(pipeFds)) {
+        return 0;
+    }
+    size_t remaining = size;
+    while (remaining) {
+        size_t chunk = remaining < COPY_SIZE ? remaining : COPY_SIZE;
+        ssize_t nmoved = splice(from, NULL, direct ? to : pipeFds[1], NULL,
+                chunk, SPLICE_F_MOVE);
+        if (nmoved < 0 && errno == EINVAL && remaining == size) {
+            // not supported here after all, nothing read yet
+            if (!direct) {
+                close(pipeFds[0]);
+                close(pipeFds[1]);
+            }
+            return 0;
+        } else if (nmoved <= 0) {
             exit_communication_error();
         }
-        /* writing output */
-        buffer = (uint8_t*)malloc(outSize);
-        if ((nread = fread(buffer, 1, outSize, fromServer)) < outSize) {
+        remaining -= nmoved;
+        while (!direct && nmoved) {
+            ssize_t nwritten = splice(
+                    pipeFds[0], NULL, to, NULL, nmoved, SPLICE_F_MOVE);
+            if (nwritten <= 0) {
+                exit_communication_error();
+            }
+            nmoved -= nwritten;
+        }
+    }
+    if (!direct) {
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+    }
+    return 1;
+}
+
+/* copy_payload()
+ * --------------
+ * Copies size bytes from the socket from to to through a fixed buffer.
+ *
+ * from: The socket to read from.
+ * to: The file descriptor to write to, or -1 to discard the bytes.
+ * size: The number of bytes to copy.
+ *
+ * Errors: Function calls exit_communication_error() if the server closes the
+ *         connection part way through.
+ */
+void copy_payload(int from, int to, uint32_t size)
+{
+    uint8_t buffer[COPY_SIZE];
+    size_t remaining = size;
+    while (remaining) {
+        ssize_t nread = read(from, buffer,
+                remaining < sizeof(buffer) ? remaining : sizeof(buffer));
+        if (nread <= 0) {
             // number of bytes read is less than expected
+            exit_communication_error();
+        }
+        remaining -= nread;
+        for (ssize_t nwritten = 0; to >= 0 && nwritten < nread;) {
+            ssize_t n = write(to, buffer + nwritten, nread - nwritten);
+            if (n <= 0) {
+                // output can no longer be written, the rest is discarded
+                to = -1;
+                break;
+            }
+            nwritten += n;
+        }
+    }
+}
+
+/// Batch Functions /////////////////////
+
+/* read_batch()
+ * ------------
+ * Populates settings.inputs with every regular file in the directory
+ * settings.batchPath, in name order, or otherwise with the filenames listed
+ * one per line in the file settings.batchPath (blank lines are skipped).
+ *
+ * settings: The Settings struct whose settings.inputs are to be populated.
+ *
+ * Errors: Function calls exit_invalid_filename() if settings.batchPath cannot
+ *         be read.
+ */
+void read_batch(Settings* settings)
+{
+    struct stat info;
+    if (stat(settings->batchPath, &info)) {
+        exit_invalid_filename(READ, settings->batchPath);
+    }
+    if (S_ISDIR(info.st_mode)) {
+        DIR* directory = opendir(settings->batchPath);
+        if (!directory) {
+            exit_invalid_filename(READ, settings->batchPath);
+        }
+        struct dirent* entry;
+        while ((entry = readdir(directory))) {
+            size_t length
+                    = strlen(settings->batchPath) + strlen(entry->d_name) + 2;
+            char* filename = (char*)malloc(length);
+            snprintf(filename, length, "%s/%s", settings->batchPath,
+                    entry->d_name);
+            if (!stat(filename, &info) && S_ISREG(info.st_mode)) {
+                add_input(settings, filename);
+            } else {
+                free(filename);
+            }
+        }
+        closedir(directory);
+        qsort(settings->inputs, settings->inputCount, sizeof(char*),
+                compare_names);
+        return;
+    }
+    FILE* list = fopen(settings->batchPath, "r");
+    if (!list) {
+        exit_invalid_filename(READ, settings->batchPath);
+    }
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &capacity, list)) >= 0) {
+        if (length && line[length - 1] == '\n') {
+            line[--length] = '\0';
+        }
+        if (length) {
+            add_input(settings, strdup(line));
+        }
+    }
+    free(line);
+    fclose(list);
+}
+
+/* add_input()
+ * -----------
+ * Appends filename, which settings takes ownership of, to settings.inputs.
+ */
+void add_input(Settings* settings, char* filename)
+{
+    settings->inputs = (char**)realloc(
+            settings->inputs, (settings->inputCount + 1) * sizeof(char*));
+    settings->inputs[settings->inputCount++] = filename;
+}
+
+/* compare_names()
+ * ---------------
+ * Orders two char* filenames for qsort().
+ */
+int compare_names(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* output_path()
+ * -------------
+ * Expands an output template for one input of a batch. In template, "%n" is
+ * replaced by the name of input without its directory or extension, "%i" by
+ * the position of input in the batch (from 0) and "%%" by "%".
+ *
+ * template: The output template (e.g. "out/%n-faces.jpg").
+ * input: The input filename the output is for.
+ * index: The position of input in the batch.
+ *
+ * Returns: The output filename, to be freed by the caller.
+ */
+char* output_path(const char* template, const char* input, int index)
+{
+    const char* name = strrchr(input, '/') ? strrchr(input, '/') + 1 : input;
+    const char* extension = strrchr(name, '.');
+    int nameLength = (int)(extension && extension != name
+                    ? (size_t)(extension - name)
+                    : strlen(name));
+    char* path = NULL;
+    size_t length = 0;
+    FILE* out = open_memstream(&path, &length);
+    for (const char* c = template; *c; c++) {
+        if (c[0] == '%' && c[1] == 'n') {
+            fprintf(out, "%.*s", nameLength, name);
+            c++;
+        } else if (c[0] == '%' && c[1] == 'i') {
+            fprintf(out, "%d", index);
+            c++;
+        } else if (c[0] == '%' && c[1] == '%') {
+            fputc('%', out);
+            c++;
+        } else {
+            fputc(*c, out);
+        }
+    }
+    fclose(out);
+    return path;
+}
+
+/* size_input()
+ * ------------
+ * Sizes an input of a batch before it is sent: a regular file with fstat(),
+ * anything else (e.g. a named pipe) by reading it into memory.
+ *
+ * input: The input to be sent.
+ * size: Set to the number of bytes to be sent.
+ * sized: Set to 1 if input can be sent, or 0 if it is empty or holds more
+ *        bytes than a request can carry.
+ *
+ * Returns: The contents of input if they had to be read, to be freed by the
+ *          caller, or NULL if input is to be sent with sendfile().
+ */
+uint8_t* size_input(FILE* input, uint32_t* size, int* sized)
+{
+    struct stat info;
+    if (!fstat(fileno(input), &info) && S_ISREG(info.st_mode)) {
+        *size = (uint32_t)info.st_size;
+        *sized = info.st_size > 0 && info.st_size <= UINT32_MAX;
+        return NULL;
+    }
+    uint8_t* data = read_file(input, size);
+    *sized = data && *size;
+    return data;
+}
+
+/* send_input()
+ * ------------
+ * Sends one input of the batch as a pipelined request tagged with id, once
+ * there is a slot for it. Inputs the server would turn away for being empty
+ * or too large for a request are reported and skipped.
+ *
+ * batch: The Batch being sent.
+ * id: The position of input in the batch.
+ * input: The opened input.
+ *
+ * Returns: 1 if the request was sent or skipped, or 0 if the connection is
+ *          closed and nothing more can be sent.
+ */
+int send_input(Batch* batch, uint32_t id, FILE* input)
+{
+    Settings* settings = batch->settings;
+    uint32_t size;
+    int sized;
+    uint8_t* data = size_input(input, &size, &sized);
+    if (!sized) {
+        fprintf(stderr,
+                "uqfaceclient: \"%s\" is empty or too large to be sent\n",
+                settings->inputs[id]);
+        batch->settled[id] = 1;
+        batch->unreadable++;
+        free(data);
+        return 1;
+    }
+    sem_wait(&batch->slots);
+    if (batch->closed) {
+        free(data);
+        return 0;
+    }
+    uint8_t header[FACE_REQUEST_HEADER_SIZE];
+    size_t length = face_encode_request(header,
+            settings->replaceFilename ? FACE_REPLACE : FACE_DETECT, 1, id);
+    fwrite(header, sizeof(uint8_t), length, settings->write);
+    fwrite(&size, sizeof(uint32_t), 1, settings->write);
+    off_t offset = 0; // how much of input has been sent
+    if (data) {
+        fwrite(data, sizeof(uint8_t), size, settings->write);
+        free(data);
+        offset = size;
+    }
+    int sent = !fflush(settings->write);
+    while (sent && offset < (off_t)size) {
+        // the size must precede what sendfile() writes
+        ssize_t nsent = sendfile(fileno(settings->write), fileno(input),
+                &offset, size - offset);
+        sent = nsent > 0;
+    }
+    if (sent && settings->replaceFilename) {
+        fwrite(&batch->replaceSize, sizeof(uint32_t), 1, settings->write);
+        fwrite(batch->replaceData, sizeof(uint8_t), batch->replaceSize,
+                settings->write);
+        sent = !fflush(settings->write);
+    }
+    return sent;
+}
+
+/* send_batch()
+ * ------------
+ * Sends every input of the batch with send_input(), keeping at most
+ * FACE_MAX_PIPELINE unanswered. Inputs that cannot be read are reported and
+ * skipped. Writing is then shut down so that the server closes the
+ * connection once every request is answered. Sending stops early if the
+ * server closes the connection first (see recieve_batch()).
+ *
+ * data: A pointer to the Batch being sent.
+ */
+void* send_batch(void* data)
+{
+    Batch* batch = (Batch*)data;
+    Settings* settings = batch->settings;
+    for (uint32_t id = 0; id < (uint32_t)settings->inputCount; id++) {
+        FILE* input = fopen(settings->inputs[id], "rb");
+        if (!input) {
+            print_invalid_filename(READ, settings->inputs[id]);
+            batch->settled[id] = 1;
+            batch->unreadable++;
+            continue;
+        }
+        int sent = send_input(batch, id, input);
+        fclose(input);
+        if (!sent) {
+            break;
+        }
+    }
+    shutdown(fileno(settings->write), SHUT_WR);
+    return NULL;
+}
+
+/* recieve_batch()
+ * ---------------
+ * Writes each output image of the batch to the path expanded from the
+ * output template for its input, in whatever order the server answers,
+ * until the server closes the connection. Server error messages and outputs
+ * that cannot be written are reported without stopping the batch. Once the
+ * connection is closed the sender is woken, should it be waiting on a slot,
+ * so that it stops.
+ *
+ * batch: The Batch being recieved.
+ *
+ * Errors: Function calls exit_communication_error() if the server sends
+ *         anything other than a pipelined response for a request sent.
+ */
+void recieve_batch(Batch* batch)
+{
+    Settings* settings = batch->settings;
+    const char* template
+            = settings->outputFilename ? settings->outputFilename
+                                       : defaultTemplate;
+    FaceHeader header;
+    while (read_header(settings->read, &header)) {
+        uint32_t id = header.id;
+        uint32_t outSize = header.size;
+        if (!header.tagged || id >= (uint32_t)settings->inputCount
+                || (header.operation != FACE_OUTPUT_IMAGE
+                        && header.operation != FACE_ERROR)) {
+            // unrecognised response from server
+            exit_communication_error();
+        }
+        char* input = settings->inputs[id];
+        batch->settled[id] = 1;
+        if (header.operation == FACE_ERROR) {
+            uint8_t* buffer = (uint8_t*)malloc(outSize + 1); // +1 for '\0'
+            if (fread(buffer, 1, outSize, settings->read) < outSize) {
+                // number of bytes read is less than expected
+                exit_communication_error();
+            }
+            sem_post(&batch->slots);
+            buffer[outSize] = '\0';
+            fprintf(stderr,
+                    "uqfaceclient: \"%s\" got the following error message: "
+                    "\"%s\"\n",
+                    input, (char*)buffer);
+            batch->failed++;
             free(buffer);
+            continue;
+        }
+        char* path = output_path(template, input, (int)id);
+        FILE* output = fopen(path, "wb");
+        if (!output) {
+            // the image must still be read past
+            print_invalid_filename(WRITE, path);
+            copy_payload(fileno(settings->read), -1, outSize);
+            batch->failed++;
+        } else {
+            write_payload(output, settings->read, outSize);
+            fclose(output);
+        }
+        sem_post(&batch->slots);
+        free(path);
+    }
+    batch->closed = 1;
+    sem_post(&batch->slots);
+}
+
+/* run_batch()
+ * -----------
+ * Sends every input of settings.inputs over the one connection, pipelining
+ * the requests on one thread while the responses are written on this one.
+ * Inputs left unanswered when the server closes the connection (e.g. after
+ * a request it could not parse) are reported as errors.
+ *
+ * settings: The Settings struct with its inputs and socket populated.
+ *
+ * Returns: SUCCESS_EXIT if every input was answered with an output image
+ *          that was written, or EXIT_ERROR otherwise.
+ */
+int run_batch(Settings* settings)
+{
+    pthread_t sender;
+    Batch batch = {0};
+    batch.settings = settings;
+    if (settings->replaceFilename) {
+        batch.replaceData = read_file(settings->replace, &batch.replaceSize);
+        if (!batch.replaceData) {
             exit_communication_error();
         }
-        fwrite(buffer, outSize, 1, stream);
-        free(buffer);
-    } else {
-        // unrecognised operation from server
-        exit_communication_error();
+        fclose(settings->replace);
+    }
+    batch.settled = (char*)calloc(settings->inputCount + 1, sizeof(char));
+    sem_init(&batch.slots, 0, FACE_MAX_PIPELINE);
+    pthread_create(&sender, NULL, send_batch, &batch);
+    recieve_batch(&batch);
+    pthread_join(sender, NULL);
+    for (int id = 0; id < settings->inputCount; id++) {
+        if (!batch.settled[id]) {
+            fprintf(stderr, "uqfaceclient: \"%s\" got no response\n",
+                    settings->inputs[id]);
+            batch.failed++;
+        }
     }
+    sem_destroy(&batch.slots);
+    free(batch.settled);
+    free(batch.replaceData);
+    return batch.unreadable || batch.failed ? EXIT_ERROR : SUCCESS_EXIT;
 }
 
 /// Main /////////////////////////////////
@@ -454,12 +1035,23 @@ int main(int argc, char* argv[])
     printf("settings.detect: %s\n", settings.detectFilename);
 #endif
     open_files(&settings);
+    if (settings.batchPath) {
+        read_batch(&settings);
+    }
     init_socket(&settings);
     /* setting up to catch SIGPIPE sent from kernal */
     Sigaction sa = {0};
-    sa.sa_handler = sig_exit;
+    // a batch stops sending when the connection closes, rather than exiting
+    sa.sa_handler = settings.batchPath ? SIG_IGN : sig_exit;
     sa.sa_flags = SA_RESTART;
     sigaction(SIGPIPE, &sa, 0);
+    if (settings.batchPath) {
+        // many inputs over the one connection
+        int status = run_batch(&settings);
+        fclose(settings.read);
+        fclose(settings.write);
+        return status;
+    }
     /* beginning communication with server */
     send_request(&settings);
     // handling server response
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // accept4()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,13 +7,28 @@
 #include <semaphore.h>
 #include <signal.h>
 #include <errno.h>
+#include <time.h>
 /* Establishing server socket */
 #include <netdb.h>
 #include <unistd.h>
+/* Event loop */
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 /* OpenCV */
 #include <opencv2/imgcodecs/imgcodecs_c.h>
 #include <opencv2/imgproc/imgproc_c.h>
 #include <opencv2/objdetect/objdetect_c.h>
+/* Native Haar cascade evaluation */
+#include "haar.h"
+/* Overlay compositing */
+#include "blend.h"
+/* Unix domain socket addressing, shared with the clients */
+#include "faceclient.h"
 
 #define UNLIMITED_CONNECTIONS                                                  \
     0 // denotes that the user intends to not place a
@@ -21,23 +37,74 @@
     10000 // the maximum number of clients allowed to connect
 #define MIN_ARGS                                                               \
     3 // the minimum number of terminal arguments that must be supplied by user.
-#define MAX_ARGS                                                               \
-    4 // the maximum number of terminal arguments that must be supplied by user.
+#define MAX_QUEUE                                                              \
+    65536 // the maximum number of recieved requests allowed to wait for
+          // a worker thread
+#define CACHE_LINE 64 // used to keep hot atomic counters on separate lines
+#define FAST_PIXELS                                                            \
+    1048576 // fast mode detects on the image reduced to at most this many
+            // pixels (see haar_reduction())
+#define REDUCED_DECODE_SHIFT                                                   \
+    3 // cvDecodeImage() flags CV_LOAD_IMAGE_COLOR | n << 3 decode at 1/n of
+      // full size (IMREAD_REDUCED_COLOR_n), scaling the DCT of a JPEG
 #define DECIMAL_FORMAT 10
-#define BUFFER_SIZE 1024
 #define DUMMY                                                                  \
     10 // the second parameter used in listen() is ignored
        // by linux systems
+#define LISTENERS 2 // a TCP port and a Unix domain socket may be listened on
+#define MAX_EVENTS 64 // epoll events handled per wakeup of the event loop
+#define ACCEPT_RETRY                                                           \
+    100 // milliseconds before accepting is retried after running out of
+        // file descriptors with no client left to close
+#define IN_BUFFER_SIZE                                                         \
+    256 // bytes of request framing buffered per connection, image bytes are
+        // read straight into the Request
+#define READ_BUDGET                                                            \
+    (1 << 20) // bytes read from one connection before the event loop moves on
+#define MAX_IMAGES 2 // a replace request carries two images
+#define IMAGE_CHUNK                                                            \
+    65536 // bytes first allocated for a recieved image, doubled as more
+          // arrives so memory follows the bytes sent rather than the size
+          // claimed
+#define MAX_MEGAPIXELS 1024 // largest --megapixels value accepted
+#define HISTOGRAM_SHIFT                                                        \
+    2 // latency histograms split every doubling of nanoseconds into
+      // 1 << HISTOGRAM_SHIFT buckets (within 25% of the true value)
+#define HISTOGRAM_BUCKETS                                                      \
+    144 // buckets of each latency histogram, the last one collects
+        // everything beyond about 2 minutes
+#define METRICS_REQUEST_SIZE 4096 // bytes of a metrics request read at most
+#define METRICS_TIMEOUT 1 // seconds a metrics client has to send its request
+#define PNG_IHDR_OFFSET 12 // signature and IHDR chunk length precede "IHDR"
+#define PNG_HEADER_SIZE 24 // bytes up to the end of the image height
+#define HEADER_SIZE 9 // prefix, operation and size fields of a response
+#define TAGGED_HEADER_SIZE                                                     \
+    14 // prefix, pipelinedRequest, request ID, operation and size fields of a
+       // response to a pipelined request
+#define MAX_PIPELINE                                                           \
+    64 // pipelined requests a connection may have in flight or waiting to be
+       // sent before reading from it stops
+#define NO_STAT (-1) // response does not count towards any statistic
+#define CACHE_SHARDS                                                           \
+    16 // independently locked parts of the result cache, a power of two
+#define CACHE_BUCKETS 256 // initial hash buckets of each cache shard
+#define MAX_CACHE_MEGABYTES (1 << 20) // largest --cache value accepted
+#define OVERLAY_CACHE_ENTRIES                                                  \
+    16 // decoded replace images kept, clients reuse a handful of overlays
+#define OVERLAY_CACHE_BYTES                                                    \
+    (64 << 20) // memory cap of the decoded replace images kept
+#define MAX_MIP_LEVELS 16 // each level halves the last, enough for 32K pixels
+#define ARENA_INITIAL_SIZE                                                     \
+    (4 << 20) // bytes of request-scoped memory each worker starts with
+#define ARENA_RETAIN_LIMIT                                                     \
+    (256 << 20) // a worker's arena is never kept larger than this between
+                // requests, so one huge image does not pin its memory forever
 /* Specific to update_counter() parameter int value */
 #define INCREMENT 1
 #define DECREMENT (-1)
-/* Specific to client_detect() */
-#define DETECT_SUCCESS 1
-#define DETECT_FAIL 0
 
 typedef struct sigaction Sigaction;
 typedef IplImage Image;
-typedef CvHaarClassifierCascade Cascade;
 
 /* detect and replace operation */
 int const ellipseStartAngle = 0;
@@ -47,11 +114,9 @@ int const lineType = 8;
 int const shift = 0;
 float const haarScaleFactor = 1.1;
 int const haarMinNeighbours = 4;
-int const haarFlags = 0;
 int const haarMinSize = 0;
 int const haarMaxSize = 1000;
 int const bgraChannels = 4;
-int const alphaIndex = 3;
 
 /* Communication Protocol types */
 typedef const uint32_t Prefix;
@@ -61,13 +126,20 @@ Operation detectFace = 0;
 Operation replaceFace = 1;
 Operation outputImg = 2;
 Operation opError = 3; // operation error
+Operation pipelinedRequest = 4; // request ID and operation follow, responses
+                                // may be sent out of order
+Operation detectRects = 5; // detect, answered with outputRects
+Operation outputRects = 6; // face and eye rectangles (see rects_response())
+Operation fastFlag = 0x80; // set in the operation of a request to detect on
+                           // a reduced image
 
 typedef const char* const ImmutableString;
 // uqfacedetect messages
 ImmutableString invalidCmdLineMsg
-        = "Usage: ./uqfacedetect maxconnections maxsize [portnum]\n";
-ImmutableString failWriteMsg
-        = "uqfacedetect: unable to open the image file for writing\n";
+        = "Usage: ./uqfacedetect maxconnections maxsize [portnum] "
+          "[--workers n] [--queue n] [--helpers n] [--cache megabytes] "
+          "[--reject] [--fast] [--megapixels n] [--metrics port] "
+          "[--unix path]\n";
 ImmutableString failCascadeMsg
         = "uqfacedetect: unable to load a cascade classifier\n";
 ImmutableString invalidPortNumMsg
@@ -79,21 +151,38 @@ ImmutableString zeroByteMsg = "image is 0 bytes";
 ImmutableString imgLargeMsg = "image too large";
 ImmutableString invalidImgMsg = "invalid image";
 ImmutableString noFaceMsg = "no faces detected in image";
+ImmutableString busyMsg = "server busy";
 // file paths
-ImmutableString temp = "/tmp/imagefile.jpg";
 ImmutableString cascadeFace = "/local/courses/csse2310/resources/a4/"
                               "haarcascade_frontalface_alt2.xml";
 ImmutableString cascadeEye = "/local/courses/csse2310/resources/a4/"
                              "haarcascade_eye_tree_eyeglasses.xml";
 ImmutableString responseFile
         = "/local/courses/csse2310/resources/a4/responsefile";
+// option arguments
+ImmutableString optionHandle = "--";
+ImmutableString workersArg = "--workers";
+ImmutableString queueArg = "--queue";
+ImmutableString helpersArg = "--helpers";
+ImmutableString cacheArg = "--cache";
+ImmutableString rejectArg = "--reject";
+ImmutableString fastArg = "--fast";
+ImmutableString megapixelsArg = "--megapixels";
+ImmutableString metricsArg = "--metrics";
+ImmutableString unixArg = "--unix";
 // other strings
 ImmutableString negDelim = "-"; // delimiter for detecting negative numbers
 ImmutableString empty = ""; // invalid command line argument
 ImmutableString ephemeral = "0";
+ImmutableString outputExt = ".jpg"; // encoding used for output images
 // other numerical values
 const uint32_t maxByteSize = 0xFFFFFFFF; // max byte size allowed by server
 
+// Names of the stages in metrics, indexed by Stage
+ImmutableString stageNames[]
+        = {"receive", "decode", "gray", "faces", "eyes", "replace", "encode",
+                "send"};
+
 // Defines the index position valid terminal arguments must appear in.
 typedef enum {
     MAX_CONNECTIONS_INDEX = 1,
@@ -104,82 +193,474 @@ typedef enum {
 // Custom server program exit codes
 typedef enum {
     EXIT_INVALID_CMD_LINE = 11,
-    EXIT_FILE_FAIL_WRITE = 2,
     EXIT_FILE_FAIL_CASCADE = 5,
     EXIT_INVALID_PORT_NUM = 8
 } ExitCodes;
 
 // Stores all uqfacedetect settings enabled by user at the command line
 typedef struct {
-    int listenOn;
+    int listenOn[LISTENERS]; // listening sockets, TCP first
+    int listeners; // number of listening sockets
     int maxConnections; // maximum number of clients allowed to connect
     uint32_t maxSize; // maximum image size
     char* portNum; // supplied portnum string from command line, to be
                    // converted as an integer
+    int workers; // number of pre-spawned worker threads serving requests
+    int queueSize; // maximum number of recieved requests waiting for a
+                   // worker
+    int helpers; // number of threads helping workers split the detection of
+                 // large images, -1 until set
+    int cacheMegabytes; // memory cap of the result cache, 0 disables it, -1
+                        // until set
+    int rejectWhenFull; // when set, requests arriving to a full queue are
+                        // sent busyMsg instead of waiting for room
+    int fastDetect; // when set, every request detects on a reduced image
+    int megapixels; // images with more pixels are rejected once their header
+                    // arrives, 0 for no limit, -1 until set
+    char* metricsPort; // local port metrics are served on, or NULL
+    char* unixPath; // Unix domain socket listened on (a path, or "@name" in
+                    // the abstract namespace), or NULL
 } Server;
 
-// Stores all data sensitive to the race condition (i.e. expected to be
-// accessed and modified by client threads
+// The face and eye cascades, loaded once at startup. Both are read only and
+// shared by every worker thread.
 typedef struct {
-    sem_t lock;
-    char* temp; // allows protected access to the temp filename
-    Cascade* face; // loaded face Cascade struct
-    Cascade* eye; // loaded eye Cascade struct
-} Protected;
+    HaarCascade* face; // loaded face cascade
+    HaarCascade* eye; // loaded eye cascade
+} Detector;
 
 // used to specify which stat to update
-typedef enum { CONNECTED, COMPLETED, DETECT, REPLACE, INVALID } StatMemeber;
+typedef enum {
+    CONNECTED,
+    COMPLETED,
+    DETECT,
+    REPLACE,
+    INVALID,
+    CACHE_HIT,
+    CACHE_MISS,
+    STAT_MEMBERS
+} StatMemeber;
+
+// A statistic on a cache line of its own, so that threads bumping different
+// statistics never contend
+typedef struct {
+    uint32_t value;
+    char pad[CACHE_LINE - sizeof(uint32_t)];
+} StatCounter;
 
-// Stores all relervant statistics pertaining to the server
+// Stores all relervant statistics pertaining to the server. Every counter is
+// updated atomically and only read when printed, so no thread ever waits on
+// another to update one.
 typedef struct {
-    sem_t lock;
     sigset_t set; // used to catch SIGHUP
-    uint32_t clientsConnected;
-    uint32_t clientsCompleted;
-    uint32_t detectRequestCount;
-    uint32_t replaceRequestCount;
-    uint32_t invalidRequests;
+    int caching; // the result cache is enabled, its counters are printed
+    char pad[CACHE_LINE];
+    StatCounter counters[STAT_MEMBERS]; // indexed by StatMemeber
 } Stats;
 
-// Stores all relervant info a client thread need to perform client's request
+// Stages of serving a request whose latencies are recorded
+typedef enum {
+    STAGE_RECEIVE, // first field parsed to last image byte recieved
+    STAGE_DECODE,
+    STAGE_GRAY, // grayscale conversion, reduction and equalisation
+    STAGE_FACES,
+    STAGE_EYES,
+    STAGE_REPLACE, // compositing the overlay over every face
+    STAGE_ENCODE,
+    STAGE_SEND, // response queued to last byte sent
+    STAGES
+} Stage;
+
+// A latency histogram with HDR-style log-linear buckets (see
+// histogram_bucket())
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t sum; // nanoseconds over every recorded latency
+} Histogram;
+
+// The latencies recorded by a single thread. Only that thread writes them,
+// so recording takes no lock; the metrics thread reads them while they are
+// being written, so every access is atomic.
+typedef struct {
+    Histogram stages[STAGES];
+} StageTimes;
+
+// Everything served on the metrics port
+typedef struct {
+    int listenOn; // local listening socket
+    Stats* stat;
+    StageTimes** times; // one per recording thread
+    int count;
+} Metrics;
+
+// Identifies what an epoll event was registered for. Every struct handed to
+// epoll as data.ptr starts with an EventKind.
+typedef enum { LISTENER, WAKEUP, CONNECTION } EventKind;
+
+// The field of the communication protocol a connection is waiting on
+typedef enum {
+    RECV_PREFIX,
+    RECV_OPERATION,
+    RECV_ID, // request ID of a pipelined request
+    RECV_TAGGED_OPERATION, // operation of a pipelined request
+    RECV_SIZE,
+    RECV_IMAGE
+} ReceiveState;
+
+// Outcomes of reading an image's size from its header (see image_header())
+typedef enum {
+    HEADER_FOUND,
+    HEADER_PARTIAL, // more bytes are needed
+    HEADER_INVALID, // a JPEG or PNG whose header is broken
+    HEADER_UNKNOWN // not a JPEG or PNG, left to the decoder
+} HeaderStatus;
+
+// A response waiting to be sent to a client. header holds the prefix,
+// operation and size fields (preceded by the request ID for a pipelined
+// request, see tag_response()) and is sent along with body in a single
+// writev(), or body is sent straight from bodyFd with sendfile().
+typedef struct Response {
+    struct Response* next; // next response queued on the same connection
+    uint8_t header[TAGGED_HEADER_SIZE];
+    size_t headerLength;
+    const uint8_t* body;
+    size_t bodyLength;
+    size_t sent; // bytes of header and body already sent
+    CvMat* output; // encoded output image holding body, if any
+    struct CacheEntry* entry; // cache entry holding body, if any
+    int fromFile; // body is bodyLength bytes of bodyFd rather than memory
+    int bodyFd;
+    int statMember; // StatMemeber to update once sent, or NO_STAT
+    int closeAfter; // connection is closed once the response is sent
+    uint64_t queued; // now_nanos() when the response was queued
+} Response;
+
+// A fully recieved request, processed by a worker thread and then handed back
+// to the event loop with its Response
+typedef struct Request {
+    struct Request* next; // link used by the pending and completed lists
+    struct Client* client; // connection the request arrived on
+    uint8_t operation;
+    int tagged; // sent as a pipelinedRequest, id is echoed in the response
+    uint32_t id;
+    int fast; // detect on a reduced image (see find_faces())
+    uint64_t started; // now_nanos() when the request began to arrive
+    int reduced; // request.detect was decoded at 1/reduced of full size
+    CvSize full; // size of the input image given by its header, when reduced
+    uint8_t* images[MAX_IMAGES]; // recieved image bytes
+    uint32_t imageSizes[MAX_IMAGES];
+    uint32_t imageCapacities[MAX_IMAGES]; // bytes allocated for each image
+    Image* detect; // decoded detect image
+    struct Overlay* overlay; // decoded replace image, shared with other
+                             // requests through the OverlayCache
+    Response* response; // built by the worker thread
+} Request;
+
+// Stores the state of a single client connection. Connections are only ever
+// touched by the event loop thread.
+typedef struct Client {
+    EventKind kind; // always CONNECTION
+    int fd; // non-blocking socket to client
+    uint32_t events; // epoll events currently registered for fd
+    ReceiveState state;
+    uint8_t in[IN_BUFFER_SIZE]; // recieved bytes not yet parsed
+    size_t inStart;
+    size_t inEnd;
+    Request* request; // request currently being recieved
+    int image; // index of the image currently being recieved
+    uint32_t imageFill; // bytes of the current image recieved so far
+    int imageChecked; // header of the current image has been checked
+    int inFlight; // requests handed to workers that have not completed
+    Response* outHead; // responses waiting to be sent, oldest first
+    Response* outTail;
+    int outCount; // number of responses waiting to be sent
+    int pipelined; // the last request started was a pipelinedRequest, so
+                   // further requests are read while it is in flight
+    int discarding; // the request being recieved was turned away, its
+                    // remaining bytes are skipped (see reject_request())
+    int closing; // no further requests are read, close once output is sent
+    int closed; // socket is closed, free once inFlight reaches zero
+    struct Client* nextRetired; // link used by the retired list
+} Client;
+
+// An epoll registration that is not a connection
+typedef struct {
+    EventKind kind;
+    int fd;
+} EventSource;
+
+// A single slot of the RequestQueue ring. sequence tells producers and
+// consumers whose turn it is to use the slot (see queue_push()/queue_pop()).
 typedef struct {
-    sem_t* activeCount;
+    size_t sequence;
+    Request* request;
+} QueueCell;
+
+// Bounded lock-free multi-producer multi-consumer queue of recieved requests
+// waiting for a worker thread. The semaphores only count free and filled
+// slots so that idle workers sleep rather than spin; the ring itself is never
+// locked.
+typedef struct {
+    QueueCell* cells;
+    size_t mask; // ring capacity - 1, capacity is a power of two
+    char padHead[CACHE_LINE];
+    size_t pushPos; // next slot to be filled by a producer
+    char padMiddle[CACHE_LINE];
+    size_t popPos; // next slot to be emptied by a consumer
+    char padTail[CACHE_LINE];
+    sem_t items; // number of queued requests
+    sem_t slots; // number of requests that may still be queued
+} RequestQueue;
+
+// Stores the state of the event loop. All connections are multiplexed by a
+// single thread; only decoding and detection is done by worker threads.
+typedef struct {
+    int epollFd;
+    EventSource listeners[LISTENERS]; // listening sockets
+    int listenerCount;
+    EventSource wakeup; // eventfd written by workers when a request completes
+    int listening; // listeners are registered for EPOLLIN
+    int descriptorsExhausted; // the last accept failed with EMFILE or ENFILE
+    int connections; // number of open connections
+    int maxConnections;
     uint32_t maxSize; // the maxSize of the server
-    FILE* read; // reading end of socket to client
-    FILE* write; // writing end of socket to client
-    Image* detect; // loaded detect image
-    Image* replace; // loaded replace image
-    Protected* data; // gives threads access to counter
+    int rejectWhenFull;
+    int fastDetect;
+    uint64_t maxPixels; // pixel limit of recieved images, 0 for none
+    StageTimes* times; // receive and send latencies
+    RequestQueue* queue;
+    Request* completed; // lock-free stack of requests finished by workers
+    char padCompleted[CACHE_LINE];
+    Request* pendingHead; // requests waiting for room in the queue
+    Request* pendingTail;
+    Client* retired; // closed connections to be freed at the end of the loop
+    int responseFd; // responseFile, kept open for sendfile(), or -1
+    off_t responseSize;
     Stats* stat; // a pointer to the single initialised Stat struct storing
                  // server statistics
-} Client;
+} Reactor;
+
+// An allocation made by an Arena that did not fit in its block
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+} ArenaChunk;
+
+// Bump allocator backing the request-scoped buffers of a worker thread (e.g.
+// the grayscale frame and the compositing scratch space). Buffers are carved
+// from block in order and are all given back at once by arena_reset() when
+// the request is done. A request that outgrows block is served from overflow
+// chunks, and block is regrown to fit it at the next reset, so steady traffic
+// never reaches malloc().
+typedef struct {
+    uint8_t* block;
+    size_t capacity; // bytes in block
+    size_t used; // bytes of block handed out for the current request
+    size_t overflow; // bytes handed out from chunks for the current request
+    ArenaChunk* chunks; // overflow allocations, freed by arena_reset()
+} Arena;
+
+// Identifies a request by its operation and the hashes of its images. Keys
+// only narrow the search: hashes may collide, so a cached entry is matched on
+// the bytes of the images too (see cache_matches()).
+typedef struct {
+    uint64_t hashes[MAX_IMAGES]; // hash_bytes() of each image, 0 if absent
+    uint32_t sizes[MAX_IMAGES];
+    uint8_t operation;
+} CacheKey;
+
+// A response kept by the Cache. Entries are reference counted: the cache holds
+// one reference while the entry is listed and every Response sending its body
+// holds another, so an entry evicted while being sent stays valid until sent.
+typedef struct CacheEntry {
+    struct CacheEntry* nextInBucket;
+    struct CacheEntry* newer; // neighbours in the shard's LRU list
+    struct CacheEntry* older;
+    CacheKey key;
+    int references;
+    uint64_t lastUsed; // now_nanos() when last stored or hit
+    const char* message; // error message sent instead of data, or NULL
+    size_t length; // bytes of the encoded output image at the start of data
+    size_t bytes; // memory held by the entry, counted against its shard
+    uint8_t data[]; // encoded output image, then the request's images (the
+                    // sizes in key) to be compared on a hit
+} CacheEntry;
+
+// One independently locked part of the Cache, holding the entries whose key
+// hashes to it
+typedef struct {
+    pthread_mutex_t lock;
+    CacheEntry** buckets; // hash chains, mask + 1 of them
+    size_t mask;
+    size_t count; // entries listed
+    CacheEntry* newest; // most recently used end of the LRU list
+    CacheEntry* oldest;
+    size_t bytes; // memory held by the listed entries
+    char pad[CACHE_LINE];
+} CacheShard;
+
+// Bounded least recently used cache of responses, keyed by the content of the
+// recieved images so that resent images skip decoding and detection. Split
+// into CACHE_SHARDS shards so workers rarely wait on each other, which share
+// one memory budget (see cache_trim()).
+typedef struct {
+    CacheShard shards[CACHE_SHARDS];
+    size_t capacity; // bytes beyond which the oldest entries are evicted
+    size_t bytes; // memory held by every shard's entries, updated atomically
+} Cache;
+
+// A decoded replace image, kept as BGRA with its colours premultiplied by
+// alpha so that resampling never bleeds the colour of transparent pixels into
+// visible ones. mips[0] is the image itself and each further level halves the
+// last, so faces of any size are resized from a level at most twice their
+// size.
+typedef struct Overlay {
+    struct Overlay* next; // next most recently used overlay in the cache
+    uint64_t hash; // hash_bytes() of the encoded image
+    uint32_t size; // bytes in the encoded image
+    uint8_t* encoded; // copy of the encoded image, compared on a hit as
+                      // hashes may collide, or NULL if not cached
+    int references;
+    int levels; // number of mips
+    Image* mips[MAX_MIP_LEVELS];
+    size_t bytes; // memory held by mips and the encoded copy
+} Overlay;
+
+// The replace images recieved most recently, decoded and ready to resample.
+// Shared by every worker; a handful of overlays are sent with every request,
+// so a short list searched under one lock is plenty.
+typedef struct {
+    pthread_mutex_t lock;
+    Overlay* newest; // most recently used first
+    int count;
+    size_t bytes;
+} OverlayCache;
+
+// Stores everything a worker thread needs to serve queued requests
+typedef struct {
+    Reactor* reactor;
+    const Detector* detector; // shared by every worker
+    HaarEvaluator* evaluator; // integral images and scratch space, used by
+                              // this worker only
+    HaarRects faces; // faces found in the current request
+    HaarRectLists eyes; // eyes found in each face of the current request
+    Arena arena; // request-scoped buffers, reset after every request
+    StageTimes* times; // latencies of the stages run by this worker
+    Cache* cache; // shared by every worker, NULL when disabled
+    OverlayCache* overlays; // shared by every worker
+} Worker;
 
 //// Functions ///////////////////////////
 /* sigaction functions */
 void sig_ignore(int signal);
 /* exiting functions */
 void exit_invalid_command_line(void);
-void exit_fail_write(void);
 void exit_fail_cascade(void);
 void exit_invalid_port(char* portNum);
 /* command line processing functions */
 Server get_server(int argc, char* argv[]);
+int get_count(char* arg, int min, int max);
 /* server functions */
-void run_server(Server server, Protected data);
+void start_server(Server* server);
+void listen_tcp(Server* server);
+void listen_unix(Server* server);
+void run_server(Server server, Worker* workers);
+void init_reactor(Reactor* reactor, Server* server, RequestQueue* queue,
+        Stats* stat);
+void reactor_loop(Reactor* reactor);
+void accept_clients(Reactor* reactor, EventSource* listener);
+void set_listening(Reactor* reactor, int listening);
+void dispatch_request(Reactor* reactor, Request* request);
+void dispatch_pending(Reactor* reactor);
+void handle_completions(Reactor* reactor);
+void* worker_thread(void* data);
+void complete_request(Reactor* reactor, Request* request);
+/* queue functions */
+void init_queue(RequestQueue* queue, int size);
+void queue_push(RequestQueue* queue, Request* request);
+Request* queue_pop(RequestQueue* queue);
+/* arena functions */
+void init_arena(Arena* arena, size_t capacity);
+void* arena_alloc(Arena* arena, size_t size);
+Image* arena_image(Arena* arena, CvSize size, int channels);
+void arena_reset(Arena* arena);
+/* cache functions */
+Cache* init_cache(size_t capacity);
+uint64_t hash_bytes(const uint8_t* data, size_t length);
+void cache_key(Request* request, CacheKey* key);
+uint64_t cache_hash(const CacheKey* key);
+int cache_matches(
+        const CacheEntry* entry, const CacheKey* key, const Request* request);
+CacheEntry* cache_lookup(
+        Cache* cache, const CacheKey* key, const Request* request);
+void cache_response(Cache* cache, const CacheKey* key, const Request* request,
+        Response* response);
+void cache_trim(Cache* cache);
+void cache_evict(Cache* cache, CacheShard* shard, CacheEntry* entry);
+void cache_insert(CacheShard* shard, CacheEntry* entry);
+void cache_unlink(CacheShard* shard, CacheEntry* entry);
+void cache_release(CacheEntry* entry);
+/* overlay functions */
+OverlayCache* init_overlays(void);
+Overlay* get_overlay(OverlayCache* overlays, uint8_t* data, uint32_t size);
+Overlay* build_overlay(Image* image);
+Image* overlay_level(Overlay* overlay, CvSize size);
+void release_overlay(Overlay* overlay);
 /* client functions */
-void handle_bad_request(Client* client);
-void send_error_message(FILE* toClient, ImmutableString msg);
-int client_read(Client* client);
-Image* load_image(Client* client, int op);
-int client_detect(Client* client, int* error);
-void client_replace(Client* client, int* error);
-void client_write(Client* client);
-void* client_thread(void* data);
-/* Protected functions */
-Protected init_protected(void);
+void handle_client_event(Reactor* reactor, Client* client, uint32_t events);
+int wants_input(Client* client);
+int known_operation(uint8_t operation);
+int reserve_image(Request* request, int image, uint32_t fill);
+int check_image(Reactor* reactor, Client* client);
+int too_many_pixels(Reactor* reactor, CvSize size);
+void client_readable(Reactor* reactor, Client* client);
+void parse_input(Reactor* reactor, Client* client);
+void client_eof(Reactor* reactor, Client* client);
+void handle_bad_request(Reactor* reactor, Client* client);
+void reject_request(Reactor* reactor, Client* client, ImmutableString msg);
+void send_error_message(Reactor* reactor, Client* client, ImmutableString msg);
+void queue_response(Reactor* reactor, Client* client, Response* response);
+int send_response(Client* client, Response* response);
+void client_writable(Reactor* reactor, Client* client);
+void update_events(Reactor* reactor, Client* client);
+void close_client(Reactor* reactor, Client* client);
+void retire_client(Reactor* reactor, Client* client);
+/* request functions */
+void process_request(Request* request, Worker* worker);
+Image* load_image(uint8_t* data, uint32_t size, int op);
+int decode_request(Request* request, Worker* worker);
+Image* decode_frame(Request* request);
+int decoded_too_large(Request* request, Worker* worker);
+HeaderStatus image_header(
+        const uint8_t* data, uint32_t length, CvSize* dimensions);
+HeaderStatus jpeg_header(
+        const uint8_t* data, uint32_t length, CvSize* dimensions);
+int find_faces(Request* request, Worker* worker, int withEyes);
+void client_detect(Request* request, Worker* worker);
+void client_replace(Request* request, Worker* worker);
+Response* output_response(CvMat* output, StatMemeber mem);
+Response* rects_response(const HaarRects* faces, const HaarRectLists* eyes);
+Response* cached_response(CacheEntry* entry, StatMemeber mem);
+Response* error_response(ImmutableString msg);
+void set_header(Response* response, uint8_t operation, uint32_t size);
+void tag_response(Response* response, uint32_t id);
+void free_response(Response* response);
+void free_request(Request* request);
+/* detector functions */
+Worker* init_workers(int count, const Detector* detector);
+Detector* load_detector(void);
 /* Stat functions */
 void update_stat(Stats* stat, StatMemeber mem, uint32_t value);
+uint32_t read_stat(Stats* stat, StatMemeber mem);
 void* print_stats(void* data);
+/* metrics functions */
+uint64_t now_nanos(void);
+uint64_t record_stage(StageTimes* times, Stage stage, uint64_t start);
+int histogram_bucket(uint64_t nanos);
+uint64_t bucket_bound(int bucket);
+void start_metrics(Server* server, Metrics* metrics);
+void* metrics_thread(void* data);
+void serve_metrics(Metrics* metrics, int fd);
+void write_metrics(Metrics* metrics, FILE* out);
 
 //////////////////////////////////////////
 
@@ -212,17 +693,6 @@ void exit_invalid_command_line(void)
     exit(EXIT_INVALID_CMD_LINE);
 }
 
-/* exit_fail_write()
- * -----------------
- * Prints to stderr failWriteMsg and exits uqfacedetect with an exit
- * status of EXIT_FILE_FAIL_WRITE.
- */
-void exit_fail_write(void)
-{
-    fprintf(stderr, "%s", failWriteMsg);
-    exit(EXIT_FILE_FAIL_WRITE);
-}
-
 /* exit_fail_cascade()
  * ------------------
  * Prints to stderr failCascadeMsg and exit uqfacedetect with an exit
@@ -271,8 +741,12 @@ Server get_server(int argc, char* argv[])
     // NOTE: This function does not attempt to validate settings.portNum.
     //       That is handled by start_server()
     char* endptr;
+    int optionIndex = PORT_NUM_INDEX; // first argument that may be an option
     Server server = {0};
-    if (!(argc == MIN_ARGS || argc == MAX_ARGS)) {
+    server.helpers = -1;
+    server.cacheMegabytes = -1;
+    server.megapixels = -1;
+    if (argc < MIN_ARGS) {
         // insufficient arguments supplied, exit
         exit_invalid_command_line();
     }
@@ -310,31 +784,140 @@ Server get_server(int argc, char* argv[])
         // 0 was supplied as maxSize, set size limit to maxByteSize
         server.maxSize = maxByteSize;
     }
-    if (argc == MAX_ARGS) {
+    if (argc > PORT_NUM_INDEX
+            && strncmp(argv[PORT_NUM_INDEX], optionHandle,
+                    strlen(optionHandle))) {
         // save supplied portnum string
         server.portNum = argv[PORT_NUM_INDEX];
+        optionIndex++;
+    }
+    /* checking options */
+    for (int i = optionIndex; i < argc; i++) {
+        if (!strcmp(argv[i], workersArg) && (i + 1 < argc)
+                && !server.workers) {
+            server.workers = get_count(argv[++i], 1, MAX_CONNECTIONS);
+        } else if (!strcmp(argv[i], queueArg) && (i + 1 < argc)
+                && !server.queueSize) {
+            server.queueSize = get_count(argv[++i], 1, MAX_QUEUE);
+        } else if (!strcmp(argv[i], helpersArg) && (i + 1 < argc)
+                && server.helpers < 0) {
+            server.helpers = get_count(argv[++i], 0, MAX_CONNECTIONS);
+        } else if (!strcmp(argv[i], cacheArg) && (i + 1 < argc)
+                && server.cacheMegabytes < 0) {
+            server.cacheMegabytes
+                    = get_count(argv[++i], 0, MAX_CACHE_MEGABYTES);
+        } else if (!strcmp(argv[i], rejectArg) && !server.rejectWhenFull) {
+            server.rejectWhenFull = 1;
+        } else if (!strcmp(argv[i], fastArg) && !server.fastDetect) {
+            server.fastDetect = 1;
+        } else if (!strcmp(argv[i], megapixelsArg) && (i + 1 < argc)
+                && server.megapixels < 0) {
+            server.megapixels = get_count(argv[++i], 0, MAX_MEGAPIXELS);
+        } else if (!strcmp(argv[i], metricsArg) && (i + 1 < argc)
+                && !server.metricsPort && strlen(argv[i + 1])) {
+            server.metricsPort = argv[++i];
+        } else if (!strcmp(argv[i], unixArg) && (i + 1 < argc)
+                && !server.unixPath) {
+            server.unixPath = argv[++i];
+        } else {
+            // argument cannot be identified, assume to be invalid
+            exit_invalid_command_line();
+        }
+    }
+    if (!server.workers) {
+        // default to one worker per core, never more than can be connected
+        server.workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (server.workers < 1 || server.workers > server.maxConnections) {
+            server.workers = server.workers < 1 ? 1 : server.maxConnections;
+        }
+    }
+    if (server.helpers < 0) {
+        // default to every core but the one running the worker
+        server.helpers = (int)sysconf(_SC_NPROCESSORS_ONLN) - 1;
+        server.helpers = server.helpers < 0 ? 0 : server.helpers;
+    }
+    if (server.cacheMegabytes < 0) {
+        // results are not cached unless asked for
+        server.cacheMegabytes = 0;
+    }
+    if (server.megapixels < 0) {
+        // images are only limited by maxsize unless asked for
+        server.megapixels = 0;
+    }
+    if (!server.queueSize) {
+        // default to queueing as many connections as may be connected
+        server.queueSize = server.maxConnections < MAX_QUEUE
+                ? server.maxConnections
+                : MAX_QUEUE;
     }
     free(maxConnections);
     free(maxSize);
     return server;
 }
 
+/* get_count()
+ * -----------
+ * Converts an option value into a count between min and max.
+ *
+ * arg: The option value supplied at the terminal.
+ * min: The smallest count allowed.
+ * max: The largest count allowed.
+ *
+ * Returns: The converted count.
+ *
+ * Errors: exit_invalid_command_line() is called whenever arg is not a whole
+ *         number between min and max.
+ */
+int get_count(char* arg, int min, int max)
+{
+    char* endptr;
+    long count = strtol(arg, &endptr, DECIMAL_FORMAT);
+    if (*endptr != '\0' || count < min || count > max) {
+        // failed conversion or out of range
+        exit_invalid_command_line();
+    }
+    return (int)count;
+}
+
 /// Server Funtions //////////////////////
 
 /* start_server()
  * -------------
- * Initialise server.listenOn member with the provided server.portNum and starts
- * listening to socket for pending new connections.
+ * Initialise the server.listenOn sockets and starts listening to them for
+ * pending new connections: the TCP port server.portNum, or an ephemeral port
+ * if neither it nor server.unixPath was provided, and the Unix domain socket
+ * server.unixPath, if provided. Clients on the same host may connect to the
+ * latter and skip the TCP/IP stack altogether. The listening sockets are
+ * non-blocking as they are driven by the event loop (see reactor_loop()).
+ *
+ * server: The Server struct who's server.listenOn memeber is to be populated
+ *
+ * Error: Function calls exit_invalid_port() whenever the provied port or
+ *        socket cannot be listened on.
+ */
+void start_server(Server* server)
+{
+    if (server->portNum || !server->unixPath) {
+        listen_tcp(server);
+    }
+    if (server->unixPath) {
+        listen_unix(server);
+    }
+}
+
+/* listen_tcp()
+ * ------------
+ * Adds a socket listening on the TCP port server.portNum (or an ephemeral
+ * port if none provided) to server.listenOn.
  *
- * Function prints the socket address being used by the server for listening to
- * stderr.
+ * Function prints the port being used by the server for listening to stderr.
  *
  * server: The Server struct who's server.listenOn memeber is to be populated
  *
  * Error: Function calls exit_invalid_port() whenever the provied port
  *        cannot be listened on.
  */
-void start_server(Server* server)
+void listen_tcp(Server* server)
 {
     int listenOn;
     int optVal = 1;
@@ -358,7 +941,7 @@ void start_server(Server* server)
         }
     }
     /* setting up socket */
-    if ((listenOn = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if ((listenOn = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
         // socket could not be created
         exit_invalid_port(server->portNum);
     }
@@ -372,7 +955,7 @@ void start_server(Server* server)
         // socket cannot be listened to
         exit_invalid_port(server->portNum);
     }
-    server->listenOn = listenOn;
+    server->listenOn[server->listeners++] = listenOn;
     /* printing the socket addressing being used by the server for listening */
     struct sockaddr_in ad = {0};
     socklen_t len = sizeof(struct sockaddr_in);
@@ -380,30 +963,79 @@ void start_server(Server* server)
     fprintf(stderr, "%u\n", ntohs(ad.sin_port));
 }
 
+/* listen_unix()
+ * -------------
+ * Adds a socket listening on the Unix domain socket server.unixPath to
+ * server.listenOn. The path must contain a '/' (e.g. "./uqface.sock"), or
+ * be "@name" for a socket in the abstract namespace, which needs no file and
+ * disappears with the server (see face_resolve(), which clients name the
+ * socket with too). A socket file left behind by an earlier server is
+ * replaced, but only once connecting to it is refused: one a running server
+ * is still listening on is left alone.
+ *
+ * server: The Server struct who's server.listenOn memeber is to be populated
+ *
+ * Error: Function calls exit_invalid_port() whenever the provied socket
+ *        cannot be listened on, including when another server is listening
+ *        on it.
+ */
+void listen_unix(Server* server)
+{
+    int listenOn, probe;
+    FaceAddress address;
+    struct stat info;
+    if (face_resolve(NULL, server->unixPath, &address)
+            || address.address.ss_family != AF_UNIX) {
+        // not a path or an abstract name, or too long for one
+        exit_invalid_port(server->unixPath);
+    }
+    if (server->unixPath[0] != '@' && !lstat(server->unixPath, &info)
+            && S_ISSOCK(info.st_mode)
+            && (probe = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0) {
+        if (connect(probe, (struct sockaddr*)&address.address, address.length)
+                && errno == ECONNREFUSED) {
+            // stale socket from a server that was not shut down cleanly
+            unlink(server->unixPath);
+        }
+        close(probe);
+    }
+    if ((listenOn = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        // socket could not be created
+        exit_invalid_port(server->unixPath);
+    }
+    if (bind(listenOn, (struct sockaddr*)&address.address, address.length)
+            < 0) {
+        // socket could not be binded
+        exit_invalid_port(server->unixPath);
+    }
+    if (listen(listenOn, DUMMY) < 0) {
+        // socket cannot be listened to
+        exit_invalid_port(server->unixPath);
+    }
+    server->listenOn[server->listeners++] = listenOn;
+}
+
 /* run_server()
  * ------------
- * Begins accepting new connections requests to server.listenOn, and intialises
- * a thread to handle client.
- *
+ * Spawns server.helpers detection helper threads and server.workers worker
+ * threads sharing a result cache of server.cacheMegabytes, and then runs the
+ * event loop on the calling thread for the lifetime of the server. Threads
+ * are spawned once SIGHUP is blocked, so that only print_stats() ever
+ * recieves it. With server.metricsPort set, a further thread serves the
+ * statistics and stage latencies of every thread (see metrics_thread()).
  *
  * server: The Server struct populated with all server settings enabled by
  *         terminal commands.
- * data: The Protected struct which stores data sensitive to the race condition.
- *       See Protected struct definition for more details pertaining to members.
+ * workers: The server.workers Worker structs created by init_workers().
  *
  * Pre-condition: Requires server.listenOn to be populated (i.e. start_server()
  *                must be called prior).
  */
-void run_server(Server server, Protected data)
+void run_server(Server server, Worker* workers)
 {
-    int read, write; // placeholder for the read and writing socket fds between
-                     // the server and a client
-    struct sockaddr_in fromAddr;
-    socklen_t fromAddrSize;
     pthread_t thread;
     /* init stats */
     Stats stat = {0};
-    sem_init(&stat.lock, 0, 1);
     /* handling SIGHUB */
     pthread_t sigThread; // for catching SIGHUP
     sigemptyset(&stat.set);
@@ -411,539 +1043,2845 @@ void run_server(Server server, Protected data)
     pthread_sigmask(SIG_BLOCK, &stat.set, NULL);
     pthread_create(&sigThread, NULL, print_stats, (void*)&stat);
     pthread_detach(sigThread);
-    /* continueously handle new connections */
-    sem_t activeCount;
-    sem_init(&activeCount, 0, server.maxConnections);
-    while (1) {
-        sem_wait(&activeCount);
-        fromAddrSize = sizeof(struct sockaddr_in);
-        // block wait for a new connection
-        read = accept(
-                server.listenOn, (struct sockaddr*)&fromAddr, &fromAddrSize);
-        // creating a thread to deal with client
-        write = dup(read);
-        Client* client = (Client*)malloc(sizeof(Client));
-        client->read = fdopen(read, "rb");
-        client->write = fdopen(write, "wb");
-        client->maxSize = server.maxSize;
-        client->data = &data;
-        client->detect = NULL;
-        client->replace = NULL;
-        client->activeCount = &activeCount;
-        client->stat = &stat;
-        pthread_create(&thread, NULL, client_thread, client);
-        pthread_detach(thread); // ensure thread is cleaned up properly
+    /* init event loop */
+    RequestQueue queue;
+    init_queue(&queue, server.queueSize);
+    Reactor reactor = {0};
+    init_reactor(&reactor, &server, &queue, &stat);
+    /* spawning the detection helpers and the worker pool */
+    HaarScheduler* scheduler = haar_scheduler(server.helpers);
+    Cache* cache = init_cache((size_t)server.cacheMegabytes << 20);
+    stat.caching = cache != NULL;
+    OverlayCache* overlays = init_overlays();
+    for (int i = 0; i < server.workers; i++) {
+        workers[i].reactor = &reactor;
+        workers[i].cache = cache;
+        workers[i].overlays = overlays;
+        haar_use_scheduler(workers[i].evaluator, scheduler);
+        pthread_create(&thread, NULL, worker_thread, &workers[i]);
+        pthread_detach(thread);
+    }
+    Metrics metrics = {-1, &stat, NULL, server.workers + 1};
+    if (server.metricsPort) {
+        metrics.times = (StageTimes**)malloc(metrics.count * sizeof(void*));
+        metrics.times[0] = reactor.times;
+        for (int i = 0; i < server.workers; i++) {
+            metrics.times[i + 1] = workers[i].times;
+        }
+        start_metrics(&server, &metrics);
+        pthread_create(&thread, NULL, metrics_thread, &metrics);
+        pthread_detach(thread);
     }
+    reactor_loop(&reactor);
 }
 
-/// Client Functions /////////////////////
-
-/* handle_bad_request()
- * -------------------
- * Function sends the binary contents of the response file (path is specified
- * by responseFile, see line 53).
+/* init_reactor()
+ * --------------
+ * Initialises the event loop state and registers the listening sockets and
+ * the worker wakeup eventfd with a new epoll instance. responseFile is opened
+ * once here and sent to every badly formed request with sendfile().
  *
- * client: The Client that submitted a "badly formed request".
+ * reactor: The Reactor to be initialised.
+ * server: The Server struct populated with all server settings.
+ * queue: The initialised RequestQueue shared with the worker threads.
+ * stat: The Stats struct storing server statistics.
  */
-void handle_bad_request(Client* client)
+void init_reactor(Reactor* reactor, Server* server, RequestQueue* queue,
+        Stats* stat)
 {
-    // NOTE: This function does not terminate the socket connection between
-    //       the Client and Server, that is handled by client_thread()
-    size_t nread;
-    char buffer[BUFFER_SIZE];
-    FILE* responseStream = fopen(responseFile, "rb");
-    while ((nread = fread(buffer, 1, sizeof(buffer), responseStream)) > 0) {
-        // copy over contents of reponse file
-        fwrite(buffer, 1, nread, client->write);
+    struct epoll_event event = {0};
+    reactor->epollFd = epoll_create1(0);
+    for (int i = 0; i < server->listeners; i++) {
+        reactor->listeners[i].kind = LISTENER;
+        reactor->listeners[i].fd = server->listenOn[i];
+    }
+    reactor->listenerCount = server->listeners;
+    reactor->wakeup.kind = WAKEUP;
+    reactor->wakeup.fd = eventfd(0, EFD_NONBLOCK);
+    reactor->maxConnections = server->maxConnections;
+    reactor->maxSize = server->maxSize;
+    reactor->rejectWhenFull = server->rejectWhenFull;
+    reactor->fastDetect = server->fastDetect;
+    reactor->maxPixels = (uint64_t)server->megapixels * 1000000;
+    reactor->times = (StageTimes*)calloc(1, sizeof(StageTimes));
+    reactor->queue = queue;
+    reactor->stat = stat;
+    /* caching responseFile for bad requests */
+    struct stat info;
+    reactor->responseFd = open(responseFile, O_RDONLY | O_CLOEXEC);
+    if (reactor->responseFd >= 0 && !fstat(reactor->responseFd, &info)) {
+        reactor->responseSize = info.st_size;
+    }
+    event.events = EPOLLIN;
+    event.data.ptr = &reactor->wakeup;
+    epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, reactor->wakeup.fd, &event);
+    for (int i = 0; i < reactor->listenerCount; i++) {
+        event.data.ptr = &reactor->listeners[i];
+        epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, reactor->listeners[i].fd,
+                &event);
     }
-    fclose(responseStream);
-    update_stat(client->stat, INVALID, INCREMENT);
+    reactor->listening = 1;
 }
 
-/* send_error_message()
- * --------------------
- * Sends specified error message to client socket.
+/* reactor_loop()
+ * --------------
+ * Waits for and handles socket readiness and worker completions for the
+ * lifetime of the server. Connections closed while handling a batch of events
+ * are only freed once the whole batch has been handled, as later events in the
+ * batch may still refer to them. While accepting is stopped for want of file
+ * descriptors, it is retried every ACCEPT_RETRY milliseconds in case they
+ * were freed by something other than a client closing.
  *
- * toClient: The client's write socket.
- * msg: The error message to be sent to the client.
+ * reactor: The initialised Reactor.
  */
-void send_error_message(FILE* toClient, ImmutableString msg)
+void reactor_loop(Reactor* reactor)
 {
-    uint32_t errMsgLength = strlen(msg);
-    // send prefix
-    fwrite(&prefix, sizeof(uint32_t), 1, toClient);
-    // send operation (3)
-    fwrite(&opError, sizeof(uint8_t), 1, toClient);
-    // send message length
-    fwrite(&errMsgLength, sizeof(uint32_t), 1, toClient);
-    // send Message itself
-    fwrite(msg, errMsgLength, 1, toClient);
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int count = epoll_wait(reactor->epollFd, events, MAX_EVENTS,
+                reactor->descriptorsExhausted ? ACCEPT_RETRY : -1);
+        if (!count && reactor->descriptorsExhausted && !reactor->pendingHead) {
+            set_listening(
+                    reactor, reactor->connections < reactor->maxConnections);
+        }
+        for (int i = 0; i < count; i++) {
+            EventKind* kind = (EventKind*)events[i].data.ptr;
+            if (*kind == LISTENER) {
+                accept_clients(reactor, (EventSource*)kind);
+            } else if (*kind == WAKEUP) {
+                handle_completions(reactor);
+            } else {
+                handle_client_event(reactor, (Client*)kind, events[i].events);
+            }
+        }
+        while (reactor->retired) {
+            // free connections closed during this batch
+            Client* client = reactor->retired;
+            reactor->retired = client->nextRetired;
+            free(client);
+        }
+    }
 }
 
-/* load_image()
- * ------------
- * Initalises an Image struct from the image byte data send by from the
- * client socket.
- *
- * client: The client where the image byte data is expected to be recieved from.
- * op: A flag that denotes if the Image struct is to be loaded with
- *      (i) CV_LOAD_IMAGE_COLOR (denoted by 0)
- *      (ii) CV_LOAD_IMAGE_UNCHANGED (denoted by 1)
+/* accept_clients()
+ * ----------------
+ * Accepts every pending connection on a listening socket, stopping early
+ * once maxconnections clients are connected (over every listening socket).
+ * Running out of file descriptors also stops accepting, as the listener
+ * stays readable and would otherwise wake the event loop again at once; a
+ * client closing resumes it (see close_client()).
  *
- * Errors: Function calls send_error_messages() to send one of the following
- *         error messages to client under the following conditions:
- *         (i)   zeroByteMsg: When the recieved byte size of file is 0.
- *         (ii)  imgLargeMsg: When the recieved byte size exceeds the server's
- *                            maxsize limit.
- *         (iii) invalidImgMsg: When image byte data could not be extracted
- *                              from client's socket or cvLoadImage() failed
- *                              due to supplied image byte data.
- */
-Image* load_image(Client* client, int op)
-{
-    uint32_t fileByteSize;
-    uint8_t* buffer;
-    Image* img;
-    FILE* tempWrite = fopen(client->data->temp, "wb");
-    /* confirming image size is valid */
-    if (!fread(&fileByteSize, sizeof(uint32_t), 1, client->read)
-            || !fileByteSize) {
-        // byte size M of file 1 is zero
-        send_error_message(client->write, zeroByteMsg);
-        return NULL;
-    }
-    if (fileByteSize > client->maxSize) {
-        // supplied byte size M exceed's server's maxSize limit
-        send_error_message(client->write, imgLargeMsg);
-        return NULL;
-    }
-    // get file and save it to temp
-    buffer = (uint8_t*)malloc(fileByteSize);
-    if (!fread(buffer, 1, fileByteSize, client->read)) {
-        // data could not be extracted
-        send_error_message(client->write, invalidImgMsg);
-        return NULL;
+ * reactor: The Reactor the connections are registered with.
+ * listener: The listening socket with pending connections.
+ */
+void accept_clients(Reactor* reactor, EventSource* listener)
+{
+    struct epoll_event event = {0};
+    while (reactor->listening) {
+        int fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                // connection aborted before it could be accepted
+                continue;
+            } else if (errno == EMFILE || errno == ENFILE) {
+                // leave the connection in the backlog until one is freed
+                reactor->descriptorsExhausted = 1;
+                set_listening(reactor, 0);
+            }
+            // no more pending connections
+            return;
+        }
+        reactor->descriptorsExhausted = 0;
+        Client* client = (Client*)calloc(1, sizeof(Client));
+        client->kind = CONNECTION;
+        client->fd = fd;
+        client->state = RECV_PREFIX;
+        client->events = EPOLLIN;
+        event.events = EPOLLIN;
+        event.data.ptr = client;
+        epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, fd, &event);
+        update_stat(reactor->stat, CONNECTED, INCREMENT);
+        if (++reactor->connections >= reactor->maxConnections) {
+            // stop accepting until a client disconnects
+            set_listening(reactor, 0);
+        }
     }
-    fwrite(buffer, 1, fileByteSize, tempWrite); // writing to temp
-    fclose(tempWrite);
-    if (!op && !(img = cvLoadImage(client->data->temp, CV_LOAD_IMAGE_COLOR))) {
-        // failed to load image
-        send_error_message(client->write, invalidImgMsg);
-        return NULL;
+}
+
+/* set_listening()
+ * ---------------
+ * Starts or stops the event loop from accepting new connections. Pending
+ * connections wait in the listen backlog while accepting is stopped.
+ *
+ * reactor: The Reactor owning the listening sockets.
+ * listening: 1 to accept new connections, 0 otherwise.
+ */
+void set_listening(Reactor* reactor, int listening)
+{
+    struct epoll_event event = {0};
+    if (reactor->listening == listening) {
+        return;
     }
-    if (op
-            && !(img = cvLoadImage(
-                         client->data->temp, CV_LOAD_IMAGE_UNCHANGED))) {
-        // failed to load image
-        send_error_message(client->write, invalidImgMsg);
-        return NULL;
+    event.events = listening ? EPOLLIN : 0;
+    for (int i = 0; i < reactor->listenerCount; i++) {
+        event.data.ptr = &reactor->listeners[i];
+        epoll_ctl(reactor->epollFd, EPOLL_CTL_MOD, reactor->listeners[i].fd,
+                &event);
     }
-
-    free(buffer);
-    return img;
+    reactor->listening = listening;
 }
 
-/* client_read()
- * -------------
- * Reads data sent from client socket in accordance to communication protocol.
- *
- * client: Points to the client struct populated with detailed corrsponding
- *         to the client, including the reading and writing ends of the
- *         client socket.
- * error: Points to an error bit which denotes if an error has occured.
- *
- * Errors: Excluding case (i), all cases use send_error_message() to send
- *         error message to client socket.
- *      (i)   function calls handle_bad_request() whenever an invalid prefix is
- *            recieved from client. See handle_bad_request() for more details.
- *      (ii)  sends invalidMsg when an attempt to read from the socket fails.
- *      (iii) sends invalidOpMsg when recieved operation is invalid.
+/* dispatch_request()
+ * ------------------
+ * Hands a fully recieved request to the worker pool.
  *
- *  Note: Function calls sem_wait() but will not call sem_post() client
- *        input file data (and replace file data if provided) was read
- *        successfully.
+ * When the queue is full, the request waits on the reactor's pending list and
+ * accepting stops until a worker frees a slot, unless reactor.rejectWhenFull
+ * is set, in which case the client is sent busyMsg and closed straight away
+ * (or, for a pipelined request, only that request is answered with busyMsg).
  *
- *        client_thread() will call sem_post() regardless if image operation
- *        is successful.
+ * reactor: The Reactor the request was recieved by.
+ * request: The recieved Request.
  */
-int client_read(Client* client)
+void dispatch_request(Reactor* reactor, Request* request)
 {
-    // NOTE: This function follows the communication protocol highlighed in
-    //       specsheet - which is:
-    //       (i)   get prefix
-    //       (ii)  get operation type
-    //       (iii) get image 1 size (number of bytes M)
-    //       (iv)  get image 1 data (as bytes)
-    //       (v)   IF present, get image 2 size (number of bytes N)
-    //       (vi)  IF present, get image 2 data (as bytes)
-    uint32_t recievedPrefix;
-    uint8_t recievedOperation;
-    if (!fread(&recievedPrefix, sizeof(uint32_t), 1, client->read)
-            || recievedPrefix != prefix) {
-        // valid prefix was not recieved, send contents to responsefile
-        handle_bad_request(client);
-        return 0;
-    }
-    /* identifying operation request */
-    if (!fread(&recievedOperation, sizeof(uint8_t), 1, client->read)) {
-        // operation could not be recieved
-        send_error_message(client->write, invalidMsg);
-        return 0;
-    }
-    if (recievedOperation != detectFace && recievedOperation != replaceFace) {
-        // invalid operation request detected
-        send_error_message(client->write, invalidOpMsg);
-        return 0;
+    Client* client = request->client;
+    client->inFlight++;
+    if (!reactor->pendingHead && !sem_trywait(&reactor->queue->slots)) {
+        queue_push(reactor->queue, request);
+        sem_post(&reactor->queue->items);
+        return;
     }
-    /* loading images */
-    sem_wait(&client->data->lock);
-    if (!(client->detect = load_image(client, 0))) {
-        // failed to load input image (image 1)
-        sem_post(&client->data->lock);
-        return 0;
+    if (reactor->rejectWhenFull && request->tagged) {
+        // queue is full, turn only this request away
+        Response* response = error_response(busyMsg);
+        tag_response(response, request->id);
+        client->inFlight--;
+        free_request(request);
+        queue_response(reactor, client, response);
+        return;
+    } else if (reactor->rejectWhenFull) {
+        // queue is full, turn the client away
+        client->inFlight--;
+        free_request(request);
+        send_error_message(reactor, client, busyMsg);
+        return;
     }
-    if ((recievedOperation == replaceFace)
-            && !(client->replace = load_image(client, 1))) {
-        // failed to load replace image (image 2)
-        sem_post(&client->data->lock);
-        return 0;
+    // wait for room in the queue, preserving arrival order
+    request->next = NULL;
+    if (reactor->pendingTail) {
+        reactor->pendingTail->next = request;
+    } else {
+        reactor->pendingHead = request;
     }
-    return 1;
+    reactor->pendingTail = request;
+    set_listening(reactor, 0);
 }
 
-/* client_detect()
- * --------------
- *  Peforms the detect operation using the client.detect generated by input
- *  file data. Output is written to temp.
- *
- *  client: Points to the client struct populated with detailed corrsponding
- *          to the client, including the reading and writing ends of the
- *          client socket.
- *  error: Points to an error bit which denotes if an error has occured.
- *
- *  Return: 1 on success (i.e. the detect operation was successful), 0 otherwise
- *
- *  Error: On success error get populated by 1, 0 otherwise.
- */
-int client_detect(Client* client, int* error)
-{
-    IplImage* frameGray
-            = cvCreateImage(cvGetSize(client->detect), IPL_DEPTH_8U, 1);
-    cvCvtColor(client->detect, frameGray, CV_BGR2GRAY);
-    cvEqualizeHist(frameGray, frameGray);
-    CvMemStorage* storage = 0;
-    storage = cvCreateMemStorage(0);
-    cvClearMemStorage(storage);
-    CvSeq* faces = cvHaarDetectObjects(frameGray, client->data->face, storage,
-            haarScaleFactor, haarMinNeighbours, haarFlags,
-            cvSize(haarMinSize, haarMinSize), cvSize(haarMaxSize, haarMaxSize));
-    if (!faces->total) {
-        *error = 1;
-        send_error_message(client->write, noFaceMsg);
-        return 0;
-    }
-    for (int i = 0; i < faces->total; i++) {
-        CvRect* face = (CvRect*)cvGetSeqElem(faces, i);
-        CvPoint center
-                = {face->x + face->width / 2, face->y + face->height / 2};
-        const CvScalar magenta = cvScalar(255, 0, 255, 0);
-        const CvScalar blue = cvScalar(255, 0, 0, 0);
-        cvEllipse(client->detect, center,
-                cvSize(face->width / 2, face->height / 2), 0, ellipseStartAngle,
-                ellipseEndAngle, magenta, lineThickness, lineType, shift);
-        IplImage* faceROI
-                = cvCreateImage(cvGetSize(frameGray), IPL_DEPTH_8U, 1);
-        cvCopy(frameGray, faceROI, NULL);
-        cvSetImageROI(faceROI, *face);
-        CvMemStorage* eyeStorage = 0;
-        eyeStorage = cvCreateMemStorage(0);
-        cvClearMemStorage(eyeStorage);
-        CvSeq* eyes = cvHaarDetectObjects(faceROI, client->data->eye,
-                eyeStorage, haarScaleFactor, haarMinNeighbours, haarFlags,
-                cvSize(haarMinSize, haarMinSize),
-                cvSize(haarMaxSize, haarMaxSize));
-        if (eyes->total == 2) {
-            for (int j = 0; j < eyes->total; j++) {
-                CvRect* eye = (CvRect*)cvGetSeqElem(eyes, j);
-                CvPoint eyeCenter = {face->x + eye->x + eye->width / 2,
-                        face->y + eye->y + eye->height / 2};
-                int radius = cvRound((eye->width / 2 + eye->height / 2) / 2);
-                cvCircle(client->detect, eyeCenter, radius, blue, lineThickness,
-                        lineType, shift);
+/* dispatch_pending()
+ * ------------------
+ * Moves requests waiting on the pending list into the queue while it has
+ * room, resuming accepting once the pending list is empty.
+ *
+ * reactor: The Reactor owning the pending list.
+ */
+void dispatch_pending(Reactor* reactor)
+{
+    while (reactor->pendingHead) {
+        Request* request = reactor->pendingHead;
+        Client* client = request->client;
+        if (!client->closed && sem_trywait(&reactor->queue->slots)) {
+            // queue is still full
+            return;
+        }
+        if (!(reactor->pendingHead = request->next)) {
+            reactor->pendingTail = NULL;
+        }
+        if (client->closed) {
+            // client has gone, the request no longer needs processing
+            free_request(request);
+            if (!--client->inFlight) {
+                retire_client(reactor, client);
             }
+            continue;
         }
-        cvReleaseImage(&faceROI);
-        cvReleaseMemStorage(&eyeStorage);
+        queue_push(reactor->queue, request);
+        sem_post(&reactor->queue->items);
     }
-    cvSaveImage(client->data->temp, client->detect, 0);
-    cvReleaseImage(&client->detect); // we don't need input file anymore
-    cvReleaseImage(&frameGray);
-    cvReleaseMemStorage(&storage);
-    *error = 0; // no erro has occured
-    return 1;
+    set_listening(reactor, reactor->connections < reactor->maxConnections);
 }
 
-/* client_replace()
- * ----------------
- * Performs the replace operation using the client.detect and client.relace
- * gerated by the input and replace data respectively
- *
- * client: Points to the client struct populated with detailed corrsponding
- *          to the client, including the reading and writing ends of the
- *          client socket.
- *  error: Points to an error bit which denotes if an error has occured.
- *
- *  Error: On success error get populated by 1, 0 otherwise.
- */
-void client_replace(Client* client, int* error)
-{
-    IplImage* frameGray
-            = cvCreateImage(cvGetSize(client->detect), IPL_DEPTH_8U, 1);
-    cvCvtColor(client->detect, frameGray, CV_BGR2GRAY);
-    cvEqualizeHist(frameGray, frameGray);
-    CvMemStorage* storage = 0;
-    storage = cvCreateMemStorage(0);
-    cvClearMemStorage(storage);
-    CvSeq* faces = cvHaarDetectObjects(frameGray, client->data->face, storage,
-            haarScaleFactor, haarMinNeighbours, haarFlags,
-            cvSize(haarMinSize, haarMinSize), cvSize(haarMaxSize, haarMaxSize));
-    if (!faces->total) {
-        // no faces detected, notify client
-        *error = 1;
-        send_error_message(client->write, noFaceMsg);
-        return;
+/* handle_completions()
+ * --------------------
+ * Collects the requests completed by worker threads and queues their
+ * responses on the connections they arrived on. Responses for clients that
+ * have since disconnected are discarded.
+ *
+ * reactor: The Reactor the worker threads report to.
+ */
+void handle_completions(Reactor* reactor)
+{
+    uint64_t count;
+    Request* ordered = NULL;
+    // reset the eventfd before taking the stack so no wakeup is lost
+    read(reactor->wakeup.fd, &count, sizeof(count));
+    Request* request
+            = __atomic_exchange_n(&reactor->completed, NULL, __ATOMIC_ACQUIRE);
+    while (request) {
+        // stack holds the newest completion first, reverse it
+        Request* next = request->next;
+        request->next = ordered;
+        ordered = request;
+        request = next;
     }
-    for (int i = 0; i < faces->total; i++) {
-        CvRect* face = (CvRect*)cvGetSeqElem(faces, i);
-        IplImage* resized = cvCreateImage(cvSize(face->width, face->height),
-                IPL_DEPTH_8U, client->replace->nChannels);
-        cvResize(client->replace, resized, CV_INTER_AREA);
-        char* frameData = client->detect->imageData;
-        char* faceData = resized->imageData;
-        for (int y = 0; y < face->height; y++) {
-            for (int x = 0; x < face->width; x++) {
-                int faceIndex
-                        = (resized->widthStep * y) + (x * resized->nChannels);
-                if ((resized->nChannels == bgraChannels)
-                        && (faceData[faceIndex + alphaIndex] == 0)) {
-                    continue;
-                }
-                int frameIndex = (client->detect->widthStep * (face->y + y))
-                        + ((face->x + x) * client->detect->nChannels);
-                frameData[frameIndex + 0] = faceData[faceIndex + 0];
-                frameData[frameIndex + 1] = faceData[faceIndex + 1];
-                frameData[frameIndex + 2] = faceData[faceIndex + 2];
+    while ((request = ordered)) {
+        ordered = request->next;
+        Client* client = request->client;
+        client->inFlight--;
+        if (client->closed) {
+            free_response(request->response);
+            if (!client->inFlight) {
+                retire_client(reactor, client);
             }
+        } else {
+            queue_response(reactor, client, request->response);
         }
-        cvReleaseImage(&resized);
+        free_request(request);
     }
-    cvSaveImage(client->data->temp, client->detect, 0);
-    cvReleaseImage(&client->detect);
-    cvReleaseImage(&client->replace);
-    cvReleaseImage(&frameGray);
-    cvReleaseMemStorage(&storage);
-    *error = 0; // no error has occured
+    dispatch_pending(reactor);
 }
 
-/* client_write()
- * -------------
- * Send data sent from temp file to the client in accordance to
- * communication protocol.
- *
- * client: Points to the client struct populated with details corresponding
- *         to the client, including the readinf and writing ends of the client
- *         socket.
- */
-void client_write(Client* client)
-{
-    // NOTE: This function follows the communication protocol highlighed in
-    //       specsheet - which is:
-    //       (i)   send prefix
-    //       (ii)  send operation type output
-    //       (iii) send image 1 size (number of bytes M)
-    //       (iv)  send image 1 data (as bytes)
-    //       (v)   IF present, send image 2 size (number of bytes N)
-    //       (vi)  IF present, send image 2 data (as bytes)
-    ssize_t nread; // bytes read
-    uint8_t buffer[BUFFER_SIZE];
-    uint8_t* fileData = NULL;
-    // sem_wait(&client->data->lock);
-    FILE* tempRead = fopen(client->data->temp, "rb");
-    uint32_t fileByteSize = 0;
-    /* sending prefix */
-    fwrite(&prefix, 1, sizeof(uint32_t), client->write);
-    fflush(client->write);
-    /* sending ouput operation */
-    fwrite(&outputImg, 1, sizeof(uint8_t), client->write);
-    fflush(client->write);
-    while ((nread = fread(buffer, 1, sizeof(buffer), tempRead))) {
-        // save bytes read in buffer to fileData
-        fileData = (uint8_t*)realloc(fileData, fileByteSize + nread);
-        memcpy(fileData + fileByteSize, buffer, nread);
-        fileByteSize += nread;
-    }
-    fwrite(&fileByteSize, sizeof(uint32_t), 1, client->write);
-    fwrite(fileData, sizeof(uint8_t), fileByteSize, client->write);
-    fflush(client->write);
-    free(fileData);
-    fclose(tempRead);
-}
-
-/* client_thread()
- * --------------
- * Dictates how client thread handles client.
- *
- * data: A pointer to an expected Client struct that is populated by caller.
+/* worker_thread()
+ * ---------------
+ * Serves queued requests one at a time for the lifetime of the server.
  *
- * Pre-condition: data is expected to be a populated Client struct and hence
- *                must be populated properly by caller.
+ * data: A pointer to the Worker struct owned by this thread.
  */
-void* client_thread(void* data)
+void* worker_thread(void* data)
 {
-    int err, detectSuccess;
-    Client* client = (Client*)data;
-    update_stat(client->stat, CONNECTED, INCREMENT);
-    while (client_read(client)) {
-        // continuously read client until client cannot be read
-        if (!client->replace) {
-            // only input image was loaded
-            detectSuccess = client_detect(client, &err);
-        } else {
-            // both input image and replace image was loaded
-            client_replace(client, &err);
-        }
-        if (err) {
-            // an error occured, terminate connection with client
-            // and start clean up
-            sem_post(&client->data->lock);
-            break;
-        }
-        client_write(client); // send output data to client
-        if (detectSuccess) {
-            // --detect output successfully sent
-            update_stat(client->stat, DETECT, INCREMENT);
-        } else {
-            // --replace output successfully sent
-            update_stat(client->stat, REPLACE, INCREMENT);
-        }
-        sem_post(&client->data->lock);
-    }
-    update_stat(client->stat, CONNECTED, DECREMENT);
-    update_stat(client->stat, COMPLETED, INCREMENT);
-    /* clean up */
-    sem_post(client->activeCount);
-    fclose(client->read);
-    fclose(client->write);
-    free(client);
+    Worker* worker = (Worker*)data;
+    RequestQueue* queue = worker->reactor->queue;
+    while (1) {
+        sem_wait(&queue->items);
+        Request* request = queue_pop(queue);
+        sem_post(&queue->slots); // slot is free again
+        process_request(request, worker);
+        arena_reset(&worker->arena);
+        complete_request(worker->reactor, request);
+    }
     return NULL;
 }
 
-/// Protected Functions ///////////////////
-
-/* init_protected()
- * ----------------
- * Function initalises a Protected struct populated with all data protected
- * by a semephore lock Protected.lock memeber
- *
- * Errors:
- *      (i)  calls exit_fail_write() whenever temp file cannot be opened for
- *           writing.
- *      (ii) calls exit_fail_cascade() whenever a cascade object cannot be
- *           created using cascadeFace nor cascadeEye
- */
-Protected init_protected(void)
-{
-    FILE* tempWrite;
-    Protected protected = {0};
-    // init lock
-    sem_init(&protected.lock, 0, 1);
-
-    // checking temp can be opened in write mode and truncated
-    if (!(tempWrite = fopen(temp, "wb"))) {
-        // temp could not be opened
-        exit_fail_write();
-    }
-    fclose(tempWrite);
-    protected.temp = strdup(temp);
-    // init Cascade eye and face
-    if (!(protected.face = (Cascade*)cvLoad(cascadeFace, NULL, NULL, NULL))
-            || !(protected.eye
-                    = (Cascade*)cvLoad(cascadeEye, NULL, NULL, NULL))) {
-        // Casade file checking failed
-        exit_fail_cascade();
-    }
-    return protected;
+/* complete_request()
+ * ------------------
+ * Hands a processed request back to the event loop by pushing it onto the
+ * reactor's lock-free completed stack and waking the event loop.
+ *
+ * reactor: The Reactor the request was recieved by.
+ * request: The Request whose response has been built.
+ */
+void complete_request(Reactor* reactor, Request* request)
+{
+    uint64_t one = 1;
+    Request* head = __atomic_load_n(&reactor->completed, __ATOMIC_RELAXED);
+    do {
+        request->next = head;
+    } while (!__atomic_compare_exchange_n(&reactor->completed, &head, request,
+            1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    write(reactor->wakeup.fd, &one, sizeof(one));
 }
 
-/// Stats Functions ///////////////////////
+/// Queue Functions ///////////////////////
 
-/* update_stat()
- * -------------
- * Increments the Stats memeber specified by mem with provided.
+/* init_queue()
+ * ------------
+ * Initialises an empty RequestQueue that holds at most size requests.
  *
- * stat: A pointer to the Stats struct to be updated.
- * mam: Specifies which memeber of stat is to be updated.
- * value: The value to increment the stats memeber by.
+ * queue: The RequestQueue to be initialised.
+ * size: The maximum number of queued requests.
  */
-void update_stat(Stats* stat, StatMemeber mem, uint32_t value)
+void init_queue(RequestQueue* queue, int size)
 {
-    sem_wait(&stat->lock);
-    if (mem == CONNECTED) {
-        stat->clientsConnected += value;
-    } else if (mem == COMPLETED) {
-        stat->clientsCompleted += value;
-    } else if (mem == DETECT) {
-        stat->detectRequestCount += value;
-    } else if (mem == REPLACE) {
-        stat->replaceRequestCount += value;
-    } else {
-        // assume invalid is to be updated
-        stat->invalidRequests += value;
+    size_t capacity = 1;
+    while (capacity < (size_t)size) {
+        // ring indexing relies on a power of two capacity
+        capacity <<= 1;
+    }
+    queue->cells = (QueueCell*)calloc(capacity, sizeof(QueueCell));
+    for (size_t i = 0; i < capacity; i++) {
+        queue->cells[i].sequence = i;
     }
-    sem_post(&stat->lock);
+    queue->mask = capacity - 1;
+    queue->pushPos = 0;
+    queue->popPos = 0;
+    sem_init(&queue->items, 0, 0);
+    sem_init(&queue->slots, 0, size);
 }
 
-/* print_stats()
+/* queue_push()
  * ------------
- * Prints all memeber values stored by an expected Stats struct to stderr.
+ * Adds a request to the back of the queue. A slot must first be reserved
+ * by waiting on queue.slots.
  *
- * data: A pointer to the expected Stats struct who's memenbers are to be
- *       printed.
+ * queue: The RequestQueue to add to.
+ * request: The recieved request.
  */
-void* print_stats(void* data)
+void queue_push(RequestQueue* queue, Request* request)
 {
-    Stats* stat = (Stats*)data;
-    int signal;
+    QueueCell* cell;
+    size_t pos = __atomic_load_n(&queue->pushPos, __ATOMIC_RELAXED);
     while (1) {
-        sigwait(&stat->set, &signal);
-        if (signal == SIGHUP) {
-            sem_wait(&stat->lock);
-            fprintf(stderr, "Clients connected: %d\n", stat->clientsConnected);
-            fprintf(stderr, "Num clients completed: %d\n",
-                    stat->clientsCompleted);
-            fprintf(stderr, "Face detection requests: %d\n",
-                    stat->detectRequestCount);
-            fprintf(stderr, "Face replacement requests: %d\n",
-                    stat->replaceRequestCount);
-            fprintf(stderr, "Invalid requests: %d\n", stat->invalidRequests);
-            fflush(stderr);
-            sem_post(&stat->lock);
+        cell = &queue->cells[pos & queue->mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0
+                && __atomic_compare_exchange_n(&queue->pushPos, &pos, pos + 1,
+                        1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            // claimed the cell at pos
+            break;
+        } else if (diff) {
+            // another producer claimed the cell first, catch up
+            pos = __atomic_load_n(&queue->pushPos, __ATOMIC_RELAXED);
         }
     }
-    return NULL;
+    cell->request = request;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* queue_pop()
+ * -----------
+ * Removes the request at the front of the queue. An item must first be
+ * reserved by waiting on queue.items.
+ *
+ * queue: The RequestQueue to take from.
+ *
+ * Returns: The request that has waited longest.
+ */
+Request* queue_pop(RequestQueue* queue)
+{
+    QueueCell* cell;
+    size_t pos = __atomic_load_n(&queue->popPos, __ATOMIC_RELAXED);
+    while (1) {
+        cell = &queue->cells[pos & queue->mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0
+                && __atomic_compare_exchange_n(&queue->popPos, &pos, pos + 1,
+                        1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            // claimed the cell at pos
+            break;
+        } else if (diff) {
+            // another consumer claimed the cell first, catch up
+            pos = __atomic_load_n(&queue->popPos, __ATOMIC_RELAXED);
+        }
+    }
+    Request* request = cell->request;
+    __atomic_store_n(
+            &cell->sequence, pos + queue->mask + 1, __ATOMIC_RELEASE);
+    return request;
+}
+
+/// Arena Functions ///////////////////////
+
+/* init_arena()
+ * ------------
+ * Initialises an empty Arena whose block holds capacity bytes.
+ *
+ * arena: The Arena to be initialised.
+ * capacity: The size of the first block, a multiple of CACHE_LINE.
+ */
+void init_arena(Arena* arena, size_t capacity)
+{
+    arena->block = (uint8_t*)aligned_alloc(CACHE_LINE, capacity);
+    arena->capacity = arena->block ? capacity : 0;
+    arena->used = 0;
+    arena->overflow = 0;
+    arena->chunks = NULL;
+}
+
+/* arena_alloc()
+ * -------------
+ * Hands out size bytes that stay valid until the next arena_reset(). Every
+ * allocation starts on its own cache line, which also suits the aligned loads
+ * of the haar.c kernels.
+ *
+ * arena: The Arena of the calling worker thread.
+ * size: The number of bytes needed.
+ *
+ * Returns: The allocated bytes, or NULL if an overflow chunk could not be
+ *          allocated.
+ */
+void* arena_alloc(Arena* arena, size_t size)
+{
+    size = (size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    if (size <= arena->capacity - arena->used) {
+        void* data = arena->block + arena->used;
+        arena->used += size;
+        return data;
+    }
+    // block is full, fall back to a chunk of its own until the next reset
+    ArenaChunk* chunk
+            = (ArenaChunk*)aligned_alloc(CACHE_LINE, CACHE_LINE + size);
+    if (!chunk) {
+        return NULL;
+    }
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->overflow += size;
+    return (uint8_t*)chunk + CACHE_LINE;
+}
+
+/* arena_image()
+ * -------------
+ * Creates an 8 bit image whose header and pixels both live in the arena. The
+ * image must not be passed to cvReleaseImage(), it goes away with the next
+ * arena_reset().
+ *
+ * arena: The Arena of the calling worker thread.
+ * size: The width and height of the image.
+ * channels: The number of channels per pixel.
+ *
+ * Returns: The new Image, or NULL if the arena could not grow.
+ */
+Image* arena_image(Arena* arena, CvSize size, int channels)
+{
+    Image* image = (Image*)arena_alloc(arena, sizeof(Image));
+    if (!image) {
+        return NULL;
+    }
+    cvInitImageHeader(image, size, IPL_DEPTH_8U, channels, IPL_ORIGIN_TL,
+            CV_DEFAULT_IMAGE_ROW_ALIGN);
+    void* data = arena_alloc(arena, image->imageSize);
+    if (!data) {
+        return NULL;
+    }
+    cvSetData(image, data, image->widthStep);
+    return image;
+}
+
+/* arena_reset()
+ * -------------
+ * Gives back everything allocated from the arena since the last reset. If the
+ * request needed overflow chunks, block is regrown to hold all of it (up to
+ * ARENA_RETAIN_LIMIT) so that the next request of the same size fits.
+ *
+ * arena: The Arena of the calling worker thread.
+ */
+void arena_reset(Arena* arena)
+{
+    size_t needed = arena->used + arena->overflow;
+    while (arena->chunks) {
+        ArenaChunk* chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        free(chunk);
+    }
+    if (needed > arena->capacity && arena->capacity < ARENA_RETAIN_LIMIT) {
+        size_t capacity
+                = needed < ARENA_RETAIN_LIMIT ? needed : ARENA_RETAIN_LIMIT;
+        free(arena->block);
+        init_arena(arena, capacity);
+    }
+    arena->used = 0;
+    arena->overflow = 0;
+}
+
+/// Cache Functions ///////////////////////
+
+/* init_cache()
+ * ------------
+ * Creates an empty Cache holding at most capacity bytes of entries, shared
+ * by all of its shards.
+ *
+ * capacity: The memory cap of the cache in bytes.
+ *
+ * Returns: The new Cache, or NULL if capacity is 0.
+ */
+Cache* init_cache(size_t capacity)
+{
+    if (!capacity) {
+        return NULL;
+    }
+    // aligned_alloc() needs a whole number of cache lines
+    size_t size = (sizeof(Cache) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    Cache* cache = (Cache*)aligned_alloc(CACHE_LINE, size);
+    memset(cache, 0, size);
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        CacheShard* shard = &cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->buckets
+                = (CacheEntry**)calloc(CACHE_BUCKETS, sizeof(CacheEntry*));
+        shard->mask = CACHE_BUCKETS - 1;
+    }
+    cache->capacity = capacity;
+    return cache;
+}
+
+/* hash_bytes()
+ * ------------
+ * Hashes length bytes with XXH64 (seed 0), which reads eight bytes at a time
+ * in four independent lanes and so keeps up with the network.
+ *
+ * data: The bytes to be hashed.
+ * length: The number of bytes.
+ *
+ * Returns: The 64 bit hash.
+ */
+uint64_t hash_bytes(const uint8_t* data, size_t length)
+{
+    const uint64_t p1 = 11400714785074694791ULL;
+    const uint64_t p2 = 14029467366897019727ULL;
+    const uint64_t p3 = 1609587929392839161ULL;
+    const uint64_t p4 = 9650029242287828579ULL;
+    const uint64_t p5 = 2870177450012600261ULL;
+    const uint8_t* end = data + length;
+    uint64_t hash;
+    uint64_t word;
+    uint32_t half;
+#define ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+#define ROUND(acc, input) (ROTL((acc) + (input) * p2, 31) * p1)
+    if (length >= 32) {
+        uint64_t lanes[4] = {p1 + p2, p2, 0, -p1};
+        for (; data + 32 <= end; data += 32) {
+            for (int i = 0; i < 4; i++) {
+                memcpy(&word, data + i * sizeof(uint64_t), sizeof(uint64_t));
+                lanes[i] = ROUND(lanes[i], word);
+            }
+        }
+        hash = ROTL(lanes[0], 1) + ROTL(lanes[1], 7) + ROTL(lanes[2], 12)
+                + ROTL(lanes[3], 18);
+        for (int i = 0; i < 4; i++) {
+            hash = (hash ^ ROUND(0, lanes[i])) * p1 + p4;
+        }
+    } else {
+        hash = p5;
+    }
+    hash += length;
+    for (; data + sizeof(uint64_t) <= end; data += sizeof(uint64_t)) {
+        memcpy(&word, data, sizeof(uint64_t));
+        hash = ROTL(hash ^ ROUND(0, word), 27) * p1 + p4;
+    }
+    if (data + sizeof(uint32_t) <= end) {
+        memcpy(&half, data, sizeof(uint32_t));
+        hash = ROTL(hash ^ (half * p1), 23) * p2 + p3;
+        data += sizeof(uint32_t);
+    }
+    for (; data < end; data++) {
+        hash = ROTL(hash ^ (*data * p5), 11) * p1;
+    }
+#undef ROUND
+#undef ROTL
+    hash ^= hash >> 33;
+    hash *= p2;
+    hash ^= hash >> 29;
+    hash *= p3;
+    return hash ^ (hash >> 32);
+}
+
+/* cache_key()
+ * -----------
+ * Builds the CacheKey of a fully recieved request. Run by worker threads so
+ * the event loop never spends time hashing. Keys are compared with memcmp(),
+ * so the padding is zeroed too.
+ *
+ * request: The fully recieved Request.
+ * key: The CacheKey to be filled in.
+ */
+void cache_key(Request* request, CacheKey* key)
+{
+    memset(key, 0, sizeof(CacheKey));
+    key->operation = request->operation | (request->fast ? fastFlag : 0);
+    for (int i = 0; i < MAX_IMAGES; i++) {
+        if (request->images[i]) {
+            key->hashes[i]
+                    = hash_bytes(request->images[i], request->imageSizes[i]);
+            key->sizes[i] = request->imageSizes[i];
+        }
+    }
+}
+
+/* cache_hash()
+ * ------------
+ * Combines the fields of a key into the hash choosing its shard (low bits)
+ * and its bucket within the shard (high bits).
+ *
+ * key: The CacheKey to be hashed.
+ *
+ * Returns: The combined hash.
+ */
+uint64_t cache_hash(const CacheKey* key)
+{
+    return key->hashes[0] ^ key->hashes[1] ^ key->operation;
+}
+
+/* cache_matches()
+ * ---------------
+ * Tells whether entry was stored for a request with the same operation and
+ * images as request. Keys are compared first; the images are only compared
+ * when the keys are equal, which short of a hash collision means they match.
+ * A client can therefore never be served the output of another client's
+ * images, however it crafts its own.
+ *
+ * entry: A CacheEntry listed by the cache.
+ * key: The CacheKey of request.
+ * request: The fully recieved Request.
+ *
+ * Returns: 1 if entry is the response to request, 0 otherwise.
+ */
+int cache_matches(
+        const CacheEntry* entry, const CacheKey* key, const Request* request)
+{
+    if (memcmp(&entry->key, key, sizeof(CacheKey))) {
+        return 0;
+    }
+    const uint8_t* stored = entry->data + entry->length;
+    for (int i = 0; i < MAX_IMAGES; i++) {
+        if (key->sizes[i]
+                && memcmp(stored, request->images[i], key->sizes[i])) {
+            return 0;
+        }
+        stored += key->sizes[i];
+    }
+    return 1;
+}
+
+/* cache_lookup()
+ * --------------
+ * Finds the entry stored for request, marking it as the most recently used.
+ *
+ * cache: The shared Cache.
+ * key: The CacheKey of the request.
+ * request: The fully recieved Request.
+ *
+ * Returns: The entry, with a reference held for the caller, or NULL if the
+ *          request has not been seen (or has been evicted).
+ */
+CacheEntry* cache_lookup(
+        Cache* cache, const CacheKey* key, const Request* request)
+{
+    uint64_t hash = cache_hash(key);
+    CacheShard* shard = &cache->shards[hash & (CACHE_SHARDS - 1)];
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry* entry = shard->buckets[(hash >> 32) & shard->mask];
+    while (entry && !cache_matches(entry, key, request)) {
+        entry = entry->nextInBucket;
+    }
+    if (entry) {
+        // move to the most recently used end
+        cache_unlink(shard, entry);
+        cache_insert(shard, entry);
+        entry->lastUsed = now_nanos();
+        __atomic_add_fetch(&entry->references, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+}
+
+/* cache_response()
+ * ----------------
+ * Stores a freshly built response under key, evicting the least recently used
+ * entries of the whole cache to make room (see cache_trim()). The encoded
+ * output is moved into the entry and response is left sending it from there,
+ * so the output costs one copy and no extra memory. The request's images are
+ * kept alongside it, to be compared on a hit (see cache_matches()). Entries
+ * bigger than the whole cache are not kept.
+ *
+ * cache: The shared Cache.
+ * key: The CacheKey of request.
+ * request: The fully recieved Request response was built for.
+ * response: The Response built by client_detect() or client_replace(), or an
+ *           error response.
+ */
+void cache_response(Cache* cache, const CacheKey* key, const Request* request,
+        Response* response)
+{
+    size_t length = response->output ? response->bodyLength : 0;
+    size_t inputLength = (size_t)key->sizes[0] + key->sizes[1];
+    CacheEntry* entry
+            = (CacheEntry*)malloc(sizeof(CacheEntry) + length + inputLength);
+    if (!entry) {
+        return;
+    }
+    memcpy(&entry->key, key, sizeof(CacheKey)); // padding included
+    entry->references = 1; // held by response, or dropped below
+    entry->length = length;
+    entry->bytes = sizeof(CacheEntry) + length + inputLength;
+    uint8_t* stored = entry->data + length;
+    for (int i = 0; i < MAX_IMAGES; i++) {
+        if (key->sizes[i]) {
+            memcpy(stored, request->images[i], key->sizes[i]);
+            stored += key->sizes[i];
+        }
+    }
+    if (response->output) {
+        entry->message = NULL;
+        memcpy(entry->data, response->body, length);
+        cvReleaseMat(&response->output);
+        response->entry = entry;
+        response->body = entry->data;
+    } else {
+        entry->message = (const char*)response->body;
+    }
+    uint64_t hash = cache_hash(key);
+    CacheShard* shard = &cache->shards[hash & (CACHE_SHARDS - 1)];
+    CacheEntry** bucket;
+    pthread_mutex_lock(&shard->lock);
+    bucket = &shard->buckets[(hash >> 32) & shard->mask];
+    CacheEntry* found = *bucket;
+    while (found && !cache_matches(found, key, request)) {
+        found = found->nextInBucket;
+    }
+    int inserted = !found && entry->bytes <= cache->capacity;
+    if (inserted) {
+        entry->nextInBucket = *bucket;
+        *bucket = entry;
+        cache_insert(shard, entry);
+        entry->lastUsed = now_nanos();
+        shard->count++;
+        shard->bytes += entry->bytes;
+        __atomic_add_fetch(&cache->bytes, entry->bytes, __ATOMIC_RELAXED);
+        entry->references++;
+        if (shard->count > shard->mask + 1) {
+            // keep chains short by doubling the buckets
+            size_t mask = shard->mask * 2 + 1;
+            CacheEntry** buckets
+                    = (CacheEntry**)calloc(mask + 1, sizeof(CacheEntry*));
+            for (size_t i = 0; buckets && i <= shard->mask; i++) {
+                while (shard->buckets[i]) {
+                    CacheEntry* moved = shard->buckets[i];
+                    uint64_t movedHash = cache_hash(&moved->key);
+                    shard->buckets[i] = moved->nextInBucket;
+                    moved->nextInBucket = buckets[(movedHash >> 32) & mask];
+                    buckets[(movedHash >> 32) & mask] = moved;
+                }
+            }
+            if (buckets) {
+                free(shard->buckets);
+                shard->buckets = buckets;
+                shard->mask = mask;
+            }
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (!response->entry) {
+        // error messages are static, the response needs no reference
+        cache_release(entry);
+    }
+    if (inserted) {
+        cache_trim(cache);
+    }
+}
+
+/* cache_trim()
+ * ------------
+ * Evicts entries until the cache holds no more than its capacity, so a large
+ * entry makes room by evicting from any shard rather than only its own. Each
+ * time, the shard whose oldest entry was used longest ago is found and that
+ * entry evicted. Only one shard lock is held at a time, so entries used
+ * meanwhile may make this only close to least recently used.
+ *
+ * cache: The shared Cache.
+ */
+void cache_trim(Cache* cache)
+{
+    while (__atomic_load_n(&cache->bytes, __ATOMIC_RELAXED)
+            > cache->capacity) {
+        CacheShard* victim = NULL;
+        uint64_t oldest = UINT64_MAX;
+        for (int i = 0; i < CACHE_SHARDS; i++) {
+            CacheShard* shard = &cache->shards[i];
+            pthread_mutex_lock(&shard->lock);
+            if (shard->oldest && shard->oldest->lastUsed <= oldest) {
+                oldest = shard->oldest->lastUsed;
+                victim = shard;
+            }
+            pthread_mutex_unlock(&shard->lock);
+        }
+        if (!victim) {
+            return;
+        }
+        pthread_mutex_lock(&victim->lock);
+        if (victim->oldest) {
+            cache_evict(cache, victim, victim->oldest);
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+}
+
+/* cache_evict()
+ * -------------
+ * Takes an entry out of the cache, freeing it unless a Response is still
+ * sending it. The shard's lock must be held.
+ *
+ * cache: The shared Cache.
+ * shard: The CacheShard the entry belongs to.
+ * entry: The CacheEntry, currently listed.
+ */
+void cache_evict(Cache* cache, CacheShard* shard, CacheEntry* entry)
+{
+    CacheEntry** link
+            = &shard->buckets[(cache_hash(&entry->key) >> 32) & shard->mask];
+    while (*link != entry) {
+        link = &(*link)->nextInBucket;
+    }
+    *link = entry->nextInBucket;
+    cache_unlink(shard, entry);
+    shard->count--;
+    shard->bytes -= entry->bytes;
+    __atomic_sub_fetch(&cache->bytes, entry->bytes, __ATOMIC_RELAXED);
+    cache_release(entry);
+}
+
+/* cache_insert()
+ * --------------
+ * Puts an entry at the most recently used end of its shard's LRU list. The
+ * shard's lock must be held.
+ *
+ * shard: The CacheShard the entry belongs to.
+ * entry: The CacheEntry, not currently in the list.
+ */
+void cache_insert(CacheShard* shard, CacheEntry* entry)
+{
+    entry->newer = NULL;
+    entry->older = shard->newest;
+    if (shard->newest) {
+        shard->newest->newer = entry;
+    } else {
+        shard->oldest = entry;
+    }
+    shard->newest = entry;
+}
+
+/* cache_unlink()
+ * --------------
+ * Takes an entry out of its shard's LRU list. The shard's lock must be held.
+ *
+ * shard: The CacheShard the entry belongs to.
+ * entry: The CacheEntry, currently in the list.
+ */
+void cache_unlink(CacheShard* shard, CacheEntry* entry)
+{
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        shard->newest = entry->older;
+    }
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        shard->oldest = entry->newer;
+    }
+}
+
+/* cache_release()
+ * ---------------
+ * Drops a reference to an entry, freeing it once neither the cache nor any
+ * Response refers to it.
+ *
+ * entry: The CacheEntry no longer needed by the caller.
+ */
+void cache_release(CacheEntry* entry)
+{
+    if (!__atomic_sub_fetch(&entry->references, 1, __ATOMIC_ACQ_REL)) {
+        free(entry);
+    }
+}
+
+/// Overlay Functions /////////////////////
+
+/* init_overlays()
+ * ---------------
+ * Creates the empty OverlayCache shared by every worker.
+ *
+ * Returns: The new OverlayCache.
+ */
+OverlayCache* init_overlays(void)
+{
+    OverlayCache* overlays = (OverlayCache*)calloc(1, sizeof(OverlayCache));
+    pthread_mutex_init(&overlays->lock, NULL);
+    return overlays;
+}
+
+/* get_overlay()
+ * -------------
+ * Finds the Overlay for a recieved replace image, decoding it and building
+ * its mips only if the same bytes have not been recieved recently. Overlays
+ * are found by hash and size, and then checked against a copy of their
+ * encoded image, so an image crafted to collide with another is never drawn
+ * with its overlay. A new overlay is kept in place of the least recently used
+ * ones, unless it alone is bigger than OVERLAY_CACHE_BYTES.
+ *
+ * overlays: The shared OverlayCache.
+ * data: The recieved replace image bytes.
+ * size: The number of recieved bytes.
+ *
+ * Returns: The Overlay, with a reference held for the caller, or NULL if the
+ *          image could not be decoded.
+ */
+Overlay* get_overlay(OverlayCache* overlays, uint8_t* data, uint32_t size)
+{
+    uint64_t hash = hash_bytes(data, size);
+    pthread_mutex_lock(&overlays->lock);
+    for (Overlay** link = &overlays->newest; *link; link = &(*link)->next) {
+        Overlay* overlay = *link;
+        if (overlay->hash == hash && overlay->size == size
+                && !memcmp(overlay->encoded, data, size)) {
+            // move to the front
+            *link = overlay->next;
+            overlay->next = overlays->newest;
+            overlays->newest = overlay;
+            __atomic_add_fetch(&overlay->references, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&overlays->lock);
+            return overlay;
+        }
+    }
+    pthread_mutex_unlock(&overlays->lock);
+    // decode outside the lock, other workers may use the cache meanwhile
+    Image* image = load_image(data, size, 1);
+    Overlay* overlay = image ? build_overlay(image) : NULL;
+    if (!overlay) {
+        return NULL;
+    }
+    overlay->hash = hash;
+    overlay->size = size;
+    overlay->bytes += size;
+    if (overlay->bytes > OVERLAY_CACHE_BYTES
+            || !(overlay->encoded = (uint8_t*)malloc(size))) {
+        return overlay;
+    }
+    memcpy(overlay->encoded, data, size);
+    pthread_mutex_lock(&overlays->lock);
+    overlay->references++; // held by the cache
+    overlay->next = overlays->newest;
+    overlays->newest = overlay;
+    overlays->count++;
+    overlays->bytes += overlay->bytes;
+    while (overlays->count > OVERLAY_CACHE_ENTRIES
+            || overlays->bytes > OVERLAY_CACHE_BYTES) {
+        // evict the least recently used overlay
+        Overlay** link = &overlays->newest;
+        while ((*link)->next) {
+            link = &(*link)->next;
+        }
+        Overlay* oldest = *link;
+        *link = NULL;
+        overlays->count--;
+        overlays->bytes -= oldest->bytes;
+        release_overlay(oldest);
+    }
+    pthread_mutex_unlock(&overlays->lock);
+    return overlay;
+}
+
+/* build_overlay()
+ * ---------------
+ * Builds the premultiplied BGRA mips of a decoded replace image. Images
+ * without an alpha channel are made opaque so every overlay is drawn the same
+ * way.
+ *
+ * image: The decoded replace image, taken over by the Overlay.
+ *
+ * Returns: The new Overlay with one reference held for the caller, or NULL if
+ *          image does not have 8 bit channels.
+ */
+Overlay* build_overlay(Image* image)
+{
+    if (image->depth != IPL_DEPTH_8U) {
+        cvReleaseImage(&image);
+        return NULL;
+    }
+    if (image->nChannels != bgraChannels) {
+        Image* bgra = cvCreateImage(
+                cvGetSize(image), IPL_DEPTH_8U, bgraChannels);
+        cvCvtColor(image, bgra,
+                image->nChannels == 1 ? CV_GRAY2BGRA : CV_BGR2BGRA);
+        cvReleaseImage(&image);
+        image = bgra;
+    } else {
+        blend_premultiply((uint8_t*)image->imageData, image->widthStep,
+                image->width, image->height);
+    }
+    Overlay* overlay = (Overlay*)calloc(1, sizeof(Overlay));
+    overlay->references = 1;
+    overlay->mips[0] = image;
+    overlay->bytes = image->imageSize;
+    overlay->levels = 1;
+    while (overlay->levels < MAX_MIP_LEVELS
+            && (image->width > 1 || image->height > 1)) {
+        // each level is a 2x2 box filter of the last
+        CvSize size = cvSize(image->width > 1 ? image->width / 2 : 1,
+                image->height > 1 ? image->height / 2 : 1);
+        Image* level = cvCreateImage(size, IPL_DEPTH_8U, image->nChannels);
+        cvResize(image, level, CV_INTER_AREA);
+        overlay->mips[overlay->levels++] = level;
+        overlay->bytes += level->imageSize;
+        image = level;
+    }
+    return overlay;
+}
+
+/* overlay_level()
+ * ---------------
+ * Chooses the mip to resize an overlay from: the smallest one still at least
+ * size in both dimensions, so a face is never resampled from more than twice
+ * its own size nor enlarged from a smaller mip than necessary.
+ *
+ * overlay: The Overlay to be drawn.
+ * size: The size it is to be drawn at.
+ *
+ * Returns: The chosen mip.
+ */
+Image* overlay_level(Overlay* overlay, CvSize size)
+{
+    int level = 0;
+    while (level + 1 < overlay->levels
+            && overlay->mips[level + 1]->width >= size.width
+            && overlay->mips[level + 1]->height >= size.height) {
+        level++;
+    }
+    return overlay->mips[level];
+}
+
+/* release_overlay()
+ * -----------------
+ * Drops a reference to an overlay, freeing it and its mips once neither the
+ * cache nor any request refers to it.
+ *
+ * overlay: The Overlay no longer needed by the caller.
+ */
+void release_overlay(Overlay* overlay)
+{
+    if (__atomic_sub_fetch(&overlay->references, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    for (int i = 0; i < overlay->levels; i++) {
+        cvReleaseImage(&overlay->mips[i]);
+    }
+    free(overlay->encoded);
+    free(overlay);
+}
+
+/// Client Functions /////////////////////
+
+/* handle_client_event()
+ * ---------------------
+ * Handles socket readiness reported by epoll for a connection.
+ *
+ * reactor: The Reactor the connection is registered with.
+ * client: The connection the events were reported for.
+ * events: The epoll events reported.
+ */
+void handle_client_event(Reactor* reactor, Client* client, uint32_t events)
+{
+    if (client->closed) {
+        // closed earlier in the same batch of events
+        return;
+    }
+    if (events & EPOLLOUT) {
+        client_writable(reactor, client);
+    }
+    if (client->closed) {
+        return;
+    }
+    if (events & EPOLLIN) {
+        client_readable(reactor, client);
+    } else if (events & (EPOLLERR | EPOLLHUP)) {
+        // socket failed while nothing was being read from it
+        close_client(reactor, client);
+    }
+}
+
+/* wants_input()
+ * -------------
+ * Requests on a connection are served one at a time, in the order they were
+ * sent. Reading stops while a request is being processed or its response is
+ * still being sent, leaving further requests in the socket buffer.
+ *
+ * Pipelined requests are the exception: after one, reading goes on while up
+ * to MAX_PIPELINE requests are in flight or have responses waiting to be
+ * sent. A plain request following pipelined ones waits for all of them to be
+ * answered (see parse_input()).
+ *
+ * client: The connection to be checked.
+ *
+ * Returns: 1 if the next request may be read from client, 0 otherwise.
+ */
+int wants_input(Client* client)
+{
+    if (client->closing || client->closed) {
+        return 0;
+    } else if (client->pipelined) {
+        return client->inFlight + client->outCount < MAX_PIPELINE;
+    }
+    return !client->inFlight && !client->outHead;
+}
+
+/* known_operation()
+ * -----------------
+ * client: The operation field of a request.
+ *
+ * Returns: 1 if operation is one a request may ask for, 0 otherwise.
+ */
+int known_operation(uint8_t operation)
+{
+    return operation == detectFace || operation == replaceFace
+            || operation == detectRects;
+}
+
+/* reserve_image()
+ * ---------------
+ * Makes room for more of an image being recieved. Images are allocated
+ * IMAGE_CHUNK bytes at first and doubled whenever full, never beyond the size
+ * the client claimed, so a client claiming a large image but sending little
+ * costs little.
+ *
+ * request: The Request being recieved.
+ * image: The index of the image being recieved.
+ * fill: The number of bytes of the image recieved so far.
+ *
+ * Returns: 1 if there is room for at least one more byte, 0 if no memory
+ *          was left.
+ */
+int reserve_image(Request* request, int image, uint32_t fill)
+{
+    uint32_t capacity = request->imageCapacities[image];
+    uint32_t size = request->imageSizes[image];
+    if (fill < capacity) {
+        return 1;
+    }
+    if (!capacity) {
+        capacity = size < IMAGE_CHUNK ? size : IMAGE_CHUNK;
+    } else {
+        capacity = capacity > size / 2 ? size : capacity * 2;
+    }
+    uint8_t* data = (uint8_t*)realloc(request->images[image], capacity);
+    if (!data) {
+        return 0;
+    }
+    request->images[image] = data;
+    request->imageCapacities[image] = capacity;
+    return 1;
+}
+
+/* check_image()
+ * -------------
+ * Checks the header of the image being recieved as soon as enough of it has
+ * arrived, so a broken or oversized image is turned away before the rest of
+ * it is read. Formats other than JPEG and PNG are left to the decoder, and
+ * checked against the pixel limit once decoded (see decoded_too_large()).
+ *
+ * reactor: The Reactor the connection is registered with.
+ * client: The connection the image is being recieved on.
+ *
+ * Returns: 1 if the image may still be recieved, 0 if the request was
+ *          turned away.
+ * Errors: rejects the request (see reject_request()) with invalidImgMsg when
+ *         the header is broken and imgLargeMsg when the image has more pixels
+ *         than reactor.maxPixels.
+ */
+int check_image(Reactor* reactor, Client* client)
+{
+    Request* request = client->request;
+    CvSize size;
+    HeaderStatus status = image_header(
+            request->images[client->image], client->imageFill, &size);
+    if (status == HEADER_PARTIAL
+            && client->imageFill < request->imageSizes[client->image]) {
+        // wait for more of the header
+        return 1;
+    }
+    client->imageChecked = 1;
+    if (status == HEADER_INVALID) {
+        reject_request(reactor, client, invalidImgMsg);
+        return 0;
+    } else if (status == HEADER_FOUND && too_many_pixels(reactor, size)) {
+        reject_request(reactor, client, imgLargeMsg);
+        return 0;
+    }
+    return 1;
+}
+
+/* too_many_pixels()
+ * -----------------
+ * Returns: 1 if an image of size has more pixels than reactor.maxPixels, 0
+ *          otherwise or if there is no limit.
+ */
+int too_many_pixels(Reactor* reactor, CvSize size)
+{
+    return reactor->maxPixels
+            && (uint64_t)size.width * size.height > reactor->maxPixels;
+}
+
+/* client_readable()
+ * -----------------
+ * Reads whatever the client has sent without blocking, parsing it as it
+ * arrives. Image bytes are read straight into the Request being recieved
+ * (see reserve_image()), only the small framing fields pass through
+ * client.in.
+ *
+ * At most READ_BUDGET bytes are read per call so a single fast client cannot
+ * starve the other connections.
+ *
+ * reactor: The Reactor the connection is registered with.
+ * client: The connection that has become readable.
+ */
+void client_readable(Reactor* reactor, Client* client)
+{
+    size_t budget = READ_BUDGET;
+    while (budget && wants_input(client)) {
+        uint8_t* target;
+        size_t length;
+        int intoImage = client->state == RECV_IMAGE && !client->discarding;
+        if (intoImage) {
+            // parse_input() has already emptied client.in
+            Request* request = client->request;
+            if (!reserve_image(request, client->image, client->imageFill)) {
+                reject_request(reactor, client, imgLargeMsg);
+                continue;
+            }
+            target = request->images[client->image] + client->imageFill;
+            length = request->imageCapacities[client->image]
+                    - client->imageFill;
+        } else {
+            // keep unparsed bytes at the start of client.in
+            memmove(client->in, client->in + client->inStart,
+                    client->inEnd - client->inStart);
+            client->inEnd -= client->inStart;
+            client->inStart = 0;
+            target = client->in + client->inEnd;
+            length = IN_BUFFER_SIZE - client->inEnd;
+        }
+        if (length > budget) {
+            length = budget;
+        }
+        ssize_t nread = recv(client->fd, target, length, 0);
+        if (nread == 0) {
+            client_eof(reactor, client);
+            return;
+        } else if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // connection reset
+                close_client(reactor, client);
+            }
+            return;
+        }
+        budget -= nread;
+        if (intoImage) {
+            client->imageFill += nread;
+        } else {
+            client->inEnd += nread;
+        }
+        parse_input(reactor, client);
+    }
+    update_events(reactor, client);
+}
+
+/* parse_input()
+ * -------------
+ * Advances the connection through the communication protocol using the bytes
+ * recieved so far, dispatching the request once it is complete.
+ *
+ * reactor: The Reactor the connection is registered with.
+ * client: The connection whose recieved bytes are to be parsed.
+ *
+ * A pipelinedRequest operation is followed by a 4 byte request ID and then
+ * the operation and images as usual. fastFlag may be set in the operation
+ * of any request (other than pipelinedRequest itself).
+ *
+ * Errors: Excluding case (i), all cases use send_error_message() to send
+ *         error message to client socket.
+ *      (i)   function calls handle_bad_request() whenever an invalid prefix is
+ *            recieved from client. See handle_bad_request() for more details.
+ *      (ii)  sends invalidOpMsg when recieved operation (or the operation of
+ *            a pipelined request) is invalid.
+ *      (iii) sends zeroByteMsg when the recieved byte size of an image is 0.
+ *      (iv)  sends imgLargeMsg when the recieved byte size exceeds the
+ *            server's maxsize limit, or memory for the image runs out.
+ *      (v)   sends invalidImgMsg or imgLargeMsg as soon as the header of an
+ *            image is found to be broken or too large (see check_image()).
+ *      Cases (iii) to (v) only close the connection for a plain request; a
+ *      pipelined request is answered on its own and the rest of it skipped
+ *      (see reject_request()).
+ */
+void parse_input(Reactor* reactor, Client* client)
+{
+    // NOTE: This function follows the communication protocol highlighed in
+    //       specsheet - which is:
+    //       (i)   get prefix
+    //       (ii)  get operation type (IF pipelined, get request ID and then
+    //             operation type)
+    //       (iii) get image 1 size (number of bytes M)
+    //       (iv)  get image 1 data (as bytes)
+    //       (v)   IF present, get image 2 size (number of bytes N)
+    //       (vi)  IF present, get image 2 data (as bytes)
+    while (wants_input(client)) {
+        size_t available = client->inEnd - client->inStart;
+        uint8_t* next = client->in + client->inStart;
+        Request* request = client->request;
+        if (client->state == RECV_PREFIX) {
+            uint32_t recievedPrefix;
+            if (available < sizeof(uint32_t)) {
+                return;
+            }
+            memcpy(&recievedPrefix, next, sizeof(uint32_t));
+            client->inStart += sizeof(uint32_t);
+            if (recievedPrefix != prefix) {
+                // valid prefix was not recieved, send contents to responsefile
+                handle_bad_request(reactor, client);
+                return;
+            }
+            client->state = RECV_OPERATION;
+        } else if (client->state == RECV_OPERATION) {
+            if (!available) {
+                return;
+            }
+            uint8_t recievedOperation = *next;
+            if (recievedOperation == pipelinedRequest) {
+                client->pipelined = 1;
+            } else if (!known_operation(recievedOperation & ~fastFlag)) {
+                // invalid operation request detected
+                client->inStart++;
+                send_error_message(reactor, client, invalidOpMsg);
+                return;
+            } else if (client->inFlight || client->outHead) {
+                // plain request after pipelined ones, answer those first
+                client->pipelined = 0;
+                return;
+            }
+            client->inStart++;
+            client->request = (Request*)calloc(1, sizeof(Request));
+            client->request->client = client;
+            client->request->started = now_nanos();
+            client->request->operation = recievedOperation & ~fastFlag;
+            client->request->fast
+                    = reactor->fastDetect || recievedOperation & fastFlag;
+            client->image = 0;
+            client->state = recievedOperation == pipelinedRequest ? RECV_ID
+                                                                  : RECV_SIZE;
+        } else if (client->state == RECV_ID) {
+            if (available < sizeof(uint32_t)) {
+                return;
+            }
+            memcpy(&request->id, next, sizeof(uint32_t));
+            client->inStart += sizeof(uint32_t);
+            request->tagged = 1;
+            client->state = RECV_TAGGED_OPERATION;
+        } else if (client->state == RECV_TAGGED_OPERATION) {
+            if (!available) {
+                return;
+            }
+            request->operation = *next & ~fastFlag;
+            request->fast = reactor->fastDetect || *next & fastFlag;
+            client->inStart++;
+            if (!known_operation(request->operation)) {
+                // invalid operation request detected
+                send_error_message(reactor, client, invalidOpMsg);
+                return;
+            }
+            client->state = RECV_SIZE;
+        } else if (client->state == RECV_SIZE) {
+            uint32_t fileByteSize;
+            if (available < sizeof(uint32_t)) {
+                return;
+            }
+            memcpy(&fileByteSize, next, sizeof(uint32_t));
+            client->inStart += sizeof(uint32_t);
+            request->imageSizes[client->image] = fileByteSize;
+            client->imageFill = 0;
+            client->imageChecked = 0;
+            client->state = RECV_IMAGE;
+            if (client->discarding) {
+                // size of an image of a rejected request, only skipped
+            } else if (!fileByteSize) {
+                // byte size of image is zero
+                reject_request(reactor, client, zeroByteMsg);
+            } else if (fileByteSize > reactor->maxSize) {
+                // supplied byte size exceed's server's maxSize limit
+                reject_request(reactor, client, imgLargeMsg);
+            }
+        } else if (client->discarding) {
+            uint32_t left
+                    = request->imageSizes[client->image] - client->imageFill;
+            size_t skip = available < left ? available : left;
+            client->inStart += skip;
+            client->imageFill += skip;
+            if (client->imageFill < request->imageSizes[client->image]) {
+                // rest of the image has not arrived yet
+                return;
+            }
+            if (request->operation == replaceFace && !client->image) {
+                // replace image follows the detect image
+                client->image = 1;
+                client->state = RECV_SIZE;
+            } else {
+                // the rejected request has been skipped and answered
+                free_request(request);
+                client->request = NULL;
+                client->discarding = 0;
+                client->state = RECV_PREFIX;
+            }
+        } else {
+            if (!reserve_image(request, client->image, client->imageFill)) {
+                reject_request(reactor, client, imgLargeMsg);
+                continue;
+            }
+            uint32_t room = request->imageCapacities[client->image]
+                    - client->imageFill;
+            size_t copy = available < room ? available : room;
+            memcpy(request->images[client->image] + client->imageFill, next,
+                    copy);
+            client->inStart += copy;
+            client->imageFill += copy;
+            if (!client->imageChecked && !check_image(reactor, client)) {
+                continue;
+            } else if (client->imageFill
+                    < request->imageSizes[client->image]) {
+                if (copy == available) {
+                    // rest of the image has not arrived yet
+                    return;
+                }
+                continue;
+            }
+            if (request->operation == replaceFace && !client->image) {
+                // replace image follows the detect image
+                client->image = 1;
+                client->state = RECV_SIZE;
+            } else {
+                client->request = NULL;
+                client->state = RECV_PREFIX;
+                record_stage(reactor->times, STAGE_RECEIVE, request->started);
+                dispatch_request(reactor, request);
+            }
+        }
+    }
+}
+
+/* client_eof()
+ * ------------
+ * Handles the client shutting down its end of the connection. A client that
+ * disconnects between requests is simply closed (once the responses to any
+ * pipelined requests have been sent), one that disconnects part way through a
+ * request is sent the error matching the missing field.
+ *
+ * reactor: The Reactor the connection is registered with.
+ * client: The connection that has reached end of file.
+ */
+void client_eof(Reactor* reactor, Client* client)
+{
+    if (client->discarding) {
+        // the rejected request has already been answered
+        free_request(client->request);
+        client->request = NULL;
+        client->discarding = 0;
+        client->state = RECV_PREFIX;
+        client->inStart = client->inEnd;
+    }
+    if (client->state == RECV_PREFIX && client->inStart == client->inEnd
+            && (client->inFlight || client->outHead)) {
+        // no request was started, finish answering the pipelined ones
+        client->closing = 1;
+        update_events(reactor, client);
+    } else if (client->state == RECV_PREFIX
+            && client->inStart == client->inEnd) {
+        // no request was started
+        close_client(reactor, client);
+    } else if (client->state == RECV_PREFIX) {
+        // valid prefix was not recieved
+        handle_bad_request(reactor, client);
+    } else if (client->state == RECV_OPERATION || client->state == RECV_ID
+            || client->state == RECV_TAGGED_OPERATION) {
+        // operation could not be recieved
+        send_error_message(reactor, client, invalidMsg);
+    } else if (client->state == RECV_SIZE) {
+        // image size could not be recieved
+        send_error_message(reactor, client, zeroByteMsg);
+    } else {
+        // image data could not be recieved
+        send_error_message(reactor, client, invalidImgMsg);
+    }
+}
+
+/* handle_bad_request()
+ * -------------------
+ * Function sends the binary contents of the response file (path is specified
+ * by responseFile) and closes the connection once it has been sent. The file
+ * is sent straight from the cached descriptor, it is never copied into
+ * memory.
+ *
+ * reactor: The Reactor the connection is registered with.
+ * client: The Client that submitted a "badly formed request".
+ */
+void handle_bad_request(Reactor* reactor, Client* client)
+{
+    Response* response = (Response*)calloc(1, sizeof(Response));
+    if (reactor->responseFd >= 0) {
+        response->fromFile = 1;
+        response->bodyFd = reactor->responseFd;
+        response->bodyLength = reactor->responseSize;
+    }
+    response->statMember = NO_STAT;
+    response->closeAfter = 1;
+    update_stat(reactor->stat, INVALID, INCREMENT);
+    client->closing = 1;
+    queue_response(reactor, client, response);
+}
+
+/* reject_request()
+ * ----------------
+ * Turns away the request being recieved with an error message. A pipelined
+ * request is answered on its own and the connection stays open: as the size
+ * of every image is known before it arrives, the rest of the request is
+ * skipped (see parse_input()) and the next request is found after it. A
+ * plain request is answered by send_error_message(). The response may be
+ * sent, and the requests after it parsed, before this returns, so callers
+ * must not rely on the connection's state being unchanged.
+ *
+ * reactor: The Reactor the connection is registered with.
+ * client: The connection the request is being recieved on.
+ * msg: The error message to be sent to the client.
+ */
+void reject_request(Reactor* reactor, Client* client, ImmutableString msg)
+{
+    Request* request = client->request;
+    if (!request->tagged) {
+        send_error_message(reactor, client, msg);
+        return;
+    }
+    Response* response = error_response(msg);
+    tag_response(response, request->id);
+    for (int i = 0; i < MAX_IMAGES; i++) {
+        // only the sizes are needed to skip the images
+        free(request->images[i]);
+        request->images[i] = NULL;
+        request->imageCapacities[i] = 0;
+    }
+    client->discarding = 1;
+    queue_response(reactor, client, response);
+}
+
+/* send_error_message()
+ * --------------------
+ * Sends specified error message to client and closes the connection once it
+ * has been sent. Any partly recieved request is discarded.
+ *
+ * reactor: The Reactor the connection is registered with.
+ * client: The connection the error occured on.
+ * msg: The error message to be sent to the client.
+ */
+void send_error_message(Reactor* reactor, Client* client, ImmutableString msg)
+{
+    Response* response = error_response(msg);
+    if (client->request) {
+        if (client->request->tagged) {
+            tag_response(response, client->request->id);
+        }
+        free_request(client->request);
+        client->request = NULL;
+    }
+    client->closing = 1;
+    queue_response(reactor, client, response);
+}
+
+/* queue_response()
+ * ----------------
+ * Adds a response to the back of the connection's output and tries to send it
+ * straight away.
+ *
+ * reactor: The Reactor the connection is registered with.
+ * client: The connection the response is for.
+ * response: The Response to be sent.
+ */
+void queue_response(Reactor* reactor, Client* client, Response* response)
+{
+    response->next = NULL;
+    if (client->outTail) {
+        client->outTail->next = response;
+    } else {
+        client->outHead = response;
+    }
+    client->outTail = response;
+    client->outCount++;
+    response->queued = now_nanos();
+    if (response->closeAfter) {
+        client->closing = 1;
+    }
+    client_writable(reactor, client);
+}
+
+/* send_response()
+ * ---------------
+ * Sends as much of a response as the socket accepts without blocking, in
+ * accordance to communication protocol:
+ *       (i)   send prefix
+ *       (ii)  send operation type
+ *       (iii) send body size
+ *       (iv)  send body
+ *
+ * The header and body are gathered into one writev() straight from where
+ * they are stored (e.g. the encoder's output buffer), file bodies are sent
+ * with sendfile(). No bytes are copied in user space.
+ *
+ * client: The connection the response is for.
+ * response: The Response to be sent, response.sent is advanced.
+ *
+ * Returns: 1 once the whole response is sent, 0 if the socket is full and -1
+ *          if the connection has failed.
+ */
+int send_response(Client* client, Response* response)
+{
+    size_t total = response->headerLength + response->bodyLength;
+    while (response->sent < total) {
+        ssize_t nsent;
+        if (response->fromFile) {
+            // file bodies are never sent with a header
+            off_t offset = response->sent;
+            nsent = sendfile(client->fd, response->bodyFd, &offset,
+                    total - response->sent);
+        } else {
+            struct iovec iov[2];
+            int count = 0;
+            if (response->sent < response->headerLength) {
+                iov[count].iov_base = response->header + response->sent;
+                iov[count++].iov_len = response->headerLength - response->sent;
+            }
+            size_t bodySent = response->sent > response->headerLength
+                    ? response->sent - response->headerLength
+                    : 0;
+            if (bodySent < response->bodyLength) {
+                iov[count].iov_base = (void*)(response->body + bodySent);
+                iov[count++].iov_len = response->bodyLength - bodySent;
+            }
+            nsent = writev(client->fd, iov, count);
+        }
+        if (nsent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        } else if (!nsent) {
+            // file shrank since it was cached
+            return -1;
+        }
+        response->sent += nsent;
+    }
+    return 1;
+}
+
+/* client_writable()
+ * -----------------
+ * Sends queued responses until the socket is full. Once every response has
+ * been sent, the connection is either closed or goes back to reading the
+ * next request.
+ *
+ * reactor: The Reactor the connection is registered with.
+ * client: The connection that may be written to.
+ */
+void client_writable(Reactor* reactor, Client* client)
+{
+    while (client->outHead) {
+        Response* response = client->outHead;
+        int status = send_response(client, response);
+        if (status < 0) {
+            // client has gone away
+            close_client(reactor, client);
+            return;
+        } else if (!status) {
+            // wait for EPOLLOUT
+            break;
+        }
+        if (!(client->outHead = response->next)) {
+            client->outTail = NULL;
+        }
+        client->outCount--;
+        record_stage(reactor->times, STAGE_SEND, response->queued);
+        if (response->statMember != NO_STAT) {
+            // output successfully sent
+            update_stat(reactor->stat, response->statMember, INCREMENT);
+        }
+        free_response(response);
+    }
+    if (!client->outHead && client->closing && !client->inFlight) {
+        close_client(reactor, client);
+        return;
+    }
+    // serve any request that arrived while this one was being processed
+    parse_input(reactor, client);
+    update_events(reactor, client);
+}
+
+/* update_events()
+ * ---------------
+ * Registers the connection for reading only while it wants input and for
+ * writing only while a response is blocked on a full socket.
+ *
+ * reactor: The Reactor the connection is registered with.
+ * client: The connection to be updated.
+ */
+void update_events(Reactor* reactor, Client* client)
+{
+    struct epoll_event event = {0};
+    if (client->closed) {
+        return;
+    }
+    event.events = (wants_input(client) ? EPOLLIN : 0)
+            | (client->outHead ? EPOLLOUT : 0);
+    if (event.events != client->events) {
+        event.data.ptr = client;
+        epoll_ctl(reactor->epollFd, EPOLL_CTL_MOD, client->fd, &event);
+        client->events = event.events;
+    }
+}
+
+/* close_client()
+ * --------------
+ * Closes the connection and discards any output that was not sent. The
+ * Client struct itself is kept until no worker thread is processing a
+ * request for it.
+ *
+ * reactor: The Reactor the connection is registered with.
+ * client: The connection to be closed.
+ */
+void close_client(Reactor* reactor, Client* client)
+{
+    if (client->closed) {
+        return;
+    }
+    epoll_ctl(reactor->epollFd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    client->closed = 1;
+    while (client->outHead) {
+        Response* response = client->outHead;
+        client->outHead = response->next;
+        free_response(response);
+    }
+    client->outTail = NULL;
+    client->outCount = 0;
+    if (client->request) {
+        free_request(client->request);
+        client->request = NULL;
+    }
+    update_stat(reactor->stat, CONNECTED, DECREMENT);
+    update_stat(reactor->stat, COMPLETED, INCREMENT);
+    reactor->connections--;
+    if (!client->inFlight) {
+        retire_client(reactor, client);
+    }
+    if (!reactor->pendingHead) {
+        set_listening(reactor, reactor->connections < reactor->maxConnections);
+    }
+}
+
+/* retire_client()
+ * ---------------
+ * Schedules a closed connection to be freed at the end of the current batch
+ * of events (see reactor_loop()).
+ *
+ * reactor: The Reactor the connection was registered with.
+ * client: The closed connection with no requests in flight.
+ */
+void retire_client(Reactor* reactor, Client* client)
+{
+    client->nextRetired = reactor->retired;
+    reactor->retired = client;
+}
+
+/// Request Functions ////////////////////
+
+/* process_request()
+ * -----------------
+ * Decodes the recieved images and performs the requested operation, leaving
+ * the Response to be sent in request.response. Run by worker threads.
+ *
+ * When the result cache is enabled, a request whose images have been seen
+ * before is answered from the cache without being decoded, and every other
+ * response is cached unless it only failed for lack of memory.
+ *
+ * The response to a pipelined request is tagged with its request ID.
+ *
+ * request: The fully recieved Request.
+ * worker: The Worker struct of the calling worker thread.
+ *
+ * Errors: request.response is set to invalidImgMsg whenever either image
+ *         cannot be decoded, and to imgLargeMsg whenever either has more
+ *         pixels than reactor.maxPixels once decoded.
+ */
+void process_request(Request* request, Worker* worker)
+{
+    CacheKey key;
+    CacheEntry* entry = NULL;
+    if (worker->cache) {
+        cache_key(request, &key);
+        entry = cache_lookup(worker->cache, &key, request);
+        update_stat(worker->reactor->stat, entry ? CACHE_HIT : CACHE_MISS,
+                INCREMENT);
+    }
+    if (entry) {
+        // identical images were served before
+        request->response = cached_response(
+                entry, request->operation == replaceFace ? REPLACE : DETECT);
+    } else if (!decode_request(request, worker)) {
+        // failed to load input image (image 1) or replace image (image 2)
+        request->response = error_response(invalidImgMsg);
+    } else if (decoded_too_large(request, worker)) {
+        request->response = error_response(imgLargeMsg);
+    } else if (request->operation != replaceFace) {
+        client_detect(request, worker);
+    } else {
+        client_replace(request, worker);
+    }
+    if (worker->cache && !entry
+            && request->response->body != (const uint8_t*)imgLargeMsg) {
+        cache_response(worker->cache, &key, request, request->response);
+    }
+    if (request->tagged) {
+        tag_response(request->response, request->id);
+    }
+    for (int i = 0; i < MAX_IMAGES; i++) {
+        // decoded images hold their own copy of the pixels
+        free(request->images[i]);
+        request->images[i] = NULL;
+    }
+}
+
+/* load_image()
+ * ------------
+ * Initalises an Image struct from the image byte data recieved from the
+ * client. The image is decoded directly from the recieved bytes, no
+ * intermediate file is used.
+ *
+ * data: The recieved image bytes.
+ * size: The number of recieved image bytes.
+ * op: A flag that denotes if the Image struct is to be loaded with
+ *      (i) CV_LOAD_IMAGE_COLOR (denoted by 0)
+ *      (ii) CV_LOAD_IMAGE_UNCHANGED (denoted by 1)
+ *
+ * Returns: The decoded Image, or NULL if cvDecodeImage() failed due to the
+ *          supplied image byte data.
+ */
+Image* load_image(uint8_t* data, uint32_t size, int op)
+{
+    CvMat encoded = cvMat(1, size, CV_8UC1, data); // wraps the recieved bytes
+    return cvDecodeImage(
+            &encoded, op ? CV_LOAD_IMAGE_UNCHANGED : CV_LOAD_IMAGE_COLOR);
+}
+
+/* decode_request()
+ * ----------------
+ * Decodes the input image (image 1) of a request and, for replaceFace, looks
+ * up or decodes the replace image (image 2).
+ *
+ * request: The fully recieved Request.
+ * worker: The Worker struct of the calling worker thread.
+ *
+ * Returns: 1 if every image was decoded, 0 otherwise.
+ */
+int decode_request(Request* request, Worker* worker)
+{
+    uint64_t start = now_nanos();
+    request->detect = decode_frame(request);
+    if (request->detect && request->operation == replaceFace) {
+        request->overlay = get_overlay(worker->overlays, request->images[1],
+                request->imageSizes[1]);
+    }
+    record_stage(worker->times, STAGE_DECODE, start);
+    return request->detect
+            && (request->operation != replaceFace || request->overlay);
+}
+
+/* decode_frame()
+ * --------------
+ * Decodes the input image (image 1) of a request. A fast detectRects request
+ * needs nothing but the reduced image it is searched at, so a large JPEG is
+ * decoded straight to that size by scaling its DCT, which skips most of the
+ * decoding work. The rectangles found are scaled back by the reduction, so
+ * it is taken from the size the decoder returned rather than assumed: the
+ * full size divided by the reduction (rounded either way) means it was
+ * applied, the full size means the format was not reduced, and any other
+ * size (e.g. a JPEG rotated by its EXIF orientation) is decoded again in
+ * full. Every other request needs the full image to draw on.
+ *
+ * request: The Request whose input image is to be decoded, request.reduced
+ *          is set to the reduction the image was decoded at, and
+ *          request.full to the full size when reduced.
+ *
+ * Returns: The decoded Image, or NULL if the image could not be decoded.
+ */
+Image* decode_frame(Request* request)
+{
+    CvSize full;
+    request->reduced = 1;
+    if (request->fast && request->operation == detectRects
+            && image_header(request->images[0], request->imageSizes[0], &full)
+                    == HEADER_FOUND) {
+        request->reduced = haar_reduction(full.width, full.height, FAST_PIXELS);
+    }
+    if (request->reduced == 1) {
+        return load_image(request->images[0], request->imageSizes[0], 0);
+    }
+    int reduced = request->reduced;
+    CvMat encoded = cvMat(1, request->imageSizes[0], CV_8UC1,
+            request->images[0]); // wraps the recieved bytes
+    Image* image = cvDecodeImage(
+            &encoded, CV_LOAD_IMAGE_COLOR | reduced << REDUCED_DECODE_SHIFT);
+    if (!image) {
+        return NULL;
+    }
+    request->full = full;
+    // a DCT scaled JPEG rounds its size up, a resized image rounds it down
+    if ((image->width == full.width / reduced
+                || image->width == (full.width + reduced - 1) / reduced)
+            && (image->height == full.height / reduced
+                    || image->height
+                            == (full.height + reduced - 1) / reduced)) {
+        return image;
+    }
+    request->reduced = 1;
+    if (image->width == full.width && image->height == full.height) {
+        // the decoder does not reduce this format
+        return image;
+    }
+    cvReleaseImage(&image);
+    return load_image(request->images[0], request->imageSizes[0], 0);
+}
+
+/* decoded_too_large()
+ * -------------------
+ * Checks the decoded images of a request against the pixel limit. Only the
+ * headers of JPEGs and PNGs are checked as they arrive (see check_image()),
+ * so an image in any other format, or one whose header was not found, is
+ * only known to be too large once decoded.
+ *
+ * request: The Request whose images have been decoded.
+ * worker: The Worker struct of the calling worker thread.
+ *
+ * Returns: 1 if the input image (at its full size) or the replace image has
+ *          more pixels than reactor.maxPixels, 0 otherwise.
+ */
+int decoded_too_large(Request* request, Worker* worker)
+{
+    Reactor* reactor = worker->reactor;
+    CvSize frame = request->reduced > 1 ? request->full
+                                        : cvGetSize(request->detect);
+    return too_many_pixels(reactor, frame)
+            || (request->overlay
+                    && too_many_pixels(
+                            reactor, cvGetSize(request->overlay->mips[0])));
+}
+
+/* image_header()
+ * --------------
+ * Reads the image size from the header of a JPEG or PNG without decoding it.
+ *
+ * data: The image bytes recieved so far.
+ * length: The number of image bytes recieved so far.
+ * dimensions: Set to the width and height of the image when found.
+ *
+ * Returns: The HeaderStatus of the bytes recieved so far.
+ */
+HeaderStatus image_header(
+        const uint8_t* data, uint32_t length, CvSize* dimensions)
+{
+    static const uint8_t png[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    static const uint8_t ihdr[] = {'I', 'H', 'D', 'R'};
+    uint32_t compared = length < sizeof(png) ? length : sizeof(png);
+    if (!length) {
+        return HEADER_PARTIAL;
+    } else if (data[0] == 0xFF) {
+        return jpeg_header(data, length, dimensions);
+    } else if (memcmp(data, png, compared)) {
+        return HEADER_UNKNOWN;
+    } else if (length < PNG_HEADER_SIZE) {
+        return HEADER_PARTIAL;
+    } else if (memcmp(data + PNG_IHDR_OFFSET, ihdr, sizeof(ihdr))) {
+        // IHDR must be the first chunk
+        return HEADER_INVALID;
+    }
+    // IHDR holds the width and then the height, big endian
+    const uint8_t* field = data + PNG_IHDR_OFFSET + sizeof(ihdr);
+    dimensions->width
+            = field[0] << 24 | field[1] << 16 | field[2] << 8 | field[3];
+    dimensions->height
+            = field[4] << 24 | field[5] << 16 | field[6] << 8 | field[7];
+    return dimensions->width > 0 && dimensions->height > 0 ? HEADER_FOUND
+                                                           : HEADER_INVALID;
+}
+
+/* jpeg_header()
+ * -------------
+ * Reads the image size from the frame header of a JPEG, walking the marker
+ * segments that precede it (e.g. EXIF data).
+ *
+ * data: The image bytes recieved so far, starting with 0xFF.
+ * length: The number of image bytes recieved so far.
+ * dimensions: Set to the width and height of the image when found.
+ *
+ * Returns: The HeaderStatus of the bytes recieved so far.
+ */
+HeaderStatus jpeg_header(
+        const uint8_t* data, uint32_t length, CvSize* dimensions)
+{
+    uint32_t pos = 2;
+    if (length < pos) {
+        return HEADER_PARTIAL;
+    } else if (data[1] != 0xD8) {
+        // no start of image marker
+        return HEADER_UNKNOWN;
+    }
+    while (pos + 4 <= length) {
+        if (data[pos] != 0xFF) {
+            return HEADER_INVALID;
+        }
+        uint8_t marker = data[pos + 1];
+        if (marker == 0xFF) {
+            // fill byte before a marker
+            pos++;
+            continue;
+        }
+        uint32_t segment = data[pos + 2] << 8 | data[pos + 3];
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4
+                && marker != 0xC8 && marker != 0xCC) {
+            // start of frame: length, precision, height and width
+            if (pos + 9 > length) {
+                return HEADER_PARTIAL;
+            }
+            dimensions->height = data[pos + 5] << 8 | data[pos + 6];
+            dimensions->width = data[pos + 7] << 8 | data[pos + 8];
+            return dimensions->width ? HEADER_FOUND : HEADER_INVALID;
+        } else if (marker == 0xDA || marker == 0xD9 || segment < 2) {
+            // image data reached without a frame header
+            return HEADER_INVALID;
+        }
+        pos += 2 + segment;
+    }
+    return HEADER_PARTIAL;
+}
+
+/* find_faces()
+ * ------------
+ * Searches request.detect for faces, and optionally for the eyes in each,
+ * leaving them in worker.faces and worker.eyes in pixels of the full image.
+ *
+ * A fast request is searched at a reduced size (see haar_reduction()), the
+ * image being either decoded at that size already (see decode_frame()) or
+ * reduced here after the grayscale conversion. The rectangles found are then
+ * scaled back up, so faces smaller than the cascade's window at the reduced
+ * size are missed in exchange for a far smaller search.
+ *
+ * Eyes are searched for in every face at once, straight from the integral
+ * images of the whole frame (see haar_detect_regions()), so no face is
+ * copied and the faces may be searched by several threads.
+ *
+ * request: The Request whose images have been decoded.
+ * worker: The Worker struct of the calling worker thread.
+ * withEyes: Whether eyes are searched for in the faces found.
+ *
+ * Returns: The number of faces found, or -1 if there was no memory for a
+ *          frame this large.
+ */
+int find_faces(Request* request, Worker* worker, int withEyes)
+{
+    uint64_t start = now_nanos();
+    CvSize size = cvGetSize(request->detect);
+    Image* frameGray = arena_image(&worker->arena, size, 1);
+    if (!frameGray) {
+        return -1;
+    }
+    haar_gray((uint8_t*)request->detect->imageData,
+            request->detect->widthStep, frameGray->width, frameGray->height,
+            (uint8_t*)frameGray->imageData, frameGray->widthStep);
+    int reduction = request->fast
+            ? haar_reduction(size.width, size.height, FAST_PIXELS)
+            : 1;
+    if (reduction > 1) {
+        Image* reduced = arena_image(&worker->arena,
+                cvSize(size.width / reduction, size.height / reduction), 1);
+        if (!reduced) {
+            return -1;
+        }
+        cvResize(frameGray, reduced, CV_INTER_AREA);
+        frameGray = reduced;
+    }
+    int factor = reduction * request->reduced;
+    CvSize maxSize = cvSize(haarMaxSize / factor, haarMaxSize / factor);
+    haar_equalize((uint8_t*)frameGray->imageData, frameGray->widthStep,
+            frameGray->width, frameGray->height);
+    start = record_stage(worker->times, STAGE_GRAY, start);
+    haar_set_image(worker->evaluator, (uint8_t*)frameGray->imageData,
+            frameGray->width, frameGray->height, frameGray->widthStep);
+    int count = haar_detect(worker->evaluator, worker->detector->face,
+            haarMinNeighbours, cvSize(haarMinSize, haarMinSize), maxSize,
+            &worker->faces);
+    start = record_stage(worker->times, STAGE_FACES, start);
+    if (count && withEyes) {
+        haar_detect_regions(worker->evaluator, worker->detector->eye,
+                haarMinNeighbours, cvSize(haarMinSize, haarMinSize), maxSize,
+                worker->faces.rects, count, &worker->eyes);
+        record_stage(worker->times, STAGE_EYES, start);
+    } else {
+        worker->eyes.count = 0;
+    }
+    if (factor > 1) {
+        // back to pixels of the full image, eyes relative to their face
+        haar_scale_rects(worker->faces.rects, count, factor,
+                request->reduced > 1 ? request->full : size);
+        for (int i = 0; i < worker->eyes.count; i++) {
+            CvRect* face = &worker->faces.rects[i];
+            haar_scale_rects(worker->eyes.lists[i].rects,
+                    worker->eyes.lists[i].count, factor,
+                    cvSize(face->width, face->height));
+        }
+    }
+    return count;
+}
+
+/* client_detect()
+ * --------------
+ *  Peforms the detect operation using the request.detect generated by input
+ *  file data. The encoded output, or noFaceMsg if no faces were found, is left
+ *  in request.response. A detectRects request is answered with the
+ *  rectangles found instead (see rects_response()), nothing is drawn or
+ *  encoded and finding no faces is not an error.
+ *
+ *  request: The Request whose images have been decoded.
+ *  worker: The Worker struct of the calling worker thread.
+ */
+void client_detect(Request* request, Worker* worker)
+{
+    int count = find_faces(request, worker, 1);
+    if (count < 0) {
+        // no memory left for a frame this large
+        request->response = error_response(imgLargeMsg);
+        return;
+    } else if (request->operation == detectRects) {
+        request->response = rects_response(&worker->faces, &worker->eyes);
+        return;
+    } else if (!count) {
+        request->response = error_response(noFaceMsg);
+        return;
+    }
+    for (int i = 0; i < worker->faces.count; i++) {
+        CvRect* face = &worker->faces.rects[i];
+        HaarRects* eyes = &worker->eyes.lists[i];
+        CvPoint center
+                = {face->x + face->width / 2, face->y + face->height / 2};
+        const CvScalar magenta = cvScalar(255, 0, 255, 0);
+        const CvScalar blue = cvScalar(255, 0, 0, 0);
+        cvEllipse(request->detect, center,
+                cvSize(face->width / 2, face->height / 2), 0, ellipseStartAngle,
+                ellipseEndAngle, magenta, lineThickness, lineType, shift);
+        if (eyes->count == 2) {
+            for (int j = 0; j < eyes->count; j++) {
+                CvRect* eye = &eyes->rects[j];
+                CvPoint eyeCenter = {face->x + eye->x + eye->width / 2,
+                        face->y + eye->y + eye->height / 2};
+                int radius = cvRound((eye->width / 2 + eye->height / 2) / 2);
+                cvCircle(request->detect, eyeCenter, radius, blue,
+                        lineThickness, lineType, shift);
+            }
+        }
+    }
+    uint64_t start = now_nanos();
+    request->response = output_response(
+            cvEncodeImage(outputExt, request->detect, 0), DETECT);
+    record_stage(worker->times, STAGE_ENCODE, start);
+}
+
+/* client_replace()
+ * ----------------
+ * Performs the replace operation using the request.detect and request.overlay
+ * generated by the input and replace data respectively. The encoded output,
+ * or noFaceMsg if no faces were found, is left in request.response.
+ *
+ * The overlay is resized to each face and alpha blended over it in a single
+ * pass (see blend_face()), sampling the nearest mip of the overlay.
+ *
+ * request: The Request whose images have been decoded.
+ * worker: The Worker struct of the calling worker thread.
+ */
+void client_replace(Request* request, Worker* worker)
+{
+    int count = find_faces(request, worker, 0);
+    if (count < 0) {
+        // no memory left for a frame this large
+        request->response = error_response(imgLargeMsg);
+        return;
+    } else if (!count) {
+        // no faces detected, notify client
+        request->response = error_response(noFaceMsg);
+        return;
+    }
+    Overlay* overlay = request->overlay;
+    Image* frame = request->detect;
+    uint64_t start = now_nanos();
+    for (int i = 0; i < worker->faces.count; i++) {
+        CvRect* face = &worker->faces.rects[i];
+        Image* level
+                = overlay_level(overlay, cvSize(face->width, face->height));
+        void* scratch = arena_alloc(&worker->arena,
+                blend_scratch_size(level->width, face->width));
+        if (!scratch) {
+            request->response = error_response(imgLargeMsg);
+            return;
+        }
+        blend_face((uint8_t*)level->imageData, level->widthStep, level->width,
+                level->height,
+                (uint8_t*)frame->imageData + face->y * frame->widthStep
+                        + face->x * frame->nChannels,
+                frame->widthStep, face->width, face->height, scratch);
+    }
+    start = record_stage(worker->times, STAGE_REPLACE, start);
+    request->response = output_response(
+            cvEncodeImage(outputExt, request->detect, 0), REPLACE);
+    record_stage(worker->times, STAGE_ENCODE, start);
+}
+
+/* output_response()
+ * -----------------
+ * Builds the outputImg response carrying an encoded output image.
+ *
+ * output: The encoded output image, released along with the Response.
+ * mem: The statistic updated once the response has been sent.
+ *
+ * Returns: The new Response.
+ */
+Response* output_response(CvMat* output, StatMemeber mem)
+{
+    Response* response = (Response*)calloc(1, sizeof(Response));
+    response->output = output;
+    response->body = output->data.ptr;
+    response->bodyLength = output->rows * output->cols;
+    set_header(response, outputImg, response->bodyLength);
+    response->statMember = mem;
+    return response;
+}
+
+/* rects_response()
+ * ----------------
+ * Builds the outputRects response listing the faces found and the eyes found
+ * in each. All fields are 32 bit integers in the same byte order as the size
+ * fields of the protocol:
+ *       (i)   number of faces
+ *       (ii)  for each face: x, y, width and height of the face, number of
+ *             eyes, then x, y, width and height of each eye
+ * Coordinates are in pixels of the recieved image.
+ *
+ * faces: The faces found.
+ * eyes: The eyes found in each face.
+ *
+ * Returns: The new Response.
+ */
+Response* rects_response(const HaarRects* faces, const HaarRectLists* eyes)
+{
+    size_t count = 1 + faces->count * 5;
+    for (int i = 0; i < faces->count; i++) {
+        count += eyes->lists[i].count * 4;
+    }
+    CvMat* output = cvCreateMat(1, count * sizeof(int32_t), CV_8UC1);
+    int32_t* fields = (int32_t*)output->data.ptr; // matrix data is aligned
+    size_t n = 0;
+    fields[n++] = faces->count;
+    for (int i = 0; i < faces->count; i++) {
+        const CvRect* face = &faces->rects[i];
+        const HaarRects* found = &eyes->lists[i];
+        fields[n++] = face->x;
+        fields[n++] = face->y;
+        fields[n++] = face->width;
+        fields[n++] = face->height;
+        fields[n++] = found->count;
+        for (int j = 0; j < found->count; j++) {
+            // eyes are found relative to their face
+            fields[n++] = face->x + found->rects[j].x;
+            fields[n++] = face->y + found->rects[j].y;
+            fields[n++] = found->rects[j].width;
+            fields[n++] = found->rects[j].height;
+        }
+    }
+    Response* response = output_response(output, DETECT);
+    set_header(response, outputRects, response->bodyLength);
+    return response;
+}
+
+/* cached_response()
+ * -----------------
+ * Builds the response to a request answered from the result cache, sending
+ * the cached body without copying it.
+ *
+ * entry: The CacheEntry found by cache_lookup(), its reference is handed to
+ *        the Response.
+ * mem: The statistic updated once the response has been sent.
+ *
+ * Returns: The new Response.
+ */
+Response* cached_response(CacheEntry* entry, StatMemeber mem)
+{
+    if (entry->message) {
+        // cached failure, the message itself is static
+        Response* response = error_response(entry->message);
+        cache_release(entry);
+        return response;
+    }
+    Response* response = (Response*)calloc(1, sizeof(Response));
+    response->entry = entry;
+    response->body = entry->data;
+    response->bodyLength = entry->length;
+    set_header(response,
+            (entry->key.operation & ~fastFlag) == detectRects ? outputRects
+                                                              : outputImg,
+            response->bodyLength);
+    response->statMember = mem;
+    return response;
+}
+
+/* error_response()
+ * ----------------
+ * Builds the opError response carrying msg. The connection is closed once it
+ * has been sent.
+ *
+ * msg: The error message to be sent to the client.
+ *
+ * Returns: The new Response.
+ */
+Response* error_response(ImmutableString msg)
+{
+    Response* response = (Response*)calloc(1, sizeof(Response));
+    response->body = (const uint8_t*)msg;
+    response->bodyLength = strlen(msg);
+    set_header(response, opError, response->bodyLength);
+    response->statMember = NO_STAT;
+    response->closeAfter = 1;
+    return response;
+}
+
+/* set_header()
+ * ------------
+ * Fills in the prefix, operation and size fields sent ahead of a response
+ * body.
+ *
+ * response: The Response whose header is to be set.
+ * operation: The operation type of the response.
+ * size: The number of body bytes.
+ */
+void set_header(Response* response, uint8_t operation, uint32_t size)
+{
+    memcpy(response->header, &prefix, sizeof(uint32_t));
+    response->header[sizeof(uint32_t)] = operation;
+    memcpy(response->header + sizeof(uint32_t) + sizeof(uint8_t), &size,
+            sizeof(uint32_t));
+    response->headerLength = HEADER_SIZE;
+}
+
+/* tag_response()
+ * --------------
+ * Turns a response into the response to a pipelined request: the prefix is
+ * followed by pipelinedRequest and the request ID, then the operation and
+ * size fields set by set_header(). Errors in a single pipelined request
+ * leave the connection open for the rest.
+ *
+ * response: The Response whose header has been set.
+ * id: The request ID sent by the client.
+ */
+void tag_response(Response* response, uint32_t id)
+{
+    uint8_t* fields = response->header + sizeof(uint32_t);
+    memmove(fields + sizeof(uint8_t) + sizeof(uint32_t), fields,
+            HEADER_SIZE - sizeof(uint32_t));
+    fields[0] = pipelinedRequest;
+    memcpy(fields + sizeof(uint8_t), &id, sizeof(uint32_t));
+    response->headerLength = TAGGED_HEADER_SIZE;
+    response->closeAfter = 0;
+}
+
+/* free_response()
+ * ---------------
+ * Releases a Response along with whatever holds its body.
+ *
+ * response: The Response to be released.
+ */
+void free_response(Response* response)
+{
+    if (response->output) {
+        cvReleaseMat(&response->output);
+    }
+    if (response->entry) {
+        cache_release(response->entry);
+    }
+    free(response);
+}
+
+/* free_request()
+ * --------------
+ * Releases a Request along with its image bytes and decoded images. The
+ * Response is not released, it is owned by the connection once queued.
+ *
+ * request: The Request to be released.
+ */
+void free_request(Request* request)
+{
+    for (int i = 0; i < MAX_IMAGES; i++) {
+        free(request->images[i]);
+    }
+    if (request->detect) {
+        cvReleaseImage(&request->detect);
+    }
+    if (request->overlay) {
+        release_overlay(request->overlay);
+    }
+    free(request);
+}
+
+/// Detector Functions ////////////////////
+
+/* init_workers()
+ * --------------
+ * Creates the Worker structs for the worker pool. Every Worker shares
+ * detector and is given its own HaarEvaluator and Arena.
+ *
+ * count: The number of worker threads.
+ * detector: The Detector loaded by load_detector().
+ *
+ * Returns: An array of count Workers.
+ */
+Worker* init_workers(int count, const Detector* detector)
+{
+    Worker* workers = (Worker*)calloc(count, sizeof(Worker));
+    for (int i = 0; i < count; i++) {
+        workers[i].detector = detector;
+        workers[i].evaluator = haar_evaluator();
+        init_arena(&workers[i].arena, ARENA_INITIAL_SIZE);
+        workers[i].times = (StageTimes*)calloc(1, sizeof(StageTimes));
+    }
+    return workers;
+}
+
+/* load_detector()
+ * ---------------
+ * Loads the cascadeFace and cascadeEye files once and converts them into
+ * HaarCascades, precomputing their features for every window size up to
+ * haarMaxSize. The widest detection and compositing kernels the CPU supports
+ * are chosen here, before any worker thread starts.
+ *
+ * Returns: The loaded Detector.
+ *
+ * Errors: calls exit_fail_cascade() whenever a cascade object cannot be
+ *         created using cascadeFace nor cascadeEye
+ */
+Detector* load_detector(void)
+{
+    Detector* detector = (Detector*)calloc(1, sizeof(Detector));
+    haar_use_kernels(HAAR_AVX2);
+    blend_use_kernels(BLEND_AVX2);
+    if (!(detector->face
+                = haar_load(cascadeFace, haarScaleFactor, haarMaxSize))
+            || !(detector->eye
+                    = haar_load(cascadeEye, haarScaleFactor, haarMaxSize))) {
+        // Casade file checking failed
+        exit_fail_cascade();
+    }
+    return detector;
+}
+
+/// Stats Functions ///////////////////////
+
+/* update_stat()
+ * -------------
+ * Increments the Stats memeber specified by mem with provided. Never blocks.
+ *
+ * stat: A pointer to the Stats struct to be updated.
+ * mam: Specifies which memeber of stat is to be updated.
+ * value: The value to increment the stats memeber by.
+ */
+void update_stat(Stats* stat, StatMemeber mem, uint32_t value)
+{
+    __atomic_add_fetch(&stat->counters[mem].value, value, __ATOMIC_RELAXED);
+}
+
+/* read_stat()
+ * -----------
+ * stat: A pointer to the Stats struct to be read.
+ * mem: Specifies which memeber of stat is to be read.
+ *
+ * Returns: The current value of the memeber. Counters are read one at a time,
+ *          so two read together may be a request apart.
+ */
+uint32_t read_stat(Stats* stat, StatMemeber mem)
+{
+    return __atomic_load_n(&stat->counters[mem].value, __ATOMIC_RELAXED);
+}
+
+/* print_stats()
+ * ------------
+ * Prints all memeber values stored by an expected Stats struct to stderr.
+ *
+ * data: A pointer to the expected Stats struct who's memenbers are to be
+ *       printed.
+ */
+void* print_stats(void* data)
+{
+    Stats* stat = (Stats*)data;
+    int signal;
+    while (1) {
+        sigwait(&stat->set, &signal);
+        if (signal == SIGHUP) {
+            fprintf(stderr, "Clients connected: %d\n",
+                    read_stat(stat, CONNECTED));
+            fprintf(stderr, "Num clients completed: %d\n",
+                    read_stat(stat, COMPLETED));
+            fprintf(stderr, "Face detection requests: %d\n",
+                    read_stat(stat, DETECT));
+            fprintf(stderr, "Face replacement requests: %d\n",
+                    read_stat(stat, REPLACE));
+            fprintf(stderr, "Invalid requests: %d\n", read_stat(stat, INVALID));
+            if (stat->caching) {
+                fprintf(stderr, "Cache hits: %d\n", read_stat(stat, CACHE_HIT));
+                fprintf(stderr, "Cache misses: %d\n",
+                        read_stat(stat, CACHE_MISS));
+            }
+            fflush(stderr);
+        }
+    }
+    return NULL;
+}
+
+/// Metrics Functions /////////////////////
+
+/* now_nanos()
+ * -----------
+ * Returns: The monotonic clock in nanoseconds.
+ */
+uint64_t now_nanos(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* record_stage()
+ * --------------
+ * Records the time elapsed since start against stage. Only the thread owning
+ * times may call this, so the counts are bumped without a read-modify-write;
+ * the stores are atomic only so that write_metrics() never reads a torn value.
+ *
+ * times: The StageTimes of the calling thread.
+ * stage: The Stage that has just finished.
+ * start: now_nanos() when the stage began.
+ *
+ * Returns: now_nanos() as read here, the start of whatever stage follows.
+ */
+uint64_t record_stage(StageTimes* times, Stage stage, uint64_t start)
+{
+    uint64_t now = now_nanos();
+    uint64_t elapsed = now - start;
+    Histogram* histogram = &times->stages[stage];
+    int bucket = histogram_bucket(elapsed);
+    __atomic_store_n(&histogram->counts[bucket],
+            histogram->counts[bucket] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(
+            &histogram->sum, histogram->sum + elapsed, __ATOMIC_RELAXED);
+    return now;
+}
+
+/* histogram_bucket()
+ * ------------------
+ * Values below 1 << HISTOGRAM_SHIFT get a bucket each. Every doubling above
+ * that is split into 1 << HISTOGRAM_SHIFT equal buckets, picked by the bits
+ * just below the most significant one.
+ *
+ * nanos: The latency to be bucketed.
+ *
+ * Returns: The index of the bucket nanos falls in.
+ */
+int histogram_bucket(uint64_t nanos)
+{
+    uint64_t linear = 1 << HISTOGRAM_SHIFT;
+    if (nanos < linear) {
+        return (int)nanos;
+    }
+    int msb = 63 - __builtin_clzll(nanos);
+    uint64_t bucket = (msb - HISTOGRAM_SHIFT + 1) * linear
+            + ((nanos >> (msb - HISTOGRAM_SHIFT)) & (linear - 1));
+    return bucket < HISTOGRAM_BUCKETS ? (int)bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+/* bucket_bound()
+ * --------------
+ * The inverse of histogram_bucket().
+ *
+ * bucket: A bucket index below HISTOGRAM_BUCKETS - 1.
+ *
+ * Returns: The largest latency in nanoseconds that falls in bucket.
+ */
+uint64_t bucket_bound(int bucket)
+{
+    uint64_t linear = 1 << HISTOGRAM_SHIFT;
+    if ((uint64_t)bucket < linear) {
+        return bucket;
+    }
+    int msb = bucket / linear + HISTOGRAM_SHIFT - 1;
+    return ((linear + bucket % linear + 1) << (msb - HISTOGRAM_SHIFT)) - 1;
+}
+
+/* start_metrics()
+ * ---------------
+ * Initialises metrics.listenOn with a blocking socket listening on
+ * server.metricsPort. The port is bound to the loopback address only, as
+ * nothing on it is authenticated.
+ *
+ * server: The Server struct holding the metricsPort requested.
+ * metrics: The Metrics who's listenOn memeber is to be populated.
+ *
+ * Error: Function calls exit_invalid_port() whenever metricsPort cannot be
+ *        listened on.
+ */
+void start_metrics(Server* server, Metrics* metrics)
+{
+    int optVal = 1;
+    struct addrinfo* ai = 0;
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo("127.0.0.1", server->metricsPort, &hints, &ai)) {
+        exit_invalid_port(server->metricsPort);
+    }
+    int listenOn = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenOn < 0) {
+        exit_invalid_port(server->metricsPort);
+    }
+    setsockopt(listenOn, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(int));
+    if (bind(listenOn, ai->ai_addr, ai->ai_addrlen) < 0
+            || listen(listenOn, DUMMY) < 0) {
+        exit_invalid_port(server->metricsPort);
+    }
+    freeaddrinfo(ai);
+    metrics->listenOn = listenOn;
+}
+
+/* metrics_thread()
+ * ----------------
+ * Answers every connection to the metrics port, one at a time, for the
+ * lifetime of the server.
+ *
+ * data: A pointer to the Metrics to be served.
+ */
+void* metrics_thread(void* data)
+{
+    Metrics* metrics = (Metrics*)data;
+    while (1) {
+        int fd = accept(metrics->listenOn, NULL, NULL);
+        if (fd >= 0) {
+            serve_metrics(metrics, fd);
+        }
+    }
+    return NULL;
+}
+
+/* serve_metrics()
+ * ---------------
+ * Reads (and ignores) a single HTTP request from fd, answers it with the
+ * current metrics in the Prometheus text format, and closes fd. Whatever the
+ * path asked for, the metrics are sent.
+ *
+ * metrics: The Metrics to be served.
+ * fd: The accepted connection.
+ */
+void serve_metrics(Metrics* metrics, int fd)
+{
+    char request[METRICS_REQUEST_SIZE];
+    struct timeval timeout = {METRICS_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (read(fd, request, sizeof(request)) <= 0) {
+        close(fd);
+        return;
+    }
+    FILE* out = fdopen(fd, "w");
+    if (!out) {
+        close(fd);
+        return;
+    }
+    fprintf(out,
+            "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n\r\n");
+    write_metrics(metrics, out);
+    fclose(out);
+}
+
+/* write_metrics()
+ * ---------------
+ * Writes the Stats counters and, for every Stage, a histogram of its
+ * latencies summed over every recording thread to out.
+ *
+ * metrics: The Metrics to be written.
+ * out: Where the metrics are written.
+ */
+void write_metrics(Metrics* metrics, FILE* out)
+{
+    Stats* stat = metrics->stat;
+    fprintf(out,
+            "# TYPE uqface_clients_connected gauge\n"
+            "uqface_clients_connected %u\n",
+            read_stat(stat, CONNECTED));
+    fprintf(out,
+            "# TYPE uqface_clients_completed_total counter\n"
+            "uqface_clients_completed_total %u\n",
+            read_stat(stat, COMPLETED));
+    fprintf(out,
+            "# TYPE uqface_requests_total counter\n"
+            "uqface_requests_total{operation=\"detect\"} %u\n"
+            "uqface_requests_total{operation=\"replace\"} %u\n"
+            "uqface_requests_total{operation=\"invalid\"} %u\n",
+            read_stat(stat, DETECT), read_stat(stat, REPLACE),
+            read_stat(stat, INVALID));
+    if (stat->caching) {
+        fprintf(out,
+                "# TYPE uqface_cache_hits_total counter\n"
+                "uqface_cache_hits_total %u\n"
+                "# TYPE uqface_cache_misses_total counter\n"
+                "uqface_cache_misses_total %u\n",
+                read_stat(stat, CACHE_HIT), read_stat(stat, CACHE_MISS));
+    }
+    fprintf(out, "# TYPE uqface_stage_seconds histogram\n");
+    for (int stage = 0; stage < STAGES; stage++) {
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+            for (int i = 0; i < metrics->count; i++) {
+                Histogram* histogram = &metrics->times[i]->stages[stage];
+                count += __atomic_load_n(
+                        &histogram->counts[bucket], __ATOMIC_RELAXED);
+            }
+            if (bucket < HISTOGRAM_BUCKETS - 1) {
+                fprintf(out,
+                        "uqface_stage_seconds_bucket{stage=\"%s\","
+                        "le=\"%g\"} %lu\n",
+                        stageNames[stage], bucket_bound(bucket) / 1e9,
+                        (unsigned long)count);
+            }
+        }
+        for (int i = 0; i < metrics->count; i++) {
+            sum += __atomic_load_n(
+                    &metrics->times[i]->stages[stage].sum, __ATOMIC_RELAXED);
+        }
+        fprintf(out,
+                "uqface_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n"
+                "uqface_stage_seconds_sum{stage=\"%s\"} %g\n"
+                "uqface_stage_seconds_count{stage=\"%s\"} %lu\n",
+                stageNames[stage], (unsigned long)count, stageNames[stage],
+                sum / 1e9, stageNames[stage], (unsigned long)count);
+    }
 }
 
 /// Main /////////////////////////////////
 int main(int argc, char* argv[])
 {
     Server server = get_server(argc, argv);
-    Protected data = init_protected(); // initialising protected data types
+    Detector* detector = load_detector(); // loading the cascades
+    Worker* workers = init_workers(server.workers, detector);
     start_server(&server); // ensure listening socket is initialised
     /* initialising a sigaction struct to handle SIGPIPE */
     Sigaction sa = {0};
     sa.sa_handler = sig_ignore;
     sa.sa_flags = SA_RESTART;
     sigaction(SIGPIPE, &sa, 0);
-    run_server(server, data); // begin begin accepting and handling new clients
+    run_server(server, workers); // begin accepting and handling new clients
     return 0;
 }
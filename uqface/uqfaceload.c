@@ -0,0 +1,614 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+/* Communication protocol framing */
+#include "faceclient.h"
+/* Helpers shared with uqfacebench */
+#include "bench.h"
+
+#define DECIMAL_FORMAT 10
+#define DEFAULT_DURATION 10 // seconds requests are sent for
+#define MILLISECONDS 1e6 // nanoseconds per millisecond
+#define PERCENT 100
+#define LATENCY_SHIFT                                                          \
+    4 // latency histograms split every doubling of nanoseconds into
+      // 1 << LATENCY_SHIFT buckets (within about 6% of the true value)
+#define LATENCY_BUCKETS                                                        \
+    640 // buckets of each latency histogram, the last one collects
+        // everything beyond about 20 minutes
+#define MODE_LENGTH 24 // longest mode printed in the results table
+
+// Messages
+ImmutableString benchName = "uqfaceload";
+ImmutableString invalidCmdLineMsg
+        = "Usage: ./uqfaceload portnum image|directory... "
+          "[--replacefilename filename] [--mix percent] [--clients n] "
+          "[--rate requests/s] [--duration seconds]\n";
+ImmutableString emptyCorpusMsg = "uqfaceload: no images were found\n";
+ImmutableString tableHeader = "mode         clients  requests  errors      "
+                              "req/s   p50 ms   p99 ms  p99.9 ms   max ms\n";
+// Command line arguments
+ImmutableString replace = "--replacefilename";
+ImmutableString mixArg = "--mix";
+ImmutableString clientsArg = "--clients";
+ImmutableString rateArg = "--rate";
+ImmutableString durationArg = "--duration";
+
+// Stores all load generator settings enabled by user at the command line
+typedef struct {
+    char* portNum;
+    ImageFile* corpus; // images sent to be detected or replaced in
+    int corpusSize;
+    ImageFile replace; // size is 0 when --replacefilename was not supplied
+    int mix; // percentage of requests that are replace requests
+    int clients; // number of concurrent connections
+    double rate; // requests/s over every connection, 0 for a closed loop
+    int duration; // seconds requests are sent for
+} Settings;
+
+// A latency histogram with log-linear buckets (see latency_bucket())
+typedef struct {
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t max;
+} Histogram;
+
+// Stores the state of one connection to the server. Requests are pipelined so
+// that an error answers only its own request; in an open loop a sender and a
+// reciever thread share the connection.
+typedef struct {
+    Settings* settings;
+    pthread_barrier_t* start; // released once every connection is open
+    uint64_t begin; // now_nanos() when the first request is due
+    uint64_t deadline; // now_nanos() after which no request is sent
+    uint64_t interval; // nanoseconds between requests in an open loop
+    int fd; // connected socket to the server
+    uint64_t random; // xorshift state picking images and operations
+    uint64_t due[FACE_MAX_PIPELINE]; // when each outstanding request was
+                                     // due, by request ID
+    sem_t slots; // requests that may still be sent before one is answered
+    pthread_mutex_t lock; // guards the request IDs below
+    uint32_t idle[FACE_MAX_PIPELINE]; // request IDs free to be sent
+    int idleCount;
+    uint8_t outstanding[FACE_MAX_PIPELINE]; // sent and not yet answered, by
+                                            // request ID
+    uint64_t completed; // number of responses recieved
+    uint64_t errors; // number of those that were error messages
+    Histogram latency;
+} Connection;
+
+/// Functions ///////////////////////////
+/* command line processing functions */
+Settings get_settings(int argc, char* argv[]);
+int parse_number(char* arg, int min, int max);
+void add_images(Settings* settings, char* path);
+/* latency functions */
+int latency_bucket(uint64_t nanos);
+uint64_t latency_bound(int bucket);
+void record_latency(Histogram* histogram, uint64_t nanos);
+double percentile(Histogram* histogram, uint64_t total, double fraction);
+/* load functions */
+uint32_t acquire_id(Connection* connection);
+void release_id(Connection* connection, uint32_t id);
+void send_request(Connection* connection, uint32_t id);
+int read_response(Connection* connection);
+void* closed_loop_thread(void* data);
+void* sender_thread(void* data);
+void* reciever_thread(void* data);
+void run_load(Settings* settings);
+/* main */
+int main(int argc, char* argv[]);
+
+/////////////////////////////////////////
+
+/// Command Line Processing Functions ////
+
+/* get_settings()
+ * --------------
+ * Generates a Settings struct populated with all load generator settings
+ * enabled by user through terminal input. Every image of the corpus is read
+ * into memory.
+ *
+ * argc: The number of program arguments supplied by user at the terminal.
+ * argv: The program arguments supplied by user at the terminal.
+ *
+ * Return: A Settings struct populated with all of the settings.
+ * Errors: Function calls exit_invalid_command_line() whenever an invalid
+ *         argument is detected.
+ */
+Settings get_settings(int argc, char* argv[])
+{
+    char* endptr;
+    char* replaceFilename = NULL;
+    int mix = -1;
+    Settings settings = {0};
+    settings.clients = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    settings.duration = DEFAULT_DURATION;
+    if (argc < 3 || !strlen(argv[1])) {
+        // portnum and at least one image are required
+        exit_invalid_command_line();
+    }
+    settings.portNum = argv[1];
+    int i = 2;
+    for (; i < argc && strncmp(argv[i], "--", 2); i++) {
+        if (!strlen(argv[i])) {
+            exit_invalid_command_line();
+        }
+    }
+    int corpusEnd = i;
+    for (; i < argc; i++) {
+        if (i + 1 >= argc || !strlen(argv[i + 1])) {
+            // every option expects a non-empty value
+            exit_invalid_command_line();
+        }
+        if (!strcmp(argv[i], replace) && !replaceFilename) {
+            replaceFilename = argv[++i];
+        } else if (!strcmp(argv[i], mixArg)) {
+            mix = parse_number(argv[++i], 0, PERCENT);
+        } else if (!strcmp(argv[i], clientsArg)) {
+            settings.clients = parse_number(argv[++i], 1, INT32_MAX);
+        } else if (!strcmp(argv[i], rateArg)) {
+            settings.rate = strtod(argv[++i], &endptr);
+            if (*endptr != '\0' || !(settings.rate > 0)) {
+                exit_invalid_command_line();
+            }
+        } else if (!strcmp(argv[i], durationArg)) {
+            settings.duration = parse_number(argv[++i], 1, INT32_MAX);
+        } else {
+            // argument cannot be identified, assume to be invalid
+            exit_invalid_command_line();
+        }
+    }
+    if (corpusEnd == 2 || (mix > 0 && !replaceFilename)) {
+        // replace requests need a replace image
+        exit_invalid_command_line();
+    }
+    // with a replace image and no --mix, send only replace requests
+    settings.mix = mix >= 0 ? mix : (replaceFilename ? PERCENT : 0);
+    for (i = 2; i < corpusEnd; i++) {
+        add_images(&settings, argv[i]);
+    }
+    if (!settings.corpusSize) {
+        fprintf(stderr, "%s", emptyCorpusMsg);
+        exit(EXIT_INVALID_FILE_READ);
+    }
+    if (replaceFilename) {
+        settings.replace = read_image(replaceFilename);
+    }
+    return settings;
+}
+
+/* parse_number()
+ * --------------
+ * arg: A command line argument expected to be a decimal integer.
+ * min: The smallest value allowed.
+ * max: The largest value allowed.
+ *
+ * Returns: The value of arg.
+ * Errors: Function calls exit_invalid_command_line() if arg is not a number
+ *         between min and max.
+ */
+int parse_number(char* arg, int min, int max)
+{
+    char* endptr;
+    long value = strtol(arg, &endptr, DECIMAL_FORMAT);
+    if (*endptr != '\0' || value < min || value > max) {
+        exit_invalid_command_line();
+    }
+    return (int)value;
+}
+
+/* add_images()
+ * ------------
+ * Adds path to the corpus of settings or, if path is a directory, every
+ * regular file within it (e.g. uqface/testimages). Files are not checked to
+ * be images; the server answers those that are not with an error.
+ *
+ * settings: The Settings whose corpus is added to.
+ * path: An image file or a directory of them.
+ *
+ * Errors: Function calls exit_invalid_file() if path cannot be read.
+ */
+void add_images(Settings* settings, char* path)
+{
+    struct stat info;
+    if (stat(path, &info)) {
+        exit_invalid_file(path);
+    }
+    if (!S_ISDIR(info.st_mode)) {
+        settings->corpus = (ImageFile*)realloc(settings->corpus,
+                (settings->corpusSize + 1) * sizeof(ImageFile));
+        settings->corpus[settings->corpusSize++] = read_image(path);
+        return;
+    }
+    DIR* directory = opendir(path);
+    if (!directory) {
+        exit_invalid_file(path);
+    }
+    struct dirent* entry;
+    while ((entry = readdir(directory))) {
+        size_t length = strlen(path) + strlen(entry->d_name) + 2;
+        char* file = (char*)malloc(length);
+        snprintf(file, length, "%s/%s", path, entry->d_name);
+        if (!stat(file, &info) && S_ISREG(info.st_mode)) {
+            add_images(settings, file);
+        }
+        free(file);
+    }
+    closedir(directory);
+}
+
+/// Latency Functions ///////////////////
+
+/* latency_bucket()
+ * ----------------
+ * Values below 1 << LATENCY_SHIFT get a bucket each. Every doubling above
+ * that is split into 1 << LATENCY_SHIFT equal buckets, picked by the bits
+ * just below the most significant one.
+ *
+ * nanos: The latency to be bucketed.
+ *
+ * Returns: The index of the bucket nanos falls in.
+ */
+int latency_bucket(uint64_t nanos)
+{
+    uint64_t linear = 1 << LATENCY_SHIFT;
+    if (nanos < linear) {
+        return (int)nanos;
+    }
+    int msb = 63 - __builtin_clzll(nanos);
+    uint64_t bucket = (msb - LATENCY_SHIFT + 1) * linear
+            + ((nanos >> (msb - LATENCY_SHIFT)) & (linear - 1));
+    return bucket < LATENCY_BUCKETS ? (int)bucket : LATENCY_BUCKETS - 1;
+}
+
+/* latency_bound()
+ * ---------------
+ * The inverse of latency_bucket().
+ *
+ * bucket: A bucket index.
+ *
+ * Returns: The largest latency in nanoseconds that falls in bucket.
+ */
+uint64_t latency_bound(int bucket)
+{
+    uint64_t linear = 1 << LATENCY_SHIFT;
+    if ((uint64_t)bucket < linear) {
+        return bucket;
+    }
+    int msb = bucket / linear + LATENCY_SHIFT - 1;
+    return ((linear + bucket % linear + 1) << (msb - LATENCY_SHIFT)) - 1;
+}
+
+/* record_latency()
+ * ----------------
+ * Adds nanos to histogram.
+ */
+void record_latency(Histogram* histogram, uint64_t nanos)
+{
+    histogram->counts[latency_bucket(nanos)]++;
+    if (nanos > histogram->max) {
+        histogram->max = nanos;
+    }
+}
+
+/* percentile()
+ * ------------
+ * histogram: The Histogram holding total latencies.
+ * total: The number of latencies recorded in histogram.
+ * fraction: The fraction of latencies to be at or below the result.
+ *
+ * Returns: The latency in milliseconds that fraction of those recorded are at
+ *          or below, rounded up to the bound of its bucket (but never past
+ *          the largest recorded).
+ */
+double percentile(Histogram* histogram, uint64_t total, double fraction)
+{
+    uint64_t rank = (uint64_t)(fraction * total + 0.5);
+    uint64_t count = 0;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        count += histogram->counts[bucket];
+        if (count && count >= rank) {
+            uint64_t bound = latency_bound(bucket);
+            return (bound < histogram->max ? bound : histogram->max)
+                    / MILLISECONDS;
+        }
+    }
+    return histogram->max / MILLISECONDS;
+}
+
+/// Load Functions //////////////////////
+
+/* acquire_id()
+ * ------------
+ * Waits for a request ID of the connection to be free and takes it. IDs run
+ * from 0 to FACE_MAX_PIPELINE - 1, and one is only reused once its own
+ * response has arrived: the server answers out of order, so the oldest
+ * request may well still be outstanding.
+ *
+ * connection: The Connection a request is about to be sent on.
+ *
+ * Returns: The request ID to send the request with.
+ */
+uint32_t acquire_id(Connection* connection)
+{
+    sem_wait(&connection->slots);
+    pthread_mutex_lock(&connection->lock);
+    uint32_t id = connection->idle[--connection->idleCount];
+    connection->outstanding[id] = 1;
+    pthread_mutex_unlock(&connection->lock);
+    return id;
+}
+
+/* release_id()
+ * ------------
+ * Frees the request ID of a request that has been answered.
+ *
+ * connection: The Connection the response arrived on.
+ * id: The request ID the response was tagged with.
+ *
+ * Errors: Function calls exit_communication_error() if no request is
+ *         outstanding with that ID.
+ */
+void release_id(Connection* connection, uint32_t id)
+{
+    pthread_mutex_lock(&connection->lock);
+    if (id >= FACE_MAX_PIPELINE || !connection->outstanding[id]) {
+        exit_communication_error();
+    }
+    connection->outstanding[id] = 0;
+    connection->idle[connection->idleCount++] = id;
+    pthread_mutex_unlock(&connection->lock);
+    sem_post(&connection->slots);
+}
+
+/* send_request()
+ * --------------
+ * Sends one pipelined request, picking an image of the corpus at random and
+ * making it a replace request settings.mix percent of the time.
+ *
+ * connection: The Connection the request is sent on.
+ * id: The request ID it is tagged with.
+ */
+void send_request(Connection* connection, uint32_t id)
+{
+    Settings* settings = connection->settings;
+    uint64_t random = connection->random;
+    random ^= random << 13;
+    random ^= random >> 7;
+    random ^= random << 17;
+    connection->random = random;
+    ImageFile* image = &settings->corpus[(random >> 8) % settings->corpusSize];
+    int isReplace = (int)((random >> 40) % PERCENT) < settings->mix;
+    // the image size goes out with the header, in one segment
+    uint8_t header[FACE_REQUEST_HEADER_SIZE + sizeof(uint32_t)];
+    size_t length = face_encode_request(
+            header, isReplace ? FACE_REPLACE : FACE_DETECT, 1, id);
+    memcpy(header + length, &image->size, sizeof(uint32_t));
+    write_fully(connection->fd, header, length + sizeof(uint32_t));
+    write_fully(connection->fd, image->data, image->size);
+    if (isReplace) {
+        write_fully(connection->fd, &settings->replace.size, sizeof(uint32_t));
+        write_fully(connection->fd, settings->replace.data,
+                settings->replace.size);
+    }
+}
+
+/* read_response()
+ * ---------------
+ * Reads one pipelined response and records its latency, from when its
+ * request was due, against the connection, then frees its request ID. Error
+ * messages (e.g. "no faces detected") are counted as errors.
+ *
+ * connection: The Connection the response is read from.
+ *
+ * Returns: 1 if a response was read, 0 if the server closed the connection.
+ * Errors: Function calls exit_communication_error() if anything other than a
+ *         pipelined output image or error message to an outstanding request
+ *         is recieved.
+ */
+int read_response(Connection* connection)
+{
+    uint8_t fields[FACE_TAGGED_HEADER_SIZE];
+    FaceHeader header;
+    uint8_t discard[BUFSIZ];
+    if (!read_fully(connection->fd, fields, FACE_TAGGED_HEADER_SIZE)) {
+        return 0;
+    }
+    uint64_t now = now_nanos();
+    if (face_decode_response(fields, &header) || !header.tagged
+            || (header.operation != FACE_OUTPUT_IMAGE
+                    && header.operation != FACE_ERROR)) {
+        exit_communication_error();
+    }
+    uint32_t size = header.size;
+    while (size) {
+        // the body is not needed, only its arrival
+        uint32_t length = size < BUFSIZ ? size : BUFSIZ;
+        if (!read_fully(connection->fd, discard, length)) {
+            exit_communication_error();
+        }
+        size -= length;
+    }
+    if (header.id >= FACE_MAX_PIPELINE) {
+        exit_communication_error();
+    }
+    record_latency(&connection->latency, now - connection->due[header.id]);
+    release_id(connection, header.id);
+    connection->completed++;
+    connection->errors += header.operation == FACE_ERROR;
+    return 1;
+}
+
+/* closed_loop_thread()
+ * --------------------
+ * Repeatedly sends a request and waits for its response until the deadline
+ * passes, so the server sets the pace.
+ *
+ * data: A pointer to the Connection run by this thread.
+ */
+void* closed_loop_thread(void* data)
+{
+    Connection* connection = (Connection*)data;
+    pthread_barrier_wait(connection->start);
+    while (now_nanos() < connection->deadline) {
+        uint32_t id = acquire_id(connection);
+        connection->due[id] = now_nanos();
+        send_request(connection, id);
+        if (!read_response(connection)) {
+            exit_communication_error();
+        }
+    }
+    return NULL;
+}
+
+/* sender_thread()
+ * ---------------
+ * Sends a request every connection.interval nanoseconds until the deadline,
+ * whether or not earlier ones have been answered (an open loop). A request is
+ * due at its scheduled time, so time spent waiting for one of the
+ * FACE_MAX_PIPELINE request IDs, or on a slow write, counts towards its
+ * latency.
+ * Writing is then shut down so that the server closes the connection once
+ * every request is answered.
+ *
+ * data: A pointer to the Connection whose requests are sent.
+ */
+void* sender_thread(void* data)
+{
+    Connection* connection = (Connection*)data;
+    pthread_barrier_wait(connection->start);
+    uint64_t due = connection->begin;
+    while (due < connection->deadline) {
+        struct timespec wake = {due / NANOSECONDS, due % NANOSECONDS};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL)) {
+            // interrupted, sleep again
+        }
+        uint32_t id = acquire_id(connection);
+        connection->due[id] = due;
+        send_request(connection, id);
+        due += connection->interval;
+    }
+    shutdown(connection->fd, SHUT_WR);
+    return NULL;
+}
+
+/* reciever_thread()
+ * -----------------
+ * Reads responses for the sender_thread() of the same connection until the
+ * server closes it, freeing a request ID for each.
+ *
+ * data: A pointer to the Connection whose responses are read.
+ */
+void* reciever_thread(void* data)
+{
+    Connection* connection = (Connection*)data;
+    while (read_response(connection)) {
+        // read_response() has freed the request ID
+    }
+    return NULL;
+}
+
+/* run_load()
+ * ----------
+ * Runs settings.clients connections against the server for settings.duration
+ * seconds and prints a row of the results table.
+ *
+ * settings: The load generator settings.
+ */
+void run_load(Settings* settings)
+{
+    int clients = settings->clients;
+    int threads = settings->rate ? 2 * clients : clients;
+    pthread_t* ids = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+    Connection* connections = (Connection*)calloc(clients, sizeof(Connection));
+    Histogram* latency = (Histogram*)calloc(1, sizeof(Histogram));
+    pthread_barrier_t start;
+    uint64_t completed = 0, errors = 0;
+    uint64_t interval = settings->rate ? NANOSECONDS * clients / settings->rate
+                                       : 0;
+    pthread_barrier_init(&start, NULL, clients + 1);
+    for (int i = 0; i < clients; i++) {
+        Connection* connection = &connections[i];
+        connection->settings = settings;
+        connection->start = &start;
+        connection->interval = interval;
+        connection->random = 0x9E3779B97F4A7C15ULL * (i + 1);
+        sem_init(&connection->slots, 0, FACE_MAX_PIPELINE);
+        pthread_mutex_init(&connection->lock, NULL);
+        for (uint32_t id = 0; id < FACE_MAX_PIPELINE; id++) {
+            connection->idle[connection->idleCount++] = id;
+        }
+        connection->fd = connect_server(settings->portNum);
+        if (settings->rate) {
+            pthread_create(&ids[2 * i], NULL, sender_thread, connection);
+            pthread_create(&ids[2 * i + 1], NULL, reciever_thread, connection);
+        } else {
+            pthread_create(&ids[i], NULL, closed_loop_thread, connection);
+        }
+    }
+    uint64_t begin = now_nanos();
+    for (int i = 0; i < clients; i++) {
+        // stagger the connections so requests arrive evenly spaced
+        connections[i].begin = begin + interval * i / clients;
+        connections[i].deadline = begin + settings->duration * NANOSECONDS;
+    }
+    pthread_barrier_wait(&start); // every connection starts sending together
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    double elapsed = (now_nanos() - begin) / (double)NANOSECONDS;
+    for (int i = 0; i < clients; i++) {
+        Connection* connection = &connections[i];
+        completed += connection->completed;
+        errors += connection->errors;
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+            latency->counts[bucket] += connection->latency.counts[bucket];
+        }
+        if (connection->latency.max > latency->max) {
+            latency->max = connection->latency.max;
+        }
+        sem_destroy(&connection->slots);
+        pthread_mutex_destroy(&connection->lock);
+        close(connection->fd);
+    }
+    char mode[MODE_LENGTH];
+    if (settings->rate) {
+        snprintf(mode, sizeof(mode), "%.0f/s", settings->rate);
+    } else {
+        snprintf(mode, sizeof(mode), "closed");
+    }
+    printf("%-11s  %7d  %8lu  %6lu  %9.2f  %7.3f  %7.3f  %8.3f  %7.3f\n", mode,
+            clients, (unsigned long)completed, (unsigned long)errors,
+            completed / elapsed, percentile(latency, completed, 0.5),
+            percentile(latency, completed, 0.99),
+            percentile(latency, completed, 0.999),
+            latency->max / MILLISECONDS);
+    pthread_barrier_destroy(&start);
+    free(ids);
+    free(connections);
+    free(latency);
+}
+
+/// Main /////////////////////////////////
+int main(int argc, char* argv[])
+{
+    Settings settings = get_settings(argc, argv);
+    signal(SIGPIPE, SIG_IGN); // broken connections are reported by write()
+    printf("%s", tableHeader);
+    run_load(&settings);
+    for (int i = 0; i < settings.corpusSize; i++) {
+        free(settings.corpus[i].data);
+    }
+    free(settings.corpus);
+    free(settings.replace.data);
+    return SUCCESS_EXIT;
+}
@@ -0,0 +1,793 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <limits.h>
+#include <opencv2/core/core_c.h>
+#include <opencv2/imgcodecs/imgcodecs_c.h>
+#include <opencv2/imgproc/imgproc_c.h>
+#include <opencv2/objdetect/objdetect_c.h>
+#include "haar.h"
+
+#define DECIMAL_FORMAT 10
+#define DEFAULT_ITERATIONS 10 // times each step is repeated
+#define MILLISECONDS 1e3
+#define NANOSECONDS 1e9
+#define STEPS 4 // gray, equalize, integral and detect
+#define MAX_COMPARED 16 // faces compared rectangle by rectangle
+#define NAME_LENGTH 24 // longest table row name
+#define FAST_PIXELS                                                            \
+    1048576 // fast mode reduces images to at most this many pixels, as
+            // uqfacedetect does
+#define REDUCED_DECODE_SHIFT                                                   \
+    3 // cvDecodeImage() flags CV_LOAD_IMAGE_COLOR | n << 3 decode at 1/n of
+      // full size
+#define MIN_OVERLAP 0.5 // intersection over union of rectangles that agree
+
+/* typedef definitions */
+typedef const char* const ImmutableString;
+// Messages
+ImmutableString invalidCmdLineMsg
+        = "Usage: ./uqhaarbench imagefile [--iterations n] [--helpers n] "
+          "[--reduction n]\n";
+ImmutableString invalidFileMsg = "uqhaarbench: cannot read the image file \"";
+ImmutableString invalidCascadeMsg
+        = "uqhaarbench: unable to load a cascade classifier\n";
+ImmutableString tableHeader = "kernels      gray  equalize  integral    "
+                              "detect     total  speedup  results\n";
+ImmutableString fastHeader = "path         decode    detect     total  "
+                             "speedup  faces    eyes\n";
+// Command line arguments
+ImmutableString iterationsArg = "--iterations";
+ImmutableString helpersArg = "--helpers";
+ImmutableString reductionArg = "--reduction";
+// Detection parameters, as used by uqfacedetect
+ImmutableString cascadeFace = "/local/courses/csse2310/resources/a4/"
+                              "haarcascade_frontalface_alt2.xml";
+ImmutableString cascadeEye = "/local/courses/csse2310/resources/a4/"
+                             "haarcascade_eye_tree_eyeglasses.xml";
+float const haarScaleFactor = 1.1;
+int const haarMinNeighbours = 4;
+int const haarMinSize = 0;
+int const haarMaxSize = 1000;
+// Names of the kernels in table rows, indexed by HaarKernels
+ImmutableString kernelNames[] = {"scalar", "sse4.2", "avx2"};
+
+// Custom benchmark exit codes
+typedef enum {
+    EXIT_INVALID_COMMAND_LINE = 13,
+    EXIT_INVALID_FILE_READ = 16,
+    EXIT_INVALID_CASCADE = 9,
+    EXIT_MISMATCH = 1,
+    SUCCESS_EXIT = 0
+} ExitCodes;
+
+// The images produced by one pass over every step, kept for comparison
+typedef struct {
+    IplImage* gray; // grayscale image
+    IplImage* equalized; // histogram equalised grayscale image
+    CvMat* sum; // integral image
+    CvMat* sqsum; // squared integral image
+    CvRect faces[MAX_COMPARED]; // first faces found
+    int faceCount;
+    int eyeCount; // eyes found over every face
+} Results;
+
+// Settings supplied at the command line
+typedef struct {
+    int iterations; // times each step is repeated
+    int helpers; // helper threads splitting detections, 0 for none
+    int reduction; // fast mode reduction, 0 to choose as uqfacedetect does
+} Settings;
+
+// Milliseconds spent per iteration of each step
+typedef struct {
+    double step[STEPS];
+    double total;
+} Timings;
+
+// Ways of reducing an image before a fast detection
+typedef enum {
+    FULL_SIZE = 0, // no reduction, the reference
+    RESIZED = 1, // decoded at full size, reduced after the gray conversion
+    DECODED = 2 // decoded at reduced size
+} FastPath;
+
+// Faces and eyes found by one fast mode path, in pixels of the full image
+typedef struct {
+    HaarRects faces;
+    HaarRectLists eyes; // relative to their face
+} Detection;
+
+// Milliseconds spent per iteration by one fast mode path
+typedef struct {
+    double decode;
+    double detect; // gray conversion through to eye detection
+    double total;
+} FastTimings;
+
+/// Functions ///////////////////////////
+/* exiting functions */
+void exit_invalid_command_line(void);
+void exit_invalid_file(char* filename);
+void exit_invalid_cascade(void);
+/* command line processing functions */
+Settings get_settings(int argc, char* argv[]);
+int get_count(char* arg, int min);
+/* benchmark functions */
+double elapsed_ms(struct timespec* begin);
+Results create_results(IplImage* image);
+void free_results(Results* results);
+Timings time_opencv(IplImage* image, int iterations, Results* results);
+Timings time_native(IplImage* image, int iterations, Results* results,
+        HaarScheduler* scheduler);
+int same_results(Results* a, Results* b);
+void print_row(const char* name, Timings* timings, Timings* baseline,
+        const char* outcome);
+/* fast mode functions */
+uint8_t* read_file(const char* filename, size_t* size);
+FastTimings time_fast(const uint8_t* data, size_t size, FastPath path,
+        int reduction, int iterations, Detection* detection);
+int overlap(CvRect a, CvRect b);
+void agreement(const Detection* reference, const Detection* detection,
+        int* faces, int* eyes);
+void print_fast_row(const char* name, FastTimings* timings,
+        FastTimings* baseline, const Detection* reference,
+        const Detection* detection);
+void free_detection(Detection* detection);
+/* main */
+int main(int argc, char* argv[]);
+
+/////////////////////////////////////////
+
+/// Exiting Functions ///////////////////
+
+/* exit_invalid_command_line()
+ * ---------------------------
+ * Prints to stderr invalidCmdLineMsg and exits uqhaarbench with an exit
+ * status of EXIT_INVALID_COMMAND_LINE.
+ */
+void exit_invalid_command_line(void)
+{
+    fprintf(stderr, "%s", invalidCmdLineMsg);
+    exit(EXIT_INVALID_COMMAND_LINE);
+}
+
+/* exit_invalid_file()
+ * -------------------
+ * Prints to stderr that filename could not be read as an image and exits
+ * uqhaarbench with an exit status of EXIT_INVALID_FILE_READ.
+ *
+ * filename: The file that could not be read.
+ */
+void exit_invalid_file(char* filename)
+{
+    fprintf(stderr, "%s%s\"\n", invalidFileMsg, filename);
+    exit(EXIT_INVALID_FILE_READ);
+}
+
+/* exit_invalid_cascade()
+ * ----------------------
+ * Prints to stderr invalidCascadeMsg and exits uqhaarbench with an exit
+ * status of EXIT_INVALID_CASCADE.
+ */
+void exit_invalid_cascade(void)
+{
+    fprintf(stderr, "%s", invalidCascadeMsg);
+    exit(EXIT_INVALID_CASCADE);
+}
+
+/// Command Line Processing Functions ////
+
+/* get_settings()
+ * --------------
+ * Reads the benchmark settings from the command line.
+ *
+ * argc: The number of program arguments supplied by user at the terminal.
+ * argv: The program arguments supplied by user at the terminal.
+ *
+ * Return: The settings supplied, defaults for those that were not.
+ * Errors: Function calls exit_invalid_command_line() whenever an invalid
+ *         argument is detected.
+ */
+Settings get_settings(int argc, char* argv[])
+{
+    Settings settings = {DEFAULT_ITERATIONS, 0, 0};
+    if (argc < 2 || !strlen(argv[1])) {
+        // imagefile is required
+        exit_invalid_command_line();
+    }
+    for (int i = 2; i < argc; i++) {
+        if (i + 1 >= argc || !strlen(argv[i + 1])) {
+            // every option expects a non-empty value
+            exit_invalid_command_line();
+        }
+        if (!strcmp(argv[i], iterationsArg)) {
+            settings.iterations = get_count(argv[++i], 1);
+        } else if (!strcmp(argv[i], helpersArg)) {
+            settings.helpers = get_count(argv[++i], 0);
+        } else if (!strcmp(argv[i], reductionArg)) {
+            settings.reduction = get_count(argv[++i], 2);
+            if (settings.reduction > HAAR_MAX_REDUCTION
+                    || settings.reduction & (settings.reduction - 1)) {
+                // scaled decoding only offers powers of two
+                exit_invalid_command_line();
+            }
+        } else {
+            // argument cannot be identified, assume to be invalid
+            exit_invalid_command_line();
+        }
+    }
+    return settings;
+}
+
+/* get_count()
+ * -----------
+ * Converts an option value into a count of at least min.
+ *
+ * Errors: Function calls exit_invalid_command_line() whenever arg is not a
+ *         whole number of at least min.
+ */
+int get_count(char* arg, int min)
+{
+    char* endptr;
+    long count = strtol(arg, &endptr, DECIMAL_FORMAT);
+    if (*endptr != '\0' || count < min || count > INT_MAX) {
+        exit_invalid_command_line();
+    }
+    return (int)count;
+}
+
+/// Benchmark Functions /////////////////
+
+/* elapsed_ms()
+ * ------------
+ * Returns the milliseconds passed since begin, then restarts begin.
+ */
+double elapsed_ms(struct timespec* begin)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - begin->tv_sec) * MILLISECONDS
+            + (end.tv_nsec - begin->tv_nsec) * MILLISECONDS / NANOSECONDS;
+    *begin = end;
+    return elapsed;
+}
+
+/* create_results()
+ * ----------------
+ * Allocates the images of a Results struct sized for image.
+ */
+Results create_results(IplImage* image)
+{
+    Results results = {0};
+    results.gray = cvCreateImage(cvGetSize(image), IPL_DEPTH_8U, 1);
+    results.equalized = cvCreateImage(cvGetSize(image), IPL_DEPTH_8U, 1);
+    results.sum = cvCreateMat(image->height + 1, image->width + 1, CV_32SC1);
+    results.sqsum = cvCreateMat(image->height + 1, image->width + 1, CV_64FC1);
+    return results;
+}
+
+/* free_results()
+ * --------------
+ * Releases the images of a Results struct.
+ */
+void free_results(Results* results)
+{
+    cvReleaseImage(&results->gray);
+    cvReleaseImage(&results->equalized);
+    cvReleaseMat(&results->sum);
+    cvReleaseMat(&results->sqsum);
+}
+
+/* time_opencv()
+ * -------------
+ * Times the OpenCV path of uqfacedetect (cvCvtColor(), cvEqualizeHist(),
+ * cvIntegral() and cvHaarDetectObjects() for faces and then eyes within
+ * each face).
+ *
+ * image: The BGR image to be processed.
+ * iterations: The number of times each step is repeated.
+ * results: Set to the outputs of the last iteration.
+ *
+ * Returns: The milliseconds spent per iteration of each step.
+ * Errors: Function calls exit_invalid_cascade() if a cascade cannot be loaded.
+ */
+Timings time_opencv(IplImage* image, int iterations, Results* results)
+{
+    Timings timings = {{0}, 0};
+    struct timespec begin;
+    CvHaarClassifierCascade* face
+            = (CvHaarClassifierCascade*)cvLoad(cascadeFace, NULL, NULL, NULL);
+    CvHaarClassifierCascade* eye
+            = (CvHaarClassifierCascade*)cvLoad(cascadeEye, NULL, NULL, NULL);
+    if (!face || !eye) {
+        exit_invalid_cascade();
+    }
+    CvMemStorage* storage = cvCreateMemStorage(0);
+    for (int i = 0; i < iterations; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        cvCvtColor(image, results->gray, CV_BGR2GRAY);
+        timings.step[0] += elapsed_ms(&begin);
+        cvEqualizeHist(results->gray, results->equalized);
+        timings.step[1] += elapsed_ms(&begin);
+        cvIntegral(results->equalized, results->sum, results->sqsum, NULL);
+        timings.step[2] += elapsed_ms(&begin);
+        CvSeq* faces = cvHaarDetectObjects(results->equalized, face, storage,
+                haarScaleFactor, haarMinNeighbours, 0,
+                cvSize(haarMinSize, haarMinSize),
+                cvSize(haarMaxSize, haarMaxSize));
+        results->faceCount = faces->total;
+        results->eyeCount = 0;
+        for (int j = 0; j < faces->total; j++) {
+            CvRect* found = (CvRect*)cvGetSeqElem(faces, j);
+            if (j < MAX_COMPARED) {
+                results->faces[j] = *found;
+            }
+            cvSetImageROI(results->equalized, *found);
+            results->eyeCount += cvHaarDetectObjects(results->equalized, eye,
+                    storage, haarScaleFactor, haarMinNeighbours, 0,
+                    cvSize(haarMinSize, haarMinSize),
+                    cvSize(haarMaxSize, haarMaxSize))
+                                         ->total;
+            cvResetImageROI(results->equalized);
+        }
+        cvClearMemStorage(storage);
+        timings.step[3] += elapsed_ms(&begin);
+    }
+    cvReleaseMemStorage(&storage);
+    cvReleaseHaarClassifierCascade(&face);
+    cvReleaseHaarClassifierCascade(&eye);
+    for (int i = 0; i < STEPS; i++) {
+        timings.step[i] /= iterations;
+        timings.total += timings.step[i];
+    }
+    return timings;
+}
+
+/* time_native()
+ * -------------
+ * Times the haar.c path of uqfacedetect with the kernels currently chosen
+ * by haar_use_kernels(). The cascades are loaded beforehand, as uqfacedetect
+ * does at startup.
+ *
+ * image: The BGR image to be processed.
+ * iterations: The number of times each step is repeated.
+ * results: Set to the outputs of the last iteration.
+ * scheduler: The HaarScheduler detections are split with, or NULL.
+ *
+ * Returns: The milliseconds spent per iteration of each step.
+ * Errors: Function calls exit_invalid_cascade() if a cascade cannot be loaded.
+ */
+Timings time_native(IplImage* image, int iterations, Results* results,
+        HaarScheduler* scheduler)
+{
+    Timings timings = {{0}, 0};
+    struct timespec begin;
+    HaarCascade* face = haar_load(cascadeFace, haarScaleFactor, haarMaxSize);
+    HaarCascade* eye = haar_load(cascadeEye, haarScaleFactor, haarMaxSize);
+    if (!face || !eye) {
+        exit_invalid_cascade();
+    }
+    HaarEvaluator* evaluator = haar_evaluator();
+    haar_use_scheduler(evaluator, scheduler);
+    HaarRects faces = {0};
+    HaarRectLists eyes = {0};
+    IplImage* equalized = results->equalized;
+    for (int i = 0; i < iterations; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        haar_gray((uint8_t*)image->imageData, image->widthStep, image->width,
+                image->height, (uint8_t*)results->gray->imageData,
+                results->gray->widthStep);
+        timings.step[0] += elapsed_ms(&begin);
+        // equalised in place by uqfacedetect, so the copy is not timed
+        cvCopy(results->gray, equalized, NULL);
+        elapsed_ms(&begin);
+        haar_equalize((uint8_t*)equalized->imageData, equalized->widthStep,
+                equalized->width, equalized->height);
+        timings.step[1] += elapsed_ms(&begin);
+        haar_set_image(evaluator, (uint8_t*)equalized->imageData,
+                equalized->width, equalized->height, equalized->widthStep);
+        timings.step[2] += elapsed_ms(&begin);
+        results->faceCount = haar_detect(evaluator, face, haarMinNeighbours,
+                cvSize(haarMinSize, haarMinSize),
+                cvSize(haarMaxSize, haarMaxSize), &faces);
+        results->eyeCount = haar_detect_regions(evaluator, eye,
+                haarMinNeighbours, cvSize(haarMinSize, haarMinSize),
+                cvSize(haarMaxSize, haarMaxSize), faces.rects, faces.count,
+                &eyes);
+        for (int j = 0; j < faces.count && j < MAX_COMPARED; j++) {
+            results->faces[j] = faces.rects[j];
+        }
+        timings.step[3] += elapsed_ms(&begin);
+        if (i == iterations - 1) {
+            // the integral images of the whole frame, for comparison
+            memcpy(results->sum->data.ptr, evaluator->sum,
+                    evaluator->stride * (equalized->height + 1)
+                            * sizeof(uint32_t));
+            memcpy(results->sqsum->data.ptr, evaluator->sqsum,
+                    evaluator->stride * (equalized->height + 1)
+                            * sizeof(double));
+        }
+    }
+    free(faces.rects);
+    for (int j = 0; j < eyes.capacity; j++) {
+        free(eyes.lists[j].rects);
+    }
+    free(eyes.lists);
+    haar_free_evaluator(evaluator);
+    haar_free(face);
+    haar_free(eye);
+    for (int i = 0; i < STEPS; i++) {
+        timings.step[i] /= iterations;
+        timings.total += timings.step[i];
+    }
+    return timings;
+}
+
+/* same_results()
+ * --------------
+ * Compares the outputs of two paths pixel for pixel and rectangle for
+ * rectangle.
+ *
+ * Returns: 1 if every output is identical, 0 otherwise.
+ */
+int same_results(Results* a, Results* b)
+{
+    size_t entries = (size_t)a->sum->rows * a->sum->cols;
+    for (int y = 0; y < a->gray->height; y++) {
+        if (memcmp(a->gray->imageData + y * a->gray->widthStep,
+                    b->gray->imageData + y * b->gray->widthStep,
+                    a->gray->width)
+                || memcmp(a->equalized->imageData
+                                + y * a->equalized->widthStep,
+                        b->equalized->imageData + y * b->equalized->widthStep,
+                        a->equalized->width)) {
+            return 0;
+        }
+    }
+    int faces = a->faceCount < MAX_COMPARED ? a->faceCount : MAX_COMPARED;
+    return !memcmp(a->sum->data.ptr, b->sum->data.ptr, entries * sizeof(int))
+            && !memcmp(a->sqsum->data.ptr, b->sqsum->data.ptr,
+                    entries * sizeof(double))
+            && a->faceCount == b->faceCount && a->eyeCount == b->eyeCount
+            && !memcmp(a->faces, b->faces, faces * sizeof(CvRect));
+}
+
+/* print_row()
+ * -----------
+ * Prints the timings of one path as a row of the table.
+ *
+ * name: The name of the path.
+ * timings: The path's timings.
+ * baseline: The timings of the OpenCV path.
+ * outcome: Whether the path's outputs matched the OpenCV path.
+ */
+void print_row(const char* name, Timings* timings, Timings* baseline,
+        const char* outcome)
+{
+    printf("%-8s", name);
+    for (int i = 0; i < STEPS; i++) {
+        printf("  %8.2f", timings->step[i]);
+    }
+    printf("  %8.2f  %6.2fx  %s\n", timings->total,
+            baseline->total / timings->total, outcome);
+}
+
+/// Fast Mode Functions ////////////////
+
+/* read_file()
+ * -----------
+ * Reads a whole file into memory, so decoding can be timed on its own.
+ *
+ * filename: The file to be read.
+ * size: Set to the number of bytes read.
+ *
+ * Returns: The file's bytes, or NULL if it cannot be read.
+ */
+uint8_t* read_file(const char* filename, size_t* size)
+{
+    FILE* file = fopen(filename, "rb");
+    uint8_t* data = NULL;
+    long length;
+    if (!file) {
+        return NULL;
+    }
+    if (!fseek(file, 0, SEEK_END) && (length = ftell(file)) > 0
+            && !fseek(file, 0, SEEK_SET)) {
+        data = (uint8_t*)malloc(length);
+        if (data && fread(data, 1, length, file) != (size_t)length) {
+            free(data);
+            data = NULL;
+        }
+        *size = length;
+    }
+    fclose(file);
+    return data;
+}
+
+/* time_fast()
+ * -----------
+ * Times the fast mode of uqfacedetect along one path: decoding the image,
+ * then the gray conversion, reduction, equalisation and face and eye
+ * detection with the kernels currently chosen, mapping what is found back to
+ * pixels of the full image.
+ *
+ * data: The encoded image.
+ * size: The number of encoded bytes.
+ * path: How the image is reduced.
+ * reduction: The factor each side is reduced by (ignored for FULL_SIZE).
+ * iterations: The number of times the path is repeated.
+ * detection: Set to the faces and eyes found by the last iteration.
+ *
+ * Returns: The milliseconds spent per iteration.
+ * Errors: Function calls exit_invalid_cascade() if a cascade cannot be loaded.
+ */
+FastTimings time_fast(const uint8_t* data, size_t size, FastPath path,
+        int reduction, int iterations, Detection* detection)
+{
+    FastTimings timings = {0, 0, 0};
+    struct timespec begin;
+    HaarCascade* face = haar_load(cascadeFace, haarScaleFactor, haarMaxSize);
+    HaarCascade* eye = haar_load(cascadeEye, haarScaleFactor, haarMaxSize);
+    if (!face || !eye) {
+        exit_invalid_cascade();
+    }
+    HaarEvaluator* evaluator = haar_evaluator();
+    CvMat encoded = cvMat(1, size, CV_8UC1, (void*)data);
+    int factor = path == FULL_SIZE ? 1 : reduction;
+    int flags = path == DECODED
+            ? CV_LOAD_IMAGE_COLOR | reduction << REDUCED_DECODE_SHIFT
+            : CV_LOAD_IMAGE_COLOR;
+    for (int i = 0; i < iterations; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        IplImage* image = cvDecodeImage(&encoded, flags);
+        timings.decode += elapsed_ms(&begin);
+        IplImage* gray = cvCreateImage(cvGetSize(image), IPL_DEPTH_8U, 1);
+        haar_gray((uint8_t*)image->imageData, image->widthStep, image->width,
+                image->height, (uint8_t*)gray->imageData, gray->widthStep);
+        CvSize full = cvSize(image->width, image->height);
+        if (path == RESIZED) {
+            IplImage* reduced = cvCreateImage(
+                    cvSize(full.width / reduction, full.height / reduction),
+                    IPL_DEPTH_8U, 1);
+            cvResize(gray, reduced, CV_INTER_AREA);
+            cvReleaseImage(&gray);
+            gray = reduced;
+        } else if (path == DECODED) {
+            full = cvSize(full.width * reduction, full.height * reduction);
+        }
+        CvSize maxSize = cvSize(haarMaxSize / factor, haarMaxSize / factor);
+        haar_equalize((uint8_t*)gray->imageData, gray->widthStep, gray->width,
+                gray->height);
+        haar_set_image(evaluator, (uint8_t*)gray->imageData, gray->width,
+                gray->height, gray->widthStep);
+        int count = haar_detect(evaluator, face, haarMinNeighbours,
+                cvSize(haarMinSize, haarMinSize), maxSize,
+                &detection->faces);
+        haar_detect_regions(evaluator, eye, haarMinNeighbours,
+                cvSize(haarMinSize, haarMinSize), maxSize,
+                detection->faces.rects, count, &detection->eyes);
+        haar_scale_rects(detection->faces.rects, count, factor, full);
+        for (int j = 0; j < count; j++) {
+            CvRect* found = &detection->faces.rects[j];
+            haar_scale_rects(detection->eyes.lists[j].rects,
+                    detection->eyes.lists[j].count, factor,
+                    cvSize(found->width, found->height));
+        }
+        timings.detect += elapsed_ms(&begin);
+        cvReleaseImage(&gray);
+        cvReleaseImage(&image);
+    }
+    haar_free_evaluator(evaluator);
+    haar_free(face);
+    haar_free(eye);
+    timings.decode /= iterations;
+    timings.detect /= iterations;
+    timings.total = timings.decode + timings.detect;
+    return timings;
+}
+
+/* overlap()
+ * ---------
+ * Returns: 1 if the intersection of a and b covers at least MIN_OVERLAP of
+ *          their union, 0 otherwise.
+ */
+int overlap(CvRect a, CvRect b)
+{
+    int left = a.x > b.x ? a.x : b.x;
+    int top = a.y > b.y ? a.y : b.y;
+    int right = a.x + a.width < b.x + b.width ? a.x + a.width : b.x + b.width;
+    int bottom = a.y + a.height < b.y + b.height ? a.y + a.height
+                                                 : b.y + b.height;
+    if (right <= left || bottom <= top) {
+        return 0;
+    }
+    double shared = (double)(right - left) * (bottom - top);
+    double areas = (double)a.width * a.height + (double)b.width * b.height;
+    return shared >= MIN_OVERLAP * (areas - shared);
+}
+
+/* agreement()
+ * -----------
+ * Counts the faces of reference that detection also found (overlapping by at
+ * least MIN_OVERLAP, each face of detection matching at most one), and the
+ * eyes of matching faces that agree in the same way.
+ *
+ * reference: The full size detection.
+ * detection: The detection compared with it.
+ * faces: Set to the number of faces that agree.
+ * eyes: Set to the number of eyes that agree.
+ */
+void agreement(const Detection* reference, const Detection* detection,
+        int* faces, int* eyes)
+{
+    int count = detection->faces.count;
+    char* used = (char*)calloc(count ? count : 1, 1);
+    *faces = *eyes = 0;
+    for (int i = 0; i < reference->faces.count; i++) {
+        CvRect face = reference->faces.rects[i];
+        int j = 0;
+        while (j < count
+                && (used[j] || !overlap(face, detection->faces.rects[j]))) {
+            j++;
+        }
+        if (j == count) {
+            continue;
+        }
+        used[j] = 1;
+        (*faces)++;
+        CvRect other = detection->faces.rects[j];
+        const HaarRects* expected = &reference->eyes.lists[i];
+        const HaarRects* found = &detection->eyes.lists[j];
+        for (int k = 0; k < expected->count; k++) {
+            CvRect eye = expected->rects[k];
+            eye.x += face.x;
+            eye.y += face.y;
+            for (int m = 0; m < found->count; m++) {
+                CvRect candidate = found->rects[m];
+                candidate.x += other.x;
+                candidate.y += other.y;
+                if (overlap(eye, candidate)) {
+                    (*eyes)++;
+                    break;
+                }
+            }
+        }
+    }
+    free(used);
+}
+
+/* print_fast_row()
+ * ----------------
+ * Prints the timings of one fast mode path as a row of the table, with how
+ * many of the faces and eyes found at full size it agrees on.
+ *
+ * name: The name of the path.
+ * timings: The path's timings.
+ * baseline: The timings at full size.
+ * reference: The faces and eyes found at full size.
+ * detection: The faces and eyes found by the path.
+ */
+void print_fast_row(const char* name, FastTimings* timings,
+        FastTimings* baseline, const Detection* reference,
+        const Detection* detection)
+{
+    int faces, eyes, expectedEyes = 0, foundEyes = 0;
+    char faceColumn[NAME_LENGTH], eyeColumn[NAME_LENGTH];
+    agreement(reference, detection, &faces, &eyes);
+    for (int i = 0; i < reference->faces.count; i++) {
+        expectedEyes += reference->eyes.lists[i].count;
+    }
+    for (int i = 0; i < detection->faces.count; i++) {
+        foundEyes += detection->eyes.lists[i].count;
+    }
+    snprintf(faceColumn, sizeof(faceColumn), "%d/%d", faces,
+            reference->faces.count);
+    snprintf(eyeColumn, sizeof(eyeColumn), "%d/%d", eyes, expectedEyes);
+    printf("%-10s  %8.2f  %8.2f  %8.2f  %6.2fx  %-7s  %-7s", name,
+            timings->decode, timings->detect, timings->total,
+            baseline->total / timings->total, faceColumn, eyeColumn);
+    if (detection->faces.count > faces || foundEyes > eyes) {
+        printf("  (+%d faces, +%d eyes)", detection->faces.count - faces,
+                foundEyes - eyes);
+    }
+    printf("\n");
+}
+
+/* free_detection()
+ * ----------------
+ * Releases the rectangle lists of a Detection.
+ */
+void free_detection(Detection* detection)
+{
+    free(detection->faces.rects);
+    for (int i = 0; i < detection->eyes.capacity; i++) {
+        free(detection->eyes.lists[i].rects);
+    }
+    free(detection->eyes.lists);
+}
+
+/// Main /////////////////////////////////
+int main(int argc, char* argv[])
+{
+    Settings settings = get_settings(argc, argv);
+    int iterations = settings.iterations;
+    int mismatch = 0, widest = HAAR_SCALAR;
+    IplImage* image = cvLoadImage(argv[1], CV_LOAD_IMAGE_COLOR);
+    if (!image) {
+        exit_invalid_file(argv[1]);
+    }
+    Results expected = create_results(image);
+    Results actual = create_results(image);
+    printf("%dx%d image, %d iterations, milliseconds per iteration\n",
+            image->width, image->height, iterations);
+    printf("%s", tableHeader);
+    Timings opencv = time_opencv(image, iterations, &expected);
+    print_row("opencv", &opencv, &opencv, "reference");
+    fflush(stdout);
+    for (int kernels = HAAR_SCALAR; kernels <= HAAR_AVX2; kernels++) {
+        if ((int)haar_use_kernels((HaarKernels)kernels) != kernels) {
+            // not supported by this CPU
+            printf("%-8s  unsupported\n", kernelNames[kernels]);
+            continue;
+        }
+        widest = kernels;
+        Timings native = time_native(image, iterations, &actual, NULL);
+        int same = same_results(&expected, &actual);
+        mismatch |= !same;
+        print_row(kernelNames[kernels], &native, &opencv,
+                same ? "identical" : "MISMATCH");
+        fflush(stdout);
+    }
+    if (settings.helpers) {
+        // the widest kernels again, splitting detections between threads
+        char name[NAME_LENGTH];
+        snprintf(name, sizeof(name), "%s+%d", kernelNames[widest],
+                settings.helpers);
+        haar_use_kernels((HaarKernels)widest);
+        HaarScheduler* scheduler = haar_scheduler(settings.helpers);
+        Timings split = time_native(image, iterations, &actual, scheduler);
+        int same = same_results(&expected, &actual);
+        mismatch |= !same;
+        print_row(name, &split, &opencv, same ? "identical" : "MISMATCH");
+    }
+    size_t size;
+    uint8_t* data = read_file(argv[1], &size);
+    if (!data) {
+        exit_invalid_file(argv[1]);
+    }
+    int reduction = settings.reduction
+            ? settings.reduction
+            : haar_reduction(image->width, image->height, FAST_PIXELS);
+    reduction = reduction > 1 ? reduction : 2; // always compare something
+    char name[NAME_LENGTH];
+    Detection full = {0}, resized = {0}, decoded = {0};
+    haar_use_kernels((HaarKernels)widest);
+    printf("\nfast mode, detecting at 1/%d size (%dx%d), %s kernels\n",
+            reduction, image->width / reduction, image->height / reduction,
+            kernelNames[widest]);
+    printf("%s", fastHeader);
+    FastTimings fullTimings
+            = time_fast(data, size, FULL_SIZE, 1, iterations, &full);
+    print_fast_row("full", &fullTimings, &fullTimings, &full, &full);
+    fflush(stdout);
+    FastTimings resizedTimings
+            = time_fast(data, size, RESIZED, reduction, iterations, &resized);
+    snprintf(name, sizeof(name), "resize 1/%d", reduction);
+    print_fast_row(name, &resizedTimings, &fullTimings, &full, &resized);
+    fflush(stdout);
+    FastTimings decodedTimings
+            = time_fast(data, size, DECODED, reduction, iterations, &decoded);
+    snprintf(name, sizeof(name), "decode 1/%d", reduction);
+    print_fast_row(name, &decodedTimings, &fullTimings, &full, &decoded);
+    free_detection(&full);
+    free_detection(&resized);
+    free_detection(&decoded);
+    free(data);
+    free_results(&expected);
+    free_results(&actual);
+    cvReleaseImage(&image);
+    return mismatch ? EXIT_MISMATCH : SUCCESS_EXIT;
+}